@@ -1,7 +1,12 @@
 ﻿#include "alembic_loader.hpp"
 #include "integrator.hpp"
+#include "material_parameters.hpp"
+#include "async_image_writer.hpp"
+#include "render_thread.hpp"
 
 #include <random>
+#include <mutex>
+#include <set>
 #include <xmmintrin.h>
 #include <pmmintrin.h>
 #include <tbb/tbb.h>
@@ -9,45 +14,54 @@
 #include "ofApp.h"
 #include "ofxImGuiLite.hpp"
 
-inline ofPixels toOf(const rt::Image &image) {
-	ofPixels pixels;
-	pixels.allocate(image.width(), image.height(), OF_IMAGE_COLOR);
-	uint8_t *dst = pixels.getPixels();
-
-	double scale = 1.0;
-	for (int y = 0; y < image.height(); ++y) {
-		for (int x = 0; x < image.width(); ++x) {
-			int index = y * image.width() + x;
-			const auto &px = *image.pixel(x, y);
-			auto L = px.color / (double)px.sample;
-			dst[index * 3 + 0] = (uint8_t)glm::clamp(glm::pow(L.x * scale, 1.0 / 2.2) * 255.0, 0.0, 255.99999);
-			dst[index * 3 + 1] = (uint8_t)glm::clamp(glm::pow(L.y * scale, 1.0 / 2.2) * 255.0, 0.0, 255.99999);
-			dst[index * 3 + 2] = (uint8_t)glm::clamp(glm::pow(L.z * scale, 1.0 / 2.2) * 255.0, 0.0, 255.99999);
-		}
-	}
-	return pixels;
-}
-inline ofFloatPixels toOfLinear(const rt::Image &image) {
-	ofFloatPixels pixels;
-	pixels.allocate(image.width(), image.height(), OF_IMAGE_COLOR);
-	float *dst = pixels.getPixels();
-
-	for (int y = 0; y < image.height(); ++y) {
-		for (int x = 0; x < image.width(); ++x) {
-			int index = y * image.width() + x;
-			const auto &px = *image.pixel(x, y);
-			auto L = px.color / (double)px.sample;
-			dst[index * 3 + 0] = L[0];
-			dst[index * 3 + 1] = L[1];
-			dst[index * 3 + 2] = L[2];
+std::shared_ptr<rt::Scene> scene;
+std::shared_ptr<rt::AsyncImageWriter> imageWriter;
+
+// レンダリングは専用のスレッドで行い、UI スレッドは出来上がったフレームを表示するだけ
+std::shared_ptr<rt::RenderThread> renderThread;
+
+// ワイヤーフレームのマウス位置の交差。リロードと競合しないようにレンダリングスレッドで調べる
+struct Probe {
+	bool hit = false;
+	glm::dvec3 o;
+	glm::dvec3 d;
+	float tmin = 0.0f;
+	glm::dvec3 Ng;
+};
+std::mutex probeMutex;
+Probe probe;
+std::atomic<bool> probePending(false);
+
+// 編集パネルの項目。ジオメトリごと、マテリアルの種類ごとに 1 つ
+// material は UI 側のコピーで、書き換えた値をコマンドでレンダリングスレッドに送る
+struct MaterialSlot {
+	int geometry = 0;
+	std::string geometryName;
+	std::string materialName;
+	rt::Material material;
+};
+std::vector<MaterialSlot> materialSlots;
+
+void collectMaterialSlots(const rt::Scene &scene, std::vector<MaterialSlot> *slots) {
+	slots->clear();
+	for (int i = 0; i < scene.geometries.size(); ++i) {
+		const rt::Geometry &geometry = scene.geometries[i];
+		std::set<std::string> names;
+		for (const rt::Material &material : geometry.materials) {
+			std::string name = rt::materialName(material.get());
+			if (names.insert(name).second == false) {
+				continue;
+			}
+			MaterialSlot slot;
+			slot.geometry = i;
+			slot.geometryName = geometry.name;
+			slot.materialName = name;
+			slot.material = material;
+			slots->push_back(slot);
 		}
 	}
-	return pixels;
 }
 
-std::shared_ptr<rt::Scene> scene;
-std::shared_ptr<rt::PTRenderer> renderer;
-
 bool isPowerOfTwo(uint32_t value)
 {
 	return value && !(value & (value - 1));
@@ -60,7 +74,10 @@ void ofApp::setup() {
 
 	ofxImGuiLite::initialize();
 
-	ofSetVerticalSync(false);
+	imageWriter = std::shared_ptr<rt::AsyncImageWriter>(new rt::AsyncImageWriter());
+
+	// 描画は表示レートで十分。残りの CPU はレンダリングスレッドに回す
+	ofSetVerticalSync(true);
 
 	_camera.setNearClip(0.1);
 	_camera.setFarClip(100.0);
@@ -72,6 +89,12 @@ void ofApp::setup() {
 	rt::CoupledBRDFDielectrics::load(
 		ofToDataPath("baked/albedo_specular_dielectrics.bin").c_str(),
 		ofToDataPath("baked/albedo_specular_dielectrics_avg.bin").c_str());
+	rt::CoupledBRDFConductorGGX::load(
+		ofToDataPath("baked/albedo_specular_conductor_ggx.bin").c_str(),
+		ofToDataPath("baked/albedo_specular_conductor_ggx_avg.bin").c_str());
+	rt::CoupledBRDFDielectricsGGX::load(
+		ofToDataPath("baked/albedo_specular_dielectrics_ggx.bin").c_str(),
+		ofToDataPath("baked/albedo_specular_dielectrics_ggx_avg.bin").c_str());
 
 	rt::CoupledBRDFVelvet::load(
 		ofToDataPath("baked/albedo_velvet.bin").c_str(),
@@ -80,6 +103,7 @@ void ofApp::setup() {
 	loadScene();
 }
 void ofApp::exit() {
+	renderThread.reset();
 	// ofxImGuiLite::shutdown();
 }
 
@@ -90,7 +114,30 @@ void ofApp::loadScene() {
 	rt::loadFromABC(ofToDataPath("cornelbox.abc").c_str(), *scene);
 	printf("load scene %f seconds\n", sw.elapsed());
 
-	renderer = std::shared_ptr<rt::PTRenderer>(new rt::PTRenderer(scene));
+	// レンダリングスレッドに渡す前に読んでおく
+	collectMaterialSlots(*scene, &materialSlots);
+
+	if (renderThread) {
+		// 変わったジオメトリだけを更新する。できなければ作り直す
+		auto next = scene;
+		renderThread->post([next](std::shared_ptr<rt::PTRenderer> &current) {
+			if (current->reloadScene(next) == false) {
+				current = std::shared_ptr<rt::PTRenderer>(new rt::PTRenderer(next, true));
+			}
+		});
+	}
+	else {
+		auto renderer = std::shared_ptr<rt::PTRenderer>(new rt::PTRenderer(scene, true));
+		renderThread = std::shared_ptr<rt::RenderThread>(new rt::RenderThread(renderer, [](const rt::PTRenderer &r) {
+			uint32_t n = r.stepCount();
+			if (32 <= n && isPowerOfTwo(n)) {
+				char name[64];
+				sprintf(name, "%dspp.png", n);
+				imageWriter->save(r._image, n, ofToDataPath(name));
+				printf("elapsed %fs\n", ofGetElapsedTimef());
+			}
+		}));
+	}
 }
 //--------------------------------------------------------------
 void ofApp::update() {
@@ -119,18 +166,36 @@ void ofApp::draw() {
 			static ofMesh mesh;
 			mesh.clear();
 
-			auto geometry = scene->geometries[i];
+			// インスタンスはプロトタイプの形を変換して描く
+			const auto &placed = scene->geometries[i];
+			const auto &geometry = placed.prototype < 0 ? placed : scene->geometries[placed.prototype];
+			if (0 <= placed.prototype) {
+				ofPushMatrix();
+				ofMultMatrix(ofMatrix4x4(glm::value_ptr(glm::mat4(placed.transform))));
+			}
 			for (int j = 0; j < geometry.points.size(); ++j) {
 				auto p = geometry.points[j].P;
 				mesh.addVertex(ofVec3f(p.x, p.y, p.z));
 			}
-			for (int j = 0; j < geometry.primitives.size(); ++j) {
-				auto prim = geometry.primitives[j];
-				mesh.addIndex(prim.indices[0]);
-				mesh.addIndex(prim.indices[1]);
-				mesh.addIndex(prim.indices[2]);
+			for (int j = 0; j < geometry.indices.size(); ++j) {
+				const auto &indices = geometry.indices[j];
+				mesh.addIndex(indices[0]);
+				mesh.addIndex(indices[1]);
+				mesh.addIndex(indices[2]);
+			}
+			for (int j = 0; j < geometry.quads.size(); ++j) {
+				const auto &quad = geometry.quads[j];
+				mesh.addIndex(quad[0]);
+				mesh.addIndex(quad[1]);
+				mesh.addIndex(quad[3]);
+				mesh.addIndex(quad[2]);
+				mesh.addIndex(quad[3]);
+				mesh.addIndex(quad[1]);
 			}
 			mesh.drawWireframe();
+			if (0 <= placed.prototype) {
+				ofPopMatrix();
+			}
 		}
 		{
 			auto camera = scene->camera;
@@ -148,21 +213,40 @@ void ofApp::draw() {
 		}
 
 		{
-			rt::Xor64 random;
 			int x = ofMap(ofGetMouseX(), 0, ofGetWidth(), 0, scene->camera.imageWidth());
 			int y = ofMap(ofGetMouseY(), 0, ofGetHeight(), 0, scene->camera.imageHeight());
-			glm::dvec3 o;
-			glm::dvec3 d;
-			scene->camera.sampleRay(&random, x, y, &o, &d);
+			if (probePending.exchange(true) == false) {
+				renderThread->post([x, y](std::shared_ptr<rt::PTRenderer> &r) {
+					rt::Xor64 random;
+					Probe result;
+					r->camera().sampleRay(&random, x, y, &result.o, &result.d);
+
+					rt::Material m;
+					result.hit = r->sceneInterface().intersect(result.o, result.d, &m, &result.tmin);
+					if (result.hit) {
+						result.Ng = m->Ng;
+					}
+					{
+						std::lock_guard<std::mutex> lock(probeMutex);
+						probe = result;
+					}
+					probePending = false;
+				});
+			}
 
-			rt::Material m;
-			float tmin = 0.0f;
-			if (renderer->sceneInterface().intersect(o, d, &m, &tmin)) {
+			Probe result;
+			{
+				std::lock_guard<std::mutex> lock(probeMutex);
+				result = probe;
+			}
+			auto o = result.o;
+			auto d = result.d;
+			if (result.hit) {
 				ofSetColor(255, 0, 0);
-				auto p = o + d * (double)tmin;
+				auto p = o + d * (double)result.tmin;
 				ofDrawLine(o.x, o.y, o.z, p.x, p.y, p.z);
 
-				auto pn = p + m->Ng * 0.1;
+				auto pn = p + result.Ng * 0.1;
 				ofDrawLine(p.x, p.y, p.z, pn.x, pn.y, pn.z);
 			}
 			else {
@@ -173,24 +257,14 @@ void ofApp::draw() {
 		}
 	}
 
-	if(_render) {
-		renderer->step();
-
+	if (_syncCamera) {
+		syncRenderCamera();
+	}
+	renderThread->setPaused(_render == false);
+	if (renderThread->pullFrame()) {
+		const rt::RenderThread::Frame &frame = renderThread->frame();
 		ofDisableArbTex();
-
-		if (ofGetFrameNum() % 5 == 0) {
-			_image.setFromPixels(toOf(renderer->_image));
-		}
-		uint32_t n = renderer->stepCount();
-
-		if (32 <= n && isPowerOfTwo(n)) {
-			_image.setFromPixels(toOf(renderer->_image));
-			char name[64];
-			sprintf(name, "%dspp.png", n);
-			_image.save(name);
-			printf("elapsed %fs\n", ofGetElapsedTimef());
-		}
-
+		_image.setFromPixels(frame.rgb.data(), frame.width, frame.height, OF_IMAGE_COLOR);
 		ofEnableArbTex();
 	}
 
@@ -217,18 +291,89 @@ void ofApp::draw() {
 	ImGui::Begin("settings", nullptr);
 	ImGui::Checkbox("render", &_render);
 	ImGui::Checkbox("show wireframe", &_showWireframe);
+	ImGui::Checkbox("render from view camera ('f' to start from scene camera)", &_syncCamera);
+	if (ImGui::Checkbox("temporal reprojection", &_temporalReprojection)) {
+		bool enabled = _temporalReprojection;
+		renderThread->post([enabled](std::shared_ptr<rt::PTRenderer> &r) {
+			r->setTemporalReprojection(enabled);
+		});
+	}
 	
-	ImGui::Text("%d sample, fps = %.3f", renderer->stepCount(), ofGetFrameRate());
-	ImGui::Text("%d bad sample nan", renderer->badSampleNanCount());
-	ImGui::Text("%d bad sample inf", renderer->badSampleInfCount());
-	ImGui::Text("%d bad sample neg", renderer->badSampleNegativeCount());
-	ImGui::Text("%d bad sample firefly", renderer->badSampleFireflyCount());
+	const rt::RenderThread::Frame &frame = renderThread->frame();
+	ImGui::Text("%d sample, fps = %.3f", frame.steps, ofGetFrameRate());
+	ImGui::Text("%d bad sample nan", frame.badSampleNanCount);
+	ImGui::Text("%d bad sample inf", frame.badSampleInfCount);
+	ImGui::Text("%d bad sample neg", frame.badSampleNegativeCount);
+	ImGui::Text("%d bad sample firefly", frame.badSampleFireflyCount);
 	if (_image.isAllocated()) {
 		ofxImGuiLite::image(_image);
 	}
+
+	// 書き換えると次のパスから反映される。BVH は作り直さない
+	if (ImGui::CollapsingHeader("materials")) {
+		for (int i = 0; i < materialSlots.size(); ++i) {
+			MaterialSlot &slot = materialSlots[i];
+			ImGui::PushID(i);
+			ImGui::Text("%s [%s]", slot.geometryName.c_str(), slot.materialName.c_str());
+			for (rt::MaterialParameter &p : rt::materialParameters(slot.material.get())) {
+				int n = p.color ? 3 : 1;
+				float value[3];
+				for (int j = 0; j < n; ++j) {
+					value[j] = (float)p.value[j];
+				}
+				bool changed = p.color
+					? ImGui::SliderFloat3(p.name, value, (float)p.minValue, (float)p.maxValue)
+					: ImGui::SliderFloat(p.name, value, (float)p.minValue, (float)p.maxValue);
+				if (changed == false) {
+					continue;
+				}
+
+				rt::MaterialEdit edit;
+				edit.geometry = slot.geometry;
+				edit.material = slot.materialName;
+				edit.parameter = p.name;
+				for (int j = 0; j < n; ++j) {
+					p.value[j] = value[j];
+					edit.value[j] = value[j];
+				}
+				renderThread->post([edit](std::shared_ptr<rt::PTRenderer> &r) {
+					r->editMaterial(edit);
+				});
+			}
+			ImGui::PopID();
+		}
+	}
 	ImGui::End();
 }
 
+void ofApp::syncRenderCamera() {
+	auto p = _camera.getGlobalPosition();
+	auto d = _camera.getLookAtDir();
+	auto u = _camera.getUpDir();
+	ofVec3f eye(p.x, p.y, p.z);
+	ofVec3f lookDir(d.x, d.y, d.z);
+	ofVec3f up(u.x, u.y, u.z);
+	float fov = _camera.getFov();
+	if (eye == _syncedEye && lookDir == _syncedLookDir && up == _syncedUp && fov == _syncedFov) {
+		return;
+	}
+	_syncedEye = eye;
+	_syncedLookDir = lookDir;
+	_syncedUp = up;
+	_syncedFov = fov;
+
+	// 解像度やレンズはシーンのカメラのまま
+	rt::CameraSetting setting = scene->camera.setting();
+	setting.eye = glm::dvec3(eye.x, eye.y, eye.z);
+	setting.lookat = setting.eye + glm::dvec3(lookDir.x, lookDir.y, lookDir.z);
+	setting.up = glm::dvec3(up.x, up.y, up.z);
+	setting.fovy = glm::radians((double)fov);
+	rt::Camera camera(setting);
+	renderThread->post([camera](std::shared_ptr<rt::PTRenderer> &r) {
+		r->setCamera(camera);
+	});
+}
+
 //--------------------------------------------------------------
 void ofApp::keyPressed(int key) {
 	if (key == 'f') {
@@ -244,8 +389,9 @@ void ofApp::keyPressed(int key) {
 	}
 
 	if (key == 's') {
-		ofFloatImage image = toOfLinear(renderer->_image);
-		image.save("pt.exr");
+		renderThread->post([](std::shared_ptr<rt::PTRenderer> &r) {
+			imageWriter->save(r->_image, r->stepCount(), ofToDataPath("pt.exr"));
+		});
 	}
 
 	if (key == 'r') {
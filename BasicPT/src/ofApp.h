@@ -27,4 +27,13 @@ public:
 	ofImage _image;
 	bool _render = true;
 	bool _showWireframe = false;
+
+	// ビューのカメラをレンダリングのカメラにする
+	void syncRenderCamera();
+	bool _syncCamera = false;
+	ofVec3f _syncedEye;
+	ofVec3f _syncedLookDir;
+	ofVec3f _syncedUp;
+	float _syncedFov = 0.0f;
+	bool _temporalReprojection = false;
 };
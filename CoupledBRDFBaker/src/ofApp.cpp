@@ -13,6 +13,25 @@
 
 static const int kBakeResolution = 64;
 
+// name.bin と、確認用の name.exr を書き出す
+inline void save_albedo(const rt::SpecularAlbedo &albedo, std::string name) {
+	saveAsBinary(albedo, ofToDataPath(name + ".bin").c_str());
+
+	// preview
+	ofFloatImage image;
+	image.allocate(albedo.alphaSize(), albedo.cosThetaSize(), OF_IMAGE_GRAYSCALE);
+	float *p = image.getPixels().getPixels();
+	for (int j = 0; j < albedo.cosThetaSize(); ++j) {
+		for (int i = 0; i < albedo.alphaSize(); ++i) {
+			double value = albedo.get(i, j);
+			p[j * albedo.alphaSize() + i] = value;
+		}
+	}
+	image.save(name + ".exr");
+}
+
+// Distribution は material.hpp の BeckmannVCavity, GGXHeightCorrelated
+template <class Distribution>
 inline void bake(std::string name, bool include_fresnel_dielectrics) {
 	rt::SpecularAlbedo albedo;
 	albedo.build(kBakeResolution, kBakeResolution, [&](double alpha, double cosTheta) {
@@ -26,12 +45,12 @@ inline void bake(std::string name, bool include_fresnel_dielectrics) {
 
 		OnlineMean<double> mean;
 		for (int i = 0; i < SampleCount; ++i) {
-			glm::dvec3 wi = VCavityBeckmannVisibleNormalSampler::sample(&random, alpha, wo, Ng);
-			double pdf_omega = VCavityBeckmannVisibleNormalSampler::pdf(wi, alpha, wo, Ng);
+			glm::dvec3 wi = Distribution::sample(&random, alpha, wo, Ng);
+			double pdf_omega = Distribution::pdf(wi, alpha, wo, Ng);
 
 			glm::dvec3 h = glm::normalize(wi + wo);
-			double d = D_Beckmann(Ng, h, alpha);
-			double g = G2_v_cavity(wo, wi, h, Ng);
+			double d = Distribution::D(Ng, h, alpha);
+			double g = Distribution::G2(wi, wo, h, Ng, alpha);
 
 			double cos_term_wo = glm::dot(Ng, wo);
 			double cos_term_wi = glm::dot(Ng, wi);
@@ -58,19 +77,7 @@ inline void bake(std::string name, bool include_fresnel_dielectrics) {
 		}
 		return mean.mean();
 	});
-	saveAsBinary(albedo, ofToDataPath(name + ".bin").c_str());
-
-	// preview
-	ofFloatImage image;
-	image.allocate(albedo.alphaSize(), albedo.cosThetaSize(), OF_IMAGE_GRAYSCALE);
-	float *p = image.getPixels().getPixels();
-	for (int j = 0; j < albedo.cosThetaSize(); ++j) {
-		for (int i = 0; i < albedo.alphaSize(); ++i) {
-			double value = albedo.get(i, j);
-			p[j * albedo.alphaSize() + i] = value;
-		}
-	}
-	image.save(name + ".exr");
+	save_albedo(albedo, name);
 }
 
 // 両方拡張子を含む
@@ -105,47 +112,50 @@ inline void bake_velvet(std::string name) {
 		Xor64 random;
 
 		OnlineMean<double> mean;
-		for (int i = 0; i < SampleCount; ++i) {
-			glm::dvec3 wi = m.sample(&random, wo);
-			double pdf_omega = m.pdf(wo, wi);
 
-			double brdf = m.bxdf(wo, wi).x;
-			double cos_term_wi = glm::dot(wi, Ng);
-			double value = brdf * cos_term_wi / pdf_omega;
-
-			// wiが裏面
-			if (glm::dot(wi, Ng) <= 0.0) {
-				value = 0.0;
-			}
-
-			if (glm::isfinite(value) == false) {
-				value = 0.0;
+		// bxdf, pdf は kBxdfBatchWidth 本ずつまとめて評価する
+		BxdfBatch batch;
+		auto flush = [&]() {
+			m.pdf_batch(&batch);
+			m.bxdf_batch(&batch);
+			for (int k = 0; k < batch.count; ++k) {
+				glm::dvec3 wi = batch.directionI(k);
+				double pdf_omega = batch.pdf[k];
+
+				double brdf = batch.bxdf[0][k];
+				double cos_term_wi = glm::dot(wi, Ng);
+				double value = brdf * cos_term_wi / pdf_omega;
+
+				// wiが裏面
+				if (glm::dot(wi, Ng) <= 0.0) {
+					value = 0.0;
+				}
+
+				if (glm::isfinite(value) == false) {
+					value = 0.0;
+				}
+
+				if (value < 0.0) {
+					printf("?");
+				}
+
+				mean.addSample(value);
 			}
-
-			if (value < 0.0) {
-				printf("?");
+			batch.clear();
+		};
+		for (int i = 0; i < SampleCount; ++i) {
+			batch.add(wo, m.sample(&random, wo));
+			if (batch.full()) {
+				flush();
 			}
-
-			mean.addSample(value);
 		}
+		flush();
 		// return mean.mean();
 		// alpha が低いとき、一部でエネルギーをオーバーする。
 		// ただごく一部であり、今回は気にせずクランプすることにする。
 		return std::min(mean.mean(), 1.0);
 	});
-	saveAsBinary(albedo, ofToDataPath(name + ".bin").c_str());
-
-	// preview
-	ofFloatImage image;
-	image.allocate(albedo.alphaSize(), albedo.cosThetaSize(), OF_IMAGE_GRAYSCALE);
-	float *p = image.getPixels().getPixels();
-	for (int j = 0; j < albedo.cosThetaSize(); ++j) {
-		for (int i = 0; i < albedo.alphaSize(); ++i) {
-			double value = albedo.get(i, j);
-			p[j * albedo.alphaSize() + i] = value;
-		}
-	}
-	image.save(name + ".exr");
+	save_albedo(albedo, name);
 }
 
 //--------------------------------------------------------------
@@ -156,12 +166,20 @@ void ofApp::setup() {
 	//printf("done %f seconds\n", sw.elapsed());
 
 	 //rt::Stopwatch sw;
-	 //bake("albedo_specular_conductor", false);
-	 //bake("albedo_specular_dielectrics", true);
+	 //bake<rt::BeckmannVCavity>("albedo_specular_conductor", false);
+	 //bake<rt::BeckmannVCavity>("albedo_specular_dielectrics", true);
 	 //printf("done %f seconds\n", sw.elapsed());
 
 	 // bake_avg("albedo_specular_conductor.bin", "albedo_specular_conductor_avg.bin");
 	 // bake_avg("albedo_specular_dielectrics.bin", "albedo_specular_dielectrics_avg.bin");
+
+	 //rt::Stopwatch sw;
+	 //bake<rt::GGXHeightCorrelated>("albedo_specular_conductor_ggx", false);
+	 //bake<rt::GGXHeightCorrelated>("albedo_specular_dielectrics_ggx", true);
+	 //printf("done %f seconds\n", sw.elapsed());
+
+	 // bake_avg("albedo_specular_conductor_ggx.bin", "albedo_specular_conductor_ggx_avg.bin");
+	 // bake_avg("albedo_specular_dielectrics_ggx.bin", "albedo_specular_dielectrics_ggx_avg.bin");
 	bake_avg("albedo_velvet.bin", "albedo_velvet_avg.bin");
 
 	ofSetVerticalSync(false);
@@ -0,0 +1,707 @@
+#include "alembic_loader.hpp"
+#include "alembic_sequence.hpp"
+#include "integrator.hpp"
+#include "render_loop.hpp"
+#include "async_image_writer.hpp"
+#include "checkpoint.hpp"
+#include "distributed.hpp"
+#include "hash.hpp"
+#include "scene_cache.hpp"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <numeric>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <xmmintrin.h>
+#include <pmmintrin.h>
+
+// openFrameworks を使わない Linux 向けのレンダラー
+// 計算ノードで GL やウィンドウなしに動かすためのもの
+
+struct Options {
+	std::string scene;
+	std::string dataDirectory = "data";
+	std::string output = "image_%d_spp.png";
+	double renderTime = 123.0;
+	double saveInterval = 15.0;
+	int threads = 0;
+	std::string checkpoint;
+	double checkpointInterval = 60.0;
+	bool loadTimings = false;
+	std::string sceneCache;
+	bool triangulate = false;
+	rt::SceneBuildSettings build;
+	int lightSamples = 1;
+
+	// 分散レンダリング
+	std::string job;     // コーディネーターとしてジョブを作るディレクトリ
+	std::string worker;  // ワーカーとして参加するジョブのディレクトリ
+	int passes = 1024;
+	int spawn = 0;
+	double staleSeconds = 120.0;
+
+	// NUMA
+	bool numa = false;
+	bool replicateScene = false;
+	int benchNumaSteps = 0;
+
+	// アニメーション
+	bool sequence = false;
+	int firstFrame = 0;
+	int lastFrame = -1; // -1 なら最後まで
+	int framePasses = 64;
+};
+
+static void printUsage(const char *program) {
+	printf("usage: %s <scene.abc> [options]\n", program);
+	printf("  -t, --time <sec>       render time budget (default 123)\n");
+	printf("  -i, --interval <sec>   progressive save interval (default 15)\n");
+	printf("  -j, --threads <n>      worker threads, 0 = all cores (default 0)\n");
+	printf("  -o, --output <path>    output image, %%d is replaced by spp (default image_%%d_spp.png)\n"
+		"                         .png: gamma 2.2 8bit, .exr: linear half, .pfm: linear float\n");
+	printf("  -d, --data <dir>       directory containing baked/ (default data)\n");
+	printf("  -c, --checkpoint <path>        save accumulation state to path, resume from it if valid\n");
+	printf("  --checkpoint-interval <sec>    checkpoint interval (default 60)\n");
+	printf("  --load-timings         print load time of each object\n");
+	printf("  --scene-cache <path>   map preprocessed scene from path, write it there when missing or stale\n");
+	printf("  --triangulate          split quad meshes into triangles (to compare memory and speed)\n");
+	printf("  --light-samples <n>    NEE samples per path vertex from the chosen light, 1..8 (default 1)\n");
+	printf("  --bvh-quality <q>      low, medium or high (default high)\n");
+	printf("  --bvh-async            start on the --bvh-quality BVH, swap in a high quality one built in background\n");
+	printf("  --numa                 one task arena per NUMA node, image rows placed per node\n");
+	printf("  --numa-replicate       --numa and also build one Embree scene per node\n");
+	printf("  --bench-numa <steps>   measure scaling over 1..N NUMA nodes and exit\n");
+	printf("animation:\n");
+	printf("  --frames <first>:<last>  render time samples first..last, last may be omitted for all\n"
+		"                           %%d in --output is replaced by the frame number\n");
+	printf("  --frame-passes <n>     samples per pixel of each frame (default 64)\n");
+	printf("distributed rendering over a shared directory:\n");
+	printf("  --job <dir>            create a job in dir, render, merge and write the output\n");
+	printf("  --passes <n>           samples per pixel of the job (default 1024)\n");
+	printf("  --spawn <n>            also start n local worker processes\n");
+	printf("  --worker <dir>         join the job in dir (scene, --triangulate and --light-samples are read from the job,\n"
+		"                         a scene file changed since the job was created is refused)\n");
+	printf("  --stale <sec>          reclaim units without heartbeat for this long (default 120)\n");
+}
+
+static bool parseOptions(int argc, char *argv[], Options *options) {
+	for (int i = 1; i < argc; ++i) {
+		std::string arg = argv[i];
+		auto value = [&]() -> const char * {
+			if (i + 1 < argc) {
+				return argv[++i];
+			}
+			printf("missing value for %s\n", arg.c_str());
+			return nullptr;
+		};
+		const char *v = nullptr;
+		if (arg == "-h" || arg == "--help") {
+			return false;
+		}
+		else if (arg == "-t" || arg == "--time") {
+			if ((v = value()) == nullptr) return false;
+			options->renderTime = atof(v);
+		}
+		else if (arg == "-i" || arg == "--interval") {
+			if ((v = value()) == nullptr) return false;
+			options->saveInterval = atof(v);
+		}
+		else if (arg == "-j" || arg == "--threads") {
+			if ((v = value()) == nullptr) return false;
+			options->threads = atoi(v);
+		}
+		else if (arg == "-o" || arg == "--output") {
+			if ((v = value()) == nullptr) return false;
+			options->output = v;
+		}
+		else if (arg == "-d" || arg == "--data") {
+			if ((v = value()) == nullptr) return false;
+			options->dataDirectory = v;
+		}
+		else if (arg == "-c" || arg == "--checkpoint") {
+			if ((v = value()) == nullptr) return false;
+			options->checkpoint = v;
+		}
+		else if (arg == "--checkpoint-interval") {
+			if ((v = value()) == nullptr) return false;
+			options->checkpointInterval = atof(v);
+		}
+		else if (arg == "--load-timings") {
+			options->loadTimings = true;
+		}
+		else if (arg == "--scene-cache") {
+			if ((v = value()) == nullptr) return false;
+			options->sceneCache = v;
+		}
+		else if (arg == "--triangulate") {
+			options->triangulate = true;
+		}
+		else if (arg == "--light-samples") {
+			if ((v = value()) == nullptr) return false;
+			options->lightSamples = atoi(v);
+		}
+		else if (arg == "--bvh-quality") {
+			if ((v = value()) == nullptr) return false;
+			std::string quality = v;
+			if (quality == "low") {
+				options->build.quality = RTC_BUILD_QUALITY_LOW;
+			}
+			else if (quality == "medium") {
+				options->build.quality = RTC_BUILD_QUALITY_MEDIUM;
+			}
+			else if (quality == "high") {
+				options->build.quality = RTC_BUILD_QUALITY_HIGH;
+			}
+			else {
+				printf("invalid bvh quality %s\n", v);
+				return false;
+			}
+		}
+		else if (arg == "--bvh-async") {
+			options->build.asyncUpgrade = true;
+		}
+		else if (arg == "--numa") {
+			options->numa = true;
+		}
+		else if (arg == "--numa-replicate") {
+			options->numa = true;
+			options->replicateScene = true;
+		}
+		else if (arg == "--bench-numa") {
+			if ((v = value()) == nullptr) return false;
+			options->benchNumaSteps = atoi(v);
+		}
+		else if (arg == "--frames") {
+			if ((v = value()) == nullptr) return false;
+			options->sequence = true;
+			if (sscanf(v, "%d:%d", &options->firstFrame, &options->lastFrame) < 1) {
+				printf("invalid frame range %s\n", v);
+				return false;
+			}
+		}
+		else if (arg == "--frame-passes") {
+			if ((v = value()) == nullptr) return false;
+			options->framePasses = atoi(v);
+		}
+		else if (arg == "--job") {
+			if ((v = value()) == nullptr) return false;
+			options->job = v;
+		}
+		else if (arg == "--worker") {
+			if ((v = value()) == nullptr) return false;
+			options->worker = v;
+		}
+		else if (arg == "--passes") {
+			if ((v = value()) == nullptr) return false;
+			options->passes = atoi(v);
+		}
+		else if (arg == "--spawn") {
+			if ((v = value()) == nullptr) return false;
+			options->spawn = atoi(v);
+		}
+		else if (arg == "--stale") {
+			if ((v = value()) == nullptr) return false;
+			options->staleSeconds = atof(v);
+		}
+		else if (arg[0] == '-') {
+			printf("unknown option %s\n", arg.c_str());
+			return false;
+		}
+		else {
+			options->scene = arg;
+		}
+	}
+	return options->scene.empty() == false || options->worker.empty() == false;
+}
+
+static std::string dataPath(const Options &options, const char *name) {
+	return options.dataDirectory + "/" + name;
+}
+
+static std::string outputPath(const Options &options, int spp) {
+	std::string path = options.output;
+	auto at = path.find("%d");
+	if (at != std::string::npos) {
+		path.replace(at, 2, std::to_string(spp));
+	}
+	return path;
+}
+
+// シーンファイルの中身 (SceneCache::sourceKey と同じ fnv1a64), 読み方と解像度から作る。
+// パスやサイズが同じでも中身が変わっていれば別のシーンとして最初から描く
+static uint64_t checkpointKey(const Options &options, int width, int height) {
+	uint64_t key = rt::SceneCache::sourceKey(options.scene.c_str());
+	key = rt::fnv1a64(&options.triangulate, sizeof(options.triangulate), key);
+	key = rt::fnv1a64(&width, sizeof(width), key);
+	key = rt::fnv1a64(&height, sizeof(height), key);
+	return key;
+}
+
+// 取れるユニットが無くなるまで描く
+static int renderUnits(rt::JobDirectory &jobDirectory, rt::PTRenderer &renderer, double staleSeconds) {
+	const rt::RenderJob &job = jobDirectory.job();
+	std::vector<rt::Image::Pixel> accum;
+	int rendered = 0;
+	for (int i = 0; i < job.unitCount(); ++i) {
+		if (jobDirectory.claim(i, staleSeconds) == false) {
+			continue;
+		}
+		// 裏で作っていた高品質の BVH はユニットの合間に差し替える
+		renderer.swapUpgradedScenes();
+
+		rt::Stopwatch sw;
+		rt::RenderJob::Unit u = job.unit(i);
+		accum.assign((size_t)job.width * (u.y1 - u.y0), rt::Image::Pixel());
+		for (int pass = u.passBegin; pass < u.passEnd; ++pass) {
+			renderer.renderPass(pass, u.y0, u.y1, accum.data());
+			jobDirectory.heartbeat(i);
+		}
+		if (jobDirectory.complete(i, accum.data())) {
+			printf("unit %d/%d (rows %d-%d, passes %d-%d) %.1f sec\n", i, job.unitCount(), u.y0, u.y1, u.passBegin, u.passEnd, sw.elapsed());
+			rendered++;
+		}
+	}
+	return rendered;
+}
+
+// 同じ実行ファイルをワーカーとして起動する
+// threads: ワーカーが使うスレッド数。同じマシンで動くプロセスでコアを分けた数を渡す
+static pid_t spawnWorker(const char *program, const Options &options, int threads) {
+	pid_t pid = fork();
+	if (pid == 0) {
+		std::string threadCount = std::to_string(threads);
+		std::string stale = std::to_string(options.staleSeconds);
+		const char *args[] = {
+			program,
+			"--worker", options.job.c_str(),
+			"--data", options.dataDirectory.c_str(),
+			"--threads", threadCount.c_str(),
+			"--stale", stale.c_str(),
+			options.triangulate ? "--triangulate" : nullptr,
+			nullptr
+		};
+		execv(program, const_cast<char *const *>(args));
+		printf("can't exec %s\n", program);
+		_exit(1);
+	}
+	return pid;
+}
+
+static std::shared_ptr<rt::PTRenderer> createRenderer(std::shared_ptr<rt::Scene> scene, const Options &options, int maxNodes = 0, bool dynamicScene = false) {
+	std::shared_ptr<rt::PTRenderer> renderer;
+	if (options.numa) {
+		std::shared_ptr<rt::NumaArenas> numa(new rt::NumaArenas(maxNodes));
+		renderer = std::make_shared<rt::PTRenderer>(scene, numa, options.replicateScene, dynamicScene);
+	}
+	else {
+		renderer = std::make_shared<rt::PTRenderer>(scene, dynamicScene);
+	}
+	renderer->setLightSamples(options.lightSamples);
+	return renderer;
+}
+static std::shared_ptr<rt::PTRenderer> createRenderer(std::shared_ptr<rt::Scene> scene, std::shared_ptr<rt::SceneInterface> sceneInterface, const Options &options) {
+	std::shared_ptr<rt::PTRenderer> renderer;
+	if (options.numa) {
+		std::shared_ptr<rt::NumaArenas> numa(new rt::NumaArenas());
+		renderer = std::make_shared<rt::PTRenderer>(scene, numa, options.replicateScene, sceneInterface);
+	}
+	else {
+		renderer = std::make_shared<rt::PTRenderer>(scene, sceneInterface);
+	}
+	renderer->setLightSamples(options.lightSamples);
+	return renderer;
+}
+
+// 三角形光源の NEE で面積サンプリングと立体角サンプリングを選んだ回数
+static void printLightSamplingCounts() {
+	rt::DirectSamplingCounts counts = rt::directSamplingCounts();
+	uint64_t total = counts.area + counts.solidAngle;
+	if (total == 0) {
+		return;
+	}
+	printf("light sampling: area %.1f%%, solid angle %.1f%%, blended region %.1f%% of %llu samples\n",
+		100.0 * counts.area / total, 100.0 * counts.solidAngle / total, 100.0 * counts.blended / total, (unsigned long long)total);
+}
+
+// Embree のシーンを作った時間の内訳
+static void printBuildStatistics(const rt::SceneInterface &sceneInterface) {
+	const rt::SceneBuildStatistics &stats = sceneInterface.buildStatistics();
+	printf("embree: attach %.3f, instances %.3f, bvh %.3f, samplers %.3f sec%s\n",
+		stats.attachSeconds, stats.instanceSeconds, stats.bvhSeconds, stats.samplerSeconds,
+		sceneInterface.upgradePending() ? ", high quality bvh building in background" : "");
+}
+
+// Embree と共有している頂点とインデックスの量。シーンキャッシュからマップしたものは mapped に数える
+static void printGeometryMemory(const rt::Scene &scene) {
+	size_t triangles = 0;
+	size_t quads = 0;
+	size_t bytes = 0;
+	size_t mapped = 0;
+	int instances = 0;
+	for (const rt::Geometry &geometry : scene.geometries) {
+		if (0 <= geometry.prototype) {
+			instances++;
+		}
+		if (geometry.hasSharedShape()) {
+			int n = geometry.shared.primitiveVertices;
+			(n == 4 ? quads : triangles) += geometry.primitives.size();
+			mapped += sizeof(float) * 3 * geometry.shared.pointCount + sizeof(uint32_t) * n * geometry.primitives.size();
+		}
+		else {
+			triangles += geometry.indices.size();
+			quads += geometry.quads.size();
+		}
+		bytes += sizeof(rt::Geometry::Point) * geometry.points.size();
+		bytes += sizeof(glm::uvec3) * geometry.indices.size() + sizeof(glm::uvec4) * geometry.quads.size();
+	}
+	printf("geometry: %zu triangles, %zu quads, %d instances, vertex and index buffers %.1f MB heap, %.1f MB mapped\n", triangles, quads, instances, bytes / (1024.0 * 1024.0), mapped / (1024.0 * 1024.0));
+}
+
+/*
+ メッシュを並列に読み、読めたものから Embree のジオメトリを作る。
+ 最後にシーンの BVH を作って sampler を用意する
+ --scene-cache があれば先にそれを見て、使えなければ読んだ結果を書いておく
+*/
+static std::shared_ptr<rt::SceneInterface> loadScene(const Options &options, std::shared_ptr<rt::Scene> scene) {
+	uint64_t cacheKey = 0;
+	if (options.sceneCache.empty() == false) {
+		rt::Stopwatch cacheSw;
+		cacheKey = rt::SceneCache::sourceKey(options.scene.c_str());
+		cacheKey = rt::fnv1a64(&options.triangulate, sizeof(options.triangulate), cacheKey);
+		double keySeconds = cacheSw.elapsed();
+		std::shared_ptr<rt::SceneInterface> cached = rt::SceneCache::load(options.sceneCache.c_str(), cacheKey, scene, options.build);
+		if (cached) {
+			printf("load: scene cache hit %s, key %.3f, map and build %.3f sec\n", options.sceneCache.c_str(), keySeconds, cacheSw.elapsed() - keySeconds);
+			printBuildStatistics(*cached);
+			printGeometryMemory(*scene);
+			return cached;
+		}
+		printf("load: scene cache miss %s\n", options.sceneCache.c_str());
+	}
+
+	std::shared_ptr<rt::SceneInterface> sceneInterface;
+	rt::AlembicLoadStatistics stats;
+	bool loaded = rt::loadFromABCPipelined(options.scene.c_str(), *scene, [&](int count) {
+		sceneInterface = std::make_shared<rt::SceneInterface>(count, false, options.build);
+	}, [&](int geomID, rt::Geometry &geometry) {
+		if (options.triangulate) {
+			rt::triangulateQuads(geometry);
+		}
+		sceneInterface->attach(geomID, geometry);
+	}, &stats);
+	if (loaded == false) {
+		return std::shared_ptr<rt::SceneInterface>();
+	}
+
+	rt::Stopwatch sw;
+	sceneInterface->commit(scene);
+	double commitSeconds = sw.elapsed();
+
+	double read = 0.0, transform = 0.0, binding = 0.0, ready = 0.0;
+	for (const rt::AlembicLoadStatistics::Object &object : stats.objects) {
+		read += object.readSeconds;
+		transform += object.transformSeconds;
+		binding += object.bindingSeconds;
+		ready += object.readySeconds;
+	}
+	printf("load: open %.3f, walk %.3f, meshes %.3f (%d objects), instancing %.3f (%d instances), scene commit %.3f sec\n",
+		stats.openSeconds, stats.walkSeconds, stats.meshSeconds, (int)stats.objects.size(), stats.instanceSeconds, stats.instances, commitSeconds);
+	printf("      summed over threads: read %.3f, transform %.3f, binding %.3f, embree geometry %.3f sec\n",
+		read, transform, binding, ready);
+	printBuildStatistics(*sceneInterface);
+	printGeometryMemory(*scene);
+	if (options.loadTimings) {
+		printf("%10s %10s %10s %8s %8s %8s %8s  %s\n", "points", "prims", "quads", "read", "xform", "bind", "embree", "object");
+		for (const rt::AlembicLoadStatistics::Object &object : stats.objects) {
+			printf("%10d %10d %10d %8.3f %8.3f %8.3f %8.3f  %s\n", object.points, object.primitives, object.quads,
+				object.readSeconds, object.transformSeconds, object.bindingSeconds, object.readySeconds, object.name.c_str());
+		}
+	}
+
+	if (options.sceneCache.empty() == false) {
+		rt::Stopwatch cacheSw;
+		if (rt::SceneCache::write(options.sceneCache.c_str(), *scene, cacheKey)) {
+			printf("load: scene cache written %s, %.3f sec\n", options.sceneCache.c_str(), cacheSw.elapsed());
+		}
+	}
+	return sceneInterface;
+}
+
+/*
+ アニメーションを 1 フレームずつ描く。
+ フレーム N を描いている間に N+1 を裏で読み、トポロジーが同じなら頂点を書き換えて BVH は refit で済ませる
+ オーバーヘッド = 読み込みを待った時間 + シーンの更新
+*/
+static int renderSequence(const Options &options) {
+	rt::AlembicSequence sequence;
+	if (sequence.open(options.scene.c_str()) == false) {
+		return 1;
+	}
+	int first = std::max(options.firstFrame, 0);
+	int last = options.lastFrame < 0 ? sequence.frameCount() - 1 : std::min(options.lastFrame, sequence.frameCount() - 1);
+	if (last < first) {
+		printf("no frame in %d:%d, %s has %d frames\n", options.firstFrame, options.lastFrame, options.scene.c_str(), sequence.frameCount());
+		return 1;
+	}
+
+	rt::AsyncImageWriter imageWriter;
+	std::shared_ptr<rt::PTRenderer> renderer;
+	double overheadSeconds = 0.0;
+	double renderSeconds = 0.0;
+
+	sequence.prefetch(first);
+	for (int frame = first; frame <= last; ++frame) {
+		double waitSeconds = 0.0;
+		double loadSeconds = 0.0;
+		std::shared_ptr<rt::Scene> scene = sequence.take(frame, &waitSeconds, &loadSeconds);
+		if (frame < last) {
+			sequence.prefetch(frame + 1);
+		}
+
+		rt::Stopwatch updateTime;
+		bool updated = renderer && renderer->reloadScene(scene, true);
+		if (updated == false) {
+			renderer = createRenderer(scene, options, 0, true);
+			renderer->setPreviewEnabled(false);
+		}
+		double updateSeconds = updateTime.elapsed();
+
+		rt::Stopwatch renderTime;
+		for (int i = 0; i < options.framePasses; ++i) {
+			renderer->step();
+		}
+		double frameRenderSeconds = renderTime.elapsed();
+		imageWriter.save(renderer->_image, renderer->stepCount(), outputPath(options, frame));
+
+		double frameOverhead = waitSeconds + updateSeconds;
+		overheadSeconds += frameOverhead;
+		renderSeconds += frameRenderSeconds;
+		printf("frame %04d (t=%.3f), load %.3f sec (waited %.3f), %s %.3f sec, render %.3f sec, overhead %.1f%%\n",
+			frame, sequence.frameTime(frame), loadSeconds, waitSeconds, updated ? "update" : "build", updateSeconds,
+			frameRenderSeconds, frameOverhead / (frameOverhead + frameRenderSeconds) * 100.0);
+	}
+	imageWriter.flush();
+
+	int frames = last - first + 1;
+	printf("%d frames, overhead %.3f sec/frame, render %.3f sec/frame\n", frames, overheadSeconds / frames, renderSeconds / frames);
+	printLightSamplingCounts();
+	return 0;
+}
+
+// 使うノード数を 1 から増やしながら steps 回の step にかかる時間を測る
+// balance: ノードが自分のバンドを終えるまでの時間の 最も遅いノード / 平均。1 に近いほど偏りが無い
+static void benchmarkNuma(std::shared_ptr<rt::Scene> scene, Options options) {
+	int nodes = rt::NumaArenas().nodeCount();
+	int pixels = scene->camera.imageWidth() * scene->camera.imageHeight();
+	int steps = options.benchNumaSteps;
+
+	auto measure = [&](const char *label, std::shared_ptr<rt::PTRenderer> renderer, std::shared_ptr<rt::NumaArenas> numa, int threads, double base) {
+		renderer->step(); // warm up
+		std::vector<double> nodeSeconds(numa ? numa->nodeCount() : 0, 0.0);
+		rt::Stopwatch sw;
+		for (int i = 0; i < steps; ++i) {
+			renderer->step();
+			for (int node = 0; node < nodeSeconds.size(); ++node) {
+				nodeSeconds[node] += numa->nodeSeconds()[node];
+			}
+		}
+		double msps = (double)pixels * steps / sw.elapsed() * 1.0e-6;
+		printf("%-20s %4d threads %10.3f Msamples/s %6.2fx", label, threads, msps, 0.0 < base ? msps / base : 1.0);
+		if (nodeSeconds.empty() == false) {
+			double slowest = *std::max_element(nodeSeconds.begin(), nodeSeconds.end());
+			double mean = std::accumulate(nodeSeconds.begin(), nodeSeconds.end(), 0.0) / nodeSeconds.size();
+			printf("  balance %.3f", 0.0 < mean ? slowest / mean : 1.0);
+		}
+		printf("\n");
+		return msps;
+	};
+
+	Options plain = options;
+	plain.numa = false;
+	double base = measure("default arena", createRenderer(scene, plain), nullptr, (int)tbb::this_task_arena::max_concurrency(), 0.0);
+
+	options.numa = true;
+	for (int k = 1; k <= nodes; ++k) {
+		std::shared_ptr<rt::NumaArenas> numa(new rt::NumaArenas(k));
+		auto renderer = std::make_shared<rt::PTRenderer>(scene, numa, options.replicateScene);
+		char label[64];
+		snprintf(label, sizeof(label), "numa %d/%d nodes", k, nodes);
+		measure(label, renderer, numa, numa->concurrency(), base);
+	}
+}
+
+int main(int argc, char *argv[]) {
+	rt::Stopwatch sw;
+
+	Options options;
+	if (parseOptions(argc, argv, &options) == false) {
+		printUsage(argv[0]);
+		return 1;
+	}
+
+	_MM_SET_FLUSH_ZERO_MODE(_MM_FLUSH_ZERO_ON);
+	_MM_SET_DENORMALS_ZERO_MODE(_MM_DENORMALS_ZERO_ON);
+
+	int threads = 0 < options.threads ? options.threads : (int)tbb::this_task_arena::max_concurrency();
+	// --spawn ではコーディネーターと n 個のワーカーが同じマシンで描くので、コアを n + 1 で分ける
+	if (options.job.empty() == false && 0 < options.spawn) {
+		threads = std::max(threads / (options.spawn + 1), 1);
+	}
+	tbb::global_control parallelism(tbb::global_control::max_allowed_parallelism, threads);
+
+	rt::CoupledBRDFConductor::load(
+		dataPath(options, "baked/albedo_specular_conductor.bin").c_str(),
+		dataPath(options, "baked/albedo_specular_conductor_avg.bin").c_str());
+	rt::CoupledBRDFDielectrics::load(
+		dataPath(options, "baked/albedo_specular_dielectrics.bin").c_str(),
+		dataPath(options, "baked/albedo_specular_dielectrics_avg.bin").c_str());
+	rt::CoupledBRDFConductorGGX::load(
+		dataPath(options, "baked/albedo_specular_conductor_ggx.bin").c_str(),
+		dataPath(options, "baked/albedo_specular_conductor_ggx_avg.bin").c_str());
+	rt::CoupledBRDFDielectricsGGX::load(
+		dataPath(options, "baked/albedo_specular_dielectrics_ggx.bin").c_str(),
+		dataPath(options, "baked/albedo_specular_dielectrics_ggx_avg.bin").c_str());
+
+	rt::CoupledBRDFVelvet::load(
+		dataPath(options, "baked/albedo_velvet.bin").c_str(),
+		dataPath(options, "baked/albedo_velvet_avg.bin").c_str());
+
+	if (options.sequence) {
+		return renderSequence(options);
+	}
+
+	rt::JobDirectory jobDirectory;
+	if (options.worker.empty() == false) {
+		if (jobDirectory.open(options.worker) == false) {
+			return 1;
+		}
+		options.scene = jobDirectory.job().scene;
+		options.triangulate = jobDirectory.job().triangulate;
+		options.lightSamples = jobDirectory.job().lightSamples;
+	}
+
+	std::shared_ptr<rt::Scene> scene(new rt::Scene());
+	std::shared_ptr<rt::SceneInterface> sceneInterface = loadScene(options, scene);
+	if (sceneInterface == nullptr || scene->geometries.empty()) {
+		printf("no geometry in %s\n", options.scene.c_str());
+		return 1;
+	}
+	printf("setup %f seconds, %d threads\n", sw.elapsed(), threads);
+
+	if (0 < options.benchNumaSteps) {
+		benchmarkNuma(scene, options);
+		return 0;
+	}
+
+	std::shared_ptr<rt::PTRenderer> renderer = createRenderer(scene, sceneInterface, options);
+	sceneInterface.reset();
+
+	if (options.worker.empty() == false) {
+		const rt::RenderJob &job = jobDirectory.job();
+		if (job.width != scene->camera.imageWidth() || job.height != scene->camera.imageHeight()) {
+			printf("resolution mismatch, job %dx%d, scene %dx%d\n", job.width, job.height, scene->camera.imageWidth(), scene->camera.imageHeight());
+			return 1;
+		}
+		// シーンファイルが書き換わっていたら違う画像を混ぜてしまうので描かない
+		uint64_t key = checkpointKey(options, job.width, job.height);
+		if (job.key != key) {
+			printf("scene mismatch, job key %016llx, worker key %016llx\n", (unsigned long long)job.key, (unsigned long long)key);
+			return 1;
+		}
+		int rendered = renderUnits(jobDirectory, *renderer, options.staleSeconds);
+		printf("worker done, %d units, %.1f sec\n", rendered, sw.elapsed());
+		return 0;
+	}
+
+	if (options.job.empty() == false) {
+		rt::RenderJob job;
+		job.scene = options.scene;
+		job.triangulate = options.triangulate;
+		job.lightSamples = options.lightSamples;
+		job.width = scene->camera.imageWidth();
+		job.height = scene->camera.imageHeight();
+		job.key = checkpointKey(options, job.width, job.height);
+		job.passes = options.passes;
+		if (jobDirectory.create(options.job, job) == false) {
+			return 1;
+		}
+
+		std::vector<pid_t> workers;
+		for (int i = 0; i < options.spawn; ++i) {
+			pid_t pid = spawnWorker(argv[0], options, threads);
+			if (0 < pid) {
+				workers.push_back(pid);
+			}
+		}
+
+		// コーディネーター自身も描く。途中で参加したワーカーは残りのユニットを取り、
+		// 死んだワーカーのユニットはハートビートが切れたあとで誰かが取り直す
+		renderUnits(jobDirectory, *renderer, options.staleSeconds);
+		while (0 < jobDirectory.remaining()) {
+			std::this_thread::sleep_for(std::chrono::seconds(1));
+			renderUnits(jobDirectory, *renderer, options.staleSeconds);
+		}
+		for (pid_t pid : workers) {
+			waitpid(pid, nullptr, 0);
+		}
+
+		rt::Image::Snapshot snapshot;
+		if (jobDirectory.merge(&snapshot) == false) {
+			return 1;
+		}
+		rt::AsyncImageWriter::write(snapshot, outputPath(options, job.passes));
+		printf("merged %d units, %.1f sec\n", job.unitCount(), sw.elapsed());
+		return 0;
+	}
+
+	rt::AsyncImageWriter imageWriter;
+
+	// 前回までに使ったレンダリング時間
+	double resumedSeconds = 0.0;
+	rt::Checkpoint checkpoint;
+	if (options.checkpoint.empty() == false) {
+		const rt::Image &image = renderer->_image;
+		if (checkpoint.open(options.checkpoint.c_str(), image.width(), image.height(), checkpointKey(options, image.width(), image.height()))) {
+			if (checkpoint.resume(*renderer, &resumedSeconds)) {
+				printf("resumed from %s, %d steps, %.1f sec\n", options.checkpoint.c_str(), renderer->stepCount(), resumedSeconds);
+			}
+		}
+	}
+
+	rt::Stopwatch renderTime;
+	rt::Stopwatch checkpointTime;
+	int resumedSteps = renderer->stepCount();
+	rt::progressiveRender(&sw, [&](int frame) {
+		renderer->step();
+		printf("frame %03d, %.1f sec\n", renderer->stepCount(), resumedSeconds + sw.elapsed());
+
+		if (checkpoint.isOpen() && options.checkpointInterval < checkpointTime.elapsed()) {
+			checkpoint.save(*renderer, resumedSeconds + sw.elapsed());
+			checkpointTime = rt::Stopwatch();
+		}
+	}, [&](int) {
+		int spp = renderer->stepCount();
+		imageWriter.save(renderer->_image, spp, outputPath(options, spp));
+	}, options.renderTime - resumedSeconds, options.saveInterval);
+
+	int pixels = renderer->_image.width() * renderer->_image.height();
+	printf("rendered %d steps, %.3f Msamples/s\n", renderer->stepCount() - resumedSteps,
+		(double)pixels * (renderer->stepCount() - resumedSteps) / renderTime.elapsed() * 1.0e-6);
+	printLightSamplingCounts();
+
+	if (checkpoint.isOpen()) {
+		checkpoint.save(*renderer, resumedSeconds + sw.elapsed());
+		checkpoint.wait();
+		printf("checkpoint overhead %.3f sec (%.2f%% of render time)\n",
+			checkpoint.overheadSeconds(), checkpoint.overheadSeconds() / renderTime.elapsed() * 100.0);
+	}
+
+	imageWriter.flush();
+
+	return 0;
+}
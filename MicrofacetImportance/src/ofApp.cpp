@@ -300,6 +300,8 @@ void ofApp::setup(){
 
 	rt::CoupledBRDFConductor::load(ofToDataPath("baked/albedo_specular_conductor.bin").c_str(), ofToDataPath("baked/albedo_specular_conductor_avg.bin").c_str());
 	rt::CoupledBRDFDielectrics::load(ofToDataPath("baked/albedo_specular_dielectrics.bin").c_str(), ofToDataPath("baked/albedo_specular_dielectrics_avg.bin").c_str());
+	rt::CoupledBRDFConductorGGX::load(ofToDataPath("baked/albedo_specular_conductor_ggx.bin").c_str(), ofToDataPath("baked/albedo_specular_conductor_ggx_avg.bin").c_str());
+	rt::CoupledBRDFDielectricsGGX::load(ofToDataPath("baked/albedo_specular_dielectrics_ggx.bin").c_str(), ofToDataPath("baked/albedo_specular_dielectrics_ggx_avg.bin").c_str());
 
 	_camera.setNearClip(0.1);
 	_camera.setFarClip(100.0);
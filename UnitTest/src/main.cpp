@@ -4,7 +4,10 @@
 #include <catch.hpp>
 
 #include <set>
+#include <cmath>
+#include <limits>
 #include <memory>
+#include <functional>
 
 #include "online.hpp"
 #include "peseudo_random.hpp"
@@ -17,6 +20,13 @@
 #include "material.hpp"
 #include "geometry.hpp"
 #include "randomsampler.hpp"
+#include "integrator.hpp"
+#include "scene_cache.hpp"
+#include "checkpoint.hpp"
+#include "distributed.hpp"
+#include "instancing.hpp"
+#include "alembic_loader.hpp"
+#include "image_io.hpp"
 
 TEST_CASE("online", "[online]") {
 	SECTION("online") {
@@ -352,6 +362,195 @@ TEST_CASE("microfacet", "[microfacet]") {
 			printf("MC coupled dielectrics %.10f\n", result);
 		}
 	}
+
+	// 極のすぐ近くでも拡散側の pdf は有限で、sinθ = sqrt(1 - cos^2) の式と合う
+	SECTION("coupled pdf near the pole") {
+		using namespace rt;
+		const CoupledBRDFSampler &sampler = CoupledBRDFConductor::sampler();
+		double alpha = 0.5;
+		for (double e : { 1.0e-4, 1.0e-6, 1.0e-7, 2.0e-8, 1.0e-9 }) {
+			double cosTheta = 1.0 - e;
+			double sinTheta = std::sqrt((2.0 - e) * e);
+			double expected = sampler.thetaSize(alpha) / (glm::pi<double>() * glm::pi<double>() * sinTheta) * sampler.probability(alpha, std::asin(sinTheta));
+			double pdf = sampler.pdf(alpha, cosTheta);
+			CAPTURE(e);
+			CAPTURE(pdf);
+			CAPTURE(expected);
+			REQUIRE(std::isfinite(pdf));
+			REQUIRE(std::abs(pdf - expected) <= expected * 1.0e-6);
+		}
+	}
+}
+
+TEST_CASE("GGX", "[GGX]") {
+	using namespace rt;
+	rt::CoupledBRDFConductorGGX::load(
+		ofToDataPath("baked/albedo_specular_conductor_ggx.bin").c_str(),
+		ofToDataPath("baked/albedo_specular_conductor_ggx_avg.bin").c_str());
+	rt::CoupledBRDFDielectricsGGX::load(
+		ofToDataPath("baked/albedo_specular_dielectrics_ggx.bin").c_str(),
+		ofToDataPath("baked/albedo_specular_dielectrics_ggx_avg.bin").c_str());
+
+	rt::Xor64 random;
+	glm::dvec3 Ng(0.0, 0.0, 1.0);
+
+	SECTION("D Normalization") {
+		for (int j = 0; j < 32; ++j) {
+			// alphaが小さい場合、simpsonによる積分が適さない
+			double alpha = random.uniform(0.1, 1.0);
+
+			double result = hemisphere_composite_simpson<double>([&](double theta, double phi) {
+				glm::dvec3 h = rt::polar_to_cartesian((double)theta, (double)phi);
+				return D_GGX(Ng, h, alpha) * glm::dot(Ng, h);
+			}, 500);
+			CAPTURE(alpha);
+			CAPTURE(result);
+			REQUIRE(std::abs(result - 1.0) < 1.0e-4);
+		}
+	}
+
+	SECTION("visible normal normalization") {
+		for (int j = 0; j < 32; ++j) {
+			double alpha = random.uniform(0.1, 1.0);
+			glm::dvec3 wo = LambertianSampler::sample(&random, Ng);
+			double cosThetaO = wo.z;
+
+			double result = hemisphere_composite_simpson<double>([&](double theta, double phi) {
+				glm::dvec3 h = rt::polar_to_cartesian((double)theta, (double)phi);
+				return G1_ggx(cosThetaO, alpha) * std::max(glm::dot(wo, h), 0.0) * D_GGX(Ng, h, alpha) / cosThetaO;
+			}, 500);
+			CAPTURE(alpha);
+			CAPTURE(result);
+			REQUIRE(std::abs(result - 1.0) < 1.0e-4);
+		}
+	}
+
+	// sample と pdf が合っていれば、MC の推定値が Simpson の積分と一致する
+	SECTION("MC MicrofacetGGXConductorMaterial") {
+		for (int j = 0; j < 16; ++j) {
+			double alpha = random.uniform(0.1, 1.0);
+			glm::dvec3 wo = LambertianSampler::sample(&random, Ng);
+
+			MicrofacetGGXConductorMaterial m;
+			m.Ng = Ng;
+			m.alpha = alpha;
+			m.useFresnel = false;
+
+			double albedo = hemisphere_composite_simpson<double>([&](double theta, double phi) {
+				glm::dvec3 wi = rt::polar_to_cartesian((double)theta, (double)phi);
+				return m.bxdf(wo, wi).r * glm::dot(m.Ng, wi);
+			}, 500);
+
+			OnlineMean<double> mean;
+			for (int i = 0; i < 200000; ++i) {
+				glm::dvec3 wi = m.sample(&random, wo);
+				double value = m.bxdf(wo, wi).r * glm::dot(m.Ng, wi) / m.pdf(wo, wi);
+				mean.addSample(glm::dot(m.Ng, wi) <= 0.0 || glm::isfinite(value) == false ? 0.0 : value);
+			}
+
+			CAPTURE(alpha);
+			CAPTURE(glm::dot(Ng, wo));
+			CAPTURE(albedo);
+			REQUIRE(std::abs(mean.mean() - albedo) < 1.0e-2);
+		}
+	}
+
+	SECTION("white furnance test MicrofacetGGXCoupledConductorMaterial") {
+		for (int j = 0; j < 16; ++j) {
+			double alpha = random.uniform(0.1, 1.0);
+			glm::dvec3 wo = LambertianSampler::sample(&random, Ng);
+
+			MicrofacetGGXCoupledConductorMaterial m;
+			m.Ng = Ng;
+			m.alpha = alpha;
+			m.useFresnel = false;
+
+			double result = hemisphere_composite_simpson<double>([&](double theta, double phi) {
+				glm::dvec3 wi = rt::polar_to_cartesian((double)theta, (double)phi);
+				return m.bxdf(wo, wi).r * glm::dot(m.Ng, wi);
+			}, 500);
+
+			CAPTURE(alpha);
+			CAPTURE(glm::dot(Ng, wo));
+			REQUIRE(std::abs(result - 1.0) < 1.0e-2);
+		}
+	}
+
+	SECTION("white furnance test MC MicrofacetGGXCoupledDielectricsMaterial") {
+		for (int j = 0; j < 16; ++j) {
+			double alpha = random.uniform(0.1, 1.0);
+			glm::dvec3 wo = LambertianSampler::sample(&random, Ng);
+
+			MicrofacetGGXCoupledDielectricsMaterial m;
+			m.Ng = Ng;
+			m.alpha = alpha;
+
+			OnlineMean<double> mean;
+			for (int i = 0; i < 200000; ++i) {
+				glm::dvec3 wi = m.sample(&random, wo);
+				glm::dvec3 bxdf = m.bxdf(wo, wi);
+				double value = 0.0;
+				if (glm::any(glm::greaterThanEqual(bxdf, glm::dvec3(1.0e-6f)))) {
+					value = bxdf.x * glm::dot(m.Ng, wi) / m.pdf(wo, wi);
+				}
+				mean.addSample(value);
+			}
+
+			CAPTURE(alpha);
+			CAPTURE(glm::dot(Ng, wo));
+			REQUIRE(std::abs(mean.mean() - 1.0) < 1.0e-2);
+		}
+	}
+}
+
+TEST_CASE("HeitzConductorMaterial", "[HeitzConductorMaterial]") {
+	using namespace rt;
+	rt::Xor64 random;
+	glm::dvec3 Ng(0.0, 0.0, 1.0);
+
+	// フレネルがなければ多重散乱でエネルギーは失われない
+	SECTION("white furnace") {
+		for (int j = 0; j < 8; ++j) {
+			double alpha = random.uniform(0.1, 1.0);
+			glm::dvec3 wo = LambertianSampler::sample(&random, Ng);
+
+			HeitzConductorMaterial m;
+			m.Ng = Ng;
+			m.alpha = alpha;
+			m.useFresnel = false;
+
+			OnlineMean<double> mean;
+			for (int i = 0; i < 800000; ++i) {
+				glm::dvec3 wi = m.sample(&random, wo);
+				double value = m.stochastic_bxdf(&random, wo, wi).r * glm::dot(m.Ng, wi) / m.pdf(wo, wi);
+				mean.addSample(value);
+			}
+
+			CAPTURE(alpha);
+			CAPTURE(glm::dot(Ng, wo));
+			REQUIRE(std::abs(mean.mean() - 1.0) < 5.0e-3);
+		}
+	}
+
+	// 乱数は呼び出し側のものだけを使う
+	SECTION("reproducible") {
+		HeitzConductorMaterial m;
+		m.Ng = Ng;
+		for (int j = 0; j < 32; ++j) {
+			glm::dvec3 wo = LambertianSampler::sample(&random, Ng);
+			glm::dvec3 wi = LambertianSampler::sample(&random, Ng);
+			rt::Xor64 a(j + 1);
+			rt::Xor64 b(j + 1);
+			glm::dvec3 x = m.stochastic_bxdf(&a, wo, wi);
+			glm::dvec3 y = m.stochastic_bxdf(&b, wo, wi);
+			REQUIRE(x == y);
+
+			// bxdf は (wo, wi) だけで決まる
+			glm::dvec3 z = m.bxdf(wo, wi);
+			m.stochastic_bxdf(&random, wo, wi);
+			REQUIRE(m.bxdf(wo, wi) == z);
+		}
+	}
 }
 
 // 
@@ -431,6 +630,1572 @@ TEST_CASE("Velvet", "[Velvet]") {
 	}
 }
 
+TEST_CASE("fast_math", "[fast_math]") {
+	using namespace rt;
+
+	// 最大相対誤差。スカラー版と __m128 版の両方を見る
+	auto maxRelativeError = [](std::function<float(float)> f, std::function<__m128(__m128)> f_ps, std::function<double(double)> reference, double a, double b, bool logScale) {
+		rt::Xor64 random;
+		double maxError = 0.0;
+		for (int i = 0; i < 1000000; ++i) {
+			double u = random.uniform(a, b);
+			float x = (float)(logScale ? std::pow(10.0, u) : u);
+			double r = reference(x);
+			if (r == 0.0) {
+				continue;
+			}
+			float simd[4];
+			_mm_storeu_ps(simd, f_ps(_mm_set1_ps(x)));
+			maxError = std::max(maxError, std::abs(f(x) - r) / std::abs(r));
+			maxError = std::max(maxError, std::abs(simd[0] - r) / std::abs(r));
+		}
+		return maxError;
+	};
+
+	SECTION("max relative error") {
+		double e;
+		e = maxRelativeError([](float x) { return fast_math::exp(x); }, fast_math::exp_ps, [](double x) { return std::exp(x); }, -80.0, 80.0, false);
+		printf("exp  %.3e\n", e);
+		REQUIRE(e < 4.0e-7);
+
+		e = maxRelativeError([](float x) { return fast_math::log(x); }, fast_math::log_ps, [](double x) { return std::log(x); }, -30.0, 30.0, true);
+		printf("log  %.3e\n", e);
+		REQUIRE(e < 3.0e-7);
+
+		e = maxRelativeError([](float x) { return fast_math::atan(x); }, fast_math::atan_ps, [](double x) { return std::atan(x); }, -6.0, 6.0, true);
+		printf("atan %.3e\n", e);
+		REQUIRE(e < 4.0e-7);
+
+		e = maxRelativeError([](float x) { return fast_math::acos(x); }, fast_math::acos_ps, [](double x) { return std::acos(x); }, -1.0, 1.0, false);
+		printf("acos %.3e\n", e);
+		REQUIRE(e < 4.0e-7);
+
+		e = maxRelativeError([](float x) { return fast_math::sin(x); }, fast_math::sin_ps, [](double x) { return std::sin(x); }, -glm::half_pi<double>(), glm::half_pi<double>(), false);
+		printf("sin  %.3e\n", e);
+		REQUIRE(e < 3.0e-7);
+
+		e = maxRelativeError([](float x) { return fast_math::erf(x); }, fast_math::erf_ps, [](double x) { return std::erf(x); }, -6.0, 6.0, false);
+		printf("erf  %.3e\n", e);
+		REQUIRE(e < 7.0e-7);
+
+		// pow は y ln x に比例して誤差が増える
+		rt::Xor64 random;
+		double powError = 0.0;
+		for (int i = 0; i < 1000000; ++i) {
+			float x = (float)random.uniform(1.0e-4, 1.0);
+			float y = (float)random.uniform(1.0e-3, 100.0);
+			double r = std::pow((double)x, (double)y);
+			if (r < 1.0e-30) {
+				continue;
+			}
+			float simd[4];
+			_mm_storeu_ps(simd, fast_math::pow_ps(_mm_set1_ps(x), _mm_set1_ps(y)));
+			double bound = std::abs(y * std::log(x)) + 1.0;
+			powError = std::max(powError, std::abs(fast_math::pow(x, y) - r) / r / bound);
+			powError = std::max(powError, std::abs(simd[0] - r) / r / bound);
+		}
+		printf("pow  %.3e * (|y ln x| + 1)\n", powError);
+		REQUIRE(powError < 4.0e-7);
+	}
+
+	// inf, NaN, 0, 非正規化数, あふれは std と同じ
+	SECTION("edge cases") {
+		const float inf = std::numeric_limits<float>::infinity();
+		const float nan = std::numeric_limits<float>::quiet_NaN();
+		auto same = [](float value, double reference) {
+			if (reference != reference) {
+				return value != value;
+			}
+			if (std::isinf(reference) || reference == 0.0) {
+				return (double)value == reference;
+			}
+			// 結果が非正規化数になるところは 0 に落ちてもよい
+			if (std::abs(reference) < std::numeric_limits<float>::min()) {
+				return std::abs(value) < std::numeric_limits<float>::min();
+			}
+			return std::abs(value - reference) / std::abs(reference) < 1.0e-6;
+		};
+		auto check = [&](const char *name, std::function<float(float)> f, std::function<__m128(__m128)> f_ps, std::function<double(double)> reference, std::vector<float> xs) {
+			for (float x : xs) {
+				float simd[4];
+				_mm_storeu_ps(simd, f_ps(_mm_set1_ps(x)));
+				CAPTURE(name);
+				CAPTURE(x);
+				CAPTURE(f(x));
+				CAPTURE(simd[0]);
+				CAPTURE(reference(x));
+				REQUIRE(same(f(x), reference(x)));
+				REQUIRE(same(simd[0], reference(x)));
+			}
+		};
+		check("exp", [](float x) { return fast_math::exp(x); }, fast_math::exp_ps, [](double x) { return (double)std::exp((float)x); },
+			{ -inf, inf, nan, -100.0f, -86.9f, 0.0f, 88.0f, 88.5f, 88.72f, 88.73f, 100.0f });
+		check("log", [](float x) { return fast_math::log(x); }, fast_math::log_ps, [](double x) { return std::log(x); },
+			{ -inf, -1.0f, -0.0f, 0.0f, 1.0e-45f, 1.0e-40f, 1.17549e-38f, std::numeric_limits<float>::min(), 1.0f, std::numeric_limits<float>::max(), inf, nan });
+		check("atan", [](float x) { return fast_math::atan(x); }, fast_math::atan_ps, [](double x) { return std::atan(x); },
+			{ -inf, inf, nan, 0.0f, 1.0e30f });
+		check("acos", [](float x) { return fast_math::acos(x); }, fast_math::acos_ps, [](double x) { return std::acos(x); },
+			{ -1.5f, -1.0f, 1.0f, 1.5f, nan });
+		check("sin", [](float x) { return fast_math::sin(x); }, fast_math::sin_ps, [](double x) { return std::sin(x); },
+			{ -inf, inf, nan, 0.5f });
+		check("erf", [](float x) { return fast_math::erf(x); }, fast_math::erf_ps, [](double x) { return std::erf(x); },
+			{ -inf, inf, nan, -10.0f, 10.0f });
+
+		float xs[] = { 0.0f, 0.0f, 0.0f, 2.0f, 0.5f, inf, 1.0f, 1.0e-40f };
+		float ys[] = { 0.0f, 2.0f, -1.0f, 0.0f, 3.0f, 2.0f, 100.0f, 0.5f };
+		for (int i = 0; i < 8; ++i) {
+			float simd[4];
+			_mm_storeu_ps(simd, fast_math::pow_ps(_mm_set1_ps(xs[i]), _mm_set1_ps(ys[i])));
+			double reference = std::pow((double)xs[i], (double)ys[i]);
+			CAPTURE(xs[i]);
+			CAPTURE(ys[i]);
+			REQUIRE(same(fast_math::pow(xs[i], ys[i]), reference));
+			REQUIRE(same(simd[0], reference));
+		}
+	}
+
+	// 実際に使う組み合わせの式。double 版は近似を通さず、Λ は a が大きくても打ち消し合わない
+	SECTION("lambda and D") {
+		const long double pi = 3.141592653589793238462643383279502884L;
+		for (double alpha : { 0.05, 0.3, 1.0 }) {
+			for (double a = 0.05; a < 25.0; a *= 1.1) {
+				double tanTheta = 1.0 / (alpha * a);
+				double cosTheta = 1.0 / std::sqrt(1.0 + tanTheta * tanTheta);
+
+				long double c = cosTheta;
+				long double a_l = c / (sqrtl(1.0L - c * c) * alpha);
+				long double lambda = (expl(-a_l * a_l) / (a_l * sqrtl(pi)) - erfcl(a_l)) * 0.5L;
+				if (lambda < 1.0e-300L) {
+					continue;
+				}
+				CAPTURE(alpha);
+				CAPTURE(a);
+				REQUIRE(std::abs((long double)lambda_beckmann(cosTheta, alpha) - lambda) / lambda < 1.0e-9L);
+			}
+		}
+
+		rt::Xor64 random;
+		for (int i = 0; i < 100000; ++i) {
+			double alpha = random.uniform(0.05, 1.0);
+			double cosTheta = random.uniform(0.01, 1.0);
+			glm::dvec3 h(std::sqrt(1.0 - cosTheta * cosTheta), 0.0, cosTheta);
+
+			long double c2 = (long double)cosTheta * cosTheta;
+			long double a2 = (long double)alpha * alpha;
+			long double d = expl(-(1.0L - c2) / c2 / a2) / (pi * a2 * c2 * c2);
+			if (d < 1.0e-30L) {
+				continue;
+			}
+			CAPTURE(alpha);
+			CAPTURE(cosTheta);
+			REQUIRE(std::abs((long double)D_Beckmann(glm::dvec3(0.0, 0.0, 1.0), h, alpha) - d) / d < 1.0e-12L);
+
+			// float のバッチ版は ENABLE_FAST_MATH に関わらず float の精度まで
+			float d_batch = bxdf_batch_details::D_Beckmann((float)cosTheta, (float)alpha);
+			REQUIRE(std::abs((long double)d_batch - d) / d < 1.0e-4L);
+		}
+	}
+
+	// fmath を通ったサンプリング (atan, log) と評価 (exp, erf, pow) で、エネルギーが保存されたまま、sample と pdf が食い違わない
+	SECTION("white furnance") {
+		rt::Xor64 random;
+		glm::dvec3 Ng(0.0, 0.0, 1.0);
+		for (int j = 0; j < 8; ++j) {
+			// alphaが小さい場合、simpsonによる積分が適さない
+			double alpha = random.uniform(0.1, 1.0);
+			glm::dvec3 wo = LambertianSampler::sample(&random, Ng);
+
+			MicrofacetConductorMaterial m;
+			m.Ng = Ng;
+			m.alpha = alpha;
+			m.useFresnel = false;
+
+			double albedo = hemisphere_composite_simpson<double>([&](double theta, double phi) {
+				glm::dvec3 wi = rt::polar_to_cartesian((double)theta, (double)phi);
+				return m.bxdf(wo, wi).r * glm::dot(m.Ng, wi);
+			}, 500);
+
+			OnlineMean<double> mean;
+			for (int i = 0; i < 100000; ++i) {
+				glm::dvec3 wi = m.sample(&random, wo);
+				double value = m.bxdf(wo, wi).r * glm::dot(m.Ng, wi) / m.pdf(wo, wi);
+				mean.addSample(glm::dot(m.Ng, wi) <= 0.0 || glm::isfinite(value) == false ? 0.0 : value);
+			}
+
+			CAPTURE(alpha);
+			CAPTURE(albedo);
+			CAPTURE(mean.mean());
+			REQUIRE(albedo < 1.0 + 1.0e-3);
+			REQUIRE(std::abs(mean.mean() - albedo) < 1.0e-2);
+
+			// velvet (pow, exp)
+			MicrofacetVelvetEnergyLossMaterial velvet;
+			velvet.Ng = Ng;
+			velvet.alpha = alpha;
+			double velvetAlbedo = hemisphere_composite_simpson<double>([&](double theta, double phi) {
+				glm::dvec3 wi = rt::polar_to_cartesian((double)theta, (double)phi);
+				return velvet.bxdf(wo, wi).r * glm::dot(velvet.Ng, wi);
+			}, 500);
+			CAPTURE(velvetAlbedo);
+			REQUIRE(velvetAlbedo < 1.0 + 1.0e-3);
+		}
+	}
+}
+
+TEST_CASE("BxdfBatch", "[BxdfBatch]") {
+	using namespace rt;
+	rt::CoupledBRDFConductor::load(
+		ofToDataPath("baked/albedo_specular_conductor.bin").c_str(),
+		ofToDataPath("baked/albedo_specular_conductor_avg.bin").c_str());
+	rt::CoupledBRDFDielectrics::load(
+		ofToDataPath("baked/albedo_specular_dielectrics.bin").c_str(),
+		ofToDataPath("baked/albedo_specular_dielectrics_avg.bin").c_str());
+	rt::CoupledBRDFConductorGGX::load(
+		ofToDataPath("baked/albedo_specular_conductor_ggx.bin").c_str(),
+		ofToDataPath("baked/albedo_specular_conductor_ggx_avg.bin").c_str());
+	rt::CoupledBRDFDielectricsGGX::load(
+		ofToDataPath("baked/albedo_specular_dielectrics_ggx.bin").c_str(),
+		ofToDataPath("baked/albedo_specular_dielectrics_ggx_avg.bin").c_str());
+	rt::CoupledBRDFVelvet::load(
+		ofToDataPath("baked/albedo_velvet.bin").c_str(),
+		ofToDataPath("baked/albedo_velvet_avg.bin").c_str());
+
+	// float でまとめて評価した値が、double でひとつずつ評価した値とだいたい合う
+	auto check = [](const IMaterial &m, PeseudoRandom *random) {
+		for (int j = 0; j < 256; ++j) {
+			BxdfBatch batch;
+			for (int k = 0; k < kBxdfBatchWidth - 1; ++k) {
+				batch.add(LambertianSampler::sample(random, m.Ng), LambertianSampler::sample(random, m.Ng));
+			}
+			m.bxdf_batch(&batch);
+			m.pdf_batch(&batch);
+			for (int k = 0; k < batch.count; ++k) {
+				glm::dvec3 wo = batch.directionO(k);
+				glm::dvec3 wi = batch.directionI(k);
+				glm::dvec3 bxdf = m.bxdf(wo, wi);
+				double pdf = m.pdf(wo, wi);
+				for (int i = 0; i < 3; ++i) {
+					CAPTURE(bxdf[i]);
+					CAPTURE(batch.bxdf[i][k]);
+					REQUIRE(std::abs(batch.bxdf[i][k] - bxdf[i]) <= std::max(std::abs(bxdf[i]), 1.0) * 1.0e-2);
+				}
+				CAPTURE(pdf);
+				CAPTURE(batch.pdf[k]);
+				REQUIRE(std::abs(batch.pdf[k] - pdf) <= std::max(pdf, 1.0) * 1.0e-2);
+			}
+		}
+	};
+
+	rt::XoroshiroPlus128 random;
+	glm::dvec3 Ng(0.0, 0.0, 1.0);
+	for (int j = 0; j < 8; ++j) {
+		double alpha = random.uniform(0.1, 1.0);
+		{
+			LambertianMaterial m(glm::dvec3(0.0), glm::dvec3(0.2, 0.5, 0.8));
+			m.Ng = Ng;
+			check(m, &random);
+		}
+		{
+			MicrofacetConductorMaterial m;
+			m.Ng = Ng;
+			m.alpha = alpha;
+			check(m, &random);
+		}
+		{
+			MicrofacetCoupledConductorMaterial m;
+			m.Ng = Ng;
+			m.alpha = alpha;
+			m.eta = glm::dvec3(0.15557, 0.42415, 1.3821);
+			m.k = glm::dvec3(3.6024, 2.4721, 1.9155);
+			check(m, &random);
+		}
+		{
+			MicrofacetCoupledDielectricsMaterial m;
+			m.Ng = Ng;
+			m.alpha = alpha;
+			m.Cd = glm::dvec3(0.2, 0.5, 0.8);
+			check(m, &random);
+		}
+		{
+			MicrofacetGGXConductorMaterial m;
+			m.Ng = Ng;
+			m.alpha = alpha;
+			check(m, &random);
+		}
+		{
+			MicrofacetGGXCoupledConductorMaterial m;
+			m.Ng = Ng;
+			m.alpha = alpha;
+			m.eta = glm::dvec3(0.15557, 0.42415, 1.3821);
+			m.k = glm::dvec3(3.6024, 2.4721, 1.9155);
+			check(m, &random);
+		}
+		{
+			MicrofacetGGXCoupledDielectricsMaterial m;
+			m.Ng = Ng;
+			m.alpha = alpha;
+			m.Cd = glm::dvec3(0.2, 0.5, 0.8);
+			check(m, &random);
+		}
+		{
+			MicrofacetVelvetEnergyLossMaterial m;
+			m.Ng = Ng;
+			m.alpha = alpha;
+			check(m, &random);
+		}
+		{
+			MicrofacetVelvetMaterial m;
+			m.Ng = Ng;
+			m.alpha = alpha;
+			m.Cd = glm::dvec3(0.2, 0.5, 0.8);
+			check(m, &random);
+		}
+	}
+}
+
+TEST_CASE("SphericalSamplers", "[SphericalSamplers]") {
+	// 光源ごとの sampler は原点ごとの準備を直近 2 つ使い回す。
+	// 毎回作り直した球面長方形・球面三角形と、同じ乱数で同じ点、同じ pdf になること
+	glm::dvec3 s(-0.5, 1.5, -0.5);
+	glm::dvec3 ex(1.0, 0.0, 0.0);
+	glm::dvec3 ey(0.0, 0.2, 1.0);
+	glm::dvec3 a(-1.0, 2.0, 0.0);
+	glm::dvec3 b(1.0, 2.5, 0.5);
+	glm::dvec3 c(0.0, 2.0, 1.5);
+	glm::dvec3 n = rt::triangleNormal(a, b, c, false);
+	rt::Rectangle rectangle(s, ex, ey);
+	rt::SphericalRectangleSampler rectangleSampler(s, ex, ey, true, glm::dvec3(1.0));
+	rt::SphericalTriangleDirectSampler triangleSampler(a, b, c, true, glm::dvec3(1.0));
+
+	// 原点を入れ替えながら使い、覚えている 2 つから外れる場合も通す
+	std::vector<glm::dvec3> origins = {
+		glm::dvec3(0.0, 0.0, 0.0),
+		glm::dvec3(0.3, 0.5, -0.2),
+		glm::dvec3(-2.0, 0.1, 1.0),
+	};
+	rt::Xor64 random;
+	for (int i = 0; i < 300; ++i) {
+		const glm::dvec3 &o = origins[i % origins.size()];
+		const glm::dvec3 &previous = origins[(i + origins.size() - 1) % origins.size()];
+		glm::dvec3 p, normal, Le;
+		double pdf = 0.0;
+
+		rt::Xor64 copied = random;
+		rectangleSampler.sample(&random, o, &p, &normal, &Le, &pdf);
+		rt::SphericalRectangleSamplerCoordinate coordinate(rectangle, o);
+		double u = copied.uniform();
+		double v = copied.uniform();
+		glm::dvec3 expected = coordinate.sample(u, v);
+		REQUIRE(glm::distance(p, expected) < 1.0e-9);
+
+		glm::dvec3 d = p - o;
+		double expectedPdf = std::abs(glm::dot(rectangle.normal(), glm::normalize(d))) / (coordinate.solidAngle() * glm::length2(d));
+		REQUIRE(std::abs(pdf - expectedPdf) <= 1.0e-9 * expectedPdf);
+		REQUIRE(std::abs(rectangleSampler.pdf_area(o, p) - expectedPdf) <= 1.0e-9 * expectedPdf);
+
+		// 1 つ前の原点の pdf (NEE のあと次の頂点で光源に当たったときの MIS)
+		rt::SphericalRectangleSamplerCoordinate previousCoordinate(rectangle, previous);
+		glm::dvec3 e = p - previous;
+		double previousPdf = std::abs(glm::dot(rectangle.normal(), glm::normalize(e))) / (previousCoordinate.solidAngle() * glm::length2(e));
+		REQUIRE(std::abs(rectangleSampler.pdf_area(previous, p) - previousPdf) <= 1.0e-9 * previousPdf);
+
+		copied = random;
+		triangleSampler.sample(&random, o, &p, &normal, &Le, &pdf);
+		rt::SphericalTriangleSampler triangle(a, b, c, n, o);
+		u = copied.uniform();
+		v = copied.uniform();
+		glm::dvec3 direction;
+		expected = triangle.sample(u, v, &direction);
+		REQUIRE(glm::distance(p, expected) < 1.0e-9);
+		REQUIRE(glm::distance(glm::normalize(p - o), direction) < 1.0e-9);
+
+		d = p - o;
+		expectedPdf = std::abs(glm::dot(n, direction)) / (triangle.solidAngle() * glm::length2(d));
+		REQUIRE(std::abs(pdf - expectedPdf) <= 1.0e-9 * expectedPdf);
+		REQUIRE(std::abs(triangleSampler.pdf_area(o, p) - expectedPdf) <= 1.0e-9 * expectedPdf);
+	}
+}
+
+TEST_CASE("SphericalSamplerBatch", "[SphericalSamplerBatch]") {
+	// sample_batch は float のバッチ版で点を作る。同じ乱数の double 版とほぼ同じ点 (距離の 1e-3 以内) になり、pdf は pdf_area と一致すること
+	glm::dvec3 s(-0.5, 1.5, -0.5);
+	glm::dvec3 ex(1.0, 0.0, 0.0);
+	glm::dvec3 ey(0.0, 0.2, 1.0);
+	glm::dvec3 a(-1.0, 2.0, 0.0);
+	glm::dvec3 b(1.0, 2.5, 0.5);
+	glm::dvec3 c(0.0, 2.0, 1.5);
+	glm::dvec3 n = rt::triangleNormal(a, b, c, false);
+	rt::Rectangle rectangle(s, ex, ey);
+	rt::SphericalRectangleSampler rectangleSampler(s, ex, ey, true, glm::dvec3(1.0));
+	rt::SphericalTriangleDirectSampler triangleSampler(a, b, c, true, glm::dvec3(1.0));
+
+	rt::Xor64 random;
+	for (int i = 0; i < 1000; ++i) {
+		glm::dvec3 o(random.uniform(-2.0, 2.0), random.uniform(-1.0, 1.0), random.uniform(-2.0, 2.0));
+		int count = 1 + i % rt::kMaxLightSamples;
+		rt::LightSample samples[rt::kMaxLightSamples];
+
+		rt::Xor64 copied = random;
+		rectangleSampler.sample_batch(&random, o, count, samples);
+		rt::SphericalRectangleSamplerCoordinate coordinate(rectangle, o);
+		for (int k = 0; k < count; ++k) {
+			float u = (float)copied.uniform();
+			float v = (float)copied.uniform();
+			CAPTURE(i);
+			CAPTURE(k);
+			REQUIRE(glm::distance(samples[k].p, coordinate.sample(u, v)) < 1.0e-3 * glm::distance(samples[k].p, o));
+			REQUIRE(std::abs(samples[k].pdf_area - rectangleSampler.pdf_area(o, samples[k].p)) <= 1.0e-9 * samples[k].pdf_area);
+		}
+
+		copied = random;
+		triangleSampler.sample_batch(&random, o, count, samples);
+		rt::SphericalTriangleSampler triangle(a, b, c, n, o);
+		for (int k = 0; k < count; ++k) {
+			float u = (float)copied.uniform();
+			float v = (float)copied.uniform();
+			glm::dvec3 direction;
+			CAPTURE(i);
+			CAPTURE(k);
+			REQUIRE(glm::distance(samples[k].p, triangle.sample(u, v, &direction)) < 1.0e-3 * glm::distance(samples[k].p, o));
+			REQUIRE(std::abs(samples[k].pdf_area - triangleSampler.pdf_area(o, samples[k].p)) <= 1.0e-9 * samples[k].pdf_area);
+		}
+	}
+
+	// レーンごとに原点の違うもの (set と prepare) も同じ
+	for (int i = 0; i < 100; ++i) {
+		rt::SphericalRectangleBatch<8> rectangles;
+		rt::SphericalTriangleBatch<8> triangles;
+		glm::dvec3 origins[8];
+		float u[8];
+		float v[8];
+		for (int k = 0; k < 8; ++k) {
+			origins[k] = glm::dvec3(random.uniform(-1.0, 1.0), random.uniform(-1.0, 1.0), random.uniform(-1.0, 1.0));
+			u[k] = (float)random.uniform();
+			v[k] = (float)random.uniform();
+			rectangles.set(k, rectangle, origins[k]);
+			triangles.set(k, a, b, c, n, origins[k]);
+		}
+		rectangles.prepare();
+		triangles.prepare();
+		float px[8], py[8], pz[8];
+		rectangles.sample(u, v, px, py, pz);
+		for (int k = 0; k < 8; ++k) {
+			glm::dvec3 p(px[k], py[k], pz[k]);
+			REQUIRE(glm::distance(p, rt::SphericalRectangleSamplerCoordinate(rectangle, origins[k]).sample(u[k], v[k])) < 1.0e-3 * glm::distance(p, origins[k]));
+		}
+		triangles.sample(u, v, px, py, pz);
+		for (int k = 0; k < 8; ++k) {
+			glm::dvec3 p(px[k], py[k], pz[k]);
+			glm::dvec3 direction;
+			REQUIRE(glm::distance(p, rt::SphericalTriangleSampler(a, b, c, n, origins[k]).sample(u[k], v[k], &direction)) < 1.0e-3 * glm::distance(p, origins[k]));
+		}
+	}
+
+	// 1 つだけ, または小さく見える光源は double の sample と同じ
+	for (glm::dvec3 o : { glm::dvec3(0.0, 0.0, 0.0), glm::dvec3(0.0, -30.0, 0.0) }) {
+		for (int count : { 1, rt::kMaxLightSamples }) {
+			if (count != 1 && rt::kMinBatchSolidAngle <= rt::SphericalRectangleSamplerCoordinate(rectangle, o).solidAngle()) {
+				continue;
+			}
+			rt::LightSample samples[rt::kMaxLightSamples];
+			rt::Xor64 copied = random;
+			rectangleSampler.sample_batch(&random, o, count, samples);
+			for (int k = 0; k < count; ++k) {
+				glm::dvec3 p, normal, Le;
+				double pdf;
+				rectangleSampler.sample(&copied, o, &p, &normal, &Le, &pdf);
+				REQUIRE(samples[k].p == p);
+				REQUIRE(samples[k].pdf_area == pdf);
+			}
+		}
+	}
+}
+
+TEST_CASE("AdaptiveTriangleSampler", "[AdaptiveTriangleSampler]") {
+	using namespace rt;
+	glm::dvec3 a(-1.0, 0.0, 0.0);
+	glm::dvec3 b(1.5, 0.2, 0.0);
+	glm::dvec3 c(0.0, 0.1, 1.0);
+	glm::dvec3 n = triangleNormal(a, b, c, false);
+	glm::dvec3 center = (a + b + c) / 3.0;
+	double radius2 = std::max(glm::distance2(a, center), std::max(glm::distance2(b, center), glm::distance2(c, center)));
+	double area = triangleArea(a, b, c);
+	AdaptiveTriangleSampler sampler(a, b, c, false, glm::dvec3(1.0));
+
+	// 見かけの大きさが e になる点。法線から少し傾ける
+	auto origin = [&](double e) {
+		glm::dvec3 d = glm::normalize(n + glm::normalize(b - a) * 0.3);
+		return center + d * std::sqrt(radius2 / e);
+	};
+
+	// 三角形上の積分。p = a + s (b - a) + t (1 - s) (c - a), dA = 2 area (1 - s) ds dt
+	auto integrate = [&](std::function<double(glm::dvec3)> f) {
+		return composite_simpson<double>([&](double s) {
+			return composite_simpson<double>([&](double t) {
+				glm::dvec3 p = a + s * (b - a) + t * (1.0 - s) * (c - a);
+				return f(p) * 2.0 * area * (1.0 - s);
+			}, 200, 0.0, 1.0);
+		}, 200, 0.0, 1.0);
+	};
+
+	// 混合の pdf は近くても遠くても三角形上で積分すると 1
+	SECTION("pdf_area integrates to one") {
+		for (double e : { 0.005, 0.01, 0.02, 0.05, 0.1, 0.5 }) {
+			glm::dvec3 o = origin(e);
+			REQUIRE(sampler.can_sample(o));
+			double integral = integrate([&](glm::dvec3 p) { return sampler.pdf_area(o, p); });
+			CAPTURE(e);
+			REQUIRE(std::abs(integral - 1.0) < 1.0e-4);
+		}
+	}
+
+	// 混ぜる範囲で sample が返す pdf が pdf_area と一致し、その pdf で割った推定が積分と合う
+	SECTION("sample agrees with pdf_area") {
+		Xor64 random;
+		for (double e : { 0.015, 0.03, 0.055, 0.08, 0.095 }) {
+			glm::dvec3 o = origin(e);
+			double w = sampler.solidAngleWeight(o);
+			REQUIRE(0.0 < w);
+			REQUIRE(w < 1.0);
+
+			// 点光源から受けるような cos / r^2
+			auto irradiance = [&](glm::dvec3 p) {
+				glm::dvec3 d = p - o;
+				double r2 = glm::length2(d);
+				return std::abs(glm::dot(n, d)) / (r2 * std::sqrt(r2));
+			};
+			double expected = integrate(irradiance);
+
+			OnlineMean<double> areaEstimate;
+			OnlineMean<double> irradianceEstimate;
+			for (int i = 0; i < 200000; ++i) {
+				glm::dvec3 p, q, Le;
+				double pdf;
+				sampler.sample(&random, o, &p, &q, &Le, &pdf);
+				REQUIRE(std::abs(pdf - sampler.pdf_area(o, p)) <= 1.0e-9 * pdf);
+				areaEstimate.addSample(1.0 / pdf);
+				irradianceEstimate.addSample(irradiance(p) / pdf);
+			}
+			CAPTURE(e);
+			CAPTURE(w);
+			REQUIRE(std::abs(areaEstimate.mean() - area) < area * 2.0e-3);
+			REQUIRE(std::abs(irradianceEstimate.mean() - expected) < expected * 2.0e-3);
+		}
+	}
+}
+
+// テスト用のジオメトリ。三角形ごとの法線は頂点の並びから求め、すべてのプリミティブに同じマテリアルを置く
+static rt::Geometry makeTriangles(const std::vector<glm::vec3> &points, const std::vector<glm::uvec3> &indices, const rt::Material &material) {
+	rt::Geometry g;
+	for (const glm::vec3 &P : points) {
+		rt::Geometry::Point point;
+		point.P = P;
+		g.points.push_back(point);
+	}
+	g.indices = indices;
+	g.materials.push_back(material);
+	for (const glm::uvec3 &i : indices) {
+		rt::Geometry::Primitive prim;
+		prim.Ng = rt::triangleNormal(glm::dvec3(points[i[0]]), glm::dvec3(points[i[1]]), glm::dvec3(points[i[2]]), false);
+		g.primitives.push_back(prim);
+	}
+	return g;
+}
+
+// 床と、その上で下を向いた三角形の光源
+static std::shared_ptr<rt::Scene> makeTestScene() {
+	auto scene = std::make_shared<rt::Scene>();
+
+	rt::LambertianMaterial floor(glm::dvec3(0.0), glm::dvec3(0.8));
+	scene->geometries.push_back(makeTriangles(
+		{ { -2.0f, 0.0f, -2.0f },{ -2.0f, 0.0f, 2.0f },{ 2.0f, 0.0f, 2.0f },{ 2.0f, 0.0f, -2.0f } },
+		{ { 0, 1, 2 },{ 0, 2, 3 } }, floor));
+
+	rt::LambertianMaterial light(glm::dvec3(4.0), glm::dvec3(0.0));
+	light.samplingStrategy = rt::AreaSample();
+	scene->geometries.push_back(makeTriangles(
+		{ { -0.5f, 1.5f, -0.5f },{ 0.5f, 1.5f, -0.5f },{ 0.0f, 1.5f, 0.5f } },
+		{ { 0, 1, 2 } }, light));
+
+	rt::CameraSetting setting;
+	setting.eye = glm::dvec3(0.0, 1.0, 3.0);
+	setting.lookat = glm::dvec3(0.0, 0.5, 0.0);
+	setting.imageWidth = 32;
+	setting.imageHeight = 24;
+	setting.lensRadius = 0.0;
+	scene->camera = rt::Camera(setting);
+	return scene;
+}
+
+TEST_CASE("LightSamples", "[LightSamples]") {
+	// 長方形の光源 (SphericalRectangleSampler) の NEE を 1 つの頂点あたり 1, 4, 8 回にしても同じ値に収束する
+	auto makeScene = []() {
+		auto scene = makeTestScene();
+		rt::LambertianMaterial light(glm::dvec3(4.0), glm::dvec3(0.0));
+		light.samplingStrategy = rt::AreaSample();
+		scene->geometries[1] = makeTriangles(
+			{ { -0.5f, 1.5f, -0.5f },{ 0.5f, 1.5f, -0.5f },{ 0.5f, 1.5f, 0.5f },{ -0.5f, 1.5f, 0.5f } },
+			{ { 0, 1, 2 },{ 0, 2, 3 } }, light);
+		return scene;
+	};
+	auto average = [&](int lightSamples) {
+		rt::PTRenderer renderer(makeScene());
+		renderer.setPreviewEnabled(false);
+		renderer.setLightSamples(lightSamples);
+		REQUIRE(renderer.lightSamples() == std::min(lightSamples, rt::kMaxLightSamples));
+		for (int i = 0; i < 256; ++i) {
+			renderer.step();
+		}
+		double sum = 0.0;
+		for (int y = 0; y < renderer._image.height(); ++y) {
+			for (int x = 0; x < renderer._image.width(); ++x) {
+				const rt::Image::Pixel *p = renderer._image.pixel(x, y);
+				sum += p->color.g / p->sample;
+			}
+		}
+		REQUIRE(renderer.badSampleNanCount() == 0);
+		return sum / (renderer._image.width() * renderer._image.height());
+	};
+	double one = average(1);
+	double four = average(4);
+	// kMaxLightSamples を超える数は 8 にする
+	double eight = average(16);
+	printf("light samples 1: %.5f, 4: %.5f, 8: %.5f\n", one, four, eight);
+	REQUIRE(0.0 < one);
+	REQUIRE(std::abs(four - one) < 0.01 * one);
+	REQUIRE(std::abs(eight - one) < 0.01 * one);
+}
+
+TEST_CASE("findRectangleEmitters", "[findRectangleEmitters]") {
+	rt::LambertianMaterial light(glm::dvec3(4.0), glm::dvec3(0.0));
+	light.samplingStrategy = rt::AreaSample();
+	std::vector<glm::uvec3> indices = { { 0, 1, 2 },{ 0, 2, 3 } };
+
+	SECTION("axis aligned") {
+		rt::Geometry g = makeTriangles({ { 0.0f, 1.0f, 0.0f },{ 1.0f, 1.0f, 0.0f },{ 1.0f, 1.0f, 2.0f },{ 0.0f, 1.0f, 2.0f } }, indices, light);
+		std::vector<rt::RectangleEmitter> rectangles = rt::findRectangleEmitters(g);
+		REQUIRE(rectangles.size() == 1);
+		const rt::RectangleEmitter &r = rectangles[0];
+		REQUIRE(std::set<int>{ r.primitives[0], r.primitives[1] } == std::set<int>{ 0, 1 });
+		REQUIRE(std::abs(glm::length(glm::cross(r.ex, r.ey)) - 2.0) < 1.0e-9);
+		REQUIRE(0.0 < glm::dot(glm::cross(r.ex, r.ey), g.primitives[0].Ng));
+		REQUIRE(std::abs(glm::dot(r.ex, r.ey)) < 1.0e-9);
+	}
+	SECTION("parallelogram") {
+		rt::Geometry g = makeTriangles({ { 0.0f, 1.0f, 0.0f },{ 1.0f, 1.0f, 0.0f },{ 1.5f, 1.0f, 1.0f },{ 0.5f, 1.0f, 1.0f } }, indices, light);
+		REQUIRE(rt::findRectangleEmitters(g).empty());
+	}
+	SECTION("not coplanar") {
+		rt::Geometry g = makeTriangles({ { 0.0f, 1.0f, 0.0f },{ 1.0f, 1.0f, 0.0f },{ 1.0f, 1.0f, 1.0f },{ 0.0f, 1.3f, 1.0f } }, indices, light);
+		REQUIRE(rt::findRectangleEmitters(g).empty());
+	}
+	SECTION("different emission") {
+		rt::Geometry g = makeTriangles({ { 0.0f, 1.0f, 0.0f },{ 1.0f, 1.0f, 0.0f },{ 1.0f, 1.0f, 1.0f },{ 0.0f, 1.0f, 1.0f } }, indices, light);
+		rt::LambertianMaterial other = light;
+		other.Le = glm::dvec3(2.0);
+		g.primitives[1].material = (uint32_t)g.materials.size();
+		g.materials.push_back(other);
+		REQUIRE(rt::findRectangleEmitters(g).empty());
+	}
+	// 点は float なので、辺の長さに対して kEps (1e-4) までのずれは長方形とみなす
+	SECTION("within tolerance") {
+		rt::Geometry g = makeTriangles({ { 0.0f, 1.0f, 0.0f },{ 1.0f, 1.0f, 0.0f },{ 1.0f, 1.00002f, 1.0f },{ 0.00002f, 1.0f, 1.0f } }, indices, light);
+		REQUIRE(rt::findRectangleEmitters(g).size() == 1);
+
+		rt::Geometry outside = makeTriangles({ { 0.0f, 1.0f, 0.0f },{ 1.0f, 1.0f, 0.0f },{ 1.0f, 1.001f, 1.0f },{ 0.0f, 1.0f, 1.0f } }, indices, light);
+		REQUIRE(rt::findRectangleEmitters(outside).empty());
+	}
+	// 2 枚は同じマテリアルの表の要素から始まり、sampler を結びつけるときにそれぞれの要素へ分かれる
+	SECTION("material table") {
+		auto scene = makeTestScene();
+		scene->geometries[1] = makeTriangles({ { 0.0f, 1.0f, 0.0f },{ 1.0f, 1.0f, 0.0f },{ 1.0f, 1.0f, 1.0f },{ 0.0f, 1.0f, 1.0f } }, indices, light);
+		rt::SceneInterface sceneInterface(scene);
+		REQUIRE(sceneInterface.samplerCount() == 1);
+
+		const rt::Geometry &floor = scene->geometries[0];
+		REQUIRE(floor.materials.size() == 1);
+
+		const rt::Geometry &g = scene->geometries[1];
+		REQUIRE(g.primitives[0].material != g.primitives[1].material);
+		auto a = dynamic_cast<const rt::LambertianMaterial *>(g.material(0).get());
+		auto b = dynamic_cast<const rt::LambertianMaterial *>(g.material(1).get());
+		REQUIRE(a->sampler);
+		REQUIRE(a->sampler == b->sampler);
+
+		// 作り直しても表は増えない
+		size_t count = g.materials.size();
+		sceneInterface.rebuildSamplers(1);
+		REQUIRE(g.materials.size() == count);
+		REQUIRE(sceneInterface.samplerCount() == 1);
+	}
+}
+
+// 読み込み直後と同じく、local の形を localToWorld で置いた点と contentHash を持つジオメトリ
+static rt::Geometry makePlaced(const std::vector<glm::vec3> &local, const glm::dmat4 &localToWorld, uint64_t contentHash, const rt::Material &material) {
+	std::vector<glm::vec3> points;
+	for (const glm::vec3 &P : local) {
+		points.push_back(glm::vec3(localToWorld * glm::dvec4(glm::dvec3(P), 1.0)));
+	}
+	rt::Geometry g = makeTriangles(points, { { 0, 1, 2 },{ 0, 2, 3 } }, material);
+	g.contentHash = contentHash;
+	g.localToWorld = localToWorld;
+	return g;
+}
+
+TEST_CASE("instanceDuplicates", "[instanceDuplicates]") {
+	rt::LambertianMaterial white(glm::dvec3(0.0), glm::dvec3(0.8));
+	std::vector<glm::vec3> quad = { { 0.0f, 0.0f, 0.0f },{ 1.0f, 0.0f, 0.0f },{ 1.0f, 0.5f, 1.0f },{ 0.0f, 0.5f, 1.0f } };
+
+	glm::dmat4 A = glm::translate(glm::dmat4(1.0), glm::dvec3(-3.0, 1.0, 2.0));
+	glm::dmat4 B = glm::scale(glm::rotate(glm::translate(glm::dmat4(1.0), glm::dvec3(5.0, 0.0, -1.0)), 0.7, glm::dvec3(0.0, 1.0, 0.0)), glm::dvec3(2.0));
+	glm::dmat4 C = glm::rotate(glm::dmat4(1.0), 2.0, glm::normalize(glm::dvec3(1.0, 1.0, 0.0)));
+
+	SECTION("same content") {
+		rt::Scene scene;
+		scene.geometries.push_back(makePlaced(quad, A, 7, white));
+		scene.geometries.push_back(makePlaced(quad, B, 7, white));
+		scene.geometries.push_back(makePlaced(quad, C, 7, white));
+		scene.geometries[1].name = "/b";
+		scene.geometries[1].shapeHash = 11;
+		std::vector<rt::Geometry::Point> expected1 = scene.geometries[1].points;
+		std::vector<rt::Geometry::Point> expected2 = scene.geometries[2].points;
+
+		REQUIRE(rt::instanceDuplicates(scene) == 2);
+
+		const rt::Geometry &prototype = scene.geometries[0];
+		REQUIRE(prototype.prototype == -1);
+		REQUIRE(prototype.points.size() == 4);
+		REQUIRE(prototype.primitives.size() == 2);
+		for (int i : { 1, 2 }) {
+			const rt::Geometry &instance = scene.geometries[i];
+			const std::vector<rt::Geometry::Point> &expected = i == 1 ? expected1 : expected2;
+			REQUIRE(instance.prototype == 0);
+			REQUIRE(instance.points.empty());
+			REQUIRE(instance.indices.empty());
+			REQUIRE(instance.primitives.empty());
+			REQUIRE(instance.materials.empty());
+
+			// transform で prototype の点を置くと、元の点に戻る
+			for (int j = 0; j < 4; ++j) {
+				glm::dvec3 p = glm::dvec3(instance.transform * glm::dvec4(glm::dvec3(prototype.points[j].P), 1.0));
+				REQUIRE(glm::length(p - glm::dvec3(expected[j].P)) < 1.0e-5);
+			}
+		}
+
+		// リロードの差分検出に使うものは残る
+		REQUIRE(scene.geometries[1].name == "/b");
+		REQUIRE(scene.geometries[1].shapeHash == 11);
+	}
+
+	// ハッシュが衝突しても、形が違えばインスタンスにしない。同じハッシュの候補はすべて比べる
+	SECTION("hash collision") {
+		std::vector<glm::vec3> other = quad;
+		other[2].y = 0.75f;
+
+		rt::Scene scene;
+		scene.geometries.push_back(makePlaced(quad, A, 7, white));
+		scene.geometries.push_back(makePlaced(other, B, 7, white));
+		scene.geometries.push_back(makePlaced(other, C, 7, white));
+
+		REQUIRE(rt::instanceDuplicates(scene) == 1);
+		REQUIRE(scene.geometries[0].prototype == -1);
+		REQUIRE(scene.geometries[1].prototype == -1);
+		REQUIRE(scene.geometries[1].points.size() == 4);
+		REQUIRE(scene.geometries[2].prototype == 1);
+	}
+
+	// 同じ形でもハッシュが違えば比べない (アトリビュートが違う)
+	SECTION("different hash") {
+		rt::Scene scene;
+		scene.geometries.push_back(makePlaced(quad, A, 7, white));
+		scene.geometries.push_back(makePlaced(quad, B, 8, white));
+		REQUIRE(rt::instanceDuplicates(scene) == 0);
+		REQUIRE(scene.geometries[1].prototype == -1);
+	}
+
+	SECTION("skipped") {
+		rt::LambertianMaterial light(glm::dvec3(4.0), glm::dvec3(0.0));
+
+		rt::Scene scene;
+		// contentHash が 0 なら調べない
+		scene.geometries.push_back(makePlaced(quad, A, 0, white));
+		scene.geometries.push_back(makePlaced(quad, B, 0, white));
+		// 光るものはインスタンスにしない
+		scene.geometries.push_back(makePlaced(quad, A, 9, light));
+		scene.geometries.push_back(makePlaced(quad, B, 9, light));
+		// 潰れた変換のプロトタイプからは逆変換が作れない
+		scene.geometries.push_back(makePlaced(quad, glm::scale(glm::dmat4(1.0), glm::dvec3(1.0, 0.0, 1.0)), 10, white));
+		scene.geometries.push_back(makePlaced(quad, B, 10, white));
+
+		REQUIRE(rt::instanceDuplicates(scene) == 0);
+		for (const rt::Geometry &g : scene.geometries) {
+			REQUIRE(g.prototype == -1);
+			REQUIRE(g.points.size() == 4);
+		}
+	}
+
+	SECTION("sameInstance") {
+		rt::Geometry prototype = makePlaced(quad, A, 7, white);
+		rt::Geometry geometry = makePlaced(quad, B, 7, white);
+		glm::dmat4 transform = B * glm::inverse(A);
+		REQUIRE(rt::sameInstance(prototype, geometry, transform));
+
+		// 点は大きさに対して相対 1e-5 まで
+		rt::Geometry near = geometry;
+		near.points[2].P.x += 1.0e-6f * 6.0f;
+		REQUIRE(rt::sameInstance(prototype, near, transform));
+		rt::Geometry far = geometry;
+		far.points[2].P.x += 1.0e-3f;
+		REQUIRE(rt::sameInstance(prototype, far, transform) == false);
+
+		// 頂点番号とアトリビュートは完全に一致すること
+		rt::Geometry flipped = geometry;
+		flipped.indices[1] = glm::uvec3(0, 3, 2);
+		REQUIRE(rt::sameInstance(prototype, flipped, transform) == false);
+		rt::Geometry attributes = geometry;
+		attributes.materialHash = 1;
+		REQUIRE(rt::sameInstance(prototype, attributes, transform) == false);
+	}
+}
+
+TEST_CASE("AttributeColumn", "[AttributeColumn]") {
+	// Alembic のサンプルの代わりに、列の値をここで持つ
+	std::vector<float> cd = { 1.0f, 0.0f, 0.0f,  1.0f, 0.0f, 0.0f,  0.0f, 1.0f, 0.0f,  1.0f, 0.0f, 0.0f };
+	std::vector<float> roughness = { 0.5f, 0.5f, 0.5f, 0.25f };
+	std::vector<uint32_t> materialIndices = { 0, 0, 1, 0 };
+
+	rt::AttributeColumn cdColumn;
+	cdColumn.type = rt::AttributeColumn::kVec3;
+	cdColumn.size = 4;
+	cdColumn.values = cd.data();
+
+	rt::AttributeColumn roughnessColumn;
+	roughnessColumn.type = rt::AttributeColumn::kFloat;
+	roughnessColumn.size = 4;
+	roughnessColumn.values = roughness.data();
+
+	rt::AttributeColumn materialColumn;
+	materialColumn.type = rt::AttributeColumn::kString;
+	materialColumn.size = 4;
+	materialColumn.indices = materialIndices.data();
+	materialColumn.dictionary = { "LambertianMaterial", "SpecularMaterial" };
+
+	SECTION("get") {
+		glm::dvec3 v;
+		REQUIRE(cdColumn.get(2, &v));
+		REQUIRE(v == glm::dvec3(0.0, 1.0, 0.0));
+		double x;
+		REQUIRE(roughnessColumn.get(3, &x));
+		REQUIRE(x == 0.25);
+		std::string s;
+		REQUIRE(materialColumn.get(2, &s));
+		REQUIRE(s == "SpecularMaterial");
+
+		// 型が違う, 範囲外, 辞書にない番号は読まない
+		REQUIRE(cdColumn.get(0, &x) == false);
+		REQUIRE(roughnessColumn.get(0, &s) == false);
+		REQUIRE(cdColumn.get(4, &v) == false);
+		materialIndices[1] = 2;
+		REQUIRE(materialColumn.get(1, &s) == false);
+	}
+
+	// 三角形 4 枚。0, 1 は同じアトリビュートで、3 は roughness だけが違う
+	rt::AlembicGeometry geometry;
+	geometry.points = { { 0.0f, 0.0f, 0.0f },{ 1.0f, 0.0f, 0.0f },{ 1.0f, 0.0f, 1.0f },{ 0.0f, 0.0f, 1.0f },{ 2.0f, 0.0f, 0.0f } };
+	geometry.primitives = { { 0, 2, 1 },{ 0, 3, 2 },{ 1, 2, 4 },{ 0, 1, 4 } };
+	geometry.primitiveAttributes["Cd"] = cdColumn;
+	geometry.primitiveAttributes["roughness"] = roughnessColumn;
+	geometry.primitiveAttributes["Material"] = materialColumn;
+
+	SECTION("grouping") {
+		REQUIRE(geometry.sameAttributes(0, 1));
+		REQUIRE(geometry.attributesHash(0) == geometry.attributesHash(1));
+		REQUIRE(geometry.sameAttributes(0, 2) == false);
+		REQUIRE(geometry.sameAttributes(0, 3) == false);
+		REQUIRE(geometry.attributesHash(0) != geometry.attributesHash(3));
+
+		// 組み合わせごとに 1 度だけ作ったマテリアルが、同じ組み合わせのプリミティブに配られる
+		rt::Geometry bound = rt::geometryMaterialBinding(geometry);
+		REQUIRE(bound.primitives.size() == 4);
+		// 表はアトリビュートの組み合わせごとに 1 つ。0, 1 は同じものを指す
+		REQUIRE(bound.materials.size() == 3);
+		REQUIRE(bound.primitives[0].material == bound.primitives[1].material);
+		for (int primID : { 0, 1, 3 }) {
+			auto lambertian = dynamic_cast<const rt::LambertianMaterial *>(bound.material(primID).get());
+			REQUIRE(lambertian);
+			REQUIRE(lambertian->R == glm::dvec3(1.0, 0.0, 0.0));
+		}
+		REQUIRE(dynamic_cast<const rt::SpecularMaterial *>(bound.material(2).get()));
+	}
+
+	// 5 角形以上を分けたときは、プリミティブから面の番号にして引く
+	SECTION("faces") {
+		geometry.faces = { 0, 0, 2, 3 };
+		REQUIRE(geometry.face(1) == 0);
+		glm::dvec3 v;
+		REQUIRE(geometry.getAttribute("Cd", 2, &v));
+		REQUIRE(v == glm::dvec3(0.0, 1.0, 0.0));
+		REQUIRE(geometry.sameAttributes(0, 1));
+		REQUIRE(geometry.attributesHash(0) == geometry.attributesHash(1));
+
+		rt::Geometry bound = rt::geometryMaterialBinding(geometry);
+		REQUIRE(dynamic_cast<const rt::LambertianMaterial *>(bound.material(1).get()));
+		REQUIRE(dynamic_cast<const rt::SpecularMaterial *>(bound.material(2).get()));
+	}
+
+	// 短い列は、どちらも範囲外のときだけ同じとみなす
+	SECTION("short column") {
+		roughnessColumn.size = 2;
+		geometry.primitiveAttributes["roughness"] = roughnessColumn;
+		REQUIRE(geometry.sameAttributes(0, 1));
+		REQUIRE(geometry.sameAttributes(1, 3) == false);
+		REQUIRE(geometry.primitiveAttributes["roughness"].equal(2, 3));
+		double x;
+		REQUIRE(geometry.getAttribute("roughness", 3, &x) == false);
+	}
+}
+
+// Alembic の面 (counts, indices) から作ったプリミティブ
+static rt::AlembicGeometry buildFaces(const std::vector<glm::vec3> &points, const std::vector<int32_t> &counts, const std::vector<int32_t> &indices) {
+	rt::AlembicGeometry geometry;
+	geometry.points = points;
+	rt::buildPrimitives(counts.data(), (int)counts.size(), indices.data(), indices.size(), &geometry);
+	return geometry;
+}
+
+TEST_CASE("buildPrimitives", "[buildPrimitives]") {
+	// y = 0 の平面で、Alembic (houdini) の順序では下から見て反時計回り。読み込むと +y を向く
+	std::vector<glm::vec3> points = {
+		{ 0.0f, 0.0f, 0.0f },{ 1.0f, 0.0f, 0.0f },{ 1.0f, 0.0f, 1.0f },{ 0.0f, 0.0f, 1.0f },
+		{ 2.0f, 0.0f, 0.0f },{ 2.0f, 0.0f, 1.0f },{ 3.0f, 0.0f, 0.0f }
+	};
+	auto requireUp = [](const rt::Geometry &bound) {
+		for (const rt::Geometry::Primitive &primitive : bound.primitives) {
+			REQUIRE(glm::length(primitive.Ng - glm::dvec3(0.0, 1.0, 0.0)) < 1.0e-9);
+		}
+	};
+
+	// 四角形が三角形と同じかより多ければ四角形メッシュ。三角形は最後の頂点を繰り返す
+	SECTION("quad mesh") {
+		rt::AlembicGeometry geometry = buildFaces(points, { 4, 4, 3 }, { 0, 1, 2, 3,  1, 4, 5, 2,  4, 6, 5 });
+		REQUIRE(geometry.primitives.empty());
+		REQUIRE(geometry.quads == std::vector<glm::uvec4>{ { 0, 3, 2, 1 },{ 1, 2, 5, 4 },{ 4, 5, 6, 6 } });
+		REQUIRE(geometry.faces.empty());
+		REQUIRE(geometry.primitiveCount() == 3);
+		requireUp(rt::geometryMaterialBinding(geometry));
+	}
+
+	// 三角形が多ければ、四角形を (0, 2, 1), (0, 3, 2) に分けた三角形メッシュ
+	SECTION("triangle mesh") {
+		rt::AlembicGeometry geometry = buildFaces(points, { 4, 3, 3 }, { 0, 1, 2, 3,  1, 4, 2,  4, 6, 5 });
+		REQUIRE(geometry.quads.empty());
+		REQUIRE(geometry.primitives == std::vector<glm::uvec3>{ { 0, 2, 1 },{ 0, 3, 2 },{ 1, 2, 4 },{ 4, 5, 6 } });
+		REQUIRE(geometry.faces == std::vector<uint32_t>{ 0, 0, 1, 2 });
+		REQUIRE(geometry.face(1) == 0);
+		REQUIRE(geometry.face(3) == 2);
+		requireUp(rt::geometryMaterialBinding(geometry));
+	}
+
+	// 5 角形は扇状に 3 枚。四角形メッシュでは最後の頂点を繰り返した四角形になる
+	SECTION("polygon") {
+		rt::AlembicGeometry geometry = buildFaces(points, { 5, 4, 4, 4 }, { 0, 4, 5, 2, 3,  0, 1, 2, 3,  1, 4, 5, 2,  0, 1, 2, 3 });
+		REQUIRE(geometry.quads.size() == 6);
+		REQUIRE(geometry.quads[0] == glm::uvec4(0, 5, 4, 4));
+		REQUIRE(geometry.quads[1] == glm::uvec4(0, 2, 5, 5));
+		REQUIRE(geometry.quads[2] == glm::uvec4(0, 3, 2, 2));
+		REQUIRE(geometry.quads[3] == glm::uvec4(0, 3, 2, 1));
+		REQUIRE(geometry.faces == std::vector<uint32_t>{ 0, 0, 0, 1, 2, 3 });
+		requireUp(rt::geometryMaterialBinding(geometry));
+
+		rt::AlembicGeometry triangles = buildFaces(points, { 5, 3 }, { 0, 4, 5, 2, 3,  4, 6, 5 });
+		REQUIRE(triangles.primitives == std::vector<glm::uvec3>{ { 0, 5, 4 },{ 0, 2, 5 },{ 0, 3, 2 },{ 4, 5, 6 } });
+		REQUIRE(triangles.faces == std::vector<uint32_t>{ 0, 0, 0, 1 });
+		requireUp(rt::geometryMaterialBinding(triangles));
+	}
+
+	SECTION("invalid") {
+		REQUIRE_THROWS(buildFaces(points, { 4, 2 }, { 0, 1, 2, 3,  4, 6 }));
+		REQUIRE_THROWS(buildFaces(points, { 4, 3 }, { 0, 1, 2, 3,  4, 6 }));
+	}
+}
+
+TEST_CASE("NumaReplicas", "[NumaReplicas]") {
+	// sampler をマテリアルに書き込むので、シーンはそれぞれで作る
+	rt::PTRenderer plain(makeTestScene());
+	REQUIRE(0 < plain.sceneInterface().samplerCount());
+
+	// NUMA の無いマシンでも 2 ノードとして動かし、2 つめのノードのバンドはレプリカで描く
+	std::shared_ptr<rt::NumaArenas> numa(new rt::NumaArenas(0, 2));
+	rt::PTRenderer replicated(makeTestScene(), numa, true);
+	REQUIRE(replicated._sceneReplicas[1] != replicated._sceneInterface);
+
+	// バンドは細かく分けて 2 つのノードへ交互に配る。どの行もちょうど 1 度、決まったノードで処理される
+	std::vector<int> rowNodes(100, -1);
+	std::vector<int> rowCounts(100, 0);
+	numa->parallelRows(100, [&](int node, const tbb::blocked_range<int> &range) {
+		for (int y = range.begin(); y < range.end(); ++y) {
+			rowNodes[y] = node;
+			rowCounts[y]++;
+		}
+	});
+	REQUIRE(numa->bandCount(100) == 2 * rt::NumaArenas::kBandsPerNode);
+	REQUIRE(numa->nodeSeconds().size() == 2);
+	int switches = 0;
+	for (int y = 0; y < 100; ++y) {
+		REQUIRE(rowCounts[y] == 1);
+		switches += 0 < y && rowNodes[y] != rowNodes[y - 1];
+	}
+	REQUIRE(switches == numa->bandCount(100) - 1);
+	REQUIRE(std::abs(std::count(rowNodes.begin(), rowNodes.end(), 0) - 50) <= 2);
+
+	for (int i = 0; i < 4; ++i) {
+		plain.step();
+		replicated.step();
+	}
+
+	// ピクセルごとの乱数列は同じなので、MIS の重みが同じなら結果も一致する
+	double sum = 0.0;
+	for (int y = 0; y < plain._image.height(); ++y) {
+		for (int x = 0; x < plain._image.width(); ++x) {
+			const rt::Image::Pixel *a = plain._image.pixel(x, y);
+			const rt::Image::Pixel *b = replicated._image.pixel(x, y);
+			CAPTURE(x);
+			CAPTURE(y);
+			REQUIRE(a->sample == b->sample);
+			REQUIRE(glm::distance(a->color, b->color) <= 1.0e-9 * (1.0 + glm::length(a->color)));
+			sum += a->color.g;
+		}
+	}
+	REQUIRE(0.0 < sum);
+
+	// レプリカも primary と同じ品質で作り、裏で作った HIGH の BVH に差し替わる
+	rt::SceneBuildSettings build;
+	build.quality = RTC_BUILD_QUALITY_LOW;
+	build.asyncUpgrade = true;
+	auto lowScene = makeTestScene();
+	rt::PTRenderer upgraded(lowScene, numa, true, std::make_shared<rt::SceneInterface>(lowScene, false, build));
+	const rt::SceneInterface &replica = *upgraded._sceneReplicas[1];
+	REQUIRE(replica.buildSettings().quality == RTC_BUILD_QUALITY_LOW);
+	REQUIRE(replica.buildSettings().asyncUpgrade);
+	REQUIRE(replica.upgradePending());
+	while (upgraded._sceneInterface->upgradePending() || replica.upgradePending()) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		upgraded.swapUpgradedScenes();
+	}
+	upgraded.step();
+	REQUIRE(0.0 < upgraded._image.pixel(upgraded._image.width() / 2, upgraded._image.height() / 2)->sample);
+}
+
+// 上から格子状に撃ったレイが、2 つのシーンで同じものに当たる
+static void requireSameHits(const rt::SceneInterface &a, const rt::SceneInterface &b) {
+	int hits = 0;
+	for (int i = 0; i < 9; ++i) {
+		for (int j = 0; j < 9; ++j) {
+			glm::dvec3 ro(-1.0 + 0.25 * i, 3.0, -1.0 + 0.25 * j);
+			glm::dvec3 rd = glm::normalize(glm::dvec3(0.1, -1.0, 0.05));
+			rt::Material ma, mb;
+			float ta = 0.0f, tb = 0.0f;
+			bool ha = a.intersect(ro, rd, &ma, &ta);
+			bool hb = b.intersect(ro, rd, &mb, &tb);
+			CAPTURE(ro);
+			REQUIRE(ha == hb);
+			if (ha == false) {
+				continue;
+			}
+			hits++;
+			REQUIRE(ta == tb);
+			REQUIRE(rt::materialName(ma.get()) == rt::materialName(mb.get()));
+			REQUIRE(ma->Ng == mb->Ng);
+			REQUIRE(ma->backfacing == mb->backfacing);
+			auto la = dynamic_cast<const rt::LambertianMaterial *>(ma.get());
+			auto lb = dynamic_cast<const rt::LambertianMaterial *>(mb.get());
+			REQUIRE(la);
+			REQUIRE(lb);
+			REQUIRE(la->Le == lb->Le);
+			REQUIRE(la->R == lb->R);
+		}
+	}
+	REQUIRE(0 < hits);
+}
+
+TEST_CASE("SceneReload", "[SceneReload]") {
+	// 光源の高さと放射を変えたシーン。読み込みと同じく名前とハッシュを付ける
+	auto makeScene = [](float lightY, double Le) {
+		auto scene = makeTestScene();
+		rt::LambertianMaterial light(glm::dvec3(Le), glm::dvec3(0.0));
+		light.samplingStrategy = rt::AreaSample();
+		scene->geometries[1] = makeTriangles({ { -0.5f, lightY, -0.5f },{ 0.5f, lightY, -0.5f },{ 0.0f, lightY, 0.5f } }, { { 0, 1, 2 } }, light);
+		scene->geometries[0].name = "/floor";
+		scene->geometries[0].shapeHash = 1;
+		scene->geometries[0].materialHash = 1;
+		scene->geometries[1].name = "/light";
+		scene->geometries[1].shapeHash = rt::fnv1a64(&lightY, sizeof(lightY));
+		scene->geometries[1].materialHash = rt::fnv1a64(&Le, sizeof(Le));
+		return scene;
+	};
+
+	rt::SceneInterface sceneInterface(makeScene(1.5f, 4.0));
+	REQUIRE(sceneInterface.samplerCount() == 1);
+	const rt::IDirectSampler *sampler = *sceneInterface.sampler_begin();
+	double power = sampler->Lavg_mul_area();
+
+	rt::SceneInterface::ReloadStatistics stats;
+	SECTION("unchanged") {
+		auto next = makeScene(1.5f, 4.0);
+		REQUIRE(sceneInterface.reload(next, &stats));
+		REQUIRE(stats.unchanged == 2);
+		REQUIRE(stats.shapeChanged == 0);
+		REQUIRE(stats.materialChanged == 0);
+
+		// sampler は作り直さず、新しいシーンのマテリアルから同じものを指す
+		REQUIRE(sceneInterface.samplerCount() == 1);
+		REQUIRE(*sceneInterface.sampler_begin() == sampler);
+		auto lambertian = dynamic_cast<const rt::LambertianMaterial *>(next->geometries[1].material(0).get());
+		REQUIRE(lambertian->sampler == sampler);
+
+		rt::SceneInterface fresh(makeScene(1.5f, 4.0));
+		requireSameHits(sceneInterface, fresh);
+	}
+	SECTION("moved shape") {
+		REQUIRE(sceneInterface.reload(makeScene(1.2f, 4.0), &stats));
+		REQUIRE(stats.shapeChanged == 1);
+		REQUIRE(stats.refitted == 0);
+		REQUIRE(stats.unchanged == 1);
+		REQUIRE(sceneInterface.samplerCount() == 1);
+		REQUIRE(std::abs((*sceneInterface.sampler_begin())->center().y - 1.2) < 1.0e-6);
+
+		rt::SceneInterface fresh(makeScene(1.2f, 4.0));
+		requireSameHits(sceneInterface, fresh);
+
+		// refit でも当たる場所は同じ
+		REQUIRE(sceneInterface.reload(makeScene(1.0f, 4.0), &stats, true));
+		REQUIRE(stats.refitted == 1);
+		rt::SceneInterface refitted(makeScene(1.0f, 4.0));
+		requireSameHits(sceneInterface, refitted);
+	}
+	SECTION("material") {
+		REQUIRE(sceneInterface.reload(makeScene(1.5f, 8.0), &stats));
+		REQUIRE(stats.materialChanged == 1);
+		REQUIRE(stats.shapeChanged == 0);
+		REQUIRE(stats.unchanged == 1);
+
+		// 放射が変わったので sampler も作り直す
+		REQUIRE(sceneInterface.samplerCount() == 1);
+		REQUIRE(std::abs((*sceneInterface.sampler_begin())->Lavg_mul_area() - 2.0 * power) < 1.0e-9 * power);
+
+		rt::SceneInterface fresh(makeScene(1.5f, 8.0));
+		requireSameHits(sceneInterface, fresh);
+	}
+	SECTION("different geometries") {
+		auto next = makeScene(1.5f, 4.0);
+		next->geometries[1].name = "/other";
+		REQUIRE(sceneInterface.reload(next, &stats) == false);
+		next->geometries.pop_back();
+		REQUIRE(sceneInterface.reload(next, &stats) == false);
+	}
+}
+
+TEST_CASE("SceneCache", "[SceneCache]") {
+	std::string path = ofToDataPath("scene_cache_test.bin");
+	uint64_t key = 0x1234;
+	{
+		auto scene = makeTestScene();
+		REQUIRE(rt::SceneCache::write(path.c_str(), *scene, key));
+	}
+	REQUIRE(rt::SceneCache::load(path.c_str(), key + 1, std::make_shared<rt::Scene>()) == nullptr);
+
+	auto cached = std::make_shared<rt::Scene>();
+	std::shared_ptr<rt::SceneInterface> sceneInterface = rt::SceneCache::load(path.c_str(), key, cached);
+	REQUIRE(sceneInterface);
+	REQUIRE(cached->geometries.size() == 2);
+
+	// 位置と頂点番号はマップしたまま。ヒープに取り出すのは光源の sampler を作る光るジオメトリだけ
+	const rt::Geometry &floor = cached->geometries[0];
+	const rt::Geometry &light = cached->geometries[1];
+	REQUIRE(floor.hasSharedShape());
+	REQUIRE(floor.points.empty());
+	REQUIRE(floor.indices.empty());
+	REQUIRE(floor.primitives.size() == 2);
+	REQUIRE(floor.materials.size() == 1);
+	REQUIRE(light.hasSharedShape());
+	REQUIRE(light.points.size() == 3);
+	REQUIRE(light.indices.size() == 1);
+	REQUIRE(sceneInterface->samplerCount() == 1);
+
+	// 読み直したシーンでも同じ絵になる
+	rt::PTRenderer plain(makeTestScene());
+	rt::PTRenderer fromCache(cached, sceneInterface);
+	for (int i = 0; i < 2; ++i) {
+		plain.step();
+		fromCache.step();
+	}
+	for (int y = 0; y < plain._image.height(); ++y) {
+		for (int x = 0; x < plain._image.width(); ++x) {
+			const rt::Image::Pixel *a = plain._image.pixel(x, y);
+			const rt::Image::Pixel *b = fromCache._image.pixel(x, y);
+			REQUIRE(glm::distance(a->color, b->color) <= 1.0e-9 * (1.0 + glm::length(a->color)));
+		}
+	}
+}
+
+// 累積バッファを値のビットで比べる。Pixel には詰め物があるので memcmp はしない
+static bool samePixels(const rt::Image::Pixel *a, const rt::Image::Pixel *b, size_t count) {
+	for (size_t i = 0; i < count; ++i) {
+		if (a[i].sample != b[i].sample || memcmp(&a[i].color, &b[i].color, sizeof(a[i].color)) != 0) {
+			return false;
+		}
+	}
+	return true;
+}
+
+TEST_CASE("Checkpoint", "[Checkpoint]") {
+	std::string path = ofToDataPath("checkpoint_test.bin");
+	remove(path.c_str());
+	const uint64_t key = 0x5678;
+	const int N = 3;
+	const int M = 2;
+
+	rt::PTRenderer straight(makeTestScene());
+	for (int i = 0; i < N + M; ++i) {
+		straight.stepFull();
+	}
+
+	{
+		rt::PTRenderer first(makeTestScene());
+		for (int i = 0; i < N; ++i) {
+			first.stepFull();
+		}
+		rt::Checkpoint checkpoint;
+		REQUIRE(checkpoint.open(path.c_str(), first._image.width(), first._image.height(), key));
+		checkpoint.save(first, 1.0);
+		checkpoint.wait();
+	}
+
+	rt::PTRenderer resumed(makeTestScene());
+	{
+		rt::Checkpoint checkpoint;
+		double seconds = 0.0;
+		REQUIRE(checkpoint.open(path.c_str(), resumed._image.width(), resumed._image.height(), key));
+		REQUIRE(checkpoint.resume(resumed, &seconds));
+		REQUIRE(seconds == 1.0);
+		REQUIRE(resumed.stepCount() == N);
+	}
+	for (int i = 0; i < M; ++i) {
+		resumed.stepFull();
+	}
+
+	// 中断しなかった場合とビット単位で同じ
+	REQUIRE(resumed.stepCount() == straight.stepCount());
+	size_t count = (size_t)straight._image.width() * straight._image.height();
+	REQUIRE(samePixels(resumed._image.pixels(), straight._image.pixels(), count));
+
+	// キーが違えば (シーンの中身が変わった) 再開しない
+	{
+		rt::PTRenderer other(makeTestScene());
+		rt::Checkpoint checkpoint;
+		double seconds = 0.0;
+		REQUIRE(checkpoint.open(path.c_str(), other._image.width(), other._image.height(), key + 1));
+		REQUIRE(checkpoint.resume(other, &seconds) == false);
+	}
+}
+
+TEST_CASE("JobDirectory", "[JobDirectory]") {
+	rt::RenderJob job;
+	job.scene = "test";
+	job.triangulate = true;
+	job.key = 0xfedcba9876543210ull;
+	job.width = 32;
+	job.height = 24;
+	job.passes = 5;
+	job.rowsPerUnit = 8;
+	job.passesPerUnit = 2;
+
+	// ワーカーごとにレンダラーを持ち、取れるユニットを描く
+	auto work = [&](rt::JobDirectory &directory, rt::PTRenderer &renderer) {
+		std::vector<rt::Image::Pixel> accum;
+		for (int i = 0; i < job.unitCount(); ++i) {
+			if (directory.claim(i, 60.0) == false) {
+				continue;
+			}
+			rt::RenderJob::Unit u = job.unit(i);
+			accum.assign((size_t)job.width * (u.y1 - u.y0), rt::Image::Pixel());
+			for (int pass = u.passBegin; pass < u.passEnd; ++pass) {
+				renderer.renderPass(pass, u.y0, u.y1, accum.data());
+			}
+			directory.complete(i, accum.data());
+		}
+	};
+
+	rt::JobDirectory single;
+	REQUIRE(single.create(ofToDataPath("job_test_1"), job));
+	{
+		rt::PTRenderer renderer(makeTestScene());
+		work(single, renderer);
+	}
+	REQUIRE(single.remaining() == 0);
+
+	// ワーカーは job.txt からシーンの読み方とキーを受け取る
+	rt::JobDirectory opened;
+	REQUIRE(opened.open(ofToDataPath("job_test_1")));
+	REQUIRE(opened.job().scene == job.scene);
+	REQUIRE(opened.job().triangulate == job.triangulate);
+	REQUIRE(opened.job().key == job.key);
+	REQUIRE(opened.job().unitCount() == job.unitCount());
+
+	// 3 つのワーカーが同時にユニットを取り合う
+	rt::JobDirectory shared;
+	REQUIRE(shared.create(ofToDataPath("job_test_3"), job));
+	{
+		std::vector<std::unique_ptr<rt::PTRenderer>> renderers;
+		std::vector<std::thread> workers;
+		for (int i = 0; i < 3; ++i) {
+			renderers.emplace_back(new rt::PTRenderer(makeTestScene()));
+		}
+		for (int i = 0; i < 3; ++i) {
+			rt::PTRenderer *renderer = renderers[i].get();
+			workers.emplace_back([&, renderer]() {
+				rt::JobDirectory directory;
+				directory.open(ofToDataPath("job_test_3"));
+				work(directory, *renderer);
+			});
+		}
+		for (std::thread &worker : workers) {
+			worker.join();
+		}
+	}
+	REQUIRE(shared.remaining() == 0);
+
+	// 誰が描いても、マージした結果はビット単位で同じ
+	rt::Image::Snapshot a;
+	rt::Image::Snapshot b;
+	REQUIRE(single.merge(&a));
+	REQUIRE(shared.merge(&b));
+	REQUIRE(a.pixels.size() == (size_t)job.width * job.height);
+	REQUIRE(a.pixels.size() == b.pixels.size());
+	REQUIRE(samePixels(a.pixels.data(), b.pixels.data(), a.pixels.size()));
+	for (const rt::Image::Pixel &p : a.pixels) {
+		REQUIRE(p.sample == job.passes);
+	}
+}
+
+// half float (binary16) を float に戻す。テストの基準
+static float halfToFloat(uint16_t h) {
+	uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+	uint32_t e = (h >> 10) & 0x1F;
+	uint32_t m = h & 0x3FF;
+	float value;
+	if (e == 0) {
+		value = std::ldexp((float)m, -24);
+	}
+	else if (e == 31) {
+		value = m ? std::numeric_limits<float>::quiet_NaN() : std::numeric_limits<float>::infinity();
+	}
+	else {
+		value = std::ldexp((float)(m | 0x400), (int)e - 25);
+	}
+	uint32_t f;
+	memcpy(&f, &value, sizeof(f));
+	f |= sign;
+	memcpy(&value, &f, sizeof(f));
+	return value;
+}
+
+// exrZipCompress の逆。zlib で展開し、差分を足し戻して偶数番目, 奇数番目の並びを元に戻す。
+// 小さくならなかったブロックは生データのまま入っている
+static std::vector<uint8_t> exrZipDecompress(const uint8_t *data, size_t size, size_t rawSize) {
+	if (size == rawSize) {
+		return std::vector<uint8_t>(data, data + size);
+	}
+	std::vector<uint8_t> tmp(rawSize);
+	uLongf n = (uLongf)rawSize;
+	REQUIRE(uncompress(tmp.data(), &n, data, (uLong)size) == Z_OK);
+	REQUIRE(n == rawSize);
+	for (size_t i = 1; i < rawSize; ++i) {
+		tmp[i] = (uint8_t)(int(tmp[i - 1]) + int(tmp[i]) - 128);
+	}
+	std::vector<uint8_t> raw(rawSize);
+	const uint8_t *t1 = tmp.data();
+	const uint8_t *t2 = tmp.data() + (rawSize + 1) / 2;
+	for (size_t i = 0; i < rawSize; ++i) {
+		raw[i] = i % 2 == 0 ? *(t1++) : *(t2++);
+	}
+	return raw;
+}
+
+TEST_CASE("floatToHalf", "[floatToHalf]") {
+	using rt::image_io_details::floatToHalf;
+
+	SECTION("known bits") {
+		REQUIRE(floatToHalf(0.0f) == 0x0000);
+		REQUIRE(floatToHalf(-0.0f) == 0x8000);
+		REQUIRE(floatToHalf(1.0f) == 0x3C00);
+		REQUIRE(floatToHalf(-2.0f) == 0xC000);
+		REQUIRE(floatToHalf(0.333333343f) == 0x3555);
+		REQUIRE(floatToHalf(65504.0f) == 0x7BFF);
+		REQUIRE(floatToHalf(std::ldexp(1.0f, -14)) == 0x0400); // 最小の正規化数
+		REQUIRE(floatToHalf(std::ldexp(1023.0f, -24)) == 0x03FF); // 最大の非正規化数
+		REQUIRE(floatToHalf(std::ldexp(1.0f, -24)) == 0x0001); // 最小の非正規化数
+	}
+	// ちょうど中間は偶数へ
+	SECTION("ties") {
+		REQUIRE(floatToHalf(1.0f + std::ldexp(1.0f, -11)) == 0x3C00);
+		REQUIRE(floatToHalf(1.0f + std::ldexp(3.0f, -11)) == 0x3C02);
+		REQUIRE(floatToHalf(std::nextafter(1.0f + std::ldexp(1.0f, -11), 2.0f)) == 0x3C01);
+		REQUIRE(floatToHalf(std::ldexp(1.0f, -25)) == 0x0000);
+		REQUIRE(floatToHalf(std::nextafter(std::ldexp(1.0f, -25), 1.0f)) == 0x0001);
+		REQUIRE(floatToHalf(std::ldexp(3.0f, -25)) == 0x0002);
+		REQUIRE(floatToHalf(-std::ldexp(3.0f, -25)) == 0x8002);
+		// 最大の非正規化数と最小の正規化数の中間は繰り上がって正規化数になる
+		REQUIRE(floatToHalf(std::ldexp(2047.0f, -25)) == 0x0400);
+	}
+	SECTION("overflow and underflow") {
+		REQUIRE(floatToHalf(65519.996f) == 0x7BFF);
+		REQUIRE(floatToHalf(65520.0f) == 0x7C00);
+		REQUIRE(floatToHalf(1.0e10f) == 0x7C00);
+		REQUIRE(floatToHalf(-1.0e10f) == 0xFC00);
+		REQUIRE(floatToHalf(std::numeric_limits<float>::infinity()) == 0x7C00);
+		REQUIRE(floatToHalf(-std::numeric_limits<float>::infinity()) == 0xFC00);
+		REQUIRE(floatToHalf(std::ldexp(1.0f, -26)) == 0x0000);
+		REQUIRE(floatToHalf(-std::numeric_limits<float>::denorm_min()) == 0x8000);
+	}
+	SECTION("nan") {
+		uint16_t h = floatToHalf(std::numeric_limits<float>::quiet_NaN());
+		REQUIRE((h & 0x7C00) == 0x7C00);
+		REQUIRE((h & 0x03FF) != 0);
+		// 仮数の上位が 0 の NaN も inf にしない
+		uint32_t bits = 0x7F800001;
+		float nan;
+		memcpy(&nan, &bits, sizeof(nan));
+		REQUIRE((floatToHalf(nan) & 0x03FF) != 0);
+		REQUIRE((floatToHalf(-nan) & 0x8000) == 0x8000);
+	}
+	// すべての有限の half は戻すと同じビットになり、隣との中間は偶数の側へ、中間の前後はそれぞれ近い側へ丸まる
+	SECTION("all halves") {
+		for (uint32_t sign : { 0x0000u, 0x8000u }) {
+			for (uint32_t h = 0; h < 0x7C00; ++h) {
+				float a = halfToFloat((uint16_t)(sign | h));
+				REQUIRE(floatToHalf(a) == (sign | h));
+				if (h == 0x7BFF) {
+					continue;
+				}
+				float b = halfToFloat((uint16_t)(sign | (h + 1)));
+				float mid = (a + b) * 0.5f;
+				uint32_t even = (h & 1) ? h + 1 : h;
+				REQUIRE(floatToHalf(mid) == (sign | even));
+				REQUIRE(floatToHalf(std::nextafter(mid, a)) == (sign | h));
+				REQUIRE(floatToHalf(std::nextafter(mid, b)) == (sign | (h + 1)));
+			}
+		}
+	}
+}
+
+TEST_CASE("writeEXR", "[writeEXR]") {
+	// 16 行ごとのブロックで、最後のブロックは 4 行
+	const int width = 37;
+	const int height = 20;
+	const size_t lineBytes = (size_t)width * 3 * sizeof(uint16_t);
+
+	std::vector<float> rgb(width * height * 3);
+	auto fill = [&](bool smooth) {
+		rt::Xor64 random;
+		for (int y = 0; y < height; ++y) {
+			for (int x = 0; x < width; ++x) {
+				for (int c = 0; c < 3; ++c) {
+					// 滑らかな値か、有限の half のビットを一様に選んだ値
+					uint16_t h;
+					do {
+						h = (uint16_t)(random.uniform() * 65536.0);
+					} while ((h & 0x7C00) == 0x7C00);
+					rgb[(y * width + x) * 3 + c] = smooth ? (float)(x + y * 0.5 + c) * 0.125f : halfToFloat(h);
+				}
+			}
+		}
+	};
+
+	// ファイルを読み、ブロックを展開して入力の half と比べる
+	auto check = [&](bool expectCompressed) {
+		std::string path = ofToDataPath("write_exr_test.exr");
+		REQUIRE(rt::writeEXR(path.c_str(), width, height, rgb.data()));
+
+		std::vector<uint8_t> file;
+		FILE *fp = fopen(path.c_str(), "rb");
+		REQUIRE(fp);
+		uint8_t buffer[4096];
+		size_t n;
+		while ((n = fread(buffer, 1, sizeof(buffer), fp)) != 0) {
+			file.insert(file.end(), buffer, buffer + n);
+		}
+		fclose(fp);
+
+		const uint8_t magic[4] = { 0x76, 0x2F, 0x31, 0x01 };
+		REQUIRE(memcmp(file.data(), magic, 4) == 0);
+
+		// 属性は 名前\0 型\0 大きさ 値 が並び、空の名前で終わる
+		size_t p = 8;
+		int compression = -1;
+		while (file[p] != 0) {
+			std::string name((const char *)&file[p]);
+			p += name.size() + 1;
+			std::string type((const char *)&file[p]);
+			p += type.size() + 1;
+			uint32_t size;
+			memcpy(&size, &file[p], 4);
+			p += 4;
+			if (name == "compression") {
+				compression = file[p];
+			}
+			p += size;
+		}
+		p++;
+		REQUIRE(compression == 3); // ZIP
+
+		int blockCount = (height + 15) / 16;
+		std::vector<uint64_t> offsets(blockCount);
+		memcpy(offsets.data(), &file[p], sizeof(uint64_t) * blockCount);
+
+		bool compressed = false;
+		for (int block = 0; block < blockCount; ++block) {
+			int32_t chunkHeader[2];
+			memcpy(chunkHeader, &file[offsets[block]], sizeof(chunkHeader));
+			int y0 = chunkHeader[0];
+			REQUIRE(y0 == block * 16);
+			int lines = std::min(16, height - y0);
+			size_t rawSize = lineBytes * lines;
+			REQUIRE(offsets[block] + sizeof(chunkHeader) + chunkHeader[1] <= file.size());
+			compressed = compressed || chunkHeader[1] < rawSize;
+
+			std::vector<uint8_t> raw = exrZipDecompress(&file[offsets[block] + sizeof(chunkHeader)], chunkHeader[1], rawSize);
+			const uint16_t *halves = reinterpret_cast<const uint16_t *>(raw.data());
+			for (int y = y0; y < y0 + lines; ++y) {
+				// 行ごとに B, G, R
+				for (int channel = 0; channel < 3; ++channel) {
+					int c = 2 - channel;
+					for (int x = 0; x < width; ++x) {
+						float value = rgb[(y * width + x) * 3 + c];
+						uint16_t h = *(halves++);
+						CAPTURE(x);
+						CAPTURE(y);
+						CAPTURE(c);
+						REQUIRE(h == rt::image_io_details::floatToHalf(value));
+						REQUIRE(std::abs(halfToFloat(h) - value) <= std::abs(value) * std::ldexp(1.0f, -11));
+					}
+				}
+			}
+		}
+		REQUIRE(compressed == expectCompressed);
+	};
+
+	SECTION("compressed") {
+		fill(true);
+		check(true);
+	}
+	// ビットが乱数なら圧縮が効かないので、ブロックは生データのまま入る
+	SECTION("stored") {
+		fill(false);
+		check(false);
+	}
+}
+
 int main(int argc, char* const argv[])
 {
 #if 1
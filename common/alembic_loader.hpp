@@ -8,36 +8,226 @@
 
 #include "render_object.hpp"
 #include "geometry.hpp"
+#include "hash.hpp"
+#include "instancing.hpp"
+#include "stopwatch.hpp"
 
+#include <cstring>
 #include <functional>
+#include <stdexcept>
+#include <unordered_map>
 
 namespace rt {
-	typedef strict_variant::variant<
-		glm::dvec3,
-		double,
-		std::string
-	> AttributeVariant;
-	
+	// 読み込んだ結果が変わる変更をしたら上げる。シーンキャッシュのキーに入る
+	const uint32_t kAlembicLoaderVersion = 6;
+
+	/*
+	 プリミティブのアトリビュート 1 つ分の列
+	 kFloat, kVec3: Alembic のサンプルの float 列をそのまま指す。kVec3 は 3 つずつ
+	 kString: 辞書とプリミティブごとの番号 (Alembic の indexed string そのまま)
+	 sample が参照先の寿命を保つ
+	*/
+	struct AttributeColumn {
+		enum Type {
+			kFloat,
+			kVec3,
+			kString
+		};
+		Type type = kFloat;
+		int size = 0;
+		Alembic::AbcCoreAbstract::ArraySamplePtr sample;
+		const float *values = nullptr;
+		const uint32_t *indices = nullptr;
+		std::vector<std::string> dictionary;
+
+		bool get(int i, double *value) const {
+			if (type != kFloat || size <= i) {
+				return false;
+			}
+			*value = values[i];
+			return true;
+		}
+		bool get(int i, glm::dvec3 *value) const {
+			if (type != kVec3 || size <= i) {
+				return false;
+			}
+			const float *v = values + (size_t)i * 3;
+			*value = glm::dvec3(v[0], v[1], v[2]);
+			return true;
+		}
+		bool get(int i, std::string *value) const {
+			if (type != kString || size <= i || dictionary.size() <= indices[i]) {
+				return false;
+			}
+			*value = dictionary[indices[i]];
+			return true;
+		}
+
+		// プリミティブ i の値のバイト列。文字列は辞書の番号
+		const void *bytes(int i, size_t *n) const {
+			switch (type) {
+			case kFloat:
+				*n = sizeof(float);
+				return values + i;
+			case kVec3:
+				*n = sizeof(float) * 3;
+				return values + (size_t)i * 3;
+			default:
+				*n = sizeof(uint32_t);
+				return indices + i;
+			}
+		}
+		bool equal(int a, int b) const {
+			if (size <= a || size <= b) {
+				return size <= a && size <= b;
+			}
+			size_t n;
+			const void *va = bytes(a, &n);
+			return memcmp(va, bytes(b, &n), n) == 0;
+		}
+	};
+
 	struct AlembicGeometry {
+		// アトリビュートは Alembic の面ごとなので、プリミティブの番号から面の番号にして引く
 		template <class T>
 		bool getAttribute(const char *attribute, int primID, T *value) const {
 			auto it = primitiveAttributes.find(attribute);
 			if (it != primitiveAttributes.end()) {
-				if (primID < it->second.size()) {
-					if (auto valuePtr = strict_variant::get<T>(&it->second[primID])) {
-						*value = *valuePtr;
-						return true;
-					}
-				}
+				return it->second.get(face(primID), value);
 			}
 			return false;
 		}
 
-		std::vector<glm::dvec3> points;
-		std::vector<glm::ivec3> primitives;
-		std::map<std::string, std::vector<AttributeVariant>> primitiveAttributes;
+		// プリミティブのアトリビュートの値をまとめたハッシュ
+		uint64_t attributesHash(int primID) const {
+			int f = face(primID);
+			uint64_t h = fnv1a64(nullptr, 0);
+			for (const auto &attribute : primitiveAttributes) {
+				const AttributeColumn &column = attribute.second;
+				if (f < column.size) {
+					size_t n;
+					const void *p = column.bytes(f, &n);
+					h = fnv1a64(p, n, h);
+				}
+			}
+			return h;
+		}
+		// 2 つのプリミティブのアトリビュートがすべて同じか。同じならマテリアルも同じになる
+		bool sameAttributes(int a, int b) const {
+			for (const auto &attribute : primitiveAttributes) {
+				if (attribute.second.equal(face(a), face(b)) == false) {
+					return false;
+				}
+			}
+			return true;
+		}
+
+		int face(int primID) const {
+			return faces.empty() ? primID : (int)faces[primID];
+		}
+		int primitiveCount() const {
+			return (int)(quads.empty() ? primitives.size() : quads.size());
+		}
+
+		// Embree に渡す精度 (float) で持つ。変換は double で行う
+		std::vector<glm::vec3> points;
+		// 三角形メッシュなら primitives, 四角形メッシュなら quads (三角形は最後の頂点を繰り返す)
+		std::vector<glm::uvec3> primitives;
+		std::vector<glm::uvec4> quads;
+		// プリミティブごとの Alembic の面の番号。5 角形以上を分けたときだけ持ち、空なら同じ番号
+		std::vector<uint32_t> faces;
+		std::map<std::string, AttributeColumn> primitiveAttributes;
 	};
 
+	inline uint64_t shapeHash(const AlembicGeometry &geometry) {
+		uint64_t h = fnv1a64(geometry.points.data(), geometry.points.size() * sizeof(glm::vec3));
+		h = fnv1a64(geometry.primitives.data(), geometry.primitives.size() * sizeof(glm::uvec3), h);
+		return fnv1a64(geometry.quads.data(), geometry.quads.size() * sizeof(glm::uvec4), h);
+	}
+	inline uint64_t materialHash(const AlembicGeometry &geometry) {
+		uint64_t h = fnv1a64(nullptr, 0);
+		for (const auto &attribute : geometry.primitiveAttributes) {
+			const AttributeColumn &column = attribute.second;
+			h = fnv1a64(attribute.first.data(), attribute.first.size(), h);
+			h = fnv1a64(&column.type, sizeof(column.type), h);
+			if (column.type == AttributeColumn::kString) {
+				for (const std::string &value : column.dictionary) {
+					uint64_t length = value.size();
+					h = fnv1a64(&length, sizeof(length), h);
+					h = fnv1a64(value.data(), value.size(), h);
+				}
+				h = fnv1a64(column.indices, sizeof(uint32_t) * column.size, h);
+			}
+			else {
+				size_t components = column.type == AttributeColumn::kVec3 ? 3 : 1;
+				h = fnv1a64(column.values, sizeof(float) * components * column.size, h);
+			}
+		}
+		return h;
+	}
+
+	/*
+	 Alembic の面 (counts, indices) から geometry の primitives, quads, faces を作る。
+	 四角形が三角形より多ければ四角形メッシュにする (Embree の quad はメモリもトラバースも三角形 2 枚より軽い)
+	 そのとき三角形は最後の頂点を繰り返した四角形になる。5 角形以上は扇状に三角形に分ける
+	*/
+	inline void buildPrimitives(const int32_t *counts, int faceCount, const int32_t *indices, size_t indexSize, AlembicGeometry *geometry) {
+		size_t indexCount = 0;
+		int quadCount = 0;
+		int triangleCount = 0;
+		for (int i = 0; i < faceCount; ++i) {
+			if (counts[i] < 3) {
+				throw std::runtime_error("degenerate primitive found.");
+			}
+			if (counts[i] == 4) {
+				quadCount++;
+			}
+			else {
+				triangleCount += counts[i] - 2;
+			}
+			indexCount += counts[i];
+		}
+		if (indexSize < indexCount) {
+			throw std::runtime_error("face indices are too short.");
+		}
+		bool quadMesh = 0 < quadCount && triangleCount <= quadCount;
+		int primitiveCount = quadMesh ? quadCount + triangleCount : quadCount * 2 + triangleCount;
+
+		if (quadMesh) {
+			geometry->quads.reserve(primitiveCount);
+		}
+		else {
+			geometry->primitives.reserve(primitiveCount);
+		}
+		if (primitiveCount != faceCount) {
+			geometry->faces.reserve(primitiveCount);
+		}
+		for (int i = 0; i < faceCount; ++i) {
+			// houdini では順序が逆のようだ
+			const int32_t *v = indices;
+			indices += counts[i];
+			if (counts[i] == 4 && quadMesh) {
+				geometry->quads.emplace_back((uint32_t)v[0], (uint32_t)v[3], (uint32_t)v[2], (uint32_t)v[1]);
+				if (primitiveCount != faceCount) {
+					geometry->faces.push_back(i);
+				}
+				continue;
+			}
+			for (int k = 1; k + 1 < counts[i]; ++k) {
+				glm::uvec3 triangle((uint32_t)v[0], (uint32_t)v[k + 1], (uint32_t)v[k]);
+				if (quadMesh) {
+					geometry->quads.emplace_back(triangle[0], triangle[1], triangle[2], triangle[2]);
+				}
+				else {
+					geometry->primitives.push_back(triangle);
+				}
+				if (primitiveCount != faceCount) {
+					geometry->faces.push_back(i);
+				}
+			}
+		}
+	}
+
 	using namespace Alembic::Abc;
 	using namespace Alembic::AbcGeom;
 
@@ -69,71 +259,66 @@ namespace rt {
 		}
 	}
 
-	inline std::vector<AttributeVariant> readAttributes(IArrayProperty prop, int compornentCount) {
+	inline AttributeColumn readAttributes(IArrayProperty prop, int compornentCount) {
 		auto dataType = prop.getDataType();
+		AttributeColumn column;
 		if (dataType.getExtent() == 3 && dataType.getPod() == kFloat32POD) {
 			Abc::IV3fArrayProperty arrayProp(prop.getParent(), prop.getName());
 			V3fArraySamplePtr sample;
 			arrayProp.get(sample);
-			std::vector<AttributeVariant> values(sample->size());
-			for (int j = 0; j < sample->size(); ++j) {
-				auto value = sample->get()[j];
-				values[j] = glm::dvec3(value.x, value.y, value.z);
-			}
-			return values;
+			column.type = AttributeColumn::kVec3;
+			column.size = (int)sample->size();
+			column.values = reinterpret_cast<const float *>(sample->get());
+			column.sample = sample;
+			return column;
 		} else if(dataType.getExtent() == 1 && dataType.getPod() == kFloat32POD) {
 			Abc::IFloatArrayProperty arrayProp(prop.getParent(), prop.getName());
 			FloatArraySamplePtr sample;
 			arrayProp.get(sample);
+			column.values = sample->get();
+			column.sample = sample;
 
 			// どうやらvectorの場合、要素数から割り出さないとだめなシチュエーションがあるらしい。
 			if (sample->size() == compornentCount) {
-				std::vector<AttributeVariant> values(sample->size());
-				for (int j = 0; j < sample->size(); ++j) {
-					auto value = sample->get()[j];
-					values[j] = value;
-				}
-				return values;
+				column.type = AttributeColumn::kFloat;
+				column.size = compornentCount;
+				return column;
 			}
 			else if(sample->size() == compornentCount * 3) {
-				std::vector<AttributeVariant> values(sample->size());
-				for (int j = 0; j < compornentCount; ++j) {
-					int index = j * 3;
-					glm::dvec3 value = { sample->get()[index], sample->get()[index +1] , sample->get()[index +2] };
-					values[j] = value;
-				}
-				return values;
+				column.type = AttributeColumn::kVec3;
+				column.size = compornentCount;
+				return column;
 			}
 			else {
-				throw std::exception("invalid data type");
+				throw std::runtime_error("invalid data type");
 			}
 		}
 		else {
-			throw std::exception("unsupported dataType");
+			throw std::runtime_error("unsupported dataType");
 		}
 	}
-	inline std::vector<AttributeVariant> readAttributes(ICompoundProperty prop) {
+	inline AttributeColumn readAttributes(ICompoundProperty prop) {
 		Abc::IUInt32ArrayProperty indicesProp(prop, ".indices");
 		Abc::IStringArrayProperty stringProp(prop, ".vals");
 
 		UInt32ArraySamplePtr indicesSample;
 		indicesProp.get(indicesSample);
-		std::vector<uint32_t> indices(indicesSample->get(), indicesSample->get() + indicesSample->size());
 
 		StringArraySamplePtr stringSample;
 		stringProp.get(stringSample);
-		std::vector<std::string> values(stringSample->get(), stringSample->get() + stringSample->size());
 
-		std::vector<AttributeVariant> expands(indices.size());
-		for (int i = 0; i < indices.size(); ++i) {
-			expands[i] = values[indices[i]];
-		}
-		return expands;
+		AttributeColumn column;
+		column.type = AttributeColumn::kString;
+		column.size = (int)indicesSample->size();
+		column.indices = indicesSample->get();
+		column.sample = indicesSample;
+		column.dictionary.assign(stringSample->get(), stringSample->get() + stringSample->size());
+		return column;
 	}
 
 	// エラーがあっても空っぽのまま返す
-	inline std::map<std::string, std::vector<AttributeVariant>> arbGeomParamsAttributes(ICompoundProperty props, int compornentCount) {
-		std::map<std::string, std::vector<AttributeVariant>> attributes;
+	inline std::map<std::string, AttributeColumn> arbGeomParamsAttributes(ICompoundProperty props, int compornentCount) {
+		std::map<std::string, AttributeColumn> attributes;
 		try {
 			ICompoundProperty geom(props, ".geom");
 			ICompoundProperty arbGeomParams(geom, ".arbGeomParams");
@@ -187,7 +372,7 @@ namespace rt {
 		return values;
 	}
 
-	inline double propertyScalarFloat(ICompoundProperty props, const char *dir) throw(std::exception) {
+	inline double propertyScalarFloat(ICompoundProperty props, const char *dir) {
 		bool found = false;
 		float value = 0.0f;
 		visitProperties(props,
@@ -202,7 +387,7 @@ namespace rt {
 			[](ICompoundProperty prop, std::string name) {}
 		);
 		if (found == false) {
-			throw std::exception("key not found");
+			throw std::runtime_error("key not found");
 		}
 		return value;
 	}
@@ -240,13 +425,13 @@ namespace rt {
 		}
 	}
 
-	inline glm::dmat4 GetTransform(IObject o) {
+	inline glm::dmat4 GetTransform(IObject o, const ISampleSelector &selector = ISampleSelector()) {
 		Abc::M44d m;
 		while (o) {
 			if (IXform::matches(o.getHeader())) {
 				IXform form(o);
 				auto schema = form.getSchema();
-				auto value = schema.getValue();
+				auto value = schema.getValue(selector);
 				auto matrix = value.getMatrix();
 				m = m * matrix;
 			}
@@ -257,59 +442,185 @@ namespace rt {
 		return matrix;
 	}
 
-	inline void parsePolyMesh(IPolyMesh &polyMesh, Scene &scene, std::function<Geometry(const AlembicGeometry&)> binding) throw (std::exception) {
+	// 読み込みの内訳
+	struct AlembicLoadStatistics {
+		struct Object {
+			std::string name;
+			int points = 0;
+			int primitives = 0;
+			int quads = 0;                 // primitives のうち Embree の四角形で持つ数
+			double readSeconds = 0.0;      // アーカイブから読む
+			double transformSeconds = 0.0; // 点の変換と三角形
+			double bindingSeconds = 0.0;   // アトリビュートとマテリアル
+			double readySeconds = 0.0;     // 出来上がったジオメトリの受け取り (Embree のジオメトリ作成など)
+		};
+		double openSeconds = 0.0;
+		double walkSeconds = 0.0;  // 階層をたどってメッシュとカメラを集める
+		double meshSeconds = 0.0;  // すべてのメッシュが揃うまで (並列)
+		double instanceSeconds = 0.0; // 重複の検出
+		int instances = 0;            // インスタンスにしたジオメトリの数
+		std::vector<Object> objects;
+	};
+
+	// selector: アニメーションの時刻。既定では最初のサンプル
+	inline Geometry readPolyMesh(IPolyMesh &polyMesh, std::function<Geometry(const AlembicGeometry&)> binding, const ISampleSelector &selector = ISampleSelector(), AlembicLoadStatistics::Object *statistics = nullptr) {
+		Stopwatch sw;
 		IPolyMeshSchema &mesh = polyMesh.getSchema();
 
-		auto transform = GetTransform(polyMesh);
+		auto transform = GetTransform(polyMesh, selector);
 
 		AlembicGeometry geometry;
 
 		// Parse Point
 		Abc::IP3fArrayProperty P = mesh.getPositionsProperty();
 		P3fArraySamplePtr PSample;
-		P.get(PSample);
-
-		geometry.points.resize(PSample->size());
-		for (int i = 0; i < PSample->size(); ++i) {
-			auto p = PSample->get()[i];
-			auto point = glm::dvec3(p.x, p.y, p.z);
-			point = transform * glm::dvec4(point, 1.0);
-			geometry.points[i] = glm::dvec3(point.x, point.y, point.z);
-		}
+		P.get(PSample, selector);
 
 		Abc::IInt32ArrayProperty FaceCounts = mesh.getFaceCountsProperty();
 		Int32ArraySamplePtr FaceCountsSample;
-		FaceCounts.get(FaceCountsSample);
+		FaceCounts.get(FaceCountsSample, selector);
 
 		Abc::IInt32ArrayProperty Indices = mesh.getFaceIndicesProperty();
 		Int32ArraySamplePtr IndicesSample;
-		Indices.get(IndicesSample);
+		Indices.get(IndicesSample, selector);
+		double readSeconds = sw.elapsed();
 
-		for (int i = 0; i < FaceCountsSample->size(); ++i) {
-			auto count = FaceCountsSample->get()[i];
-			if (count != 3) {
-				throw std::exception("non triangle primitive found.");
+		// アフィン変換なので 3x3 と平行移動に分けておく
+		glm::dmat3 linear(transform);
+		glm::dvec3 translation(transform[3]);
+		const V3f *points = PSample->get();
+		geometry.points.resize(PSample->size());
+		tbb::parallel_for(tbb::blocked_range<size_t>(0, PSample->size(), 4096), [&](const tbb::blocked_range<size_t> &range) {
+			for (size_t i = range.begin(); i < range.end(); ++i) {
+				const V3f &p = points[i];
+				geometry.points[i] = glm::vec3(linear * glm::dvec3(p.x, p.y, p.z) + translation);
 			}
-		}
-		const int32_t *indices = IndicesSample->get();
-		geometry.primitives.reserve(FaceCountsSample->size());
-		for (int i = 0; i < IndicesSample->size(); i += 3) {
-			// houdini では順序が逆のようだ
-			geometry.primitives.emplace_back(indices[i], indices[i + 2], indices[i + 1]);
-		}
+		});
+
+		buildPrimitives(FaceCountsSample->get(), (int)FaceCountsSample->size(), IndicesSample->get(), IndicesSample->size(), &geometry);
+		double transformSeconds = sw.elapsed() - readSeconds;
 
 		ICompoundProperty props = polyMesh.getProperties();
 		geometry.primitiveAttributes = arbGeomParamsAttributes(props, FaceCountsSample->size());
 
-		scene.geometries.push_back(binding(geometry));
+		Geometry bound = binding(geometry);
+		// 光源は三角形ごとに sampler を作るので、四角形メッシュでも光るものがあれば三角形に戻す
+		for (const Material &material : bound.materials) {
+			auto lambertian = dynamic_cast<const LambertianMaterial *>(material.get());
+			if (lambertian && lambertian->isEmission()) {
+				triangulateQuads(bound);
+				break;
+			}
+		}
+		bound.name = polyMesh.getFullName();
+		bound.shapeHash = shapeHash(geometry);
+		bound.materialHash = materialHash(geometry);
+
+		// 変換前の位置と面から。同じメッシュを別の場所に置いたものは同じ値になる (instanceDuplicates)
+		uint64_t content = fnv1a64(PSample->get(), sizeof(V3f) * PSample->size());
+		content = fnv1a64(FaceCountsSample->get(), sizeof(int32_t) * FaceCountsSample->size(), content);
+		content = fnv1a64(IndicesSample->get(), sizeof(int32_t) * IndicesSample->size(), content);
+		bound.contentHash = fnv1a64(&bound.materialHash, sizeof(bound.materialHash), content);
+		bound.localToWorld = transform;
+
+		if (statistics) {
+			statistics->name = bound.name;
+			statistics->points = (int)geometry.points.size();
+			statistics->primitives = (int)bound.primitives.size();
+			statistics->quads = (int)bound.quads.size();
+			statistics->readSeconds = readSeconds;
+			statistics->transformSeconds = transformSeconds;
+			statistics->bindingSeconds = sw.elapsed() - readSeconds - transformSeconds;
+		}
+		return bound;
+	}
+	inline void parsePolyMesh(IPolyMesh &polyMesh, Scene &scene, std::function<Geometry(const AlembicGeometry&)> binding, const ISampleSelector &selector = ISampleSelector()) {
+		scene.geometries.push_back(readPolyMesh(polyMesh, binding, selector));
 	}
-	inline void parseHierarchy(IObject o, Scene &scene, std::function<Geometry (const AlembicGeometry&)> binding) {
+
+	inline void parseCamera(IObject o, Scene &scene, const ISampleSelector &selector = ISampleSelector()) {
+		/*
+		とりあえず
+		　　Transform
+			View/Resolution
+			View/Focal Length, Aperture (fovy を計算)
+			    
+			Bokeh
+				Focus Distance
+				F-Stop
+		のみ対応
+		*/
+
+		ICamera cameraObj(o);
+		ICompoundProperty props = cameraObj.getProperties();
+		ICameraSchema schema = cameraObj.getSchema();
+
+		try {
+			CameraSample sample;
+			schema.get(sample, selector);
+
+			CameraSetting setting;
+			setting.imageWidth = (int)propertyScalarFloat(props, "/.geom/.userProperties/resx");
+			setting.imageHeight = (int)propertyScalarFloat(props, "/.geom/.userProperties/resy");
+
+			// http://127.0.0.1:48626/nodes/obj/cam#aperture
+			double aperture = sample.getVerticalAperture() /*centimeters*/ / 100.0;
+			double focalLength = sample.getFocalLength() /*millimeters*/ / 1000.0;
+			double fovy = std::atan2(aperture * 0.5, focalLength) * 2.0;
+			setting.fovy = (double)fovy;
+			setting.focasDistance = (double)sample.getFocusDistance();
+
+			// FStop = FocalLength / (Radius * 2)
+			// Radius = FocalLength / (2 * FStop)
+			double fStop = sample.getFStop();
+
+			printf("A, focusDistance : %f\n", setting.focasDistance);
+			printf("B, focalLength : %f\n", focalLength);
+			printf("f-number: %f\n", fStop);
+
+			// Octane Setting
+			// double phi = focalLength / fStop;
+			// setting.lensRadius = phi;
+
+			// Mantra setting
+			{
+				double A = setting.focasDistance;
+				double B = focalLength;
+				double f = A * B / (A + B);
+				printf("f : %f\n", f);
+				double phi = f / fStop;
+				setting.lensRadius = phi * 0.5;
+			}
+
+			printf("setting.lensRadius : %f\n", setting.lensRadius);
+			// setting.lensRadius = focusDistance / (2.0 * fStop);
+
+			glm::dmat4 transform = GetTransform(o, selector);
+			glm::dmat4 inverseTransposed = glm::inverseTranspose(transform);
+
+			glm::dvec4 origin = transform * glm::dvec4(0.0, 0.0, 0.0, 1.0);
+			glm::dvec4 front = inverseTransposed * glm::dvec4(0.0, 0.0, -1.0, 1.0);
+			glm::dvec4 up = inverseTransposed * glm::dvec4(0.0, 1.0, 0.0, 1.0);
+			setting.eye = origin;
+			setting.lookat = origin + front;
+			setting.up = up;
+
+			// setting.lensRadius = 0.0;
+
+			scene.camera = Camera(setting);
+		}
+		catch (...) {
+			printf("camera property error\n");
+		}
+	}
+
+	inline void parseHierarchy(IObject o, Scene &scene, std::function<Geometry (const AlembicGeometry&)> binding, const ISampleSelector &selector = ISampleSelector()) {
 		auto header = o.getHeader();
 
 		if (IPolyMesh::matches(header)) {
 			IPolyMesh polyMesh(o);
 			try {
-				parsePolyMesh(polyMesh, scene, binding);
+				parsePolyMesh(polyMesh, scene, binding, selector);
 			}
 			catch (std::exception &e) {
 				printf("IPolyMesh parse error: %s", e.what());
@@ -317,103 +628,39 @@ namespace rt {
 		}
 
 		if (ICamera::matches(header)) {
-			/*
-			とりあえず
-			　　Transform
-				View/Resolution
-				View/Focal Length, Aperture (fovy を計算)
-				    
-				Bokeh
-					Focus Distance
-					F-Stop
-			のみ対応
-			*/
-
-			ICamera cameraObj(o);
-			ICompoundProperty props = cameraObj.getProperties();
-			ICameraSchema schema = cameraObj.getSchema();
-
-			try {
-				CameraSample sample;
-				schema.get(sample);
-
-				CameraSetting setting;
-				setting.imageWidth = (int)propertyScalarFloat(props, "/.geom/.userProperties/resx");
-				setting.imageHeight = (int)propertyScalarFloat(props, "/.geom/.userProperties/resy");
-
-				// http://127.0.0.1:48626/nodes/obj/cam#aperture
-				double aperture = sample.getVerticalAperture() /*centimeters*/ / 100.0;
-				double focalLength = sample.getFocalLength() /*millimeters*/ / 1000.0;
-				double fovy = std::atan2(aperture * 0.5, focalLength) * 2.0;
-				setting.fovy = (double)fovy;
-				setting.focasDistance = (double)sample.getFocusDistance();
-
-				// FStop = FocalLength / (Radius * 2)
-				// Radius = FocalLength / (2 * FStop)
-				double fStop = sample.getFStop();
-
-				printf("A, focusDistance : %f\n", setting.focasDistance);
-				printf("B, focalLength : %f\n", focalLength);
-				printf("f-number: %f\n", fStop);
-
-				// Octane Setting
-				// double phi = focalLength / fStop;
-				// setting.lensRadius = phi;
-
-				// Mantra setting
-				{
-					double A = setting.focasDistance;
-					double B = focalLength;
-					double f = A * B / (A + B);
-					printf("f : %f\n", f);
-					double phi = f / fStop;
-					setting.lensRadius = phi * 0.5;
-				}
-
-				printf("setting.lensRadius : %f\n", setting.lensRadius);
-				// setting.lensRadius = focusDistance / (2.0 * fStop);
-
-				glm::dmat4 transform = GetTransform(o);
-				glm::dmat4 inverseTransposed = glm::inverseTranspose(transform);
-
-				glm::dvec4 origin = transform * glm::dvec4(0.0, 0.0, 0.0, 1.0);
-				glm::dvec4 front = inverseTransposed * glm::dvec4(0.0, 0.0, -1.0, 1.0);
-				glm::dvec4 up = inverseTransposed * glm::dvec4(0.0, 1.0, 0.0, 1.0);
-				setting.eye = origin;
-				setting.lookat = origin + front;
-				setting.up = up;
-
-				// setting.lensRadius = 0.0;
-
-				scene.camera = Camera(setting);
-			}
-			catch (...) {
-				printf("camera property error\n");
-			}
+			parseCamera(o, scene, selector);
 		}
 
 		for (int i = 0; i < o.getNumChildren(); ++i) {
 			IObject child = o.getChild(i);
-			parseHierarchy(child, scene, binding);
+			parseHierarchy(child, scene, binding, selector);
 		}
 	}
 
 	inline Geometry geometryMaterialBinding(const AlembicGeometry &abcGeom) {
 		Geometry geom;
-		geom.points.reserve(abcGeom.points.size());
+		geom.points.resize(abcGeom.points.size());
 		for (int pointID = 0; pointID < abcGeom.points.size(); ++pointID) {
-			Geometry::Point point;
-			point.P = abcGeom.points[pointID];
-			geom.points.push_back(point);
+			geom.points[pointID].P = abcGeom.points[pointID];
 		}
 
-		geom.primitives.reserve(abcGeom.primitives.size());
-		for (int primID = 0; primID < abcGeom.primitives.size(); ++primID) {
+		geom.indices = abcGeom.primitives;
+		geom.quads = abcGeom.quads;
+		geom.primitives.reserve(abcGeom.primitiveCount());
+		for (int primID = 0; primID < abcGeom.primitiveCount(); ++primID) {
 			Geometry::Primitive prim;
-			prim.indices = abcGeom.primitives[primID];
-			prim.Ng = triangleNormal(geom.points[prim.indices[0]].P, geom.points[prim.indices[1]].P, geom.points[prim.indices[2]].P);
+			if (geom.quads.empty()) {
+				const glm::uvec3 &indices = geom.indices[primID];
+				prim.Ng = triangleNormal(glm::dvec3(geom.points[indices[0]].P), glm::dvec3(geom.points[indices[1]].P), glm::dvec3(geom.points[indices[2]].P));
+			}
+			else {
+				// 対角線の外積。平面なら三角形 2 枚と同じ向きで、最後の頂点が重なった三角形でも使える
+				const glm::uvec4 &indices = geom.quads[primID];
+				glm::dvec3 d0 = glm::dvec3(geom.points[indices[2]].P) - glm::dvec3(geom.points[indices[0]].P);
+				glm::dvec3 d1 = glm::dvec3(geom.points[indices[3]].P) - glm::dvec3(geom.points[indices[1]].P);
+				prim.Ng = glm::cross(d0, d1);
+			}
 			prim.Ng = glm::normalize(prim.Ng);
-			prim.material = LambertianMaterial();
 			geom.primitives.push_back(prim);
 		}
 
@@ -424,6 +671,9 @@ namespace rt {
 		const char *MicrofacetConductorMaterialString = "MicrofacetConductorMaterial";
 		const char *MicrofacetCoupledConductorMaterialString = "MicrofacetCoupledConductorMaterial";
 		const char *MicrofacetCoupledDielectricsMaterialString = "MicrofacetCoupledDielectricsMaterial";
+		const char *MicrofacetGGXConductorMaterialString = "MicrofacetGGXConductorMaterial";
+		const char *MicrofacetGGXCoupledConductorMaterialString = "MicrofacetGGXCoupledConductorMaterial";
+		const char *MicrofacetGGXCoupledDielectricsMaterialString = "MicrofacetGGXCoupledDielectricsMaterial";
 		const char *HeitzConductorMaterialString = "HeitzConductorMaterial";
 		const char *MicrofacetVelvetMaterialString = "MicrofacetVelvetMaterial";
 		const char *MicrofacetVelvetEnergyLossMaterialString = "MicrofacetVelvetEnergyLossMaterial";
@@ -432,7 +682,7 @@ namespace rt {
 			return rouphness * rouphness;
 		};
 
-		auto parseMaterial = [&](int primID) {
+		auto parseMaterial = [&](int primID, Material *material) {
 			std::string materialString;
 			if (abcGeom.getAttribute<std::string>("Material", primID, &materialString) == false) {
 				return;
@@ -472,7 +722,7 @@ namespace rt {
 					}
 				}
 
-				geom.primitives[primID].material = m;
+				*material = m;
 			}
 			else if (materialString == MicrofacetConductorMaterialString) {
 				MicrofacetConductorMaterial m;
@@ -482,7 +732,7 @@ namespace rt {
 				}
 				abcGeom.getAttribute("eta", primID, &m.eta);
 				abcGeom.getAttribute("k", primID, &m.k);
-				geom.primitives[primID].material = m;
+				*material = m;
 			}
 			else if (materialString == MicrofacetCoupledConductorMaterialString) {
 				MicrofacetCoupledConductorMaterial m;
@@ -492,7 +742,7 @@ namespace rt {
 				}
 				abcGeom.getAttribute("eta", primID, &m.eta);
 				abcGeom.getAttribute("k", primID, &m.k);
-				geom.primitives[primID].material = m;
+				*material = m;
 			}
 			else if (materialString == MicrofacetCoupledDielectricsMaterialString) {
 				MicrofacetCoupledDielectricsMaterial m;
@@ -501,27 +751,56 @@ namespace rt {
 					m.alpha = rouphnessToAlpha(rouphness);
 				}
 				abcGeom.getAttribute("Cd", primID, &m.Cd);
-				geom.primitives[primID].material = m;
+				*material = m;
+			}
+			else if (materialString == MicrofacetGGXConductorMaterialString) {
+				MicrofacetGGXConductorMaterial m;
+				double rouphness;
+				if (abcGeom.getAttribute("roughness", primID, &rouphness)) {
+					m.alpha = rouphnessToAlpha(rouphness);
+				}
+				abcGeom.getAttribute("eta", primID, &m.eta);
+				abcGeom.getAttribute("k", primID, &m.k);
+				*material = m;
+			}
+			else if (materialString == MicrofacetGGXCoupledConductorMaterialString) {
+				MicrofacetGGXCoupledConductorMaterial m;
+				double rouphness;
+				if (abcGeom.getAttribute("roughness", primID, &rouphness)) {
+					m.alpha = rouphnessToAlpha(rouphness);
+				}
+				abcGeom.getAttribute("eta", primID, &m.eta);
+				abcGeom.getAttribute("k", primID, &m.k);
+				*material = m;
+			}
+			else if (materialString == MicrofacetGGXCoupledDielectricsMaterialString) {
+				MicrofacetGGXCoupledDielectricsMaterial m;
+				double rouphness;
+				if (abcGeom.getAttribute("roughness", primID, &rouphness)) {
+					m.alpha = rouphnessToAlpha(rouphness);
+				}
+				abcGeom.getAttribute("Cd", primID, &m.Cd);
+				*material = m;
 			}
 			else if (materialString == SpecularMaterialString) {
-				geom.primitives[primID].material = SpecularMaterial();
+				*material = SpecularMaterial();
 			}
 			else if (materialString == DielectricsMaterialString) {
 				DielectricsMaterial m;
 				abcGeom.getAttribute("eta", primID, &m.eta_dielectrics);
 				abcGeom.getAttribute("sigma", primID, &m.sigma);
-				geom.primitives[primID].material = m;
+				*material = m;
 			}
-#if ENABLE_HEITZ
 			else if (materialString == HeitzConductorMaterialString) {
-				double alpha = 0.5f;
+				HeitzConductorMaterial m;
 				double rouphness;
 				if (abcGeom.getAttribute("roughness", primID, &rouphness)) {
-					alpha = rouphnessToAlpha(rouphness);
+					m.alpha = rouphnessToAlpha(rouphness);
 				}
-				geom.primitives[primID].material = HeitzConductorMaterial(alpha);
+				abcGeom.getAttribute("eta", primID, &m.eta);
+				abcGeom.getAttribute("k", primID, &m.k);
+				*material = m;
 			}
-#endif
 			else if (materialString == MicrofacetVelvetMaterialString) {
 				MicrofacetVelvetMaterial m;
 				double rouphness;
@@ -529,7 +808,7 @@ namespace rt {
 					m.alpha = rouphness;
 				}
 				abcGeom.getAttribute("Cd", primID, &m.Cd);
-				geom.primitives[primID].material = m;
+				*material = m;
 			}
 			else if (materialString == MicrofacetVelvetEnergyLossMaterialString) {
 				MicrofacetVelvetEnergyLossMaterial m;
@@ -537,13 +816,43 @@ namespace rt {
 				if (abcGeom.getAttribute("roughness", primID, &rouphness)) {
 					m.alpha = rouphness;
 				}
-				geom.primitives[primID].material = m;
+				*material = m;
 			}
 		};
 
-		tbb::parallel_for(tbb::blocked_range<int>(0, abcGeom.primitives.size()), [&](const tbb::blocked_range<int> &range) {
+		// アトリビュートの組み合わせが同じプリミティブは同じマテリアルになるので、組み合わせごとに 1 度だけ作る
+		int primitiveCount = abcGeom.primitiveCount();
+		std::vector<uint64_t> hashes(primitiveCount);
+		tbb::parallel_for(tbb::blocked_range<int>(0, primitiveCount), [&](const tbb::blocked_range<int> &range) {
 			for (int primID = range.begin(); primID < range.end(); ++primID) {
-				parseMaterial(primID);
+				hashes[primID] = abcGeom.attributesHash(primID);
+			}
+		});
+
+		// 組み合わせごとに materials へ 1 つ。プリミティブはその番号を持つ
+		std::vector<int> uniques;
+		std::unordered_map<uint64_t, std::vector<int>> groups;
+		for (int primID = 0; primID < primitiveCount; ++primID) {
+			std::vector<int> &candidates = groups[hashes[primID]];
+			int index = -1;
+			for (int candidate : candidates) {
+				if (abcGeom.sameAttributes(uniques[candidate], primID)) {
+					index = candidate;
+					break;
+				}
+			}
+			if (index < 0) {
+				index = (int)uniques.size();
+				candidates.push_back(index);
+				uniques.push_back(primID);
+			}
+			geom.primitives[primID].material = index;
+		}
+
+		geom.materials.resize(uniques.size(), LambertianMaterial());
+		tbb::parallel_for(tbb::blocked_range<int>(0, (int)uniques.size()), [&](const tbb::blocked_range<int> &range) {
+			for (int i = range.begin(); i < range.end(); ++i) {
+				parseMaterial(uniques[i], &geom.materials[i]);
 			}
 		});
 		return geom;
@@ -556,9 +865,90 @@ namespace rt {
 			rt::printHierarchy(top);
 
 			rt::parseHierarchy(top, scene, geometryMaterialBinding);
+			instanceDuplicates(scene);
+		}
+		catch (std::exception &e) {
+			printf("abc archive load failed.. %s\n", e.what());
+		}
+	}
+
+	inline void collectHierarchy(IObject o, Scene &scene, std::vector<IPolyMesh> *meshes) {
+		auto header = o.getHeader();
+		if (IPolyMesh::matches(header)) {
+			meshes->push_back(IPolyMesh(o));
+		}
+		if (ICamera::matches(header)) {
+			parseCamera(o, scene);
+		}
+		for (int i = 0; i < o.getNumChildren(); ++i) {
+			collectHierarchy(o.getChild(i), scene, meshes);
+		}
+	}
+
+	/*
+	 loadFromABC と同じ結果を、メッシュごとに並列に読んで作る。
+	 アーカイブはスレッド数だけストリームを開き、メッシュはそれぞれ別のスレッドで読んで変換する。
+	 onBegin(メッシュ数) は読み始める前に 1 度、
+	 onGeometry(番号, ジオメトリ) は各メッシュが出来上がった時点で、そのメッシュを読んだスレッドから呼ばれる。
+	 番号は loadFromABC で並ぶ順番と同じ。読めなかったメッシュは空のジオメトリになる
+	 最後に重複をインスタンスにする (instanceDuplicates)。インスタンスになったジオメトリは点を手放すので、
+	 onGeometry で Embree に渡していても、SceneInterface::commit が外すまでトレースしないこと
+	*/
+	inline bool loadFromABCPipelined(const char *filename, Scene &scene,
+		std::function<void(int)> onBegin,
+		std::function<void(int, Geometry &)> onGeometry,
+		AlembicLoadStatistics *statistics = nullptr) {
+		AlembicLoadStatistics stats;
+		try {
+			Stopwatch sw;
+			IArchive archive(Alembic::AbcCoreOgawa::ReadArchive(tbb::this_task_arena::max_concurrency()), filename);
+			IObject top(archive, kTop);
+			stats.openSeconds = sw.elapsed();
+
+			sw = Stopwatch();
+			std::vector<IPolyMesh> meshes;
+			collectHierarchy(top, scene, &meshes);
+			stats.walkSeconds = sw.elapsed();
+
+			sw = Stopwatch();
+			int count = (int)meshes.size();
+			scene.geometries.resize(count);
+			stats.objects.resize(count);
+			if (onBegin) {
+				onBegin(count);
+			}
+			tbb::parallel_for(tbb::blocked_range<int>(0, count, 1), [&](const tbb::blocked_range<int> &range) {
+				for (int i = range.begin(); i < range.end(); ++i) {
+					AlembicLoadStatistics::Object &object = stats.objects[i];
+					try {
+						scene.geometries[i] = readPolyMesh(meshes[i], geometryMaterialBinding, ISampleSelector(), &object);
+					}
+					catch (std::exception &e) {
+						printf("IPolyMesh parse error: %s\n", e.what());
+						object.name = meshes[i].getFullName();
+						scene.geometries[i].name = object.name;
+					}
+
+					Stopwatch ready;
+					if (onGeometry) {
+						onGeometry(i, scene.geometries[i]);
+					}
+					object.readySeconds = ready.elapsed();
+				}
+			});
+			stats.meshSeconds = sw.elapsed();
+
+			sw = Stopwatch();
+			stats.instances = instanceDuplicates(scene);
+			stats.instanceSeconds = sw.elapsed();
 		}
 		catch (std::exception &e) {
 			printf("abc archive load failed.. %s\n", e.what());
+			return false;
+		}
+		if (statistics) {
+			*statistics = std::move(stats);
 		}
+		return true;
 	}
-}
\ No newline at end of file
+}
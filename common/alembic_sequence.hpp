@@ -0,0 +1,118 @@
+#pragma once
+
+#include <future>
+#include <memory>
+
+#include "alembic_loader.hpp"
+#include "stopwatch.hpp"
+
+namespace rt {
+	/*
+	 時間サンプルを持つ alembic をフレームごとに読む。
+	 フレーム番号は、いちばんサンプル数の多い time sampling のサンプル番号とする。
+	 prefetch で次のフレームを裏のスレッドで読み始め、take で受け取る。
+	 アーカイブに触るのは常に読み込み中の 1 スレッドだけ
+	*/
+	class AlembicSequence {
+	public:
+		AlembicSequence() {}
+		~AlembicSequence() {
+			if (_next.valid()) {
+				_next.wait();
+			}
+		}
+		AlembicSequence(const AlembicSequence &) = delete;
+		void operator=(const AlembicSequence &) = delete;
+
+		bool open(const char *filename) {
+			try {
+				_archive = IArchive(Alembic::AbcCoreOgawa::ReadArchive(), filename);
+			}
+			catch (std::exception &e) {
+				printf("abc archive load failed.. %s\n", e.what());
+				return false;
+			}
+
+			_frameCount = 1;
+			_timeSampling = _archive.getTimeSampling(0);
+			for (uint32_t i = 1; i < _archive.getNumTimeSamplings(); ++i) {
+				index_t n = _archive.getMaxNumSamplesForTimeSamplingIndex(i);
+				if (n != INDEX_UNKNOWN && _frameCount < n) {
+					_frameCount = (int)n;
+					_timeSampling = _archive.getTimeSampling(i);
+				}
+			}
+			return true;
+		}
+		int frameCount() const {
+			return _frameCount;
+		}
+		double frameTime(int frame) const {
+			return _timeSampling->getSampleTime(frame);
+		}
+
+		// frame を読む。読み込みにかかった時間を loadSeconds に返す
+		std::shared_ptr<Scene> load(int frame, double *loadSeconds = nullptr) {
+			Stopwatch sw;
+			std::shared_ptr<Scene> scene(new Scene());
+			try {
+				IObject top(_archive, kTop);
+				parseHierarchy(top, *scene, geometryMaterialBinding, ISampleSelector(frameTime(frame)));
+				instanceDuplicates(*scene);
+			}
+			catch (std::exception &e) {
+				printf("abc frame %d load failed.. %s\n", frame, e.what());
+			}
+			if (loadSeconds) {
+				*loadSeconds = sw.elapsed();
+			}
+			return scene;
+		}
+
+		// frame を裏で読み始める
+		void prefetch(int frame) {
+			if (_next.valid()) {
+				_next.wait();
+			}
+			_nextFrame = frame;
+			_next = std::async(std::launch::async, [this, frame]() {
+				return load(frame, &_nextLoadSeconds);
+			});
+		}
+
+		/*
+		 frame を受け取る。prefetch 済みならその完了を待ち、そうでなければここで読む
+		 waitSeconds: 呼び出し側が止まっていた時間, loadSeconds: 読み込み自体の時間
+		*/
+		std::shared_ptr<Scene> take(int frame, double *waitSeconds = nullptr, double *loadSeconds = nullptr) {
+			Stopwatch sw;
+			std::shared_ptr<Scene> scene;
+			double seconds = 0.0;
+			if (_next.valid() && _nextFrame == frame) {
+				scene = _next.get();
+				seconds = _nextLoadSeconds;
+			}
+			else {
+				if (_next.valid()) {
+					_next.wait();
+				}
+				scene = load(frame, &seconds);
+			}
+			if (waitSeconds) {
+				*waitSeconds = sw.elapsed();
+			}
+			if (loadSeconds) {
+				*loadSeconds = seconds;
+			}
+			return scene;
+		}
+	private:
+		IArchive _archive;
+		TimeSamplingPtr _timeSampling;
+		int _frameCount = 0;
+
+		std::future<std::shared_ptr<Scene>> _next;
+		int _nextFrame = -1;
+		double _nextLoadSeconds = 0.0;
+	};
+}
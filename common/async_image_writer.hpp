@@ -0,0 +1,121 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "image.hpp"
+#include "image_io.hpp"
+#include "tonemap.hpp"
+
+namespace rt {
+	/*
+	 レンダリングスレッドは累積バッファのスナップショットを取るだけで戻る。
+	 トーンマップ, 量子化, 圧縮, 書き出しはバックグラウンドのスレッドで行う。
+	 拡張子で形式を決める
+	   .exr : 線形 half float (ZIP)
+	   .pfm : 線形 float
+	   それ以外 : gamma 2.2 の 8bit png
+	*/
+	class AsyncImageWriter {
+	public:
+		AsyncImageWriter() :_thread([this]() { run(); }) {
+		}
+		~AsyncImageWriter() {
+			{
+				std::lock_guard<std::mutex> lock(_mutex);
+				_quit = true;
+			}
+			_condition.notify_all();
+
+			// 残っているものは全部書き出してから終わる
+			_thread.join();
+		}
+		AsyncImageWriter(const AsyncImageWriter &) = delete;
+		void operator=(const AsyncImageWriter &) = delete;
+
+		void save(const Image &image, int steps, const std::string &filename) {
+			Job job;
+			image.snapshot(&job.snapshot, steps);
+			job.filename = filename;
+
+			int pending = 0;
+			{
+				std::lock_guard<std::mutex> lock(_mutex);
+				_jobs.push_back(std::move(job));
+				pending = (int)_jobs.size();
+			}
+			_condition.notify_all();
+
+			if (2 < pending) {
+				printf("image writer is behind, %d images pending\n", pending);
+			}
+		}
+
+		// キューが空になるまで待つ
+		void flush() {
+			std::unique_lock<std::mutex> lock(_mutex);
+			_idle.wait(lock, [&]() { return _jobs.empty() && _busy == false; });
+		}
+
+		static bool write(const Image::Snapshot &snapshot, const std::string &filename) {
+			int w = snapshot.width;
+			int h = snapshot.height;
+			if (hasExtension(filename, ".exr") || hasExtension(filename, ".pfm")) {
+				std::vector<float> rgb((size_t)w * h * 3);
+				toLinearRGB(snapshot, rgb.data());
+				if (hasExtension(filename, ".exr")) {
+					return writeEXR(filename.c_str(), w, h, rgb.data());
+				}
+				return writePFM(filename.c_str(), w, h, rgb.data());
+			}
+
+			std::vector<uint8_t> rgb((size_t)w * h * 3);
+			toneMapGamma(snapshot, rgb.data());
+			return writePNG(filename.c_str(), w, h, rgb.data());
+		}
+	private:
+		struct Job {
+			Image::Snapshot snapshot;
+			std::string filename;
+		};
+
+		void run() {
+			for (;;) {
+				Job job;
+				{
+					std::unique_lock<std::mutex> lock(_mutex);
+					_condition.wait(lock, [&]() { return _quit || _jobs.empty() == false; });
+					if (_jobs.empty()) {
+						return;
+					}
+					job = std::move(_jobs.front());
+					_jobs.pop_front();
+					_busy = true;
+				}
+
+				if (write(job.snapshot, job.filename)) {
+					printf("save as %s (%d spp)\n", job.filename.c_str(), job.snapshot.steps);
+				}
+
+				{
+					std::lock_guard<std::mutex> lock(_mutex);
+					_busy = false;
+				}
+				_idle.notify_all();
+			}
+		}
+
+		std::mutex _mutex;
+		std::condition_variable _condition;
+		std::condition_variable _idle;
+		std::deque<Job> _jobs;
+		bool _busy = false;
+		bool _quit = false;
+
+		// 他のメンバーの初期化後に起動する
+		std::thread _thread;
+	};
+}
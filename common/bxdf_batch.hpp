@@ -0,0 +1,221 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+
+#include <glm/glm.hpp>
+#include <glm/ext.hpp>
+
+#include "microfacet.hpp"
+
+namespace rt {
+	static const int kBxdfBatchWidth = 8;
+
+	/*
+	 (wo, wi) の組を kBxdfBatchWidth 本まとめて float で評価するための入れ物。
+	 値はレーンごとの配列 (SoA) に持ち、IMaterial::bxdf_batch, pdf_batch が bxdf, pdf を埋める。
+	 マテリアル側のループは固定長 kBxdfBatchWidth なので、SSE なら 4 本ずつ、AVX なら 8 本ずつにベクトル化される。
+	 exp, pow は fmath:: を通す。既定では std のまま。ENABLE_FAST_MATH=1 にすると分岐のない近似がそのままベクトル化される
+	 (gcc は浮動小数の select を if 変換するのに -fno-trapping-math が要る)。
+	 使わないレーンは 0 のままにしておく (cosθ = 0 なので bxdf は 0 になる)
+	*/
+	struct BxdfBatch {
+		BxdfBatch() {
+			clear();
+		}
+		void clear() {
+			for (int i = 0; i < 3; ++i) {
+				std::fill(wo[i], wo[i] + kBxdfBatchWidth, 0.0f);
+				std::fill(wi[i], wi[i] + kBxdfBatchWidth, 0.0f);
+				std::fill(bxdf[i], bxdf[i] + kBxdfBatchWidth, 0.0f);
+			}
+			std::fill(pdf, pdf + kBxdfBatchWidth, 0.0f);
+			count = 0;
+		}
+		bool full() const {
+			return count == kBxdfBatchWidth;
+		}
+		void add(const glm::dvec3 &o, const glm::dvec3 &i) {
+			for (int j = 0; j < 3; ++j) {
+				wo[j][count] = (float)o[j];
+				wi[j][count] = (float)i[j];
+			}
+			count++;
+		}
+		glm::dvec3 directionO(int k) const {
+			return glm::dvec3(wo[0][k], wo[1][k], wo[2][k]);
+		}
+		glm::dvec3 directionI(int k) const {
+			return glm::dvec3(wi[0][k], wi[1][k], wi[2][k]);
+		}
+		glm::dvec3 bxdfAt(int k) const {
+			return glm::dvec3(bxdf[0][k], bxdf[1][k], bxdf[2][k]);
+		}
+		void setBxdf(int k, const glm::dvec3 &value) {
+			for (int j = 0; j < 3; ++j) {
+				bxdf[j][k] = (float)value[j];
+			}
+		}
+
+		// 入力
+		float wo[3][kBxdfBatchWidth];
+		float wi[3][kBxdfBatchWidth];
+
+		// 出力
+		float bxdf[3][kBxdfBatchWidth];
+		float pdf[kBxdfBatchWidth];
+
+		int count = 0;
+	};
+
+	// microfacet.hpp の関数のレーン版。分岐は select にしてあるので、固定長ループの中でベクトル化できる
+	namespace bxdf_batch_details {
+		// 反射のときのハーフベクトルまわりの cos。dot(h, wi) == dot(h, wo) なので HoO だけ持つ
+		struct Cosines {
+			Cosines(const BxdfBatch &batch, const glm::dvec3 &Ng) {
+				float nx = (float)Ng.x;
+				float ny = (float)Ng.y;
+				float nz = (float)Ng.z;
+				for (int k = 0; k < kBxdfBatchWidth; ++k) {
+					float ox = batch.wo[0][k], oy = batch.wo[1][k], oz = batch.wo[2][k];
+					float hx = ox + batch.wi[0][k];
+					float hy = oy + batch.wi[1][k];
+					float hz = oz + batch.wi[2][k];
+					float length2 = hx * hx + hy * hy + hz * hz;
+					float invLength = 0.0f < length2 ? 1.0f / std::sqrt(length2) : 0.0f;
+
+					NoO[k] = nx * ox + ny * oy + nz * oz;
+					NoI[k] = nx * batch.wi[0][k] + ny * batch.wi[1][k] + nz * batch.wi[2][k];
+					NoH[k] = (nx * hx + ny * hy + nz * hz) * invLength;
+					HoO[k] = (hx * ox + hy * oy + hz * oz) * invLength;
+				}
+			}
+			float NoO[kBxdfBatchWidth];
+			float NoI[kBxdfBatchWidth];
+			float NoH[kBxdfBatchWidth];
+			float HoO[kBxdfBatchWidth];
+		};
+
+		inline float D_Beckmann(float cosTheta, float alpha) {
+			float c = std::max(cosTheta, 1.0e-5f);
+			float cosTheta2 = c * c;
+			float alpha2 = alpha * alpha;
+			float tanTheta2 = (1.0f - cosTheta2) / cosTheta2;
+			float d = fmath::exp(-tanTheta2 / alpha2) / (glm::pi<float>() * alpha2 * cosTheta2 * cosTheta2);
+			return cosTheta < 1.0e-5f ? 0.0f : d;
+		}
+
+		// 反射のみ (dot(V, H) == dot(L, H))
+		inline float G2_v_cavity(float NoH, float NoV, float NoL, float VoH) {
+			float g = 2.0f * NoH * std::min(NoV, NoL) / std::max(VoH, 1.0e-20f);
+			return std::min(g, 1.0f);
+		}
+		inline float G1_v_cavity(float NoH, float NoV, float VoH) {
+			float g = 2.0f * NoH * NoV / std::max(VoH, 1.0e-20f);
+			return std::min(g, 1.0f);
+		}
+
+		// VCavityBeckmannVisibleNormalSampler::pdf
+		inline float vcavity_beckmann_pdf(float NoH, float NoO, float HoO, float alpha) {
+			float pdf = G1_v_cavity(NoH, NoO, HoO) * D_Beckmann(NoH, alpha) / (4.0f * NoO);
+			return HoO <= 0.0f ? 0.0f : pdf;
+		}
+
+		inline float D_GGX(float cosTheta, float alpha) {
+			float cosTheta2 = cosTheta * cosTheta;
+			float alpha2 = alpha * alpha;
+			float denom = cosTheta2 * (alpha2 - 1.0f) + 1.0f;
+			float d = alpha2 / (glm::pi<float>() * denom * denom);
+			return cosTheta <= 0.0f ? 0.0f : d;
+		}
+		inline float lambda_ggx(float cosTheta, float alpha) {
+			float cosTheta2 = cosTheta * cosTheta;
+			float alpha2 = alpha * alpha;
+			return (std::sqrt(cosTheta2 + alpha2 * std::max(1.0f - cosTheta2, 0.0f)) / std::max(std::abs(cosTheta), 1.0e-20f) - 1.0f) * 0.5f;
+		}
+
+		// 反射のみ (dot(V, H) == dot(L, H))
+		inline float G2_height_correlated_ggx(float NoO, float NoI, float HoO, float alpha) {
+			float g = 1.0f / (1.0f + lambda_ggx(NoO, alpha) + lambda_ggx(NoI, alpha));
+			return HoO <= 0.0f ? 0.0f : g;
+		}
+
+		// GGXVisibleNormalSampler::pdf
+		inline float ggx_visible_normal_pdf(float NoH, float NoO, float HoO, float alpha) {
+			float g1 = 1.0f / (1.0f + lambda_ggx(NoO, alpha));
+			float pdf = g1 * D_GGX(NoH, alpha) / (4.0f * NoO);
+			return HoO <= 0.0f || NoO <= 0.0f ? 0.0f : pdf;
+		}
+
+		inline float fresnel_unpolarized(float n, float k, float cosTheta) {
+			float n2_add_k2 = n * n + k * k;
+			float cosTheta2 = cosTheta * cosTheta;
+			float two_n_cosTheta = 2.0f * n * cosTheta;
+			float v = (n2_add_k2 - two_n_cosTheta + cosTheta2) / (n2_add_k2 + two_n_cosTheta + cosTheta2);
+			float h = (n2_add_k2 * cosTheta2 - two_n_cosTheta + 1.0f) / (n2_add_k2 * cosTheta2 + two_n_cosTheta + 1.0f);
+			return (v + h) * 0.5f;
+		}
+
+		inline float fresnel_dielectrics(float cosTheta, float eta_t, float eta_i) {
+			float c = cosTheta;
+			float g = std::sqrt(std::max(eta_t * eta_t / (eta_i * eta_i) - 1.0f + c * c, 0.0f));
+			float gmc = g - c;
+			float gpc = g + c;
+			float a = 0.5f * (gmc * gmc) / (gpc * gpc);
+			float x = c * gpc - 1.0f;
+			float y = c * gmc + 1.0f;
+			return a * (1.0f + (x * x) / (y * y));
+		}
+
+		inline float velvet_D(float cosTheta, float r) {
+			float sinTheta = std::sqrt(std::max(1.0f - cosTheta * cosTheta, 0.0f));
+			float d = (2.0f + 1.0f / r) * fmath::pow(sinTheta, 1.0f / r) / (glm::pi<float>() * 2.0f);
+			return cosTheta < 0.0f ? 0.0f : d;
+		}
+
+		// velvet_lambda。r で決まる係数はループの外で 1 度だけ求める
+		struct VelvetLambda {
+			VelvetLambda(double r) {
+				double one_minus_r = 1.0 - r;
+				double power_of_one_minus_r = one_minus_r * one_minus_r;
+				a = (float)velvet_params_interpolate(0, power_of_one_minus_r);
+				b = (float)velvet_params_interpolate(1, power_of_one_minus_r);
+				c = (float)velvet_params_interpolate(2, power_of_one_minus_r);
+				d = (float)velvet_params_interpolate(3, power_of_one_minus_r);
+				e = (float)velvet_params_interpolate(4, power_of_one_minus_r);
+				L_half = L(0.5f);
+			}
+			float L(float x) const {
+				return a / (1.0f + b * fmath::pow(x, c)) + d * x + e;
+			}
+			float operator()(float cosTheta) const {
+				bool lower = cosTheta < 0.5f;
+				float l = L(lower ? cosTheta : 1.0f - cosTheta);
+				return fmath::exp(lower ? l : 2.0f * L_half - l);
+			}
+			float a, b, c, d, e;
+			float L_half;
+		};
+		inline float velvet_G2(float cosThetaO, float cosThetaI, const VelvetLambda &lambda) {
+			float g = 1.0f / (1.0f + lambda(std::max(cosThetaO, 0.0f)) + lambda(std::max(cosThetaI, 0.0f)));
+			return cosThetaO <= 0.0f || cosThetaI <= 0.0f ? 0.0f : g;
+		}
+
+		// 表を引くところはベクトル化できないので、使っているレーン (count 本) だけひとつずつ引く
+		inline void specular_albedo(const BxdfBatch &batch, const SpecularAlbedo &table, double alpha, const float *cosTheta, float *albedo) {
+			std::fill(albedo, albedo + kBxdfBatchWidth, 0.0f);
+			for (int k = 0; k < batch.count; ++k) {
+				albedo[k] = (float)table.sample(alpha, cosTheta[k]);
+			}
+		}
+
+		// coupled の拡散側 (CoupledBRDFSampler で θ を選ぶ) の立体角あたりの pdf
+		// 表を引くうえ、極の近くの sinθ は float では足りないので、スカラー版と同じく double で求める
+		inline void coupled_diffuse_pdf(const BxdfBatch &batch, const glm::dvec3 &Ng, const CoupledBRDFSampler &sampler, double alpha, float *pdf) {
+			std::fill(pdf, pdf + kBxdfBatchWidth, 0.0f);
+			for (int k = 0; k < batch.count; ++k) {
+				pdf[k] = (float)sampler.pdf(alpha, glm::dot(Ng, batch.directionI(k)));
+			}
+		}
+	}
+}
@@ -139,6 +139,24 @@ namespace rt {
 			*o = sampleLens;
 			*d = glm::normalize(sampleFocalPlane - sampleLens);
 		}
+		// レンズの中心からピクセルの中心を通る光線
+		void pixelCenterRay(int x, int y, glm::dvec3 *o, glm::dvec3 *d) const {
+			auto focalPlaneCenter = origin() + front() * setting().focasDistance;
+
+			auto width = setting().widthV();
+			auto height = setting().heightV();
+
+			glm::dvec3 LT = focalPlaneCenter
+				+ left() * width * 0.5
+				+ up() * height * 0.5;
+
+			double stepPixel = width / setting().imageWidth;
+
+			glm::dvec3 pixelCenter = LT + stepPixel * right() * (x + 0.5) + stepPixel * down() * (y + 0.5);
+
+			*o = origin();
+			*d = glm::normalize(pixelCenter - origin());
+		}
 		double lensPDF() const {
 			double r = _setting.lensRadius;
 			return 1.0 / (glm::pi<double>() * r * r);
@@ -184,6 +202,35 @@ namespace rt {
 			return false;
 		}
 
+		// レンズの中心を通して p が写るピクセル
+		bool projectToPixel(const glm::dvec3 &p, int *x, int *y) const {
+			glm::dvec3 v = p - origin();
+			double z = glm::dot(v, front());
+			if (z <= 0.0) {
+				return false;
+			}
+			glm::dvec3 Vp = origin() + v * (setting().focasDistance / z);
+
+			auto focalPlaneCenter = origin() + front() * setting().focasDistance;
+			auto width = setting().widthV();
+			auto height = setting().heightV();
+
+			glm::dvec3 LT = focalPlaneCenter
+				+ left() * width * 0.5
+				+ up() * height * 0.5;
+
+			glm::dvec3 dir = Vp - LT;
+			double stepPixel = width / setting().imageWidth;
+			double Vx = glm::dot(dir, right()) / stepPixel;
+			double Vy = glm::dot(dir, down()) / stepPixel;
+			if (Vx < 0.0 || Vy < 0.0 || setting().imageWidth <= Vx || setting().imageHeight <= Vy) {
+				return false;
+			}
+			*x = (int)Vx;
+			*y = (int)Vy;
+			return true;
+		}
+
 		double Wi(const glm::dvec3 &x0, const glm::dvec3 &x1, const glm::dvec3 &n1) const {
 			glm::dvec3 x1_to_x0 = x0 - x1;
 			glm::dvec3 x0_to_x1 = -x1_to_x0;
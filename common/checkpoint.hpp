@@ -0,0 +1,248 @@
+#pragma once
+
+#include <atomic>
+#include <cstring>
+#include <thread>
+#include <tbb/tbb.h>
+
+#include "integrator.hpp"
+#include "mapped_file.hpp"
+#include "stopwatch.hpp"
+
+namespace rt {
+	/*
+	 累積バッファ, 乱数の状態, ステップ数, bad sample のカウンタをメモリマップしたファイルに保存する。
+
+	 ファイルは A/B の2スロットを持ち、書き込みは常に古い方のスロットに行う。
+	 データをディスクに書き戻した後でヘッダのスロット情報 (sequence) を更新するので、
+	 書き込みの途中でプロセスが落ちても直前のチェックポイントから再開できる。
+
+	 コピーは 4KB ごとに比較して、内容が変わった部分だけ書き込む。
+	 マップされたページは書き込まれたものだけが dirty になるので、変わっていない部分はディスクに書かれない。
+	 ディスクへの書き戻しはバックグラウンドで行い、レンダリングスレッドはコピーが終わればすぐ戻る。
+
+	 同じシーン, 同じ解像度で再開すれば、中断しなかった場合とビット単位で同じ結果になる
+	*/
+	class Checkpoint {
+	public:
+		Checkpoint() {}
+		~Checkpoint() {
+			wait();
+		}
+		Checkpoint(const Checkpoint &) = delete;
+		void operator=(const Checkpoint &) = delete;
+
+		// key はシーンを識別する値で、一致しない場合は古い内容を捨てる
+		bool open(const char *path, int width, int height, uint64_t key) {
+			wait();
+
+			_pixelCount = (size_t)width * height;
+			_slotBytes = alignUp(_pixelCount * (sizeof(Image::Pixel) + sizeof(uint64_t) * 2), kPageBytes);
+			size_t fileBytes = kHeaderBytes + _slotBytes * 2;
+			if (_file.open(path, MappedFile::ReadWrite, fileBytes) == false) {
+				printf("can't open checkpoint %s\n", path);
+				return false;
+			}
+
+			Header *h = header();
+			bool valid =
+				memcmp(h->magic, kMagic, sizeof(h->magic)) == 0 &&
+				h->version == kVersion &&
+				h->pixelBytes == sizeof(Image::Pixel) &&
+				h->width == width &&
+				h->height == height &&
+				h->key == key;
+			if (valid == false) {
+				memset(h, 0, sizeof(Header));
+				memcpy(h->magic, kMagic, sizeof(h->magic));
+				h->version = kVersion;
+				h->pixelBytes = sizeof(Image::Pixel);
+				h->width = width;
+				h->height = height;
+				h->key = key;
+				_file.flush(0, sizeof(Header));
+			}
+			return true;
+		}
+
+		bool isOpen() const {
+			return _file.isOpen();
+		}
+
+		// 有効なチェックポイントがあれば renderer に復元する
+		bool resume(PTRenderer &renderer, double *renderSeconds) {
+			if (isOpen() == false) {
+				return false;
+			}
+			int slot = activeSlot();
+			if (slot < 0) {
+				return false;
+			}
+			const Slot &meta = header()->slots[slot];
+			Image &image = renderer._image;
+			memcpy(image.pixels(), pixelsOf(slot), _pixelCount * sizeof(Image::Pixel));
+			const uint64_t *states = statesOf(slot);
+			for (size_t i = 0; i < _pixelCount; ++i) {
+				image.xoroshiro((int)i).setState(states + i * 2);
+			}
+			renderer._steps = meta.steps;
+			renderer._badSampleNanCount = meta.badSampleNanCount;
+			renderer._badSampleInfCount = meta.badSampleInfCount;
+			renderer._badSampleNegativeCount = meta.badSampleNegativeCount;
+			renderer._badSampleFireflyCount = meta.badSampleFireflyCount;
+			*renderSeconds = meta.renderSeconds;
+			return true;
+		}
+
+		// ステップの合間に呼ぶこと
+		void save(const PTRenderer &renderer, double renderSeconds) {
+			if (isOpen() == false) {
+				return;
+			}
+			Stopwatch sw;
+			wait();
+
+			int active = activeSlot();
+			int target = active == 0 ? 1 : 0;
+
+			const Image &image = renderer._image;
+			std::atomic<size_t> changedBytes(0);
+
+			// pixels
+			{
+				const uint8_t *src = reinterpret_cast<const uint8_t *>(image.pixels());
+				uint8_t *dst = reinterpret_cast<uint8_t *>(pixelsOf(target));
+				size_t bytes = _pixelCount * sizeof(Image::Pixel);
+				size_t blocks = (bytes + kPageBytes - 1) / kPageBytes;
+				tbb::parallel_for(tbb::blocked_range<size_t>(0, blocks), [&](const tbb::blocked_range<size_t> &range) {
+					size_t changed = 0;
+					for (size_t i = range.begin(); i < range.end(); ++i) {
+						size_t offset = i * kPageBytes;
+						size_t n = std::min(kPageBytes, bytes - offset);
+						if (memcmp(dst + offset, src + offset, n) != 0) {
+							memcpy(dst + offset, src + offset, n);
+							changed += n;
+						}
+					}
+					changedBytes += changed;
+				});
+			}
+
+			// random states
+			{
+				uint64_t *dst = statesOf(target);
+				const size_t kStatesPerBlock = kPageBytes / (sizeof(uint64_t) * 2);
+				size_t blocks = (_pixelCount + kStatesPerBlock - 1) / kStatesPerBlock;
+				tbb::parallel_for(tbb::blocked_range<size_t>(0, blocks), [&](const tbb::blocked_range<size_t> &range) {
+					uint64_t states[kStatesPerBlock * 2];
+					size_t changed = 0;
+					for (size_t i = range.begin(); i < range.end(); ++i) {
+						size_t beg = i * kStatesPerBlock;
+						size_t n = std::min(kStatesPerBlock, _pixelCount - beg);
+						for (size_t j = 0; j < n; ++j) {
+							image.xoroshiro((int)(beg + j)).state(states + j * 2);
+						}
+						size_t bytes = n * sizeof(uint64_t) * 2;
+						if (memcmp(dst + beg * 2, states, bytes) != 0) {
+							memcpy(dst + beg * 2, states, bytes);
+							changed += bytes;
+						}
+					}
+					changedBytes += changed;
+				});
+			}
+
+			Slot meta;
+			meta.sequence = (active < 0 ? 0 : header()->slots[active].sequence) + 1;
+			meta.steps = renderer._steps;
+			meta.badSampleNanCount = renderer._badSampleNanCount.load();
+			meta.badSampleInfCount = renderer._badSampleInfCount.load();
+			meta.badSampleNegativeCount = renderer._badSampleNegativeCount.load();
+			meta.badSampleFireflyCount = renderer._badSampleFireflyCount.load();
+			meta.renderSeconds = renderSeconds;
+
+			_lastChangedBytes = changedBytes.load();
+
+			// データを書き戻してからスロットを有効にする
+			_flushThread = std::thread([this, target, meta]() {
+				_file.flush(kHeaderBytes + _slotBytes * target, _slotBytes);
+				header()->slots[target] = meta;
+				_file.flush(0, sizeof(Header));
+			});
+
+			_overheadSeconds += sw.elapsed();
+		}
+
+		// 書き戻しが終わるまで待つ
+		void wait() {
+			if (_flushThread.joinable()) {
+				_flushThread.join();
+			}
+		}
+
+		// レンダリングスレッドで消費した時間の合計
+		double overheadSeconds() const {
+			return _overheadSeconds;
+		}
+		size_t lastChangedBytes() const {
+			return _lastChangedBytes;
+		}
+	private:
+		struct Slot {
+			uint64_t sequence = 0; // 0 は空
+			int32_t steps = 0;
+			int32_t badSampleNanCount = 0;
+			int32_t badSampleInfCount = 0;
+			int32_t badSampleNegativeCount = 0;
+			int32_t badSampleFireflyCount = 0;
+			double renderSeconds = 0.0;
+		};
+		struct Header {
+			char magic[8];
+			uint32_t version;
+			uint32_t pixelBytes;
+			int32_t width;
+			int32_t height;
+			uint64_t key;
+			Slot slots[2];
+		};
+		static constexpr const char *kMagic = "MRCKPT\0";
+		static const uint32_t kVersion = 1;
+		static const size_t kPageBytes = 4096;
+		static const size_t kHeaderBytes = 4096;
+
+		static size_t alignUp(size_t x, size_t a) {
+			return (x + a - 1) / a * a;
+		}
+
+		Header *header() {
+			return static_cast<Header *>(_file.data());
+		}
+		// 有効なスロットのうち新しい方, 無ければ -1
+		int activeSlot() {
+			const Header *h = header();
+			uint64_t s0 = h->slots[0].sequence;
+			uint64_t s1 = h->slots[1].sequence;
+			if (s0 == 0 && s1 == 0) {
+				return -1;
+			}
+			return s1 < s0 ? 0 : 1;
+		}
+		uint8_t *slotOf(int slot) {
+			return static_cast<uint8_t *>(_file.data()) + kHeaderBytes + _slotBytes * slot;
+		}
+		Image::Pixel *pixelsOf(int slot) {
+			return reinterpret_cast<Image::Pixel *>(slotOf(slot));
+		}
+		uint64_t *statesOf(int slot) {
+			return reinterpret_cast<uint64_t *>(slotOf(slot) + _pixelCount * sizeof(Image::Pixel));
+		}
+
+		MappedFile _file;
+		size_t _pixelCount = 0;
+		size_t _slotBytes = 0;
+		std::thread _flushThread;
+		double _overheadSeconds = 0.0;
+		size_t _lastChangedBytes = 0;
+	};
+}
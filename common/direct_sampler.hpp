@@ -1,231 +1,71 @@
 ﻿#pragma once
+#include <atomic>
+#include <cstdint>
+#include <tbb/enumerable_thread_specific.h>
 #include "geometry.hpp"
 #include "peseudo_random.hpp"
+#include "spherical_rectangle_sampler.hpp"
 #include "spherical_triangle_sampler.hpp"
+#include "spherical_sampler_batch.hpp"
 
 namespace rt {
-	struct Rectangle {
-		Rectangle() {}
-		Rectangle(glm::dvec3 s, glm::dvec3 ex, glm::dvec3 ey)
-			:_s(s)
-			, _ex(ex)
-			, _ey(ey) {
-			_exLength = glm::length(ex);
-			_eyLength = glm::length(ey);
-			_x = ex / _exLength;
-			_y = ey / _eyLength;
-			_z = glm::cross(_x, _y);
-		}
-		glm::dvec3 sample(double u, double v) const {
-			return _s + _ex * u + _ey * v;
-		}
-		double area() const {
-			return _exLength * _eyLength;
-		}
-		glm::dvec3 normal() const {
-			return _z;
-		}
-		glm::dvec3 s() const {
-			return _s;
-		}
-		glm::dvec3 ex() const {
-			return _ex;
-		}
-		glm::dvec3 ey() const {
-			return _ey;
-		}
-		glm::dvec3 x() const {
-			return _x;
-		}
-		glm::dvec3 y() const {
-			return _y;
-		}
-		glm::dvec3 z() const {
-			return _z;
-		}
-		double exLength() const {
-			return _exLength;
-		}
-		double eyLength() const {
-			return _eyLength;
-		}
-		glm::dvec3 _s;
-		glm::dvec3 _ex;
-		glm::dvec3 _ey;
-		double _exLength = 0.0;
-		double _eyLength = 0.0;
-		glm::dvec3 _x;
-		glm::dvec3 _y;
-		glm::dvec3 _z;
-	};
+	inline uint64_t newDirectSamplerId() {
+		static std::atomic<uint64_t> id(0);
+		return ++id;
+	}
 
-	class SphericalRectangleSamplerCoordinate_Optimized {
+	/*
+	 シェーディング点 o ごとの準備 (球面長方形・球面三角形の座標, acos を含む) をスレッドごとに直近 2 つ覚えておく。
+	 NEE の sample(o) と、次の頂点で同じ光源に当たったときの MIS の pdf_area(o, p) は同じ o で呼ばれるが、
+	 その間に次の頂点の NEE が入るので 2 つ要る。
+	 光源はアドレスではなく通し番号で見分ける (リロードで同じアドレスに別の光源ができても混ざらない)
+	 返した参照は次の get までしか使えない
+	*/
+	template <class T>
+	class OriginCache {
 	public:
-		SphericalRectangleSamplerCoordinate_Optimized(const Rectangle &rectangle, const glm::dvec3 &o) :_rectangle(rectangle) {
-			_o = o;
-
-			glm::dvec3 d = rectangle.s() - o;
-			_x0 = glm::dot(d, rectangle.x());
-			_y0 = glm::dot(d, rectangle.y());
-			_z0 = glm::dot(d, rectangle.z());
-
-			double exLen = rectangle.exLength();
-			double eyLen = rectangle.eyLength();
-			_x1 = _x0 + exLen;
-			_y1 = _y0 + eyLen;
-
-			// z flip
-			if (_z0 > 0.0) {
-				_z0 *= -1.0;
-				_rectangle._z *= -1.0;
-			}
-			/*
-			_v[0][0] = glm::vec3(_x0, _y0, _z0);
-			_v[0][1] = glm::vec3(_x0, _y1, _z0);
-			_v[1][0] = glm::vec3(_x1, _y0, _z0);
-			_v[1][1] = glm::vec3(_x1, _y1, _z0);
-			*/
-			/*
-			a.y * b.z - b.y * a.z,
-			a.z * b.x - b.z * a.x,
-			a.x * b.y - b.x * a.y
-			*/
-			// 外積を展開
-			//double z0_exLen = _z0 * exLen;
-			//double z0_exLen2 = z0_exLen * z0_exLen;
-			//double z0_eyLen = _z0 * eyLen;
-			//double z0_eyLen2 = z0_eyLen * z0_eyLen;
-			//_n[0] = glm::dvec3(
-			//	0.0,
-			//	z0_exLen,
-			//	-exLen * _y0
-			//);
-			//_n[1] = glm::dvec3(
-			//	-z0_eyLen,
-			//	0.0,
-			//	_x1 * eyLen
-			//);
-			//_n[2] = glm::dvec3(
-			//	0.0,
-			//	-z0_exLen,
-			//	_y1 * exLen
-			//);
-			//_n[3] = glm::dvec3(
-			//	z0_eyLen,
-			//	0.0,
-			//	-_x0 * eyLen
-			//);
-			// 必要なのは、zだけであるので、正規化はzだけ
-			//_n[0].z /= std::sqrt(z0_exLen2 + _n[0].z * _n[0].z);
-			//_n[1].z /= std::sqrt(z0_eyLen2 + _n[1].z * _n[1].z);
-			//_n[2].z /= std::sqrt(z0_exLen2 + _n[2].z * _n[2].z);
-			//_n[3].z /= std::sqrt(z0_eyLen2 + _n[3].z * _n[3].z);
-			// 定数倍なのだから、係数を掛ける必要が無い
-			_z0z0 = _z0 * _z0;
-			_y1y1 = _y1 * _y1;
-			_n[0] = glm::dvec3(
-				0.0,
-				_z0,
-				-_y0
-			);
-			_n[1] = glm::dvec3(
-				-_z0,
-				0.0,
-				_x1
-			);
-			_n[2] = glm::dvec3(
-				0.0,
-				-_z0,
-				_y1
-			);
-			_n[3] = glm::dvec3(
-				_z0,
-				0.0,
-				-_x0
-			);
-
-			/*
-			a.y * b.z - b.y * a.z,
-			a.z * b.x - b.z * a.x,
-			a.x * b.y - b.x * a.y
-
-			a.y * b.z - 0.0 * a.z,
-			a.z * b.x - b.z * 0.0,
-			0.0 * 0.0 - b.x * a.y
-			*/
-
-			// 必要なのは、zだけであるので、正規化はzだけ
-			_y0y0 = _y0 * _y0;
-			_n[0].z /= std::sqrt(_z0z0 + _y0y0);
-			_n[1].z /= std::sqrt(_z0z0 + _x1 * _x1);
-			_n[2].z /= std::sqrt(_z0z0 + _y1y1);
-			_n[3].z /= std::sqrt(_z0z0 + _x0 * _x0);
-
-			/*
-			_n[0].x == 0
-			_n[1].y == 0
-			_n[2].x == 0
-			_n[3].y == 0
-			であるため、z成分だけで良い
-			*/
-			_g[0] = std::acos(-_n[0].z * _n[1].z);
-			_g[1] = std::acos(-_n[1].z * _n[2].z);
-			_g[2] = std::acos(-_n[2].z * _n[3].z);
-			_g[3] = std::acos(-_n[3].z * _n[0].z);
-
-			_sr = _g[0] + _g[1] + _g[2] + _g[3] - glm::two_pi<double>();
-		}
-
-		double solidAngle() const {
-			return _sr;
-		}
-
-		glm::dvec3 sample(double u, double v) const {
-			double AQ = _sr;
-			double phi_u = u * AQ - _g[2] - _g[3] + glm::two_pi<double>();
-
-			auto safeSqrt = [](double x) {
-				return std::sqrt(std::max(x, 0.0));
-			};
-
-			double b0 = _n[0].z;
-			double b1 = _n[2].z;
-			double fu = (std::cos(phi_u) * b0 - b1) / std::sin(phi_u);
-			double cu = std::copysign(1.0, fu) / std::sqrt(fu * fu + b0 * b0);
-			double xu = -cu * _z0 / safeSqrt(1.0 - cu * cu);
-
-			double d = std::sqrt(xu * xu + _z0z0);
-			double d2 = d * d;
-			double h0 = _y0 / std::sqrt(d2 + _y0y0);
-			double h1 = _y1 / std::sqrt(d2 + _y1y1);
-			double hv = glm::mix(h0, h1, v);
-			double yv = hv * d / safeSqrt(1.0 - hv * hv);
-			return _o + xu * _rectangle.x() + yv * _rectangle.y() + _z0 * _rectangle.z();
-		}
-
-		Rectangle _rectangle;
-
-		glm::dvec3 _o;
-
-		double _x0;
-		double _x1;
-		double _y0;
-		double _y1;
-		double _z0;
-
-		double _z0z0;
-		double _y0y0;
-		double _y1y1;
-
-		double _sr;
-
-		glm::dvec3 _n[4];
-		double _g[4];
+		template <class F>
+		const T &get(uint64_t owner, const glm::dvec3 &o, F make) {
+			for (int i = 0; i < 2; ++i) {
+				if (_entries[i].owner == owner && _entries[i].o == o) {
+					_next = 1 - i;
+					return _entries[i].value;
+				}
+			}
+			Entry &e = _entries[_next];
+			_next = 1 - _next;
+			e.owner = owner;
+			e.o = o;
+			e.value = make();
+			return e.value;
+		}
+	private:
+		struct Entry {
+			uint64_t owner = 0;
+			glm::dvec3 o;
+			T value;
+		};
+		Entry _entries[2];
+		int _next = 0;
 	};
-	using SphericalRectangleSamplerCoordinate = SphericalRectangleSamplerCoordinate_Optimized;
+
+	// 光源上の 1 点のサンプル
+	struct LightSample {
+		glm::dvec3 p;
+		glm::dvec3 n;
+		glm::dvec3 Le;
+		double pdf_area = 0.0;
+	};
+
+	// sample_batch で 1 度に引ける数 (float のバッチ版の幅)
+	static const int kMaxLightSamples = 8;
+	// これより小さく見える光源は float のバッチ版を使わない (spherical_sampler_batch.hpp の精度の範囲)
+	static const double kMinBatchSolidAngle = 1.0e-2;
 
 	class IDirectSampler {
 	public:
+		virtual ~IDirectSampler() {}
+
 		// サンプリングが可能かどうか can_sample == falseなら pdf = 0である
 		virtual bool can_sample(glm::dvec3 o) const = 0;
 		virtual double pdf_area(glm::dvec3 o, glm::dvec3 p) const = 0;
@@ -233,6 +73,13 @@ namespace rt {
 		// can_sample == false のときは呼ばないことにする
 		virtual void sample(PeseudoRandom *random, glm::dvec3 o, glm::dvec3 *p, glm::dvec3 *n, glm::dvec3 *Le, double *pdf_area) const = 0;
 
+		// 同じ o に向けて count 個 (kMaxLightSamples 以下) を引く。count == 1 なら sample と同じ
+		virtual void sample_batch(PeseudoRandom *random, glm::dvec3 o, int count, LightSample *samples) const {
+			for (int i = 0; i < count; ++i) {
+				sample(random, o, &samples[i].p, &samples[i].n, &samples[i].Le, &samples[i].pdf_area);
+			}
+		}
+
 		// for light selection
 		virtual glm::dvec3 center() const = 0;
 		virtual double Lavg_mul_area() const = 0;
@@ -411,6 +258,7 @@ namespace rt {
 			:_doubleSided(doubleSided)
 			, _Le(Le)
 			, _q(s, ex, ey)
+			, _id(newDirectSamplerId())
 		{
 			_Lavg = (_Le.x + _Le.y + _Le.z) / 3.0;
 			_center = s + ex * 0.5 + ey * 0.5;
@@ -437,8 +285,11 @@ namespace rt {
 		}
 		virtual void sample(PeseudoRandom *random, glm::dvec3 o, glm::dvec3 *p, glm::dvec3 *n, glm::dvec3 *Le, double *pdf_area) const
 		{
-			SphericalRectangleSamplerCoordinate sampler(_q, o);
-			*p = sampler.sample(random->uniform(), random->uniform());
+			const SphericalRectangleSamplerCoordinate &sampler = coordinate(o);
+			// 引数の評価順は決まっていないので、u, v の順に引く
+			double u = random->uniform();
+			double v = random->uniform();
+			*p = sampler.sample(u, v);
 			glm::dvec3 d = *p - o;
 			bool backfacing = 0.0 < glm::dot(d, _q.normal());
 
@@ -465,20 +316,74 @@ namespace rt {
 			bool backfacing = 0.0 < glm::dot(d, _q.normal());
 			glm::dvec3 n = backfacing ? -_q.normal() : _q.normal();
 
-			SphericalRectangleSamplerCoordinate sampler(_q, o);
 			double dLength2 = glm::length2(d);
 			double cosTheta = glm::dot(-n, d / std::sqrt(dLength2));
+			double pw = 1.0 / coordinate(o).solidAngle();
+			return pw * cosTheta / dLength2;
+		}
+
+		/*
+		 点の計算は SphericalRectangleBatch で kMaxLightSamples 本まとめて float で行う。
+		 原点ごとの準備は sample, pdf_area と同じ double のもの (coordinate(o)) を使う。
+		 float では小さく見える光源ほど桁落ちするので、立体角が kMinBatchSolidAngle 未満なら double の sample を繰り返す。
+		 pdf は sample, pdf_area と同じく double の立体角から求める
+		*/
+		virtual void sample_batch(PeseudoRandom *random, glm::dvec3 o, int count, LightSample *samples) const override {
+			const SphericalRectangleSamplerCoordinate &sampler = coordinate(o);
+			if (count < 2 || sampler.solidAngle() < kMinBatchSolidAngle) {
+				IDirectSampler::sample_batch(random, o, count, samples);
+				return;
+			}
+			// どのレーンも同じ原点なので、覚えている double の準備を写すだけで prepare は要らない
+			SphericalRectangleBatch<kMaxLightSamples> batch;
+			for (int k = 0; k < kMaxLightSamples; ++k) {
+				batch.set(k, sampler);
+			}
+
+			float u[kMaxLightSamples];
+			float v[kMaxLightSamples];
+			for (int k = 0; k < kMaxLightSamples; ++k) {
+				u[k] = k < count ? (float)random->uniform() : 0.5f;
+				v[k] = k < count ? (float)random->uniform() : 0.5f;
+			}
+			float px[kMaxLightSamples];
+			float py[kMaxLightSamples];
+			float pz[kMaxLightSamples];
+			batch.sample(u, v, px, py, pz);
+
 			double pw = 1.0 / sampler.solidAngle();
-			return pw * cosTheta / glm::distance2(o, p);
+			for (int i = 0; i < count; ++i) {
+				LightSample &s = samples[i];
+				s.p = glm::dvec3(px[i], py[i], pz[i]);
+				glm::dvec3 d = s.p - o;
+				bool backfacing = 0.0 < glm::dot(d, _q.normal());
+				if (_doubleSided) {
+					s.n = backfacing ? -_q.normal() : _q.normal();
+					s.Le = _Le;
+				}
+				else {
+					s.n = _q.normal();
+					s.Le = backfacing ? glm::dvec3(0.0) : _Le;
+				}
+				double dLength2 = glm::length2(d);
+				double cosTheta = glm::dot(-s.n, d / std::sqrt(dLength2));
+				s.pdf_area = pw * cosTheta / dLength2;
+			}
 		}
 
 		virtual glm::dvec3 center() const override { return _center; }
 		virtual double Lavg_mul_area() const override { return _Lavg_mul_area; }
 	private:
+		const SphericalRectangleSamplerCoordinate &coordinate(const glm::dvec3 &o) const {
+			static thread_local OriginCache<SphericalRectangleSamplerCoordinate> cache;
+			return cache.get(_id, o, [&]() { return SphericalRectangleSamplerCoordinate(_q, o); });
+		}
+
 		glm::dvec3 _Le;
 		double _Lavg = 0;
 		bool _doubleSided = false;
 		Rectangle _q;
+		uint64_t _id = 0;
 		glm::dvec3 _center;
 
 		double _Lavg_mul_area = 0.0;
@@ -492,7 +397,8 @@ namespace rt {
 			, _b(b)
 			, _c(c)
 			, _doubleSided(doubleSided)
-			, _Le(Le) {
+			, _Le(Le)
+			, _id(newDirectSamplerId()) {
 			_Lavg = (_Le.x + _Le.y + _Le.z) / 3.0;
 			_n = triangleNormal(_a, _b, _c);
 			_center = (_a + _b + _c) / 3.0;
@@ -509,10 +415,9 @@ namespace rt {
 			bool backfacing = 0.0 < glm::dot(d, _n);
 			glm::dvec3 n = backfacing ? -_n : _n;
 
-			SphericalTriangleSampler sampler(_a, _b, _c, _n, o);
 			double dLength2 = glm::length2(d);
 			double cosTheta = glm::dot(-n, d / std::sqrt(dLength2));
-			double pw = 1.0 / sampler.solidAngle();
+			double pw = 1.0 / triangle(o).solidAngle();
 			return pw * cosTheta / dLength2;
 		}
 		virtual bool can_sample(glm::dvec3 o) const override {
@@ -535,11 +440,13 @@ namespace rt {
 		}
 
 		virtual void sample(PeseudoRandom *random, glm::dvec3 o, glm::dvec3 *p, glm::dvec3 *n, glm::dvec3 *Le, double *pdf_area) const override {
-			SphericalTriangleSampler sampler(_a, _b, _c, _n, o);
+			const SphericalTriangleSampler &sampler = triangle(o);
 
 			// dは単位ベクトル
 			glm::dvec3 d;
-			*p = sampler.sample(random->uniform(), random->uniform(), &d);
+			double u = random->uniform();
+			double v = random->uniform();
+			*p = sampler.sample(u, v, &d);
 
 			bool backfacing = 0.0 < glm::dot(d, _n);
 
@@ -558,9 +465,57 @@ namespace rt {
 			*pdf_area = pw * cosTheta / dLength2;
 		}
 
+		// SphericalRectangleSampler::sample_batch と同じく、十分大きく見えるときだけ SphericalTriangleBatch で計算する
+		virtual void sample_batch(PeseudoRandom *random, glm::dvec3 o, int count, LightSample *samples) const override {
+			const SphericalTriangleSampler &sampler = triangle(o);
+			if (count < 2 || sampler.solidAngle() < kMinBatchSolidAngle) {
+				IDirectSampler::sample_batch(random, o, count, samples);
+				return;
+			}
+			SphericalTriangleBatch<kMaxLightSamples> batch;
+			for (int k = 0; k < kMaxLightSamples; ++k) {
+				batch.set(k, sampler);
+			}
+
+			float u[kMaxLightSamples];
+			float v[kMaxLightSamples];
+			for (int k = 0; k < kMaxLightSamples; ++k) {
+				u[k] = k < count ? (float)random->uniform() : 0.5f;
+				v[k] = k < count ? (float)random->uniform() : 0.5f;
+			}
+			float px[kMaxLightSamples];
+			float py[kMaxLightSamples];
+			float pz[kMaxLightSamples];
+			batch.sample(u, v, px, py, pz);
+
+			double pw = 1.0 / sampler.solidAngle();
+			for (int i = 0; i < count; ++i) {
+				LightSample &s = samples[i];
+				s.p = glm::dvec3(px[i], py[i], pz[i]);
+				glm::dvec3 d = s.p - o;
+				bool backfacing = 0.0 < glm::dot(d, _n);
+				if (_doubleSided) {
+					s.n = backfacing ? -_n : _n;
+					s.Le = _Le;
+				}
+				else {
+					s.n = _n;
+					s.Le = backfacing ? glm::dvec3(0.0) : _Le;
+				}
+				double dLength2 = glm::length2(d);
+				double cosTheta = glm::dot(-s.n, d / std::sqrt(dLength2));
+				s.pdf_area = pw * cosTheta / dLength2;
+			}
+		}
+
 		virtual glm::dvec3 center() const override { return _center; }
 		virtual double Lavg_mul_area() const override { return _Lavg_mul_area; }
 	private:
+		const SphericalTriangleSampler &triangle(const glm::dvec3 &o) const {
+			static thread_local OriginCache<SphericalTriangleSampler> cache;
+			return cache.get(_id, o, [&]() { return SphericalTriangleSampler(_a, _b, _c, _n, o); });
+		}
+
 		glm::dvec3 _Le;
 		double _Lavg = 0;
 		glm::dvec3 _a, _b, _c;
@@ -568,5 +523,111 @@ namespace rt {
 		glm::dvec3 _center;
 		bool _doubleSided = false;
 		double _Lavg_mul_area = 0.0;
+		uint64_t _id = 0;
+	};
+
+	// 三角形光源のサンプリングで、面積と立体角のどちらを使ったか (シェーディング点での選択の回数)
+	struct DirectSamplingCounts {
+		uint64_t area = 0;
+		uint64_t solidAngle = 0;
+		uint64_t blended = 0; // area, solidAngle のうち、両方を混ぜる範囲で選んだもの
+	};
+	inline tbb::enumerable_thread_specific<DirectSamplingCounts> &directSamplingCounters() {
+		static tbb::enumerable_thread_specific<DirectSamplingCounts> counters;
+		return counters;
+	}
+	inline DirectSamplingCounts directSamplingCounts() {
+		DirectSamplingCounts sum;
+		for (const DirectSamplingCounts &c : directSamplingCounters()) {
+			sum.area += c.area;
+			sum.solidAngle += c.solidAngle;
+			sum.blended += c.blended;
+		}
+		return sum;
+	}
+	inline void resetDirectSamplingCounts() {
+		for (DirectSamplingCounts &c : directSamplingCounters()) {
+			c = DirectSamplingCounts();
+		}
+	}
+
+	/*
+	 シェーディング点 o ごとに面積サンプリングと立体角サンプリングを選ぶ三角形光源。
+	 立体角サンプリングは acos や三角関数が要り、光源が大きく見えるときにしか得をしないので、
+	 外接円の半径 r と中心までの距離 d から見かけの大きさ e = r^2 / d^2 を安く見積もり、
+	   e <= kAreaOnly      : 面積サンプリングだけ
+	   e >= kSolidAngleOnly: 立体角サンプリングだけ
+	   その間             : 確率 w で立体角, 1 - w で面積を選ぶ
+	 とする。w は o だけで決まるので、pdf は 2 つの混合 (1 - w) pdf_area + w pdf_solid_angle になり (one-sample MIS)、
+	 光源に当たったときの MIS の pdf_area とも一致する
+	*/
+	class AdaptiveTriangleSampler : public IDirectSampler {
+	public:
+		static constexpr double kAreaOnly = 0.01;
+		static constexpr double kSolidAngleOnly = 0.1;
+
+		AdaptiveTriangleSampler(glm::dvec3 a, glm::dvec3 b, glm::dvec3 c, bool doubleSided, glm::dvec3 Le)
+			:_area(a, b, c, doubleSided, Le)
+			, _solidAngle(a, b, c, doubleSided, Le) {
+			_center = (a + b + c) / 3.0;
+			_radius2 = std::max(glm::distance2(a, _center), std::max(glm::distance2(b, _center), glm::distance2(c, _center)));
+		}
+
+		// o での立体角サンプリングを選ぶ確率
+		double solidAngleWeight(glm::dvec3 o) const {
+			double e = _radius2 / glm::distance2(o, _center);
+			return glm::clamp((e - kAreaOnly) / (kSolidAngleOnly - kAreaOnly), 0.0, 1.0);
+		}
+
+		virtual double pdf_area(glm::dvec3 o, glm::dvec3 p) const override {
+			double w = solidAngleWeight(o);
+			if (w <= 0.0) {
+				return _area.pdf_area(o, p);
+			}
+			if (1.0 <= w) {
+				return _solidAngle.pdf_area(o, p);
+			}
+			return (1.0 - w) * _area.pdf_area(o, p) + w * _solidAngle.pdf_area(o, p);
+		}
+		virtual bool can_sample(glm::dvec3 o) const override {
+			return _area.can_sample(o);
+		}
+		virtual void sample(PeseudoRandom *random, glm::dvec3 o, glm::dvec3 *p, glm::dvec3 *n, glm::dvec3 *Le, double *pdf_area) const override {
+			DirectSamplingCounts &counts = directSamplingCounters().local();
+			double w = solidAngleWeight(o);
+			if (w <= 0.0) {
+				counts.area++;
+				_area.sample(random, o, p, n, Le, pdf_area);
+				return;
+			}
+			if (1.0 <= w) {
+				counts.solidAngle++;
+				_solidAngle.sample(random, o, p, n, Le, pdf_area);
+				return;
+			}
+
+			counts.blended++;
+			double pdfArea;
+			double pdfSolidAngle;
+			if (random->uniform() < w) {
+				counts.solidAngle++;
+				_solidAngle.sample(random, o, p, n, Le, &pdfSolidAngle);
+				pdfArea = _area.pdf_area(o, *p);
+			}
+			else {
+				counts.area++;
+				_area.sample(random, o, p, n, Le, &pdfArea);
+				pdfSolidAngle = _solidAngle.pdf_area(o, *p);
+			}
+			*pdf_area = (1.0 - w) * pdfArea + w * pdfSolidAngle;
+		}
+
+		virtual glm::dvec3 center() const override { return _area.center(); }
+		virtual double Lavg_mul_area() const override { return _area.Lavg_mul_area(); }
+	private:
+		TriangleAreaSampler _area;
+		SphericalTriangleDirectSampler _solidAngle;
+		glm::dvec3 _center;
+		double _radius2 = 0.0;
 	};
 }
\ No newline at end of file
@@ -0,0 +1,324 @@
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <string>
+#include <vector>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#include <direct.h>
+#include <io.h>
+#include <sys/utime.h>
+#else
+#include <unistd.h>
+#include <utime.h>
+#endif
+#include <fcntl.h>
+
+#include "image.hpp"
+
+/*
+ 共有ファイルシステム上のジョブディレクトリを介した分散レンダリング
+
+ 画像を行のバンドに、サンプルをパスの範囲に分けたものを 1 ユニットとし、
+ 各ワーカーはユニットを取り合ってレンダリングし、生の累積バッファを書き出す。
+ コーディネーターは全ユニットの累積をサンプル数ごと足し合わせて 1 枚にする。
+
+ dir/job.txt             ジョブの設定
+ dir/unit_00012.lock     担当中 (O_CREAT | O_EXCL で作る。更新時刻がハートビート)
+ dir/unit_00012.acc      完了した累積バッファ (.tmp に書いてから rename)
+
+ 一定時間ハートビートの無いロックは死んだワーカーのものとみなして奪ってよい。
+ まれに 2 つのワーカーが同じユニットを描くことがあるが、
+ サンプルは (ピクセル, パス) だけで決まるので結果は同一で害は無い
+*/
+namespace rt {
+	struct RenderJob {
+		std::string scene;
+		bool triangulate = false;
+		int lightSamples = 1;
+		// シーンの中身, 読み方, 解像度から作ったキー。ワーカーは自分で作ったものと違えば描かない
+		uint64_t key = 0;
+		int width = 0;
+		int height = 0;
+		int passes = 0;
+		int rowsPerUnit = 64;
+		int passesPerUnit = 16;
+
+		int bandCount() const {
+			return (height + rowsPerUnit - 1) / rowsPerUnit;
+		}
+		int chunkCount() const {
+			return (passes + passesPerUnit - 1) / passesPerUnit;
+		}
+		int unitCount() const {
+			return bandCount() * chunkCount();
+		}
+
+		struct Unit {
+			int y0, y1;
+			int passBegin, passEnd;
+		};
+		// 同じバンドのユニットが続く順番
+		Unit unit(int index) const {
+			int band = index / chunkCount();
+			int chunk = index % chunkCount();
+			Unit u;
+			u.y0 = band * rowsPerUnit;
+			u.y1 = std::min(u.y0 + rowsPerUnit, height);
+			u.passBegin = chunk * passesPerUnit;
+			u.passEnd = std::min(u.passBegin + passesPerUnit, passes);
+			return u;
+		}
+	};
+
+	class JobDirectory {
+	public:
+		bool create(const std::string &directory, const RenderJob &job) {
+			_directory = directory;
+			_job = job;
+#ifdef _WIN32
+			_mkdir(directory.c_str());
+#else
+			mkdir(directory.c_str(), 0755);
+#endif
+			std::string tmp = path("job.txt.tmp");
+			FILE *fp = fopen(tmp.c_str(), "w");
+			if (fp == nullptr) {
+				printf("can't create %s\n", tmp.c_str());
+				return false;
+			}
+			fprintf(fp, "scene %s\n", job.scene.c_str());
+			fprintf(fp, "triangulate %d\n", job.triangulate ? 1 : 0);
+			fprintf(fp, "lightSamples %d\n", job.lightSamples);
+			fprintf(fp, "key %016llx\n", (unsigned long long)job.key);
+			fprintf(fp, "width %d\n", job.width);
+			fprintf(fp, "height %d\n", job.height);
+			fprintf(fp, "passes %d\n", job.passes);
+			fprintf(fp, "rowsPerUnit %d\n", job.rowsPerUnit);
+			fprintf(fp, "passesPerUnit %d\n", job.passesPerUnit);
+			fclose(fp);
+
+			// 以前のジョブの結果が残っていれば消す
+			for (int i = 0; i < job.unitCount(); ++i) {
+				remove(unitPath(i, ".acc").c_str());
+				remove(unitPath(i, ".acc.tmp").c_str());
+				remove(unitPath(i, ".lock").c_str());
+			}
+			return replace(tmp, path("job.txt"));
+		}
+		bool open(const std::string &directory) {
+			_directory = directory;
+			std::string jobPath = path("job.txt");
+			FILE *fp = fopen(jobPath.c_str(), "r");
+			if (fp == nullptr) {
+				printf("can't open %s\n", jobPath.c_str());
+				return false;
+			}
+			char line[4096];
+			while (fgets(line, sizeof(line), fp)) {
+				std::string s = line;
+				while (s.empty() == false && (s.back() == '\n' || s.back() == '\r')) {
+					s.pop_back();
+				}
+				auto at = s.find(' ');
+				if (at == std::string::npos) {
+					continue;
+				}
+				std::string key = s.substr(0, at);
+				std::string value = s.substr(at + 1);
+				if (key == "scene") { _job.scene = value; }
+				else if (key == "triangulate") { _job.triangulate = atoi(value.c_str()) != 0; }
+				else if (key == "lightSamples") { _job.lightSamples = atoi(value.c_str()); }
+				else if (key == "key") { _job.key = strtoull(value.c_str(), nullptr, 16); }
+				else if (key == "width") { _job.width = atoi(value.c_str()); }
+				else if (key == "height") { _job.height = atoi(value.c_str()); }
+				else if (key == "passes") { _job.passes = atoi(value.c_str()); }
+				else if (key == "rowsPerUnit") { _job.rowsPerUnit = atoi(value.c_str()); }
+				else if (key == "passesPerUnit") { _job.passesPerUnit = atoi(value.c_str()); }
+			}
+			fclose(fp);
+			return _job.scene.empty() == false && 0 < _job.width && 0 < _job.height && 0 < _job.passes && 0 < _job.rowsPerUnit && 0 < _job.passesPerUnit;
+		}
+		const RenderJob &job() const {
+			return _job;
+		}
+
+		bool isDone(int unit) const {
+			struct stat st;
+			return stat(unitPath(unit, ".acc").c_str(), &st) == 0;
+		}
+		int remaining() const {
+			int n = 0;
+			for (int i = 0; i < _job.unitCount(); ++i) {
+				if (isDone(i) == false) {
+					n++;
+				}
+			}
+			return n;
+		}
+
+		// 未着手, またはハートビートが staleSeconds より古いユニットを担当する
+		bool claim(int unit, double staleSeconds) {
+			if (isDone(unit)) {
+				return false;
+			}
+			std::string lock = unitPath(unit, ".lock");
+			for (int attempt = 0; attempt < 2; ++attempt) {
+#ifdef _WIN32
+				int fd = _open(lock.c_str(), _O_CREAT | _O_EXCL | _O_WRONLY, _S_IREAD | _S_IWRITE);
+#else
+				int fd = ::open(lock.c_str(), O_CREAT | O_EXCL | O_WRONLY, 0644);
+#endif
+				if (0 <= fd) {
+#ifdef _WIN32
+					_close(fd);
+#else
+					::close(fd);
+#endif
+					return true;
+				}
+				if (errno != EEXIST) {
+					return false;
+				}
+				struct stat st;
+				if (stat(lock.c_str(), &st) != 0) {
+					continue;
+				}
+				double age = difftime(time(nullptr), st.st_mtime);
+				if (age < staleSeconds || isDone(unit)) {
+					return false;
+				}
+				printf("reclaim unit %d (no heartbeat for %.0f sec)\n", unit, age);
+				remove(lock.c_str());
+			}
+			return false;
+		}
+		void heartbeat(int unit) {
+			utime(unitPath(unit, ".lock").c_str(), nullptr);
+		}
+
+		// accum は 幅 * (y1 - y0)
+		bool complete(int unit, const Image::Pixel *accum) {
+			RenderJob::Unit u = _job.unit(unit);
+			std::string tmp = unitPath(unit, ".acc.tmp");
+			FILE *fp = fopen(tmp.c_str(), "wb");
+			if (fp == nullptr) {
+				printf("can't create %s\n", tmp.c_str());
+				return false;
+			}
+			AccumulationHeader header;
+			memcpy(header.magic, kMagic, sizeof(header.magic));
+			header.width = _job.width;
+			header.y0 = u.y0;
+			header.y1 = u.y1;
+			header.passBegin = u.passBegin;
+			header.passEnd = u.passEnd;
+			size_t count = (size_t)_job.width * (u.y1 - u.y0);
+			bool ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+			std::vector<AccumulationPixel> pixels(count);
+			for (size_t i = 0; i < count; ++i) {
+				pixels[i].sample = accum[i].sample;
+				pixels[i].color[0] = accum[i].color.x;
+				pixels[i].color[1] = accum[i].color.y;
+				pixels[i].color[2] = accum[i].color.z;
+			}
+			ok = ok && fwrite(pixels.data(), sizeof(AccumulationPixel), count, fp) == count;
+			ok = fclose(fp) == 0 && ok;
+			if (ok == false) {
+				printf("failed to write %s\n", tmp.c_str());
+				remove(tmp.c_str());
+				return false;
+			}
+			ok = replace(tmp, unitPath(unit, ".acc"));
+			remove(unitPath(unit, ".lock").c_str());
+			return ok;
+		}
+
+		/*
+		 全ユニットの累積を足し合わせる。
+		 ピクセルごとにパスの若い順に足すので、誰がどのユニットを描いたかに依らず同じビットになる
+		*/
+		bool merge(Image::Snapshot *snapshot) const {
+			snapshot->width = _job.width;
+			snapshot->height = _job.height;
+			snapshot->steps = _job.passes;
+			snapshot->pixels.clear();
+			snapshot->pixels.resize((size_t)_job.width * _job.height);
+
+			std::vector<AccumulationPixel> pixels;
+			for (int i = 0; i < _job.unitCount(); ++i) {
+				RenderJob::Unit u = _job.unit(i);
+				std::string accPath = unitPath(i, ".acc");
+				FILE *fp = fopen(accPath.c_str(), "rb");
+				if (fp == nullptr) {
+					printf("missing %s\n", accPath.c_str());
+					return false;
+				}
+				AccumulationHeader header;
+				size_t count = (size_t)_job.width * (u.y1 - u.y0);
+				pixels.resize(count);
+				bool ok =
+					fread(&header, sizeof(header), 1, fp) == 1 &&
+					memcmp(header.magic, kMagic, sizeof(header.magic)) == 0 &&
+					header.width == _job.width && header.y0 == u.y0 && header.y1 == u.y1 &&
+					header.passBegin == u.passBegin && header.passEnd == u.passEnd &&
+					fread(pixels.data(), sizeof(AccumulationPixel), count, fp) == count;
+				fclose(fp);
+				if (ok == false) {
+					printf("broken %s\n", accPath.c_str());
+					return false;
+				}
+				Image::Pixel *dst = snapshot->pixels.data() + (size_t)u.y0 * _job.width;
+				for (size_t j = 0; j < count; ++j) {
+					dst[j].sample += pixels[j].sample;
+					dst[j].color += glm::dvec3(pixels[j].color[0], pixels[j].color[1], pixels[j].color[2]);
+				}
+			}
+			return true;
+		}
+	private:
+		struct AccumulationHeader {
+			char magic[8];
+			int32_t width;
+			int32_t y0;
+			int32_t y1;
+			int32_t passBegin;
+			int32_t passEnd;
+			int32_t reserved = 0;
+		};
+		struct AccumulationPixel {
+			int64_t sample;
+			double color[3];
+		};
+		static constexpr const char *kMagic = "MRACC1\0";
+
+		std::string path(const char *name) const {
+			return _directory + "/" + name;
+		}
+		std::string unitPath(int unit, const char *extension) const {
+			char name[64];
+			snprintf(name, sizeof(name), "unit_%05d%s", unit, extension);
+			return path(name);
+		}
+		static bool replace(const std::string &from, const std::string &to) {
+#ifdef _WIN32
+			remove(to.c_str());
+#endif
+			if (rename(from.c_str(), to.c_str()) != 0) {
+				printf("can't rename %s to %s\n", from.c_str(), to.c_str());
+				return false;
+			}
+			return true;
+		}
+
+		std::string _directory;
+		RenderJob _job;
+	};
+}
@@ -0,0 +1,358 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <emmintrin.h>
+
+/*
+ 1 なら microfacet, velvet まわりの float の超越関数 (fmath::) を fast_math の近似にする。既定は 0 (std)。
+ gcc 12, -O2 -march=native の BxdfBatch (Beckmann 導体と velvet の bxdf_batch + pdf_batch) では近似のほうが遅かったので、
+ ベンチマークで速くなるのを確かめた環境でだけ有効にする
+*/
+#ifndef ENABLE_FAST_MATH
+#define ENABLE_FAST_MATH 0
+#endif
+
+namespace rt {
+	/*
+	 float の近似関数。スカラー版と __m128 版 (_ps) は同じ式で、同じ精度になる。
+	 スカラー版も分岐は select にしてあるので、固定長ループの中ならコンパイラがベクトル化できる。
+	 最大相対誤差 (UnitTest の [fast_math] で確認している範囲):
+	   exp   [-80, 80]                 4e-7
+	   log   [1e-30, 1e30]             3e-7
+	   pow   x in [1e-4, 1], y in (0, 100]  (|y ln x| + 1) * 4e-7
+	   atan  全域                      4e-7
+	   acos  [-1, 1]                   4e-7
+	   sin   [-pi/2, pi/2]             3e-7 (それより外は絶対誤差 2e-7 * |x|)
+	   erf   全域                      7e-7
+	 inf, NaN, 0 と非正規化数の扱いは std と同じ (exp は -87 より下を 0 にする。sin の inf は NaN)
+	*/
+	namespace fast_math {
+		inline float as_float(int32_t i) {
+			float f;
+			std::memcpy(&f, &i, sizeof(f));
+			return f;
+		}
+		inline int32_t as_int(float f) {
+			int32_t i;
+			std::memcpy(&i, &f, sizeof(i));
+			return i;
+		}
+		inline float copysign(float x, float s) {
+			return as_float((as_int(x) & 0x7FFFFFFF) | (as_int(s) & (int32_t)0x80000000));
+		}
+
+		// e^x = 2^i * e^f, i = round(x / ln2), |f| <= ln2 / 2
+		// x < -87 は 0, 88.72 より大きければ inf を返す
+		inline float exp(float x) {
+			float c = x != x ? 0.0f : std::min(std::max(x, -87.0f), 88.7228394f);
+			float t = c * 1.44269504f;
+			int32_t i = (int32_t)(t + (t < 0.0f ? -0.5f : 0.5f));
+			float fi = (float)i;
+			float f = c - fi * 0.693145752f - fi * 1.42860677e-6f;
+
+			float p = 1.0f / 720.0f;
+			p = p * f + 1.0f / 120.0f;
+			p = p * f + 1.0f / 24.0f;
+			p = p * f + 1.0f / 6.0f;
+			p = p * f + 0.5f;
+			p = p * f + 1.0f;
+			p = p * f + 1.0f;
+			// i = 128 でも表せるよう 2^(i - 1) * 2 にする
+			float r = p * as_float((i + 126) << 23) * 2.0f;
+			r = x < -87.0f ? 0.0f : r;
+			r = 88.7228394f < x ? std::numeric_limits<float>::infinity() : r;
+			return x != x ? x : r;
+		}
+
+		// x = m * 2^e, m in [sqrt(1/2), sqrt(2)), ln(m) = 2 atanh(t), t = (m - 1) / (m + 1)
+		// 非正規化数は 2^23 倍してから分ける
+		inline float log(float x) {
+			bool denormal = x < std::numeric_limits<float>::min();
+			int32_t bits = as_int(denormal ? x * 8388608.0f : x);
+			int32_t e = ((bits >> 23) & 0xFF) - (denormal ? 150 : 127);
+			float m = as_float((bits & 0x007FFFFF) | 0x3F800000);
+			bool large = 1.41421356f <= m;
+			m = large ? m * 0.5f : m;
+			float ef = (float)e + (large ? 1.0f : 0.0f);
+
+			float t = (m - 1.0f) / (m + 1.0f);
+			float t2 = t * t;
+			float p = 1.0f / 9.0f;
+			p = p * t2 + 1.0f / 7.0f;
+			p = p * t2 + 1.0f / 5.0f;
+			p = p * t2 + 1.0f / 3.0f;
+			p = p * t2 + 1.0f;
+			float r = ef * 0.693147181f + 2.0f * t * p;
+			r = x == 0.0f ? -std::numeric_limits<float>::infinity() : r;
+			r = x < 0.0f ? std::numeric_limits<float>::quiet_NaN() : r;
+			r = x == std::numeric_limits<float>::infinity() ? x : r;
+			return x != x ? x : r;
+		}
+
+		// x >= 0 (x < 0 は NaN)
+		inline float pow(float x, float y) {
+			float r = exp(y * log(x));
+			r = x == 0.0f ? (0.0f < y ? 0.0f : std::numeric_limits<float>::infinity()) : r;
+			return y == 0.0f ? 1.0f : r;
+		}
+
+		// Abramowitz and Stegun 4.4.49 (|x| <= 1), |x| > 1 は pi/2 - atan(1/x)
+		inline float atan(float x) {
+			float a = std::abs(x);
+			bool inverse = 1.0f < a;
+			float z = inverse ? 1.0f / a : a;
+			float z2 = z * z;
+			float p = 0.0028662257f;
+			p = p * z2 - 0.0161657367f;
+			p = p * z2 + 0.0429096138f;
+			p = p * z2 - 0.0752896400f;
+			p = p * z2 + 0.1065626393f;
+			p = p * z2 - 0.1420889944f;
+			p = p * z2 + 0.1999355085f;
+			p = p * z2 - 0.3333314528f;
+			p = p * z2 + 1.0f;
+			p = p * z;
+			float r = inverse ? 1.57079633f - p : p;
+			return copysign(r, x);
+		}
+
+		// Abramowitz and Stegun 4.4.46, acos(-x) = pi - acos(x)
+		inline float acos(float x) {
+			float a = std::min(std::abs(x), 1.0f);
+			float p = -0.0012624911f;
+			p = p * a + 0.0066700901f;
+			p = p * a - 0.0170881256f;
+			p = p * a + 0.0308918810f;
+			p = p * a - 0.0501743046f;
+			p = p * a + 0.0889789874f;
+			p = p * a - 0.2145988016f;
+			p = p * a + 1.5707963050f;
+			float r = std::sqrt(1.0f - a) * p;
+			r = x < 0.0f ? 3.14159265f - r : r;
+			return 1.0f < std::abs(x) ? std::numeric_limits<float>::quiet_NaN() : r;
+		}
+
+		// sin(x) = (-1)^k sin(r), k = round(x / pi), |r| <= pi / 2
+		inline float sin(float x) {
+			// inf, NaN で整数への変換があふれないよう t を抑える (結果は最後に NaN にする)
+			float t = std::min(std::max(x * 0.318309886f, -1.0e9f), 1.0e9f);
+			int32_t k = (int32_t)(t + (t < 0.0f ? -0.5f : 0.5f));
+			float fk = (float)k;
+			float r = x - fk * 3.140625f - fk * 9.67653590e-4f;
+			float r2 = r * r;
+			float p = -1.0f / 39916800.0f;
+			p = p * r2 + 1.0f / 362880.0f;
+			p = p * r2 - 1.0f / 5040.0f;
+			p = p * r2 + 1.0f / 120.0f;
+			p = p * r2 - 1.0f / 6.0f;
+			p = p * r2 + 1.0f;
+			p = p * r;
+			float s = as_float(as_int(p) ^ (int32_t)((uint32_t)k << 31));
+			return std::abs(x) <= std::numeric_limits<float>::max() ? s : std::numeric_limits<float>::quiet_NaN();
+		}
+
+		// |x| < 0.5 はテイラー展開, それ以外は Abramowitz and Stegun 7.1.26
+		inline float erf(float x) {
+			float a = std::abs(x);
+
+			float a2 = a * a;
+			float s = -1.0f / 1320.0f;
+			s = s * a2 + 1.0f / 216.0f;
+			s = s * a2 - 1.0f / 42.0f;
+			s = s * a2 + 1.0f / 10.0f;
+			s = s * a2 - 1.0f / 3.0f;
+			s = s * a2 + 1.0f;
+			s = s * a * 1.12837917f;
+
+			float t = 1.0f / (1.0f + 0.3275911f * a);
+			float p = 1.061405429f;
+			p = p * t - 1.453152027f;
+			p = p * t + 1.421413741f;
+			p = p * t - 0.284496736f;
+			p = p * t + 0.254829592f;
+			p = p * t;
+			float l = 1.0f - p * exp(-a2);
+
+			return copysign(a < 0.5f ? s : l, x);
+		}
+
+		// __m128 版。SSE2 だけで書く
+		inline __m128 select_ps(__m128 mask, __m128 a, __m128 b) {
+			return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+		}
+		inline __m128 abs_ps(__m128 x) {
+			return _mm_andnot_ps(_mm_set1_ps(-0.0f), x);
+		}
+		inline __m128 copysign_ps(__m128 x, __m128 s) {
+			const __m128 kSign = _mm_set1_ps(-0.0f);
+			return _mm_or_ps(_mm_andnot_ps(kSign, x), _mm_and_ps(kSign, s));
+		}
+		inline __m128 madd_ps(__m128 a, __m128 b, float c) {
+			return _mm_add_ps(_mm_mul_ps(a, b), _mm_set1_ps(c));
+		}
+
+		inline __m128 exp_ps(__m128 x) {
+			__m128 c = _mm_min_ps(_mm_max_ps(x, _mm_set1_ps(-87.0f)), _mm_set1_ps(88.7228394f));
+			__m128i i = _mm_cvtps_epi32(_mm_mul_ps(c, _mm_set1_ps(1.44269504f)));
+			__m128 fi = _mm_cvtepi32_ps(i);
+			__m128 f = _mm_sub_ps(c, _mm_mul_ps(fi, _mm_set1_ps(0.693145752f)));
+			f = _mm_sub_ps(f, _mm_mul_ps(fi, _mm_set1_ps(1.42860677e-6f)));
+
+			__m128 p = _mm_set1_ps(1.0f / 720.0f);
+			p = madd_ps(p, f, 1.0f / 120.0f);
+			p = madd_ps(p, f, 1.0f / 24.0f);
+			p = madd_ps(p, f, 1.0f / 6.0f);
+			p = madd_ps(p, f, 0.5f);
+			p = madd_ps(p, f, 1.0f);
+			p = madd_ps(p, f, 1.0f);
+			__m128 scale = _mm_castsi128_ps(_mm_slli_epi32(_mm_add_epi32(i, _mm_set1_epi32(126)), 23));
+			__m128 r = _mm_mul_ps(_mm_mul_ps(p, scale), _mm_set1_ps(2.0f));
+			r = _mm_andnot_ps(_mm_cmplt_ps(x, _mm_set1_ps(-87.0f)), r);
+			r = select_ps(_mm_cmpgt_ps(x, _mm_set1_ps(88.7228394f)), _mm_set1_ps(std::numeric_limits<float>::infinity()), r);
+			return select_ps(_mm_cmpunord_ps(x, x), x, r);
+		}
+
+		inline __m128 log_ps(__m128 x) {
+			const __m128 kOne = _mm_set1_ps(1.0f);
+			__m128 denormal = _mm_cmplt_ps(x, _mm_set1_ps(std::numeric_limits<float>::min()));
+			__m128i bits = _mm_castps_si128(select_ps(denormal, _mm_mul_ps(x, _mm_set1_ps(8388608.0f)), x));
+			__m128i bias = _mm_or_si128(_mm_andnot_si128(_mm_castps_si128(denormal), _mm_set1_epi32(127)), _mm_and_si128(_mm_castps_si128(denormal), _mm_set1_epi32(150)));
+			__m128i e = _mm_sub_epi32(_mm_and_si128(_mm_srli_epi32(bits, 23), _mm_set1_epi32(0xFF)), bias);
+			__m128 m = _mm_castsi128_ps(_mm_or_si128(_mm_and_si128(bits, _mm_set1_epi32(0x007FFFFF)), _mm_set1_epi32(0x3F800000)));
+			__m128 large = _mm_cmpge_ps(m, _mm_set1_ps(1.41421356f));
+			m = select_ps(large, _mm_mul_ps(m, _mm_set1_ps(0.5f)), m);
+			__m128 ef = _mm_add_ps(_mm_cvtepi32_ps(e), _mm_and_ps(large, kOne));
+
+			__m128 t = _mm_div_ps(_mm_sub_ps(m, kOne), _mm_add_ps(m, kOne));
+			__m128 t2 = _mm_mul_ps(t, t);
+			__m128 p = _mm_set1_ps(1.0f / 9.0f);
+			p = madd_ps(p, t2, 1.0f / 7.0f);
+			p = madd_ps(p, t2, 1.0f / 5.0f);
+			p = madd_ps(p, t2, 1.0f / 3.0f);
+			p = madd_ps(p, t2, 1.0f);
+			__m128 r = _mm_add_ps(_mm_mul_ps(ef, _mm_set1_ps(0.693147181f)), _mm_mul_ps(_mm_add_ps(t, t), p));
+			const __m128 kInf = _mm_set1_ps(std::numeric_limits<float>::infinity());
+			r = select_ps(_mm_cmpeq_ps(x, _mm_setzero_ps()), _mm_sub_ps(_mm_setzero_ps(), kInf), r);
+			r = select_ps(_mm_cmplt_ps(x, _mm_setzero_ps()), _mm_set1_ps(std::numeric_limits<float>::quiet_NaN()), r);
+			r = select_ps(_mm_cmpeq_ps(x, kInf), x, r);
+			return select_ps(_mm_cmpunord_ps(x, x), x, r);
+		}
+
+		inline __m128 pow_ps(__m128 x, __m128 y) {
+			__m128 r = exp_ps(_mm_mul_ps(y, log_ps(x)));
+			__m128 zero = select_ps(_mm_cmpgt_ps(y, _mm_setzero_ps()), _mm_setzero_ps(), _mm_set1_ps(std::numeric_limits<float>::infinity()));
+			r = select_ps(_mm_cmpeq_ps(x, _mm_setzero_ps()), zero, r);
+			return select_ps(_mm_cmpeq_ps(y, _mm_setzero_ps()), _mm_set1_ps(1.0f), r);
+		}
+
+		inline __m128 atan_ps(__m128 x) {
+			__m128 a = abs_ps(x);
+			__m128 inverse = _mm_cmpgt_ps(a, _mm_set1_ps(1.0f));
+			__m128 z = select_ps(inverse, _mm_div_ps(_mm_set1_ps(1.0f), a), a);
+			__m128 z2 = _mm_mul_ps(z, z);
+			__m128 p = _mm_set1_ps(0.0028662257f);
+			p = madd_ps(p, z2, -0.0161657367f);
+			p = madd_ps(p, z2, 0.0429096138f);
+			p = madd_ps(p, z2, -0.0752896400f);
+			p = madd_ps(p, z2, 0.1065626393f);
+			p = madd_ps(p, z2, -0.1420889944f);
+			p = madd_ps(p, z2, 0.1999355085f);
+			p = madd_ps(p, z2, -0.3333314528f);
+			p = madd_ps(p, z2, 1.0f);
+			p = _mm_mul_ps(p, z);
+			__m128 r = select_ps(inverse, _mm_sub_ps(_mm_set1_ps(1.57079633f), p), p);
+			return copysign_ps(r, x);
+		}
+
+		inline __m128 acos_ps(__m128 x) {
+			__m128 a = _mm_min_ps(abs_ps(x), _mm_set1_ps(1.0f));
+			__m128 p = _mm_set1_ps(-0.0012624911f);
+			p = madd_ps(p, a, 0.0066700901f);
+			p = madd_ps(p, a, -0.0170881256f);
+			p = madd_ps(p, a, 0.0308918810f);
+			p = madd_ps(p, a, -0.0501743046f);
+			p = madd_ps(p, a, 0.0889789874f);
+			p = madd_ps(p, a, -0.2145988016f);
+			p = madd_ps(p, a, 1.5707963050f);
+			__m128 r = _mm_mul_ps(_mm_sqrt_ps(_mm_sub_ps(_mm_set1_ps(1.0f), a)), p);
+			r = select_ps(_mm_cmplt_ps(x, _mm_setzero_ps()), _mm_sub_ps(_mm_set1_ps(3.14159265f), r), r);
+			return select_ps(_mm_cmpnle_ps(abs_ps(x), _mm_set1_ps(1.0f)), _mm_set1_ps(std::numeric_limits<float>::quiet_NaN()), r);
+		}
+
+		inline __m128 sin_ps(__m128 x) {
+			__m128i k = _mm_cvtps_epi32(_mm_mul_ps(x, _mm_set1_ps(0.318309886f)));
+			__m128 fk = _mm_cvtepi32_ps(k);
+			__m128 r = _mm_sub_ps(x, _mm_mul_ps(fk, _mm_set1_ps(3.140625f)));
+			r = _mm_sub_ps(r, _mm_mul_ps(fk, _mm_set1_ps(9.67653590e-4f)));
+			__m128 r2 = _mm_mul_ps(r, r);
+			__m128 p = _mm_set1_ps(-1.0f / 39916800.0f);
+			p = madd_ps(p, r2, 1.0f / 362880.0f);
+			p = madd_ps(p, r2, -1.0f / 5040.0f);
+			p = madd_ps(p, r2, 1.0f / 120.0f);
+			p = madd_ps(p, r2, -1.0f / 6.0f);
+			p = madd_ps(p, r2, 1.0f);
+			p = _mm_mul_ps(p, r);
+			__m128 s = _mm_xor_ps(p, _mm_castsi128_ps(_mm_slli_epi32(k, 31)));
+			__m128 finite = _mm_cmple_ps(abs_ps(x), _mm_set1_ps(std::numeric_limits<float>::max()));
+			return select_ps(finite, s, _mm_set1_ps(std::numeric_limits<float>::quiet_NaN()));
+		}
+
+		inline __m128 erf_ps(__m128 x) {
+			__m128 a = abs_ps(x);
+
+			__m128 a2 = _mm_mul_ps(a, a);
+			__m128 s = _mm_set1_ps(-1.0f / 1320.0f);
+			s = madd_ps(s, a2, 1.0f / 216.0f);
+			s = madd_ps(s, a2, -1.0f / 42.0f);
+			s = madd_ps(s, a2, 1.0f / 10.0f);
+			s = madd_ps(s, a2, -1.0f / 3.0f);
+			s = madd_ps(s, a2, 1.0f);
+			s = _mm_mul_ps(_mm_mul_ps(s, a), _mm_set1_ps(1.12837917f));
+
+			__m128 t = _mm_div_ps(_mm_set1_ps(1.0f), madd_ps(a, _mm_set1_ps(0.3275911f), 1.0f));
+			__m128 p = _mm_set1_ps(1.061405429f);
+			p = madd_ps(p, t, -1.453152027f);
+			p = madd_ps(p, t, 1.421413741f);
+			p = madd_ps(p, t, -0.284496736f);
+			p = madd_ps(p, t, 0.254829592f);
+			p = _mm_mul_ps(p, t);
+			__m128 l = _mm_sub_ps(_mm_set1_ps(1.0f), _mm_mul_ps(p, exp_ps(_mm_sub_ps(_mm_setzero_ps(), a2))));
+
+			return copysign_ps(select_ps(_mm_cmplt_ps(a, _mm_set1_ps(0.5f)), s, l), x);
+		}
+	}
+
+	/*
+	 microfacet, velvet まわりで使う超越関数。ENABLE_FAST_MATH が 1 なら float 版だけ fast_math の近似, 0 なら std の関数。
+	 double 版は常に std にする。double の BSDF の式 (lambda_beckmann の erf など) は打ち消し合うので、float に丸めると精度が残らない
+	*/
+	namespace fmath {
+#if ENABLE_FAST_MATH
+#define RT_FMATH_FUNCTION(name) \
+		inline float name(float x) { return fast_math::name(x); } \
+		inline double name(double x) { return std::name(x); }
+#else
+#define RT_FMATH_FUNCTION(name) \
+		inline float name(float x) { return std::name(x); } \
+		inline double name(double x) { return std::name(x); }
+#endif
+		RT_FMATH_FUNCTION(exp)
+		RT_FMATH_FUNCTION(log)
+		RT_FMATH_FUNCTION(atan)
+		RT_FMATH_FUNCTION(acos)
+		RT_FMATH_FUNCTION(sin)
+		RT_FMATH_FUNCTION(erf)
+#undef RT_FMATH_FUNCTION
+
+#if ENABLE_FAST_MATH
+		inline float pow(float x, float y) { return fast_math::pow(x, y); }
+#else
+		inline float pow(float x, float y) { return std::pow(x, y); }
+#endif
+		inline double pow(double x, double y) { return std::pow(x, y); }
+	}
+}
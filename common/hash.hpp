@@ -0,0 +1,17 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+namespace rt {
+	// FNV-1a
+	// http://www.isthe.com/chongo/tech/comp/fnv/
+	inline uint64_t fnv1a64(const void *data, size_t bytes, uint64_t hash = 14695981039346656037ULL) {
+		const uint8_t *p = static_cast<const uint8_t *>(data);
+		for (size_t i = 0; i < bytes; ++i) {
+			hash ^= p[i];
+			hash *= 1099511628211ULL;
+		}
+		return hash;
+	}
+}
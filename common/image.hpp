@@ -0,0 +1,137 @@
+#pragma once
+
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <new>
+#include <utility>
+#include <vector>
+#include <glm/glm.hpp>
+
+#include "peseudo_random.hpp"
+
+namespace rt {
+	// 引数無しの construct で何もしない allocator
+	// 確保しただけのページには触れないので、最初に書き込んだスレッドの NUMA ノードに置かれる
+	template <class T>
+	struct UninitializedAllocator : std::allocator<T> {
+		template <class U>
+		struct rebind {
+			using other = UninitializedAllocator<U>;
+		};
+		UninitializedAllocator() {}
+		template <class U>
+		UninitializedAllocator(const UninitializedAllocator<U> &) {}
+
+		template <class U>
+		void construct(U *) {
+		}
+		template <class U, class... Args>
+		void construct(U *p, Args&&... args) {
+			::new((void *)p) U(std::forward<Args>(args)...);
+		}
+	};
+
+	class Image {
+	public:
+		struct Pixel {
+			int sample = 0;
+			glm::dvec3 color;
+		};
+
+		// 保存などのためにレンダリングから切り離した累積バッファのコピー
+		struct Snapshot {
+			int width = 0;
+			int height = 0;
+			int steps = 0;
+			std::vector<Pixel> pixels;
+
+			const Pixel *pixel(int x, int y) const {
+				return pixels.data() + y * width + x;
+			}
+		};
+
+		Image(int w, int h) :_w(w), _h(h), _pixels(h * w, Pixel()), _randoms(h * w, XoroshiroPlus128()) {
+			XoroshiroPlus128 random;
+			for (int i = 0; i < _randoms.size(); ++i) {
+				_randoms[i] = random;
+				random.jump();
+			}
+		}
+		int width() const {
+			return _w;
+		}
+		int height() const {
+			return _h;
+		}
+
+		void add(int x, int y, glm::dvec3 c) {
+			int index = y * _w + x;
+			_pixels[index].color += c;
+			_pixels[index].sample++;
+		}
+
+		// 累積だけを捨てる。乱数はそのまま続ける
+		void clear() {
+			std::fill(_pixels.begin(), _pixels.end(), Pixel());
+		}
+
+		const Pixel *pixel(int x, int y) const {
+			return _pixels.data() + y * _w + x;
+		}
+		Pixel *pixel(int x, int y) {
+			return _pixels.data() + y * _w + x;
+		}
+
+		PeseudoRandom *random(int x, int y) {
+			return _randoms.data() + y * _w + x;
+		}
+
+		// 累積バッファ全体 (width * height)
+		Pixel *pixels() {
+			return _pixels.data();
+		}
+		const Pixel *pixels() const {
+			return _pixels.data();
+		}
+		XoroshiroPlus128 &xoroshiro(int index) {
+			return _randoms[index];
+		}
+		const XoroshiroPlus128 &xoroshiro(int index) const {
+			return _randoms[index];
+		}
+
+		// ステップの合間に呼ぶこと。Pixel は POD なので単純なメモリコピーで済む
+		void snapshot(Snapshot *s, int steps) const {
+			s->width = _w;
+			s->height = _h;
+			s->steps = steps;
+			s->pixels.assign(_pixels.begin(), _pixels.end());
+		}
+
+		/*
+		 累積バッファと乱数を確保し直し、rows(y0, y1) の中で最初の書き込みを行う。
+		 schedule は各行の範囲をその行をレンダリングするスレッドで rows を呼ぶ関数で、
+		 NUMA ノードごとに呼べば、それぞれの行のページがそのノードのメモリに置かれる
+		*/
+		void place(const std::function<void(const std::function<void(int, int)> &)> &schedule) {
+			PixelArray pixels(_pixels.size());
+			RandomArray randoms(_randoms.size());
+			schedule([&](int y0, int y1) {
+				for (int i = y0 * _w; i < y1 * _w; ++i) {
+					::new((void *)&pixels[i]) Pixel(_pixels[i]);
+					::new((void *)&randoms[i]) XoroshiroPlus128(_randoms[i]);
+				}
+			});
+			_pixels.swap(pixels);
+			_randoms.swap(randoms);
+		}
+	private:
+		int _w = 0;
+		int _h = 0;
+		using PixelArray = std::vector<Pixel, UninitializedAllocator<Pixel>>;
+		using RandomArray = std::vector<XoroshiroPlus128, UninitializedAllocator<XoroshiroPlus128>>;
+		PixelArray _pixels;
+		RandomArray _randoms;
+	};
+}
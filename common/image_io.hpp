@@ -0,0 +1,304 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cctype>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <zlib.h>
+#include <tbb/tbb.h>
+
+// openFrameworks に依存しない画像の書き出し
+namespace rt {
+	namespace image_io_details {
+		inline void putU32BE(uint8_t *dst, uint32_t value) {
+			dst[0] = (uint8_t)(value >> 24);
+			dst[1] = (uint8_t)(value >> 16);
+			dst[2] = (uint8_t)(value >> 8);
+			dst[3] = (uint8_t)(value);
+		}
+
+		// http://www.libpng.org/pub/png/spec/1.2/PNG-Structure.html
+		inline bool writePNGChunk(FILE *fp, const char *type, const uint8_t *data, uint32_t size) {
+			uint8_t header[8];
+			putU32BE(header, size);
+			for (int i = 0; i < 4; ++i) {
+				header[4 + i] = (uint8_t)type[i];
+			}
+			uLong crc = crc32(0L, header + 4, 4);
+			if (size) {
+				crc = crc32(crc, data, size);
+			}
+			uint8_t footer[4];
+			putU32BE(footer, (uint32_t)crc);
+
+			bool ok = fwrite(header, 1, sizeof(header), fp) == sizeof(header);
+			if (size) {
+				ok = ok && fwrite(data, 1, size, fp) == size;
+			}
+			ok = ok && fwrite(footer, 1, sizeof(footer), fp) == sizeof(footer);
+			return ok;
+		}
+
+		// round to nearest even
+		inline uint16_t floatToHalf(float value) {
+			uint32_t f;
+			memcpy(&f, &value, sizeof(f));
+			uint32_t sign = (f >> 16) & 0x8000;
+			f &= 0x7FFFFFFF;
+
+			// 65536 以上, inf, nan
+			if (0x47800000 <= f) {
+				return (uint16_t)(sign | (0x7F800000 < f ? 0x7E00 : 0x7C00));
+			}
+			// 2^-14 未満は half の非正規化数
+			if (f < 0x38800000) {
+				if (f < 0x33000000) {
+					return (uint16_t)sign;
+				}
+				uint32_t e = f >> 23;
+				uint32_t m = (f & 0x007FFFFF) | 0x00800000;
+				uint32_t shift = 126 - e;
+				uint32_t h = m >> shift;
+				uint32_t rem = m & ((1u << shift) - 1);
+				uint32_t halfway = 1u << (shift - 1);
+				if (halfway < rem || (rem == halfway && (h & 1))) {
+					h++;
+				}
+				return (uint16_t)(sign | h);
+			}
+			uint32_t h = (f >> 13) - (112 << 10);
+			uint32_t rem = f & 0x1FFF;
+			if (0x1000 < rem || (rem == 0x1000 && (h & 1))) {
+				h++;
+			}
+			return (uint16_t)(sign | h);
+		}
+
+		inline void putAttribute(std::vector<uint8_t> &dst, const char *name, const char *type, const void *value, uint32_t size) {
+			dst.insert(dst.end(), name, name + strlen(name) + 1);
+			dst.insert(dst.end(), type, type + strlen(type) + 1);
+			const uint8_t *sizeBytes = reinterpret_cast<const uint8_t *>(&size);
+			dst.insert(dst.end(), sizeBytes, sizeBytes + 4);
+			const uint8_t *bytes = static_cast<const uint8_t *>(value);
+			dst.insert(dst.end(), bytes, bytes + size);
+		}
+
+		// OpenEXR の ZIP 圧縮
+		// バイトを偶数番目, 奇数番目に並べ替え, 差分をとってから zlib で圧縮する
+		// 圧縮しても小さくならない場合は生データを格納する決まり
+		inline std::vector<uint8_t> exrZipCompress(const std::vector<uint8_t> &raw) {
+			size_t n = raw.size();
+			std::vector<uint8_t> tmp(n);
+			{
+				uint8_t *t1 = tmp.data();
+				uint8_t *t2 = tmp.data() + (n + 1) / 2;
+				for (size_t i = 0; i < n; ++i) {
+					if (i % 2 == 0) {
+						*(t1++) = raw[i];
+					}
+					else {
+						*(t2++) = raw[i];
+					}
+				}
+			}
+			{
+				int p = n ? tmp[0] : 0;
+				for (size_t i = 1; i < n; ++i) {
+					int d = int(tmp[i]) - p + (128 + 256);
+					p = tmp[i];
+					tmp[i] = (uint8_t)d;
+				}
+			}
+			uLongf compressedSize = compressBound((uLong)n);
+			std::vector<uint8_t> compressed(compressedSize);
+			if (compress(compressed.data(), &compressedSize, tmp.data(), (uLong)n) != Z_OK || n <= compressedSize) {
+				return raw;
+			}
+			compressed.resize(compressedSize);
+			return compressed;
+		}
+	}
+
+	// rgb: 8bit RGB, width * height * 3, 上の行から
+	inline bool writePNG(const char *filename, int width, int height, const uint8_t *rgb, int compressionLevel = Z_DEFAULT_COMPRESSION) {
+		using namespace image_io_details;
+
+		// 各行の先頭にフィルタ種別が入る。Sub フィルタは安価でそこそこ圧縮が効く
+		int stride = width * 3;
+		std::vector<uint8_t> filtered((size_t)(stride + 1) * height);
+		for (int y = 0; y < height; ++y) {
+			const uint8_t *src = rgb + (size_t)stride * y;
+			uint8_t *dst = filtered.data() + (size_t)(stride + 1) * y;
+			dst[0] = 1;
+			for (int i = 0; i < stride; ++i) {
+				uint8_t left = i < 3 ? 0 : src[i - 3];
+				dst[1 + i] = (uint8_t)(src[i] - left);
+			}
+		}
+
+		uLongf compressedSize = compressBound((uLong)filtered.size());
+		std::vector<uint8_t> compressed(compressedSize);
+		if (compress2(compressed.data(), &compressedSize, filtered.data(), (uLong)filtered.size(), compressionLevel) != Z_OK) {
+			printf("png compression failed, %s\n", filename);
+			return false;
+		}
+
+		FILE *fp = fopen(filename, "wb");
+		if (fp == nullptr) {
+			printf("can't open %s\n", filename);
+			return false;
+		}
+
+		static const uint8_t kSignature[8] = { 0x89, 0x50, 0x4E, 0x47, 0x0D, 0x0A, 0x1A, 0x0A };
+		uint8_t ihdr[13];
+		putU32BE(ihdr, (uint32_t)width);
+		putU32BE(ihdr + 4, (uint32_t)height);
+		ihdr[8] = 8;  // bit depth
+		ihdr[9] = 2;  // color type: RGB
+		ihdr[10] = 0; // compression
+		ihdr[11] = 0; // filter
+		ihdr[12] = 0; // interlace
+
+		bool ok = fwrite(kSignature, 1, sizeof(kSignature), fp) == sizeof(kSignature);
+		ok = ok && writePNGChunk(fp, "IHDR", ihdr, sizeof(ihdr));
+		ok = ok && writePNGChunk(fp, "IDAT", compressed.data(), (uint32_t)compressedSize);
+		ok = ok && writePNGChunk(fp, "IEND", nullptr, 0);
+		fclose(fp);
+
+		if (ok == false) {
+			printf("write failed, %s\n", filename);
+		}
+		return ok;
+	}
+
+	// rgb: float RGB, width * height * 3, 上の行から
+	// http://www.pauldebevec.com/Research/HDR/PFM/
+	inline bool writePFM(const char *filename, int width, int height, const float *rgb) {
+		FILE *fp = fopen(filename, "wb");
+		if (fp == nullptr) {
+			printf("can't open %s\n", filename);
+			return false;
+		}
+		// scale < 0 はリトルエンディアン、行は下から
+		bool ok = 0 < fprintf(fp, "PF\n%d %d\n-1.0\n", width, height);
+		for (int y = height - 1; 0 <= y && ok; --y) {
+			size_t n = (size_t)width * 3;
+			ok = fwrite(rgb + n * y, sizeof(float), n, fp) == n;
+		}
+		fclose(fp);
+
+		if (ok == false) {
+			printf("write failed, %s\n", filename);
+		}
+		return ok;
+	}
+
+	// rgb: float RGB, width * height * 3, 上の行から
+	// half float, ZIP 圧縮 (16 行ごとのブロック) の scanline EXR を書き出す。ブロックの圧縮は並列に行う
+	// https://www.openexr.com/documentation/openexrfilelayout.pdf
+	inline bool writeEXR(const char *filename, int width, int height, const float *rgb) {
+		using namespace image_io_details;
+
+		const int kLinesPerBlock = 16;
+		const int kZipCompression = 3;
+
+		std::vector<uint8_t> header;
+		{
+			const uint8_t magicAndVersion[8] = { 0x76, 0x2F, 0x31, 0x01, 2, 0, 0, 0 };
+			header.insert(header.end(), magicAndVersion, magicAndVersion + 8);
+
+			// チャンネルはアルファベット順
+			std::vector<uint8_t> chlist;
+			for (const char *name : { "B", "G", "R" }) {
+				chlist.insert(chlist.end(), name, name + strlen(name) + 1);
+				int32_t channel[4] = { 1 /* HALF */, 0 /* pLinear + reserved */, 1, 1 };
+				const uint8_t *bytes = reinterpret_cast<const uint8_t *>(channel);
+				chlist.insert(chlist.end(), bytes, bytes + sizeof(channel));
+			}
+			chlist.push_back(0);
+
+			uint8_t compression = kZipCompression;
+			int32_t window[4] = { 0, 0, width - 1, height - 1 };
+			uint8_t lineOrder = 0;
+			float pixelAspectRatio = 1.0f;
+			float screenWindowCenter[2] = { 0.0f, 0.0f };
+			float screenWindowWidth = 1.0f;
+
+			putAttribute(header, "channels", "chlist", chlist.data(), (uint32_t)chlist.size());
+			putAttribute(header, "compression", "compression", &compression, 1);
+			putAttribute(header, "dataWindow", "box2i", window, sizeof(window));
+			putAttribute(header, "displayWindow", "box2i", window, sizeof(window));
+			putAttribute(header, "lineOrder", "lineOrder", &lineOrder, 1);
+			putAttribute(header, "pixelAspectRatio", "float", &pixelAspectRatio, 4);
+			putAttribute(header, "screenWindowCenter", "v2f", screenWindowCenter, sizeof(screenWindowCenter));
+			putAttribute(header, "screenWindowWidth", "float", &screenWindowWidth, 4);
+			header.push_back(0);
+		}
+
+		int blockCount = (height + kLinesPerBlock - 1) / kLinesPerBlock;
+		std::vector<std::vector<uint8_t>> blocks(blockCount);
+		tbb::parallel_for(tbb::blocked_range<int>(0, blockCount), [&](const tbb::blocked_range<int> &range) {
+			for (int block = range.begin(); block < range.end(); ++block) {
+				int y0 = block * kLinesPerBlock;
+				int y1 = std::min(y0 + kLinesPerBlock, height);
+
+				// 行ごとに B, G, R のチャンネルが並ぶ
+				std::vector<uint8_t> raw((size_t)(y1 - y0) * width * 3 * sizeof(uint16_t));
+				uint16_t *dst = reinterpret_cast<uint16_t *>(raw.data());
+				for (int y = y0; y < y1; ++y) {
+					const float *src = rgb + (size_t)y * width * 3;
+					for (int c = 2; 0 <= c; --c) {
+						for (int x = 0; x < width; ++x) {
+							*(dst++) = floatToHalf(src[x * 3 + c]);
+						}
+					}
+				}
+				blocks[block] = exrZipCompress(raw);
+			}
+		});
+
+		FILE *fp = fopen(filename, "wb");
+		if (fp == nullptr) {
+			printf("can't open %s\n", filename);
+			return false;
+		}
+
+		std::vector<uint64_t> offsets(blockCount);
+		uint64_t offset = header.size() + sizeof(uint64_t) * blockCount;
+		for (int block = 0; block < blockCount; ++block) {
+			offsets[block] = offset;
+			offset += sizeof(int32_t) * 2 + blocks[block].size();
+		}
+
+		bool ok = fwrite(header.data(), 1, header.size(), fp) == header.size();
+		ok = ok && fwrite(offsets.data(), sizeof(uint64_t), offsets.size(), fp) == offsets.size();
+		for (int block = 0; block < blockCount && ok; ++block) {
+			int32_t chunkHeader[2] = { block * kLinesPerBlock, (int32_t)blocks[block].size() };
+			ok = fwrite(chunkHeader, sizeof(chunkHeader), 1, fp) == 1;
+			ok = ok && fwrite(blocks[block].data(), 1, blocks[block].size(), fp) == blocks[block].size();
+		}
+		fclose(fp);
+
+		if (ok == false) {
+			printf("write failed, %s\n", filename);
+		}
+		return ok;
+	}
+
+	inline bool hasExtension(const std::string &filename, const char *extension) {
+		size_t n = strlen(extension);
+		if (filename.size() < n) {
+			return false;
+		}
+		for (size_t i = 0; i < n; ++i) {
+			if (tolower(filename[filename.size() - n + i]) != tolower(extension[i])) {
+				return false;
+			}
+		}
+		return true;
+	}
+}
@@ -0,0 +1,111 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <unordered_map>
+#include <vector>
+
+#include <glm/glm.hpp>
+#include <glm/ext.hpp>
+
+#include "render_object.hpp"
+
+namespace rt {
+	// 光るプリミティブがあるか。光源の sampler はワールド座標の三角形ごとに作るので、光るジオメトリはインスタンスにしない
+	inline bool hasEmission(const Geometry &geometry) {
+		for (const Material &material : geometry.materials) {
+			auto lambertian = dynamic_cast<const LambertianMaterial *>(material.get());
+			if (lambertian && lambertian->isEmission()) {
+				return true;
+			}
+		}
+		return false;
+	}
+
+	/*
+	 geometry が prototype を transform で置いたものと同じか。
+	 頂点番号とアトリビュートは完全に一致し、点は float の精度 (大きさに対する相対 1e-5) で一致すること
+	*/
+	inline bool sameInstance(const Geometry &prototype, const Geometry &geometry, const glm::dmat4 &transform) {
+		if (prototype.points.size() != geometry.points.size() ||
+			prototype.indices.size() != geometry.indices.size() ||
+			prototype.quads.size() != geometry.quads.size() ||
+			prototype.primitives.size() != geometry.primitives.size() ||
+			prototype.materialHash != geometry.materialHash) {
+			return false;
+		}
+		if (prototype.indices.empty() == false && memcmp(prototype.indices.data(), geometry.indices.data(), sizeof(glm::uvec3) * geometry.indices.size()) != 0) {
+			return false;
+		}
+		if (prototype.quads.empty() == false && memcmp(prototype.quads.data(), geometry.quads.data(), sizeof(glm::uvec4) * geometry.quads.size()) != 0) {
+			return false;
+		}
+
+		double extent = 0.0;
+		for (const Geometry::Point &point : geometry.points) {
+			for (int k = 0; k < 3; ++k) {
+				extent = std::max(extent, (double)std::abs(point.P[k]));
+			}
+		}
+		double tolerance = 1.0e-5 * std::max(extent, 1.0e-6);
+
+		glm::dmat3 linear(transform);
+		glm::dvec3 translation(transform[3]);
+		for (size_t j = 0; j < geometry.points.size(); ++j) {
+			glm::dvec3 p = linear * glm::dvec3(prototype.points[j].P) + translation;
+			glm::dvec3 q = glm::dvec3(geometry.points[j].P);
+			if (tolerance < glm::length(p - q)) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	/*
+	 中身 (ローカル座標での形とアトリビュート) が同じジオメトリを見つけ、先に出てきたものをプロトタイプにして、
+	 残りをそのインスタンスにする。インスタンスの点, 頂点番号, プリミティブとマテリアルの表は手放す。
+	 contentHash で候補を絞り、sameInstance で実際に比べる (ハッシュの衝突や、変換が潰れている場合は別のジオメトリのまま)。
+	 名前と shapeHash, materialHash は残るので、リロードの差分検出はそのまま使える。
+	 インスタンスにしたジオメトリの数を返す
+	*/
+	inline int instanceDuplicates(Scene &scene) {
+		std::unordered_map<uint64_t, std::vector<int>> prototypes;
+		int instanced = 0;
+		for (int i = 0; i < scene.geometries.size(); ++i) {
+			Geometry &geometry = scene.geometries[i];
+			if (geometry.contentHash == 0 || 0 <= geometry.prototype || geometry.primitives.empty() || hasEmission(geometry)) {
+				continue;
+			}
+			std::vector<int> &candidates = prototypes[geometry.contentHash];
+			int found = -1;
+			glm::dmat4 transform;
+			for (int candidate : candidates) {
+				const Geometry &prototype = scene.geometries[candidate];
+				if (std::abs(glm::determinant(glm::dmat3(prototype.localToWorld))) < 1.0e-12) {
+					continue;
+				}
+				transform = geometry.localToWorld * glm::inverse(prototype.localToWorld);
+				if (sameInstance(prototype, geometry, transform)) {
+					found = candidate;
+					break;
+				}
+			}
+			if (found < 0) {
+				candidates.push_back(i);
+				continue;
+			}
+
+			geometry.prototype = found;
+			geometry.transform = transform;
+			std::vector<Geometry::Point>().swap(geometry.points);
+			std::vector<glm::uvec3>().swap(geometry.indices);
+			std::vector<glm::uvec4>().swap(geometry.quads);
+			std::vector<Geometry::Primitive>().swap(geometry.primitives);
+			std::vector<Material>().swap(geometry.materials);
+			instanced++;
+		}
+		return instanced;
+	}
+}
@@ -3,6 +3,9 @@
 #include <atomic>
 #include <tbb/tbb.h>
 #include "scene_interface.hpp"
+#include "material_parameters.hpp"
+#include "image.hpp"
+#include "numa.hpp"
 
 #define DEBUG_MODE 0
 
@@ -10,48 +13,6 @@
 #define ENABLE_NEE_MIS 1
 
 namespace rt {
-	class Image {
-	public:
-		Image(int w, int h) :_w(w), _h(h), _pixels(h * w), _randoms(h * w) {
-			XoroshiroPlus128 random;
-			for (int i = 0; i < _randoms.size(); ++i) {
-				_randoms[i] = random;
-				random.jump();
-			}
-		}
-		int width() const {
-			return _w;
-		}
-		int height() const {
-			return _h;
-		}
-
-		void add(int x, int y, glm::dvec3 c) {
-			int index = y * _w + x;
-			_pixels[index].color += c;
-			_pixels[index].sample++;
-		}
-
-		struct Pixel {
-			int sample = 0;
-			glm::dvec3 color;
-		};
-		const Pixel *pixel(int x, int y) const {
-			return _pixels.data() + y * _w + x;
-		}
-		Pixel *pixel(int x, int y) {
-			return _pixels.data() + y * _w + x;
-		}
-
-		PeseudoRandom *random(int x, int y) {
-			return _randoms.data() + y * _w + x;
-		}
-	private:
-		int _w = 0;
-		int _h = 0;
-		std::vector<Pixel> _pixels;
-		std::vector<XoroshiroPlus128> _randoms;
-	};
 	inline double GTerm(double cosThetaP, double cosThetaQ, double r2) {
 		return cosThetaP * cosThetaQ / r2;
 	}
@@ -63,7 +24,12 @@ namespace rt {
 		return glm::any(glm::greaterThanEqual(c, glm::dvec3(eps)));
 	}
 
-	inline glm::dvec3 radiance(const rt::SceneInterface &scene, glm::dvec3 ro, glm::dvec3 rd, PeseudoRandom *random) {
+	/*
+	 lightSamples: NEE で選んだ光源から 1 つの頂点あたり引く数 (1 から kMaxLightSamples)。
+	   2 以上なら IDirectSampler::sample_batch でまとめて引き、平均する。
+	   MIS の重みでは光源側の pdf を lightSamples 倍にする (光源に当たったときも同じ)
+	*/
+	inline glm::dvec3 radiance(const rt::SceneInterface &scene, glm::dvec3 ro, glm::dvec3 rd, PeseudoRandom *random, int lightSamples = 1) {
 		const double kSceneEPS = scene.adaptiveEps();
 		// const double kSceneEPS = 1.0e-6;
 		const double kValueEPS = 1.0e-6;
@@ -100,51 +66,54 @@ namespace rt {
 
 					double p_choice = 0.0;
 					auto sampler = selector.choice(random, &p_choice);
-					glm::dvec3 q;
-					glm::dvec3 n;
-					glm::dvec3 Le;
-					double pdf_area = 0.0;
-					sampler->sample(random, p, &q, &n, &Le, &pdf_area);
+					LightSample samples[kMaxLightSamples];
+					sampler->sample_batch(random, p, lightSamples, samples);
 
-					double pqDistance2 = glm::distance2(p, q);
-					glm::dvec3 wi = (q - p) / std::sqrt(pqDistance2);
+					for (int j = 0; j < lightSamples; ++j) {
+						const glm::dvec3 &q = samples[j].p;
+						const glm::dvec3 &n = samples[j].n;
+						double pdf_area = samples[j].pdf_area;
 
-					double cosThetaP = glm::dot(m->Ng, wi);
+						double pqDistance2 = glm::distance2(p, q);
+						glm::dvec3 wi = (q - p) / std::sqrt(pqDistance2);
 
-					// 裏側に光源があるので早期棄却
-					if (cosThetaP < 0.0) {
-						return;
-					}
+						double cosThetaP = glm::dot(m->Ng, wi);
 
-					// これはcan_sampleにおいてすでに裏面でないことが保証されている
-					double cosThetaQ = glm::dot(n, -wi);
+						// 裏側に光源があるので早期棄却
+						if (cosThetaP < 0.0) {
+							continue;
+						}
 
-					glm::dvec3 bxdf = m->bxdf(wo, wi);
+						// これはcan_sampleにおいてすでに裏面でないことが保証されている
+						double cosThetaQ = glm::dot(n, -wi);
 
-					double g = GTerm(cosThetaP, cosThetaQ, pqDistance2);
+						glm::dvec3 bxdf = m->stochastic_bxdf(random, wo, wi);
 
-					glm::dvec3 contribution = T * bxdf * Le * g / pdf_area / p_choice;
+						double g = GTerm(cosThetaP, cosThetaQ, pqDistance2);
 
-					if (has_value(contribution, kValueEPS) == false) {
-						return;
-					}
-					if (scene.occluded(p + m->Ng * kSceneEPS, q + n * kSceneEPS)) {
-						return;
-					}
+						glm::dvec3 contribution = T * bxdf * samples[j].Le * g / pdf_area / p_choice / (double)lightSamples;
+
+						if (has_value(contribution, kValueEPS / lightSamples) == false) {
+							continue;
+						}
+						if (scene.occluded(p + m->Ng * kSceneEPS, q + n * kSceneEPS)) {
+							continue;
+						}
 #if ENABLE_NEE_MIS
-					double this_pdf = pdf_area * p_choice;
-					double other_pdf = m->pdf(wo, wi) * glm::dot(-n, wi) / pqDistance2;
-					// double mis_weight = this_pdf / (this_pdf + other_pdf);
-					double mis_weight = this_pdf * this_pdf / (this_pdf * this_pdf + other_pdf * other_pdf);
-					Lo += contribution * mis_weight;
+						double this_pdf = pdf_area * p_choice * lightSamples;
+						double other_pdf = m->pdf(wo, wi) * glm::dot(-n, wi) / pqDistance2;
+						// double mis_weight = this_pdf / (this_pdf + other_pdf);
+						double mis_weight = this_pdf * this_pdf / (this_pdf * this_pdf + other_pdf * other_pdf);
+						Lo += contribution * mis_weight;
 #else
-					Lo += contribution;
+						Lo += contribution;
 #endif
+					}
 				};
 				nee();
 #endif
 				glm::dvec3 wi = m->sample(random, wo);
-				glm::dvec3 bxdf = m->bxdf(wo, wi);
+				glm::dvec3 bxdf = m->stochastic_bxdf(random, wo, wi);
 				glm::dvec3 emission = m->emission(wo);
 				double pdf = m->pdf(wo, wi);
 				double NoI = glm::dot(m->Ng, wi);
@@ -173,7 +142,7 @@ namespace rt {
 
 								double r = (double)tmin;
 								double this_pdf = previous_pdf * glm::dot(m->Ng, wo) / (r * r);
-								double other_pdf = sampler->pdf_area(previous_m->p, m->p) * selector.p(sampler);
+								double other_pdf = sampler->pdf_area(previous_m->p, m->p) * selector.p(sampler) * lightSamples;
 								// double mis_weight = this_pdf * this_pdf / (this_pdf + other_pdf);
 								double mis_weight = this_pdf * this_pdf / (this_pdf * this_pdf + other_pdf * other_pdf);
 								mis = true;
@@ -217,26 +186,233 @@ namespace rt {
 		return Lo;
 	}
 
+	// 再投影した履歴の重みの上限 (サンプル数相当), パスごとの減衰
+	const double kMaxHistoryWeight = 16.0;
+	const double kHistoryDecay = 0.8;
+
+	// 再投影を受け入れる深度の相対誤差, 法線の内積
+	const double kReprojectionDepthTolerance = 0.02;
+	const double kReprojectionNormalTolerance = 0.9;
+
 	class PTRenderer {
 	public:
-		PTRenderer(std::shared_ptr<rt::Scene> scene)
+		// dynamicScene: reloadScene で差分更新するなら true (SceneInterface の dynamic)
+		PTRenderer(std::shared_ptr<rt::Scene> scene, bool dynamicScene = false)
+			: PTRenderer(scene, std::make_shared<rt::SceneInterface>(scene, dynamicScene)) {
+		}
+
+		// 読み込みと並行して作った SceneInterface を使う
+		PTRenderer(std::shared_ptr<rt::Scene> scene, std::shared_ptr<rt::SceneInterface> sceneInterface)
 			: _scene(scene)
-			, _sceneInterface(new rt::SceneInterface(scene))
+			, _sceneInterface(sceneInterface)
+			, _camera(scene->camera)
 			, _image(scene->camera.imageWidth(), scene->camera.imageHeight()) {
 			_badSampleNanCount = 0;
 			_badSampleInfCount = 0;
 			_badSampleNegativeCount = 0;
 			_badSampleFireflyCount = 0;
 		}
+
+		/*
+		 NUMA ノードごとに行のバンドを割り当てる。累積バッファと乱数はそのノードで確保し直す。
+		 replicateScene ではノードごとに Embree のシーンを作り、BVH もそれぞれのノードに置く (メモリはノード数倍)。
+		 光源の sampler はすべてのノードで primary のものを共有する (MIS が sampler のポインタで光源を探すため)
+		 結果は通常の step と同じになる
+		*/
+		PTRenderer(std::shared_ptr<rt::Scene> scene, std::shared_ptr<NumaArenas> numa, bool replicateScene, bool dynamicScene = false)
+			: PTRenderer(scene, numa, replicateScene, std::make_shared<rt::SceneInterface>(scene, dynamicScene)) {
+		}
+		PTRenderer(std::shared_ptr<rt::Scene> scene, std::shared_ptr<NumaArenas> numa, bool replicateScene, std::shared_ptr<rt::SceneInterface> sceneInterface)
+			: PTRenderer(scene, sceneInterface) {
+			_numa = numa;
+			int height = _camera.imageHeight();
+			_image.place([&](const std::function<void(int, int)> &rows) {
+				_numa->parallelRows(height, [&](int node, const tbb::blocked_range<int> &range) {
+					rows(range.begin(), range.end());
+				});
+			});
+
+			_sceneReplicas.resize(_numa->nodeCount(), _sceneInterface);
+			if (replicateScene) {
+				for (int node = 1; node < _numa->nodeCount(); ++node) {
+					_numa->execute(node, [&]() {
+						_sceneReplicas[node] = std::make_shared<rt::SceneInterface>(_scene, *_sceneInterface);
+					});
+				}
+			}
+		}
+
+		/*
+		 読み直したシーンに差し替えて累積をやり直す。変わったジオメトリだけを Embree に反映する。
+		 カメラは今のものを使い続ける。
+		 解像度が変わった, ジオメトリの構成が変わったなどで差分更新できないときは false を返し、何も変えない。
+		 そのときは PTRenderer を作り直すこと
+		 animation: シーケンスの次のフレーム。形の変化は refit で済ませ、カメラも next のものにする
+		*/
+		bool reloadScene(std::shared_ptr<rt::Scene> next, bool animation = false) {
+			if (next->camera.imageWidth() != _image.width() || next->camera.imageHeight() != _image.height()) {
+				return false;
+			}
+			rt::SceneInterface::ReloadStatistics stats;
+			if (_sceneInterface->reload(next, &stats, animation) == false) {
+				return false;
+			}
+			printf("reload scene: %d shape (%d refit), %d material, %d unchanged, %f seconds\n", stats.shapeChanged, stats.refitted, stats.materialChanged, stats.unchanged, stats.seconds);
+
+			_scene = next;
+			if (animation) {
+				_camera = next->camera;
+			}
+			for (int node = 1; node < _sceneReplicas.size(); ++node) {
+				if (_sceneReplicas[node] != _sceneInterface) {
+					_numa->execute(node, [&]() {
+						_sceneReplicas[node] = std::make_shared<rt::SceneInterface>(_scene, *_sceneInterface);
+					});
+				}
+			}
+
+			restart();
+			return true;
+		}
+
+		/*
+		 マテリアルのパラメータをその場で書き換えて累積をやり直す。Embree のシーンはそのまま。
+		 拡散面の放射が変わりうるときは、そのジオメトリの光源の sampler だけを作り直す
+		 インスタンスのマテリアルはプロトタイプのものなので、同じプロトタイプのものすべてが変わる
+		*/
+		void editMaterial(MaterialEdit edit) {
+			if (edit.geometry < 0 || _scene->geometries.size() <= edit.geometry) {
+				return;
+			}
+			if (0 <= _scene->geometries[edit.geometry].prototype) {
+				edit.geometry = _scene->geometries[edit.geometry].prototype;
+			}
+			if (applyMaterialEdit(_scene->geometries[edit.geometry], edit) == 0) {
+				return;
+			}
+			if (edit.material == "LambertianMaterial") {
+				// レプリカは primary の sampler を共有しているので、一覧だけ取り直す
+				_sceneInterface->rebuildSamplers(edit.geometry);
+				for (int node = 1; node < _sceneReplicas.size(); ++node) {
+					if (_sceneReplicas[node] != _sceneInterface) {
+						_sceneReplicas[node]->shareSamplers();
+					}
+				}
+			}
+			restart();
+		}
+
+		/*
+		 カメラを差し替えて累積をやり直す。シーンは作り直さない。解像度は変えられない。
+		 直後の 2 パスは 1/8, 1/4 の解像度で描いて拡大したものを表示し、動かした直後にすぐ絵が出るようにする。
+		 プレビューのサンプルは累積には入れない
+		*/
+		void setCamera(const Camera &camera) {
+			if (_temporalReprojection) {
+				reproject(camera);
+			}
+			_camera = camera;
+			_image.clear();
+			_steps = 0;
+			_previewLevel = _previewEnabled ? 0 : kPreviewLevels;
+			updateDisplay();
+		}
+		const Camera &camera() const {
+			return _camera;
+		}
+
+		// 次の step の解像度の縮小率。1 なら通常のパス
+		int previewScale() const {
+			return _previewLevel < kPreviewLevels ? kCoarsestPreviewScale >> _previewLevel : 1;
+		}
+
+		// NEE で 1 つの頂点あたり光源から引く数 (radiance の lightSamples)。変えたら累積をやり直す
+		void setLightSamples(int lightSamples) {
+			_lightSamples = glm::clamp(lightSamples, 1, kMaxLightSamples);
+			restart();
+		}
+		int lightSamples() const {
+			return _lightSamples;
+		}
+
+		// 画面に出さないレンダリング (シーケンスなど) ではプレビューのパスは無駄なので切る
+		void setPreviewEnabled(bool enabled) {
+			_previewEnabled = enabled;
+			if (enabled == false) {
+				_previewLevel = kPreviewLevels;
+				_displayPreview = false;
+			}
+		}
+
+		/*
+		 カメラを動かしたときに、それまでの表示を新しい視点に再投影して使う。
+		 ピクセルごとに最初に当たった点 (位置, 法線, 深度) を持っておき、
+		 新しい視点の最初の交点を古い視点に投影して、深度と法線が一致するものだけを履歴として引き継ぐ。
+		 履歴は表示にだけ混ぜ、重みはパスごとに減衰させるので、止まっていれば偏りの無い結果に収束する
+		*/
+		void setTemporalReprojection(bool enabled) {
+			_temporalReprojection = enabled;
+			if (enabled == false) {
+				_surfaces.clear();
+				_history.clear();
+				_historyScale = 0.0;
+				updateDisplay();
+			}
+		}
+		bool temporalReprojection() const {
+			return _temporalReprojection;
+		}
+
+		// 表示用。プレビュー中は拡大したプレビュー、再投影した履歴があればそれを混ぜたものを返す
+		const Image::Pixel *displayPixels() const {
+			if (0.0 < _historyScale) {
+				return _display.data();
+			}
+			return _displayPreview ? _preview.data() : _image.pixels();
+		}
+
+		/*
+		 裏で作っていた高品質の BVH が出来ていれば差し替える。primary が差し替わったら true。
+		 レプリカもそれぞれ自分の BVH を作っているので、出来たものから差し替える。
+		 トレースしているスレッドが無いとき (パスやユニットの合間) に呼ぶこと
+		*/
+		bool swapUpgradedScenes() {
+			for (int node = 1; node < _sceneReplicas.size(); ++node) {
+				if (_sceneReplicas[node] != _sceneInterface) {
+					_sceneReplicas[node]->swapUpgradedScene();
+				}
+			}
+			if (_sceneInterface->swapUpgradedScene()) {
+				printf("bvh upgraded to high quality, %f seconds in background\n", _sceneInterface->buildStatistics().upgradeSeconds);
+				return true;
+			}
+			return false;
+		}
+
 		void step() {
+			swapUpgradedScenes();
+			if (_previewLevel < kPreviewLevels) {
+				stepPreview(previewScale());
+				_previewLevel++;
+				updateDisplay();
+				return;
+			}
+			_displayPreview = false;
+
+			stepFull();
+
+			decayHistory();
+			updateDisplay();
+		}
+		void stepFull() {
 			_steps++;
 
 #if DEBUG_MODE
 			int focusX = 200;
 			int focusY = 200;
 
-			for (int y = 0; y < _scene->camera.imageHeight(); ++y) {
-				for (int x = 0; x < _scene->camera.imageWidth(); ++x) {
+			for (int y = 0; y < _camera.imageHeight(); ++y) {
+				for (int x = 0; x < _camera.imageWidth(); ++x) {
 					if (x != focusX || y != focusY) {
 						continue;
 					}
@@ -244,46 +420,255 @@ namespace rt {
 
 					glm::dvec3 o;
 					glm::dvec3 d;
-					_scene->camera.sampleRay(random, x, y, &o, &d);
+					_camera.sampleRay(random, x, y, &o, &d);
 
-					auto r = radiance(*_sceneInterface, o, d, random);
+					auto r = radiance(*_sceneInterface, o, d, random, _lightSamples);
 					_image.add(x, y, r);
 				}
 			}
 #else
-			tbb::parallel_for(tbb::blocked_range<int>(0, _scene->camera.imageHeight()), [&](const tbb::blocked_range<int> &range) {
+			if (_numa) {
+				_numa->parallelRows(_camera.imageHeight(), [&](int node, const tbb::blocked_range<int> &range) {
+					stepRows(*_sceneReplicas[node], range);
+				});
+			}
+			else {
+				tbb::parallel_for(tbb::blocked_range<int>(0, _camera.imageHeight()), [&](const tbb::blocked_range<int> &range) {
+					stepRows(*_sceneInterface, range);
+				});
+			}
+#endif
+		}
+		void stepRows(const rt::SceneInterface &sceneInterface, const tbb::blocked_range<int> &range) {
+			for (int y = range.begin(); y < range.end(); ++y) {
+				for (int x = 0; x < _camera.imageWidth(); ++x) {
+					PeseudoRandom *random = _image.random(x, y);
+					glm::dvec3 o;
+					glm::dvec3 d;
+					_camera.sampleRay(random, x, y, &o, &d);
+
+					auto r = radiance(sceneInterface, o, d, random, _lightSamples);
+					_image.add(x, y, rejectBadSample(r));
+				}
+			}
+		}
+
+		struct Surface {
+			glm::dvec3 P;
+			glm::dvec3 Ng;
+			double depth = -1.0; // 負なら何にも当たっていない
+		};
+		struct History {
+			glm::dvec3 color;
+			double weight = 0.0;
+		};
+
+		void buildSurfaces(const Camera &camera, std::vector<Surface> *surfaces) const {
+			int w = camera.imageWidth();
+			int h = camera.imageHeight();
+			surfaces->resize((size_t)w * h);
+			tbb::parallel_for(tbb::blocked_range<int>(0, h), [&](const tbb::blocked_range<int> &range) {
 				for (int y = range.begin(); y < range.end(); ++y) {
-					for (int x = 0; x < _scene->camera.imageWidth(); ++x) {
-						PeseudoRandom *random = _image.random(x, y);
+					for (int x = 0; x < w; ++x) {
 						glm::dvec3 o;
 						glm::dvec3 d;
-						_scene->camera.sampleRay(random, x, y, &o, &d);
+						camera.pixelCenterRay(x, y, &o, &d);
+
+						Surface &s = (*surfaces)[(size_t)y * w + x];
+						Material m;
+						float tmin = 0.0f;
+						if (_sceneInterface->intersect(o, d, &m, &tmin)) {
+							s.P = o + d * (double)tmin;
+							s.Ng = m->Ng;
+							s.depth = tmin;
+						}
+						else {
+							s.depth = -1.0;
+						}
+					}
+				}
+			});
+		}
 
-						auto r = radiance(*_sceneInterface, o, d, random);
+		void reproject(const Camera &next) {
+			int w = _camera.imageWidth();
+			int h = _camera.imageHeight();
+			size_t n = (size_t)w * h;
+			if (_surfaces.size() != n) {
+				buildSurfaces(_camera, &_surfaces);
+			}
 
-						for (int i = 0; i < r.length(); ++i) {
-							if (glm::isnan(r[i])) {
-								_badSampleNanCount++;
-								r[i] = 0.0;
-							}
-							else if (glm::isfinite(r[i]) == false) {
-								_badSampleInfCount++;
-								r[i] = 0.0;
-							}
-							else if (r[i] < 0.0) {
-								_badSampleNegativeCount++;
-								r[i] = 0.0;
-							}
-							if (10000.0 < r[i]) {
-								_badSampleFireflyCount++;
-								r[i] = 0.0;
-							}
+			// 今の視点で表示している色と、その信頼度
+			std::vector<History> previous(n);
+			const Image::Pixel *display = displayPixels();
+			tbb::parallel_for(tbb::blocked_range<size_t>(0, n), [&](const tbb::blocked_range<size_t> &range) {
+				for (size_t i = range.begin(); i < range.end(); ++i) {
+					const Image::Pixel &p = display[i];
+					double weight = _image.pixels()[i].sample;
+					if (i < _history.size()) {
+						weight += _history[i].weight * _historyScale;
+					}
+					if (0 < p.sample) {
+						previous[i].color = p.color / (double)p.sample;
+						previous[i].weight = std::min(weight, kMaxHistoryWeight);
+					}
+				}
+			});
+
+			std::vector<Surface> nextSurfaces;
+			buildSurfaces(next, &nextSurfaces);
+
+			_history.assign(n, History());
+			glm::dvec3 previousOrigin = _camera.origin();
+			tbb::parallel_for(tbb::blocked_range<int>(0, h), [&](const tbb::blocked_range<int> &range) {
+				for (int y = range.begin(); y < range.end(); ++y) {
+					for (int x = 0; x < w; ++x) {
+						const Surface &s = nextSurfaces[(size_t)y * w + x];
+						if (s.depth < 0.0) {
+							continue;
+						}
+						int px, py;
+						if (_camera.projectToPixel(s.P, &px, &py) == false) {
+							continue;
+						}
+						double depth = glm::distance(previousOrigin, s.P);
+						const Surface &ps = _surfaces[(size_t)py * w + px];
+
+						// 隠れていた, または別の面
+						if (ps.depth < 0.0 || kReprojectionDepthTolerance * depth < std::abs(ps.depth - depth)) {
+							continue;
+						}
+						if (glm::dot(ps.Ng, s.Ng) < kReprojectionNormalTolerance) {
+							continue;
 						}
-						_image.add(x, y, r);
+						_history[(size_t)y * w + x] = previous[(size_t)py * w + px];
+					}
+				}
+			});
+			_surfaces.swap(nextSurfaces);
+			_historyScale = 1.0;
+		}
+
+		void decayHistory() {
+			if (_historyScale <= 0.0) {
+				return;
+			}
+			_historyScale *= kHistoryDecay;
+			if (_historyScale * kMaxHistoryWeight < 1.0e-3) {
+				_history.clear();
+				_historyScale = 0.0;
+			}
+		}
+
+		// 累積と再投影の履歴を捨てて、プレビューからやり直す。カメラはそのまま
+		void restart() {
+			_image.clear();
+			_steps = 0;
+			_previewLevel = _previewEnabled ? 0 : kPreviewLevels;
+			_surfaces.clear();
+			_history.clear();
+			_historyScale = 0.0;
+			updateDisplay();
+		}
+
+		// 履歴と、プレビュー または 累積を混ぜる
+		void updateDisplay() {
+			if (_historyScale <= 0.0) {
+				return;
+			}
+			size_t n = _history.size();
+			_display.resize(n);
+			const Image::Pixel *current = _displayPreview ? _preview.data() : _image.pixels();
+			tbb::parallel_for(tbb::blocked_range<size_t>(0, n), [&](const tbb::blocked_range<size_t> &range) {
+				for (size_t i = range.begin(); i < range.end(); ++i) {
+					const History &h = _history[i];
+					const Image::Pixel &c = current[i];
+					Image::Pixel &d = _display[i];
+					if (_displayPreview) {
+						// プレビューは履歴の無いところを埋めるだけ
+						d = 0.0 < h.weight ? Image::Pixel{ 1, h.color } : c;
+						continue;
+					}
+					double weight = h.weight * _historyScale;
+					d.sample = 1;
+					d.color = 0.0 < weight + c.sample ? (h.color * weight + c.color) / (weight + c.sample) : glm::dvec3(0.0);
+				}
+			});
+		}
+
+		// scale x scale ピクセルごとに 1 サンプル描き、バイリニアで全解像度に拡大する
+		void stepPreview(int scale) {
+			int w = _camera.imageWidth();
+			int h = _camera.imageHeight();
+			int cw = (w + scale - 1) / scale;
+			int ch = (h + scale - 1) / scale;
+			_previewCoarse.resize((size_t)cw * ch);
+			tbb::parallel_for(tbb::blocked_range<int>(0, ch), [&](const tbb::blocked_range<int> &range) {
+				for (int cy = range.begin(); cy < range.end(); ++cy) {
+					for (int cx = 0; cx < cw; ++cx) {
+						int x = std::min(cx * scale + scale / 2, w - 1);
+						int y = std::min(cy * scale + scale / 2, h - 1);
+						PeseudoRandom *random = _image.random(x, y);
+						glm::dvec3 o;
+						glm::dvec3 d;
+						_camera.sampleRay(random, x, y, &o, &d);
+
+						auto r = radiance(*_sceneInterface, o, d, random, _lightSamples);
+						_previewCoarse[cy * cw + cx] = rejectBadSample(r);
+					}
+				}
+			});
+
+			_preview.resize((size_t)w * h);
+			tbb::parallel_for(tbb::blocked_range<int>(0, h), [&](const tbb::blocked_range<int> &range) {
+				for (int y = range.begin(); y < range.end(); ++y) {
+					double fy = glm::clamp((y + 0.5) / scale - 0.5, 0.0, (double)(ch - 1));
+					int y0 = (int)fy;
+					int y1 = std::min(y0 + 1, ch - 1);
+					double ty = fy - y0;
+					for (int x = 0; x < w; ++x) {
+						double fx = glm::clamp((x + 0.5) / scale - 0.5, 0.0, (double)(cw - 1));
+						int x0 = (int)fx;
+						int x1 = std::min(x0 + 1, cw - 1);
+						double tx = fx - x0;
+						glm::dvec3 top = glm::mix(_previewCoarse[y0 * cw + x0], _previewCoarse[y0 * cw + x1], tx);
+						glm::dvec3 bottom = glm::mix(_previewCoarse[y1 * cw + x0], _previewCoarse[y1 * cw + x1], tx);
+						Image::Pixel &p = _preview[(size_t)y * w + x];
+						p.sample = 1;
+						p.color = glm::mix(top, bottom, ty);
+					}
+				}
+			});
+			_displayPreview = true;
+		}
+
+		/*
+		 分散レンダリング用
+		 ピクセルごとの乱数列を引き継がず、(ピクセル, パス) ごとに乱数を初期化する。
+		 どのプロセスがどのパスを担当しても、同じパスからは同じサンプルが得られる。
+		 行 [y0, y1) をパス pass の分だけ accum (幅 * (y1 - y0)) に加える
+		*/
+		static uint64_t passSeed(int pixelIndex, int pass) {
+			return ((uint64_t)(uint32_t)pass << 32 | (uint32_t)pixelIndex) * 0x9E3779B97F4A7C15ULL;
+		}
+		void renderPass(int pass, int y0, int y1, Image::Pixel *accum) {
+			int w = _camera.imageWidth();
+			tbb::parallel_for(tbb::blocked_range<int>(y0, y1), [&](const tbb::blocked_range<int> &range) {
+				for (int y = range.begin(); y < range.end(); ++y) {
+					for (int x = 0; x < w; ++x) {
+						XoroshiroPlus128 random(passSeed(y * w + x, pass));
+						glm::dvec3 o;
+						glm::dvec3 d;
+						_camera.sampleRay(&random, x, y, &o, &d);
+
+						auto r = radiance(*_sceneInterface, o, d, &random, _lightSamples);
+
+						Image::Pixel &p = accum[(y - y0) * w + x];
+						p.color += rejectBadSample(r);
+						p.sample++;
 					}
 				}
 			});
-#endif
 		}
 		int stepCount() const {
 			return _steps;
@@ -306,13 +691,56 @@ namespace rt {
 			return _badSampleFireflyCount.load();
 		}
 
+		glm::dvec3 rejectBadSample(glm::dvec3 r) {
+			for (int i = 0; i < r.length(); ++i) {
+				if (glm::isnan(r[i])) {
+					_badSampleNanCount++;
+					r[i] = 0.0;
+				}
+				else if (glm::isfinite(r[i]) == false) {
+					_badSampleInfCount++;
+					r[i] = 0.0;
+				}
+				else if (r[i] < 0.0) {
+					_badSampleNegativeCount++;
+					r[i] = 0.0;
+				}
+				if (10000.0 < r[i]) {
+					_badSampleFireflyCount++;
+					r[i] = 0.0;
+				}
+			}
+			return r;
+		}
+
 		std::shared_ptr<rt::Scene> _scene;
 		std::shared_ptr<rt::SceneInterface> _sceneInterface;
+		std::shared_ptr<NumaArenas> _numa;
+		Camera _camera;
+		std::vector<std::shared_ptr<rt::SceneInterface>> _sceneReplicas;
 		Image _image;
 		int _steps = 0;
+		int _lightSamples = 1;
 		std::atomic<int> _badSampleNanCount;
 		std::atomic<int> _badSampleInfCount;
 		std::atomic<int> _badSampleNegativeCount;
 		std::atomic<int> _badSampleFireflyCount;
+
+		// 1/8, 1/4
+		enum {
+			kPreviewLevels = 2,
+			kCoarsestPreviewScale = 8
+		};
+		int _previewLevel = kPreviewLevels;
+		bool _previewEnabled = true;
+		bool _displayPreview = false;
+		std::vector<glm::dvec3> _previewCoarse;
+		std::vector<Image::Pixel> _preview;
+
+		bool _temporalReprojection = false;
+		std::vector<Surface> _surfaces;
+		std::vector<History> _history;
+		double _historyScale = 0.0;
+		std::vector<Image::Pixel> _display;
 	};
 }
\ No newline at end of file
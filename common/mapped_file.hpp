@@ -0,0 +1,174 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <cstddef>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace rt {
+	/*
+	 ファイル全体を読み書き可能 (または読み込み専用) でメモリにマップする。
+	 flush は指定範囲をディスクへ書き戻す。ページ境界への切り下げはここで行う
+	*/
+	class MappedFile {
+	public:
+		enum Mode {
+			ReadOnly,
+			ReadWrite
+		};
+
+		MappedFile() {}
+		~MappedFile() {
+			close();
+		}
+		MappedFile(const MappedFile &) = delete;
+		void operator=(const MappedFile &) = delete;
+
+		// ReadWrite で size > 0 のときはファイルをそのサイズに合わせる (無ければ作る)
+		// size == 0 のときは既存のファイルのサイズをそのまま使う
+		bool open(const char *path, Mode mode, size_t size = 0) {
+			close();
+			_mode = mode;
+#ifdef _WIN32
+			DWORD access = mode == ReadWrite ? (GENERIC_READ | GENERIC_WRITE) : GENERIC_READ;
+			DWORD creation = mode == ReadWrite ? OPEN_ALWAYS : OPEN_EXISTING;
+			_file = CreateFileA(path, access, FILE_SHARE_READ, nullptr, creation, FILE_ATTRIBUTE_NORMAL, nullptr);
+			if (_file == INVALID_HANDLE_VALUE) {
+				return false;
+			}
+			LARGE_INTEGER fileSize;
+			GetFileSizeEx(_file, &fileSize);
+			if (size == 0) {
+				size = (size_t)fileSize.QuadPart;
+			}
+			if (size == 0) {
+				close();
+				return false;
+			}
+			LARGE_INTEGER mappingSize;
+			mappingSize.QuadPart = (LONGLONG)size;
+			_mapping = CreateFileMappingA(_file, nullptr, mode == ReadWrite ? PAGE_READWRITE : PAGE_READONLY, mappingSize.HighPart, mappingSize.LowPart, nullptr);
+			if (_mapping == nullptr) {
+				close();
+				return false;
+			}
+			_data = MapViewOfFile(_mapping, mode == ReadWrite ? FILE_MAP_WRITE : FILE_MAP_READ, 0, 0, size);
+#else
+			_fd = ::open(path, mode == ReadWrite ? (O_RDWR | O_CREAT) : O_RDONLY, 0644);
+			if (_fd < 0) {
+				return false;
+			}
+			struct stat st;
+			if (fstat(_fd, &st) != 0) {
+				close();
+				return false;
+			}
+			if (size == 0) {
+				size = (size_t)st.st_size;
+			}
+			else if ((size_t)st.st_size != size && ftruncate(_fd, (off_t)size) != 0) {
+				close();
+				return false;
+			}
+			if (size == 0) {
+				close();
+				return false;
+			}
+			void *p = mmap(nullptr, size, mode == ReadWrite ? (PROT_READ | PROT_WRITE) : PROT_READ, MAP_SHARED, _fd, 0);
+			_data = p == MAP_FAILED ? nullptr : p;
+#endif
+			if (_data == nullptr) {
+				close();
+				return false;
+			}
+			_size = size;
+			return true;
+		}
+
+		void close() {
+#ifdef _WIN32
+			if (_data) {
+				UnmapViewOfFile(_data);
+			}
+			if (_mapping) {
+				CloseHandle(_mapping);
+			}
+			if (_file != INVALID_HANDLE_VALUE) {
+				CloseHandle(_file);
+			}
+			_mapping = nullptr;
+			_file = INVALID_HANDLE_VALUE;
+#else
+			if (_data) {
+				munmap(_data, _size);
+			}
+			if (0 <= _fd) {
+				::close(_fd);
+			}
+			_fd = -1;
+#endif
+			_data = nullptr;
+			_size = 0;
+		}
+
+		// [offset, offset + bytes) をディスクに書き戻し、終わるまで待つ
+		bool flush(size_t offset, size_t bytes) {
+			if (_data == nullptr || _mode != ReadWrite || bytes == 0) {
+				return true;
+			}
+			size_t page = pageSize();
+			size_t begin = offset / page * page;
+			size_t end = offset + bytes;
+			uint8_t *p = static_cast<uint8_t *>(_data) + begin;
+#ifdef _WIN32
+			return FlushViewOfFile(p, end - begin) && FlushFileBuffers(_file);
+#else
+			return msync(p, end - begin, MS_SYNC) == 0;
+#endif
+		}
+
+		static size_t pageSize() {
+#ifdef _WIN32
+			SYSTEM_INFO info;
+			GetSystemInfo(&info);
+			return info.dwAllocationGranularity;
+#else
+			return (size_t)sysconf(_SC_PAGESIZE);
+#endif
+		}
+
+		bool isOpen() const {
+			return _data != nullptr;
+		}
+		void *data() {
+			return _data;
+		}
+		const void *data() const {
+			return _data;
+		}
+		size_t size() const {
+			return _size;
+		}
+	private:
+		Mode _mode = ReadOnly;
+		void *_data = nullptr;
+		size_t _size = 0;
+#ifdef _WIN32
+		HANDLE _file = INVALID_HANDLE_VALUE;
+		HANDLE _mapping = nullptr;
+#else
+		int _fd = -1;
+#endif
+	};
+}
@@ -1,21 +1,19 @@
 ﻿#pragma once
 
-#define ENABLE_HEITZ 0
-
 #include <glm/glm.hpp>
 #include <glm/ext.hpp>
 
 #include <functional>
 #include <strict_variant/variant.hpp>
 #include "peseudo_random.hpp"
+#include "hash.hpp"
 #include "microfacet.hpp"
 #include "coordinate.hpp"
-#if ENABLE_HEITZ
-#include "MicrosurfaceScattering.h"
-#endif
+#include "microsurface_scattering.hpp"
 #include "stack_based_polymophic_value.hpp"
 #include "direct_sampler.hpp"
 #include "randomsampler.hpp"
+#include "bxdf_batch.hpp"
 
 namespace rt {
 	// R: 650nm
@@ -93,11 +91,31 @@ namespace rt {
 		// evaluate bxdf
 		virtual glm::dvec3 bxdf(const glm::dvec3 &wo, const glm::dvec3 &wi) const = 0;
 
+		// 乱数を使って bxdf を評価する。確率的に (不偏に) 評価するマテリアルだけが上書きする
+		virtual glm::dvec3 stochastic_bxdf(PeseudoRandom *random, const glm::dvec3 &wo, const glm::dvec3 &wi) const {
+			return bxdf(wo, wi);
+		}
+
 		// sample wi
 		virtual glm::dvec3 sample(PeseudoRandom *random, const glm::dvec3 &wo) const = 0;
 
 		// pdf for wi
 		virtual double pdf(const glm::dvec3 &wo, const glm::dvec3 &sampled_wi) const = 0;
+
+		// batch->count 本の (wo, wi) の bxdf をまとめて評価して batch->bxdf に入れる
+		// 既定はひとつずつ bxdf を呼ぶだけ。float でベクトル化できるマテリアルは上書きする
+		virtual void bxdf_batch(BxdfBatch *batch) const {
+			for (int k = 0; k < batch->count; ++k) {
+				batch->setBxdf(k, bxdf(batch->directionO(k), batch->directionI(k)));
+			}
+		}
+
+		// batch->count 本の (wo, wi) の pdf をまとめて評価して batch->pdf に入れる
+		virtual void pdf_batch(BxdfBatch *batch) const {
+			for (int k = 0; k < batch->count; ++k) {
+				batch->pdf[k] = (float)pdf(batch->directionO(k), batch->directionI(k));
+			}
+		}
 	};
 
 	struct NoSample {
@@ -152,6 +170,25 @@ namespace rt {
 		virtual double pdf(const glm::dvec3 &wo, const glm::dvec3 &sampled_wi) const override {
 			return LambertianSampler::pdf(sampled_wi, Ng);
 		}
+		void bxdf_batch(BxdfBatch *batch) const override {
+			float nx = (float)Ng.x, ny = (float)Ng.y, nz = (float)Ng.z;
+			float r[3] = { (float)(R.r * glm::one_over_pi<double>()), (float)(R.g * glm::one_over_pi<double>()), (float)(R.b * glm::one_over_pi<double>()) };
+			for (int k = 0; k < kBxdfBatchWidth; ++k) {
+				float NoO = nx * batch->wo[0][k] + ny * batch->wo[1][k] + nz * batch->wo[2][k];
+				float NoI = nx * batch->wi[0][k] + ny * batch->wi[1][k] + nz * batch->wi[2][k];
+				bool valid = 0.0f <= NoO && 0.0f <= NoI;
+				for (int j = 0; j < 3; ++j) {
+					batch->bxdf[j][k] = valid ? r[j] : 0.0f;
+				}
+			}
+		}
+		void pdf_batch(BxdfBatch *batch) const override {
+			float nx = (float)Ng.x, ny = (float)Ng.y, nz = (float)Ng.z;
+			for (int k = 0; k < kBxdfBatchWidth; ++k) {
+				float NoI = nx * batch->wi[0][k] + ny * batch->wi[1][k] + nz * batch->wi[2][k];
+				batch->pdf[k] = NoI < 0.0f ? 0.0f : NoI * glm::one_over_pi<float>();
+			}
+		}
 	};
 
 	class SpecularMaterial : public IMaterial {
@@ -217,7 +254,72 @@ namespace rt {
 		}
 	};
 
-	class MicrofacetConductorMaterial : public IMaterial {
+	/*
+	 マイクロファセット分布のポリシー。D, G2, 可視法線のサンプリングと、対応する Coupled BRDF のテーブルをまとめる。
+	 float の多重定義は bxdf_batch 用
+	*/
+	struct BeckmannVCavity {
+		typedef CoupledBRDFConductor Conductor;
+		typedef CoupledBRDFDielectrics Dielectrics;
+
+		static double D(const glm::dvec3 &Ng, const glm::dvec3 &h, double alpha) {
+			return D_Beckmann(Ng, h, alpha);
+		}
+		static double G2(const glm::dvec3 &wi, const glm::dvec3 &wo, const glm::dvec3 &h, const glm::dvec3 &Ng, double alpha) {
+			return G2_v_cavity(wi, wo, h, Ng);
+		}
+		static glm::dvec3 sample(PeseudoRandom *random, double alpha, const glm::dvec3 &wo, const glm::dvec3 &Ng) {
+			return VCavityBeckmannVisibleNormalSampler::sample(random, alpha, wo, Ng);
+		}
+		static double pdf(const glm::dvec3 &wi, double alpha, const glm::dvec3 &wo, const glm::dvec3 &Ng) {
+			return VCavityBeckmannVisibleNormalSampler::pdf(wi, alpha, wo, Ng);
+		}
+
+		static float D(float NoH, float a) {
+			return bxdf_batch_details::D_Beckmann(NoH, a);
+		}
+		static float G2(float NoH, float NoO, float NoI, float HoO, float a) {
+			return bxdf_batch_details::G2_v_cavity(NoH, NoO, NoI, HoO);
+		}
+		static float pdf(float NoH, float NoO, float HoO, float a) {
+			return bxdf_batch_details::vcavity_beckmann_pdf(NoH, NoO, HoO, a);
+		}
+	};
+
+	/*
+	 GGX 版。D は GGX, G2 は height-correlated Smith で、可視法線を解析的にサンプリングする
+	 (GGXVisibleNormalSampler)。V-cavity の Beckmann 版より 1 サンプルが安く、粗い金属での分散も小さい
+	*/
+	struct GGXHeightCorrelated {
+		typedef CoupledBRDFConductorGGX Conductor;
+		typedef CoupledBRDFDielectricsGGX Dielectrics;
+
+		static double D(const glm::dvec3 &Ng, const glm::dvec3 &h, double alpha) {
+			return D_GGX(Ng, h, alpha);
+		}
+		static double G2(const glm::dvec3 &wi, const glm::dvec3 &wo, const glm::dvec3 &h, const glm::dvec3 &Ng, double alpha) {
+			return G2_height_correlated_ggx(wi, wo, h, Ng, alpha);
+		}
+		static glm::dvec3 sample(PeseudoRandom *random, double alpha, const glm::dvec3 &wo, const glm::dvec3 &Ng) {
+			return GGXVisibleNormalSampler::sample(random, alpha, wo, Ng);
+		}
+		static double pdf(const glm::dvec3 &wi, double alpha, const glm::dvec3 &wo, const glm::dvec3 &Ng) {
+			return GGXVisibleNormalSampler::pdf(wi, alpha, wo, Ng);
+		}
+
+		static float D(float NoH, float a) {
+			return bxdf_batch_details::D_GGX(NoH, a);
+		}
+		static float G2(float NoH, float NoO, float NoI, float HoO, float a) {
+			return bxdf_batch_details::G2_height_correlated_ggx(NoO, NoI, HoO, a);
+		}
+		static float pdf(float NoH, float NoO, float HoO, float a) {
+			return bxdf_batch_details::ggx_visible_normal_pdf(NoH, NoO, HoO, a);
+		}
+	};
+
+	template <class Distribution>
+	class MicrofacetConductorMaterialT : public IMaterial {
 	public:
 		bool useFresnel = true;
 		double alpha = 0.3;
@@ -241,9 +343,8 @@ namespace rt {
 			}
 
 			glm::dvec3 h = glm::normalize(wi + wo);
-			double d = D_Beckmann(Ng, h, alpha);
-			// double g = G2_height_correlated_beckmann(wi, wo, h, Ng, alpha);
-			double g = G2_v_cavity(wi, wo, h, Ng);
+			double d = Distribution::D(Ng, h, alpha);
+			double g = Distribution::G2(wi, wo, h, Ng, alpha);
 
 			double brdf_without_f = d * g / (4.0 * cos_term_wo * cos_term_wi);
 
@@ -262,32 +363,47 @@ namespace rt {
 			return brdf;
 		}
 		glm::dvec3 sample(PeseudoRandom *random, const glm::dvec3 &wo) const override {
-			return VCavityBeckmannVisibleNormalSampler::sample(random, alpha, wo, Ng);
+			return Distribution::sample(random, alpha, wo, Ng);
 		}
 		double pdf(const glm::dvec3 &wo, const glm::dvec3 &sampled_wi) const override {
-			return VCavityBeckmannVisibleNormalSampler::pdf(sampled_wi, alpha, wo, Ng);
+			return Distribution::pdf(sampled_wi, alpha, wo, Ng);
+		}
+		void bxdf_batch(BxdfBatch *batch) const override {
+			using namespace bxdf_batch_details;
+			Cosines c(*batch, Ng);
+			float a = (float)alpha;
+			float n[3] = { (float)eta.r, (float)eta.g, (float)eta.b };
+			float kk[3] = { (float)k.r, (float)k.g, (float)k.b };
+			for (int i = 0; i < kBxdfBatchWidth; ++i) {
+				float d = Distribution::D(c.NoH[i], a);
+				float g = Distribution::G2(c.NoH[i], c.NoO[i], c.NoI[i], c.HoO[i], a);
+				float brdf_without_f = d * g / (4.0f * c.NoO[i] * c.NoI[i]);
+				bool valid = 0.0f < c.NoO[i] && 0.0f < c.NoI[i];
+				for (int j = 0; j < 3; ++j) {
+					float f = useFresnel ? fresnel_unpolarized(n[j], kk[j], c.HoO[i]) : 1.0f;
+					batch->bxdf[j][i] = valid ? f * brdf_without_f : 0.0f;
+				}
+			}
+		}
+		void pdf_batch(BxdfBatch *batch) const override {
+			using namespace bxdf_batch_details;
+			Cosines c(*batch, Ng);
+			float a = (float)alpha;
+			for (int i = 0; i < kBxdfBatchWidth; ++i) {
+				batch->pdf[i] = Distribution::pdf(c.NoH[i], c.NoO[i], c.HoO[i], a);
+			}
 		}
-		
-		//glm::dvec3 sample(PeseudoRandom *random, const glm::dvec3 &wo) const override {
-		//	return BeckmannImportanceSampler::sample(random, alpha, wo, Ng);
-		//}
-		//double pdf(const glm::dvec3 &wo, const glm::dvec3 &sampled_wi) const override {
-		//	return BeckmannImportanceSampler::pdf(sampled_wi, alpha, wo, Ng);
-		//}
 	};
-	class MicrofacetCoupledConductorMaterial : public IMaterial {
+
+	template <class Distribution>
+	class MicrofacetCoupledConductorMaterialT : public IMaterial {
 	public:
+		typedef typename Distribution::Conductor Coupled;
+
 		bool useFresnel = true;
 		double alpha = 0.3;
-		//glm::dvec3 eta = glm::dvec3(0.15557, 0.42415, 1.3821);
-		//glm::dvec3 k = glm::dvec3(3.6024, 2.4721, 1.9155);
-		//glm::dvec3 eta = glm::dvec3(0.23780, 1.0066, 1.2404);
-		//glm::dvec3 k = glm::dvec3(3.6264, 2.5823, 2.3929);
 		glm::dvec3 eta = glm::dvec3();
 		glm::dvec3 k = glm::dvec3();
-		//bool can_direct_sampling() const override {
-		//	return kDirectSamplingAlphaThreashold <= alpha;
-		//}
 
 		glm::dvec3 bxdf(const glm::dvec3 &wo, const glm::dvec3 &wi) const override {
 			double cos_term_wo = glm::dot(Ng, wo);
@@ -299,25 +415,14 @@ namespace rt {
 			}
 
 			glm::dvec3 h = glm::normalize(wi + wo);
-			double d = D_Beckmann(Ng, h, alpha);
-			double g = G2_v_cavity(wi, wo, h, Ng);
+			double d = Distribution::D(Ng, h, alpha);
+			double g = Distribution::G2(wi, wo, h, Ng, alpha);
 
 			double brdf_without_f = d * g / (4.0 * cos_term_wo * cos_term_wi);
 
 			glm::dvec3 brdf_spec = glm::dvec3(brdf_without_f);
 
-			// R: 650nm
-			// G: 550nm
-			// B: 450nm
-
-			// gold
-			// glm::dvec3 eta = glm::dvec3(0.15557, 0.42415, 1.3821);
-			// glm::dvec3 k = glm::dvec3(3.6024, 2.4721, 1.9155);
-
-			// copper (Cu)
-			//glm::dvec3 eta = glm::dvec3(0.23780, 1.0066, 1.2404);
-			//glm::dvec3 k = glm::dvec3(3.6264, 2.5823, 2.3929);
-
+			glm::dvec3 kLambda = glm::dvec3(1.0);
 			if (useFresnel) {
 				double cosThetaFresnel = glm::dot(h, wo);
 				glm::dvec3 f = glm::dvec3(
@@ -326,48 +431,31 @@ namespace rt {
 					fresnel_unpolarized(eta.b, k.b, cosThetaFresnel)
 				);
 				brdf_spec = f * brdf_without_f;
-			}
-
-			glm::dvec3 kLambda = glm::dvec3(1.0);
 
-			double specularAlbedo = CoupledBRDFConductor::specularAvgAlbedo().sample(alpha);
-			if (useFresnel) {
-				glm::dvec3 F(
+				kLambda = glm::dvec3(
 					fresnel_avg(eta.r, k.r),
 					fresnel_avg(eta.g, k.g),
 					fresnel_avg(eta.b, k.b)
 				);
-				//glm::dvec3 E = glm::dvec3(specularAlbedo);
-				//glm::dvec3 ONE = glm::dvec3(1.0);
-				//kLambda = E * F * F / (ONE - F * (ONE - E));
-				//kLambda = E * F / (ONE - F * (ONE - E));
-				kLambda = F;
-
-				//double cosThetaFresnel = glm::dot(h, wo);
-				//kLambda = glm::dvec3(
-				//	fresnel_unpolarized(eta.r, k.r, cosThetaFresnel),
-				//	fresnel_unpolarized(eta.g, k.g, cosThetaFresnel),
-				//	fresnel_unpolarized(eta.b, k.b, cosThetaFresnel)
-				//);
 			}
 
 			glm::dvec3 brdf_diff = kLambda
-				* (1.0 - CoupledBRDFConductor::specularAlbedo().sample(alpha, cos_term_wo))
-				* (1.0 - CoupledBRDFConductor::specularAlbedo().sample(alpha, cos_term_wi))
-				/ (glm::pi<double>() * (1.0 - specularAlbedo));
+				* (1.0 - Coupled::specularAlbedo().sample(alpha, cos_term_wo))
+				* (1.0 - Coupled::specularAlbedo().sample(alpha, cos_term_wi))
+				/ (glm::pi<double>() * (1.0 - Coupled::specularAvgAlbedo().sample(alpha)));
 
 			return brdf_spec + brdf_diff;
 		}
 
 		glm::dvec3 sample(PeseudoRandom *random, const glm::dvec3 &wo) const override {
 			glm::dvec3 wi;
-			double spAlbedo = CoupledBRDFConductor::specularAlbedo().sample(alpha, glm::dot(Ng, wo));
+			double spAlbedo = Coupled::specularAlbedo().sample(alpha, glm::dot(Ng, wo));
 
 			if (random->uniform() < spAlbedo) {
-				wi = VCavityBeckmannVisibleNormalSampler::sample(random, alpha, wo, Ng);
+				wi = Distribution::sample(random, alpha, wo, Ng);
 			}
 			else {
-				double theta = CoupledBRDFConductor::sampler().sampleTheta(alpha, random);
+				double theta = Coupled::sampler().sampleTheta(alpha, random);
 				glm::dvec3 sample = polar_to_cartesian(theta, random->uniform(0.0, glm::two_pi<double>()));
 				ArbitraryBRDFSpace space(Ng);
 				return space.localToGlobal(sample);
@@ -375,23 +463,67 @@ namespace rt {
 			return wi;
 		}
 		double pdf(const glm::dvec3 &wo, const glm::dvec3 &sampled_wi) const override {
-			const CoupledBRDFSampler &sampler = CoupledBRDFConductor::sampler();
-			double theta = std::acos(glm::dot(Ng, sampled_wi));
+			const CoupledBRDFSampler &sampler = Coupled::sampler();
+			double spAlbedo = Coupled::specularAlbedo().sample(alpha, glm::dot(Ng, wo));
 
-			double spAlbedo = CoupledBRDFConductor::specularAlbedo().sample(alpha, glm::dot(Ng, wo));
-
-			int n = sampler.thetaSize(alpha);
-			double pDiscrete = sampler.probability(alpha, theta);
 			double pdf_omega =
-				spAlbedo * VCavityBeckmannVisibleNormalSampler::pdf(sampled_wi, alpha, wo, Ng)
+				spAlbedo * Distribution::pdf(sampled_wi, alpha, wo, Ng)
 				+
-				(1.0 - spAlbedo) * n / (glm::pi<double>() * glm::pi<double>() * std::sin(theta)) * pDiscrete;
+				(1.0 - spAlbedo) * sampler.pdf(alpha, glm::dot(Ng, sampled_wi));
 			return pdf_omega;
 		}
+
+		void bxdf_batch(BxdfBatch *batch) const override {
+			using namespace bxdf_batch_details;
+			Cosines c(*batch, Ng);
+			float albedoO[kBxdfBatchWidth];
+			float albedoI[kBxdfBatchWidth];
+			specular_albedo(*batch, Coupled::specularAlbedo(), alpha, c.NoO, albedoO);
+			specular_albedo(*batch, Coupled::specularAlbedo(), alpha, c.NoI, albedoI);
+
+			// fresnel_avg は積分なので、バッチごとに 1 度だけ求める
+			float kLambda[3] = { 1.0f, 1.0f, 1.0f };
+			if (useFresnel) {
+				for (int j = 0; j < 3; ++j) {
+					kLambda[j] = (float)fresnel_avg(eta[j], k[j]);
+				}
+			}
+			float a = (float)alpha;
+			float n[3] = { (float)eta.r, (float)eta.g, (float)eta.b };
+			float kk[3] = { (float)k.r, (float)k.g, (float)k.b };
+			float diffuseScale = (float)(1.0 / (glm::pi<double>() * (1.0 - Coupled::specularAvgAlbedo().sample(alpha))));
+			for (int i = 0; i < kBxdfBatchWidth; ++i) {
+				float d = Distribution::D(c.NoH[i], a);
+				float g = Distribution::G2(c.NoH[i], c.NoO[i], c.NoI[i], c.HoO[i], a);
+				float brdf_without_f = d * g / (4.0f * c.NoO[i] * c.NoI[i]);
+				float diffuse = (1.0f - albedoO[i]) * (1.0f - albedoI[i]) * diffuseScale;
+				bool valid = 0.0f < c.NoO[i] && 0.0f < c.NoI[i];
+				for (int j = 0; j < 3; ++j) {
+					float f = useFresnel ? fresnel_unpolarized(n[j], kk[j], c.HoO[i]) : 1.0f;
+					batch->bxdf[j][i] = valid ? f * brdf_without_f + kLambda[j] * diffuse : 0.0f;
+				}
+			}
+		}
+		void pdf_batch(BxdfBatch *batch) const override {
+			using namespace bxdf_batch_details;
+			Cosines c(*batch, Ng);
+			float spAlbedo[kBxdfBatchWidth];
+			float diffusePdf[kBxdfBatchWidth];
+			specular_albedo(*batch, Coupled::specularAlbedo(), alpha, c.NoO, spAlbedo);
+			coupled_diffuse_pdf(*batch, Ng, Coupled::sampler(), alpha, diffusePdf);
+			float a = (float)alpha;
+			for (int i = 0; i < kBxdfBatchWidth; ++i) {
+				float specularPdf = Distribution::pdf(c.NoH[i], c.NoO[i], c.HoO[i], a);
+				batch->pdf[i] = spAlbedo[i] * specularPdf + (1.0f - spAlbedo[i]) * diffusePdf[i];
+			}
+		}
 	};
-	
-	class MicrofacetCoupledDielectricsMaterial : public IMaterial {
+
+	template <class Distribution>
+	class MicrofacetCoupledDielectricsMaterialT : public IMaterial {
 	public:
+		typedef typename Distribution::Dielectrics Coupled;
+
 		double alpha = 0.2;
 		glm::dvec3 Cd = glm::dvec3(1.0);
 
@@ -405,42 +537,36 @@ namespace rt {
 			}
 
 			glm::dvec3 h = glm::normalize(wi + wo);
-			double d = D_Beckmann(Ng, h, alpha);
-			// double g = G2_height_correlated_beckmann(wi, wo, h, Ng, alpha);
-			double g = G2_v_cavity(wi, wo, h, Ng);
+			double d = Distribution::D(Ng, h, alpha);
+			double g = Distribution::G2(wi, wo, h, Ng, alpha);
 
 			double brdf_without_f = d * g / (4.0 * cos_term_wo * cos_term_wi);
 
-			glm::dvec3 brdf_spec = glm::dvec3(brdf_without_f);
-
-			{
-				double cosThetaFresnel = glm::dot(h, wo);
-				glm::dvec3 f = glm::dvec3(fresnel_dielectrics(cosThetaFresnel, 1.5, 1.0));
-				brdf_spec = f * brdf_without_f;
-			}
+			double cosThetaFresnel = glm::dot(h, wo);
+			glm::dvec3 brdf_spec = glm::dvec3(fresnel_dielectrics(cosThetaFresnel, 1.5, 1.0) * brdf_without_f);
 
 			glm::dvec3 kLambda = Cd;
 
 			glm::dvec3 brdf_diff = kLambda
-				* (1.0 - CoupledBRDFDielectrics::specularAlbedo().sample(alpha, cos_term_wo))
-				* (1.0 - CoupledBRDFDielectrics::specularAlbedo().sample(alpha, cos_term_wi))
-				/ (glm::pi<double>() * (1.0 - CoupledBRDFDielectrics::specularAvgAlbedo().sample(alpha)));
+				* (1.0 - Coupled::specularAlbedo().sample(alpha, cos_term_wo))
+				* (1.0 - Coupled::specularAlbedo().sample(alpha, cos_term_wi))
+				/ (glm::pi<double>() * (1.0 - Coupled::specularAvgAlbedo().sample(alpha)));
 
 			return brdf_spec + brdf_diff;
 		}
-		
+
 		glm::dvec3 sample(PeseudoRandom *random, const glm::dvec3 &wo) const override {
 			glm::dvec3 wi;
-			double spAlbedo = CoupledBRDFDielectrics::specularAlbedo().sample(alpha, glm::dot(Ng, wo));
+			double spAlbedo = Coupled::specularAlbedo().sample(alpha, glm::dot(Ng, wo));
 			glm::dvec3 kLambda = Cd;
 			double k_avg = (kLambda[0] + kLambda[1] + kLambda[2]) / 3.0;
 			double P_spec = spAlbedo / (spAlbedo + k_avg * (1.0 - spAlbedo));
 
 			if (random->uniform() < P_spec) {
-				wi = VCavityBeckmannVisibleNormalSampler::sample(random, alpha, wo, Ng);
+				wi = Distribution::sample(random, alpha, wo, Ng);
 			}
 			else {
-				double theta = CoupledBRDFDielectrics::sampler().sampleTheta(alpha, random);
+				double theta = Coupled::sampler().sampleTheta(alpha, random);
 				glm::dvec3 sample = polar_to_cartesian(theta, random->uniform(0.0, glm::two_pi<double>()));
 				ArbitraryBRDFSpace space(Ng);
 				return space.localToGlobal(sample);
@@ -448,40 +574,96 @@ namespace rt {
 			return wi;
 		}
 		double pdf(const glm::dvec3 &wo, const glm::dvec3 &sampled_wi) const override {
-			const CoupledBRDFSampler &sampler = CoupledBRDFDielectrics::sampler();
-			double theta = std::acos(glm::dot(Ng, sampled_wi));
-			double spAlbedo = CoupledBRDFDielectrics::specularAlbedo().sample(alpha, glm::dot(Ng, wo));
+			const CoupledBRDFSampler &sampler = Coupled::sampler();
+			double spAlbedo = Coupled::specularAlbedo().sample(alpha, glm::dot(Ng, wo));
 
 			glm::dvec3 kLambda = Cd;
 			double k_avg = (kLambda[0] + kLambda[1] + kLambda[2]) / 3.0;
 			double P_spec = spAlbedo / (spAlbedo + k_avg * (1.0 - spAlbedo));
 
-			int n = sampler.thetaSize(alpha);
-			double pDiscrete = sampler.probability(alpha, theta);
 			double pdf_omega =
-				P_spec * VCavityBeckmannVisibleNormalSampler::pdf(sampled_wi, alpha, wo, Ng)
+				P_spec * Distribution::pdf(sampled_wi, alpha, wo, Ng)
 				+
-				(1.0 - P_spec) * n / (glm::pi<double>() * glm::pi<double>() * std::sin(theta)) * pDiscrete;
+				(1.0 - P_spec) * sampler.pdf(alpha, glm::dot(Ng, sampled_wi));
 			return pdf_omega;
 		}
+
+		void bxdf_batch(BxdfBatch *batch) const override {
+			using namespace bxdf_batch_details;
+			Cosines c(*batch, Ng);
+			float albedoO[kBxdfBatchWidth];
+			float albedoI[kBxdfBatchWidth];
+			specular_albedo(*batch, Coupled::specularAlbedo(), alpha, c.NoO, albedoO);
+			specular_albedo(*batch, Coupled::specularAlbedo(), alpha, c.NoI, albedoI);
+
+			float a = (float)alpha;
+			float kLambda[3] = { (float)Cd.r, (float)Cd.g, (float)Cd.b };
+			float diffuseScale = (float)(1.0 / (glm::pi<double>() * (1.0 - Coupled::specularAvgAlbedo().sample(alpha))));
+			for (int i = 0; i < kBxdfBatchWidth; ++i) {
+				float d = Distribution::D(c.NoH[i], a);
+				float g = Distribution::G2(c.NoH[i], c.NoO[i], c.NoI[i], c.HoO[i], a);
+				float f = fresnel_dielectrics(c.HoO[i], 1.5f, 1.0f);
+				float specular = f * d * g / (4.0f * c.NoO[i] * c.NoI[i]);
+				float diffuse = (1.0f - albedoO[i]) * (1.0f - albedoI[i]) * diffuseScale;
+				bool valid = 0.0f < c.NoO[i] && 0.0f < c.NoI[i];
+				for (int j = 0; j < 3; ++j) {
+					batch->bxdf[j][i] = valid ? specular + kLambda[j] * diffuse : 0.0f;
+				}
+			}
+		}
+		void pdf_batch(BxdfBatch *batch) const override {
+			using namespace bxdf_batch_details;
+			Cosines c(*batch, Ng);
+			float spAlbedo[kBxdfBatchWidth];
+			float diffusePdf[kBxdfBatchWidth];
+			specular_albedo(*batch, Coupled::specularAlbedo(), alpha, c.NoO, spAlbedo);
+			coupled_diffuse_pdf(*batch, Ng, Coupled::sampler(), alpha, diffusePdf);
+			float a = (float)alpha;
+			float k_avg = (float)((Cd[0] + Cd[1] + Cd[2]) / 3.0);
+			for (int i = 0; i < kBxdfBatchWidth; ++i) {
+				float P_spec = spAlbedo[i] / (spAlbedo[i] + k_avg * (1.0f - spAlbedo[i]));
+				float specularPdf = Distribution::pdf(c.NoH[i], c.NoO[i], c.HoO[i], a);
+				batch->pdf[i] = P_spec * specularPdf + (1.0f - P_spec) * diffusePdf[i];
+			}
+		}
 	};
-#if ENABLE_HEITZ
+
+	typedef MicrofacetConductorMaterialT<BeckmannVCavity> MicrofacetConductorMaterial;
+	typedef MicrofacetCoupledConductorMaterialT<BeckmannVCavity> MicrofacetCoupledConductorMaterial;
+	typedef MicrofacetCoupledDielectricsMaterialT<BeckmannVCavity> MicrofacetCoupledDielectricsMaterial;
+
+	typedef MicrofacetConductorMaterialT<GGXHeightCorrelated> MicrofacetGGXConductorMaterial;
+	typedef MicrofacetCoupledConductorMaterialT<GGXHeightCorrelated> MicrofacetGGXCoupledConductorMaterial;
+	typedef MicrofacetCoupledDielectricsMaterialT<GGXHeightCorrelated> MicrofacetGGXCoupledDielectricsMaterial;
+	/*
+	 Heitz et al. 2016 の多重散乱を含む Beckmann の導体。bxdf はランダムウォークで確率的に評価する。
+	 integrator からは stochastic_bxdf で呼ばれ、レンダラーの乱数で 1 回だけ (RGB まとめて) 歩く
+	*/
 	class HeitzConductorMaterial : public IMaterial {
 	public:
+		bool useFresnel = true;
+		double alpha = 0.5;
 
+		// copper (Cu)
+		glm::dvec3 eta = glm::dvec3(0.23780, 1.0066, 1.2404);
+		glm::dvec3 k = glm::dvec3(3.6264, 2.5823, 2.3929);
 
-		HeitzConductorMaterial(double a):alpha(a) {
-			for (int i = 0; i < 3; ++i) {
-				_microsurfaceConductor[i] = std::shared_ptr<MicrosurfaceConductor>(new MicrosurfaceConductor(false, true, alpha, alpha));
-				_microsurfaceConductor[i]->n = eta[i];
-				_microsurfaceConductor[i]->k = k[i];
-			}
-		}
+		/*
+		 integrator の外 (テストなど) から呼ばれたとき。
+		 乱数は (wo, wi) から作った種で毎回作り直すので、同じ引数なら同じ値を返す (呼んだ順やスレッドによらない)
+		 値は 1 本のランダムウォークなので、期待値が要るときは stochastic_bxdf を何度も呼ぶこと
+		*/
 		glm::dvec3 bxdf(const glm::dvec3 &wo, const glm::dvec3 &wi) const override {
+			uint64_t seed = fnv1a64(glm::value_ptr(wo), sizeof(wo));
+			seed = fnv1a64(glm::value_ptr(wi), sizeof(wi), seed);
+			XoroshiroPlus128 random(seed);
+			return stochastic_bxdf(&random, wo, wi);
+		}
+		glm::dvec3 stochastic_bxdf(PeseudoRandom *random, const glm::dvec3 &wo, const glm::dvec3 &wi) const override {
 			if (glm::dot(Ng, wi) < 0.0 || glm::dot(Ng, wo) < 0.0) {
 				return glm::dvec3(0.0);
 			}
-			
+
 			ArbitraryBRDFSpace space(Ng);
 			/*
 			Supplemental
@@ -489,11 +671,8 @@ namespace rt {
 			Note eval is f * cosθo
 			*/
 			double cosThetaO = std::abs(glm::dot(Ng, wo));
-			glm::vec3 brdf;
-			for (int i = 0; i < 3; ++i) {
-				brdf[i] = _microsurfaceConductor[i]->eval(space.globalToLocal(wi), space.globalToLocal(wo)) / cosThetaO;
-			}
-			return brdf;
+			MicrosurfaceConductorRGB microsurface(alpha, eta, k, useFresnel);
+			return microsurface.eval(space.globalToLocal(wi), space.globalToLocal(wo), random) / cosThetaO;
 		}
 		glm::dvec3 sample(PeseudoRandom *random, const glm::dvec3 &wo) const override {
 			glm::dvec3 wi;
@@ -509,28 +688,12 @@ namespace rt {
 		double pdf(const glm::dvec3 &wo, const glm::dvec3 &sampled_wi) const override {
 			double singleScattering = 0.8;
 			double pdf_omega =
-				0.8 * VCavityBeckmannVisibleNormalSampler::pdf(sampled_wi, alpha, wo, Ng)
+				singleScattering * VCavityBeckmannVisibleNormalSampler::pdf(sampled_wi, alpha, wo, Ng)
 				+
 				(1.0 - singleScattering) * UniformHemisphereSampler::pdf(sampled_wi, Ng);
 			return pdf_omega;
 		}
-	private:
-		// R: 650nm
-		// G: 550nm
-		// B: 450nm
-
-		// gold
-		//glm::dvec3 eta = glm::dvec3(0.15557, 0.42415, 1.3821);
-		//glm::dvec3 k = glm::dvec3(3.6024, 2.4721, 1.9155);
-
-		// copper (Cu)
-		glm::dvec3 eta = glm::dvec3(0.23780, 1.0066, 1.2404);
-		glm::dvec3 k = glm::dvec3(3.6264, 2.5823, 2.3929);
-
-		double alpha = 1.0;
-		std::shared_ptr<MicrosurfaceConductor> _microsurfaceConductor[3];
 	};
-#endif
 
 	class MicrofacetVelvetEnergyLossMaterial : public IMaterial {
 	public:
@@ -572,6 +735,28 @@ namespace rt {
 			// によるとこちらのほうが効率的
 			return UniformHemisphereSampler::pdf(sampled_wi, Ng);
 		}
+		void bxdf_batch(BxdfBatch *batch) const override {
+			using namespace bxdf_batch_details;
+			Cosines c(*batch, Ng);
+			VelvetLambda lambda(alpha);
+			float r = (float)alpha;
+			for (int i = 0; i < kBxdfBatchWidth; ++i) {
+				float d = velvet_D(c.NoH[i], r);
+				float g = velvet_G2(c.NoO[i], c.NoI[i], lambda);
+				float brdf = d * g / (4.0f * c.NoO[i] * c.NoI[i]);
+				bool valid = 0.0f < c.NoO[i] && 0.0f < c.NoI[i];
+				for (int j = 0; j < 3; ++j) {
+					batch->bxdf[j][i] = valid ? brdf : 0.0f;
+				}
+			}
+		}
+		void pdf_batch(BxdfBatch *batch) const override {
+			float nx = (float)Ng.x, ny = (float)Ng.y, nz = (float)Ng.z;
+			for (int k = 0; k < kBxdfBatchWidth; ++k) {
+				float NoI = nx * batch->wi[0][k] + ny * batch->wi[1][k] + nz * batch->wi[2][k];
+				batch->pdf[k] = NoI < 0.0f ? 0.0f : 1.0f / glm::two_pi<float>();
+			}
+		}
 	};
 
 	class MicrofacetVelvetMaterial : public IMaterial {
@@ -622,18 +807,56 @@ namespace rt {
 		}
 		double pdf(const glm::dvec3 &wo, const glm::dvec3 &sampled_wi) const override {
 			const CoupledBRDFSampler &sampler = CoupledBRDFVelvet::sampler();
-			double theta = std::acos(glm::dot(Ng, sampled_wi));
-
 			double spAlbedo = CoupledBRDFVelvet::specularAlbedo().sample(alpha, glm::dot(Ng, wo));
 
-			int n = sampler.thetaSize(alpha);
-			double pDiscrete = sampler.probability(alpha, theta);
 			double pdf_omega =
 				spAlbedo * UniformHemisphereSampler::pdf(sampled_wi, Ng)
 				+
-				(1.0 - spAlbedo) * n / (glm::pi<double>() * glm::pi<double>() * std::sin(theta)) * pDiscrete;
+				(1.0 - spAlbedo) * sampler.pdf(alpha, glm::dot(Ng, sampled_wi));
 			return pdf_omega;
 		}
+
+		void bxdf_batch(BxdfBatch *batch) const override {
+			using namespace bxdf_batch_details;
+			Cosines c(*batch, Ng);
+			float albedoO[kBxdfBatchWidth];
+			float albedoI[kBxdfBatchWidth];
+			specular_albedo(*batch, CoupledBRDFVelvet::specularAlbedo(), alpha, c.NoO, albedoO);
+			specular_albedo(*batch, CoupledBRDFVelvet::specularAlbedo(), alpha, c.NoI, albedoI);
+
+			double E = CoupledBRDFVelvet::specularAvgAlbedo().sample(alpha);
+			float cd[3];
+			float kLambda[3];
+			for (int j = 0; j < 3; ++j) {
+				double F = Cd[j];
+				cd[j] = (float)F;
+				kLambda[j] = (float)(E * F * F / (1.0 - F * (1.0 - E)) / (glm::pi<double>() * (1.0 - E)));
+			}
+			VelvetLambda lambda(alpha);
+			float r = (float)alpha;
+			for (int i = 0; i < kBxdfBatchWidth; ++i) {
+				float d = velvet_D(c.NoH[i], r);
+				float g = velvet_G2(c.NoO[i], c.NoI[i], lambda);
+				float specular = d * g / (4.0f * c.NoO[i] * c.NoI[i]);
+				float diffuse = (1.0f - albedoO[i]) * (1.0f - albedoI[i]);
+				bool valid = 0.0f < c.NoO[i] && 0.0f < c.NoI[i];
+				for (int j = 0; j < 3; ++j) {
+					batch->bxdf[j][i] = valid ? cd[j] * specular + kLambda[j] * diffuse : 0.0f;
+				}
+			}
+		}
+		void pdf_batch(BxdfBatch *batch) const override {
+			using namespace bxdf_batch_details;
+			Cosines c(*batch, Ng);
+			float spAlbedo[kBxdfBatchWidth];
+			float diffusePdf[kBxdfBatchWidth];
+			specular_albedo(*batch, CoupledBRDFVelvet::specularAlbedo(), alpha, c.NoO, spAlbedo);
+			coupled_diffuse_pdf(*batch, Ng, CoupledBRDFVelvet::sampler(), alpha, diffusePdf);
+			for (int i = 0; i < kBxdfBatchWidth; ++i) {
+				float uniformPdf = c.NoI[i] < 0.0f ? 0.0f : 1.0f / glm::two_pi<float>();
+				batch->pdf[i] = spAlbedo[i] * uniformPdf + (1.0f - spAlbedo[i]) * diffusePdf[i];
+			}
+		}
 	};
 
 	//class UndefinedMaterial : public IMaterial {
@@ -658,9 +881,10 @@ namespace rt {
 		MicrofacetConductorMaterial,
 		MicrofacetCoupledConductorMaterial,
 		MicrofacetCoupledDielectricsMaterial,
-#if ENABLE_HEITZ
+		MicrofacetGGXConductorMaterial,
+		MicrofacetGGXCoupledConductorMaterial,
+		MicrofacetGGXCoupledDielectricsMaterial,
 		HeitzConductorMaterial,
-#endif
 		MicrofacetVelvetMaterial,
 		MicrofacetVelvetEnergyLossMaterial
 	> Material;
@@ -0,0 +1,142 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "render_object.hpp"
+
+namespace rt {
+	/*
+	 マテリアルの編集できるパラメータの一覧。UI から名前で読み書きするために使う
+	 color なら value は 3 要素 (glm::dvec3) を指す
+	*/
+	struct MaterialParameter {
+		const char *name = "";
+		bool color = false;
+		double *value = nullptr;
+		double minValue = 0.0;
+		double maxValue = 1.0;
+	};
+
+	inline const char *materialName(const IMaterial *m) {
+		if (dynamic_cast<const LambertianMaterial *>(m)) { return "LambertianMaterial"; }
+		if (dynamic_cast<const SpecularMaterial *>(m)) { return "SpecularMaterial"; }
+		if (dynamic_cast<const DielectricsMaterial *>(m)) { return "DielectricsMaterial"; }
+		if (dynamic_cast<const MicrofacetConductorMaterial *>(m)) { return "MicrofacetConductorMaterial"; }
+		if (dynamic_cast<const MicrofacetCoupledConductorMaterial *>(m)) { return "MicrofacetCoupledConductorMaterial"; }
+		if (dynamic_cast<const MicrofacetCoupledDielectricsMaterial *>(m)) { return "MicrofacetCoupledDielectricsMaterial"; }
+		if (dynamic_cast<const MicrofacetGGXConductorMaterial *>(m)) { return "MicrofacetGGXConductorMaterial"; }
+		if (dynamic_cast<const MicrofacetGGXCoupledConductorMaterial *>(m)) { return "MicrofacetGGXCoupledConductorMaterial"; }
+		if (dynamic_cast<const MicrofacetGGXCoupledDielectricsMaterial *>(m)) { return "MicrofacetGGXCoupledDielectricsMaterial"; }
+		if (dynamic_cast<const HeitzConductorMaterial *>(m)) { return "HeitzConductorMaterial"; }
+		if (dynamic_cast<const MicrofacetVelvetMaterial *>(m)) { return "MicrofacetVelvetMaterial"; }
+		if (dynamic_cast<const MicrofacetVelvetEnergyLossMaterial *>(m)) { return "MicrofacetVelvetEnergyLossMaterial"; }
+		return "UnknownMaterial";
+	}
+
+	inline std::vector<MaterialParameter> materialParameters(IMaterial *m) {
+		std::vector<MaterialParameter> parameters;
+		auto scalar = [&](const char *name, double *value, double minValue, double maxValue) {
+			MaterialParameter p;
+			p.name = name;
+			p.value = value;
+			p.minValue = minValue;
+			p.maxValue = maxValue;
+			parameters.push_back(p);
+		};
+		auto color = [&](const char *name, glm::dvec3 *value, double minValue, double maxValue) {
+			MaterialParameter p;
+			p.name = name;
+			p.color = true;
+			p.value = &(*value)[0];
+			p.minValue = minValue;
+			p.maxValue = maxValue;
+			parameters.push_back(p);
+		};
+
+		if (auto lambertian = dynamic_cast<LambertianMaterial *>(m)) {
+			color("Cd", &lambertian->R, 0.0, 1.0);
+			color("Le", &lambertian->Le, 0.0, 100.0);
+		}
+		else if (auto dielectrics = dynamic_cast<DielectricsMaterial *>(m)) {
+			color("sigma", &dielectrics->sigma, 0.0, 10.0);
+			color("eta", &dielectrics->eta_dielectrics, 1.0, 3.0);
+		}
+		else if (auto conductor = dynamic_cast<MicrofacetConductorMaterial *>(m)) {
+			scalar("alpha", &conductor->alpha, 0.001, 1.0);
+			color("eta", &conductor->eta, 0.0, 5.0);
+			color("k", &conductor->k, 0.0, 5.0);
+		}
+		else if (auto conductor = dynamic_cast<MicrofacetCoupledConductorMaterial *>(m)) {
+			scalar("alpha", &conductor->alpha, 0.001, 1.0);
+			color("eta", &conductor->eta, 0.0, 5.0);
+			color("k", &conductor->k, 0.0, 5.0);
+		}
+		else if (auto dielectrics = dynamic_cast<MicrofacetCoupledDielectricsMaterial *>(m)) {
+			scalar("alpha", &dielectrics->alpha, 0.001, 1.0);
+			color("Cd", &dielectrics->Cd, 0.0, 1.0);
+		}
+		else if (auto conductor = dynamic_cast<MicrofacetGGXConductorMaterial *>(m)) {
+			scalar("alpha", &conductor->alpha, 0.001, 1.0);
+			color("eta", &conductor->eta, 0.0, 5.0);
+			color("k", &conductor->k, 0.0, 5.0);
+		}
+		else if (auto conductor = dynamic_cast<MicrofacetGGXCoupledConductorMaterial *>(m)) {
+			scalar("alpha", &conductor->alpha, 0.001, 1.0);
+			color("eta", &conductor->eta, 0.0, 5.0);
+			color("k", &conductor->k, 0.0, 5.0);
+		}
+		else if (auto dielectrics = dynamic_cast<MicrofacetGGXCoupledDielectricsMaterial *>(m)) {
+			scalar("alpha", &dielectrics->alpha, 0.001, 1.0);
+			color("Cd", &dielectrics->Cd, 0.0, 1.0);
+		}
+		else if (auto conductor = dynamic_cast<HeitzConductorMaterial *>(m)) {
+			scalar("alpha", &conductor->alpha, 0.001, 1.0);
+			color("eta", &conductor->eta, 0.0, 5.0);
+			color("k", &conductor->k, 0.0, 5.0);
+		}
+		else if (auto velvet = dynamic_cast<MicrofacetVelvetMaterial *>(m)) {
+			scalar("alpha", &velvet->alpha, 0.001, 1.0);
+			color("Cd", &velvet->Cd, 0.0, 1.0);
+		}
+		else if (auto velvet = dynamic_cast<MicrofacetVelvetEnergyLossMaterial *>(m)) {
+			scalar("alpha", &velvet->alpha, 0.001, 1.0);
+		}
+		return parameters;
+	}
+
+	/*
+	 ジオメトリ geometry の中の、materialName が material のマテリアルすべての parameter を value にする
+	 スカラーなら value.x だけを使う
+	*/
+	struct MaterialEdit {
+		int geometry = 0;
+		std::string material;
+		std::string parameter;
+		glm::dvec3 value;
+	};
+
+	// 書き換えたマテリアル (Geometry::materials の要素) の数を返す
+	inline int applyMaterialEdit(Geometry &geometry, const MaterialEdit &edit) {
+		int count = 0;
+		for (Material &material : geometry.materials) {
+			IMaterial *m = material.get();
+			if (edit.material != materialName(m)) {
+				continue;
+			}
+			for (MaterialParameter &p : materialParameters(m)) {
+				if (edit.parameter != p.name) {
+					continue;
+				}
+				int n = p.color ? 3 : 1;
+				for (int i = 0; i < n; ++i) {
+					p.value[i] = edit.value[i];
+				}
+				count++;
+			}
+		}
+		return count;
+	}
+}
@@ -9,6 +9,7 @@
 #include "serializable_buffer.hpp"
 #include "value_prportional_sampler.hpp"
 #include "composite_simpson.hpp"
+#include "fast_math.hpp"
 
 namespace rt {
 	inline double chi_plus(double x) {
@@ -30,12 +31,16 @@ namespace rt {
 
 		// \tan { \theta  } =\pm \frac { \sqrt { 1-\cos { \theta  }  }  }{ \cos { \theta  }  } \\ \tan ^{ 2 }{ \theta  } =\frac { 1-\cos ^{ 2 }{ \theta  }  }{ \cos ^{ 2 }{ \theta  }  } 
 		double tanTheta2 = (1.0 - cosTheta2) / cosTheta2;
-		return chi * std::exp(-tanTheta2 / alpha2) / (glm::pi<double>() * alpha2 * cosTheta4);
+		return chi * fmath::exp(-tanTheta2 / alpha2) / (glm::pi<double>() * alpha2 * cosTheta4);
+	}
+	// a = 1 / (alpha tanθ) での Smith の Λ。(erf(a) - 1) / 2 + exp(-a^2) / (2 a sqrt(pi)) は a が大きいと打ち消し合うので、erfc で書く
+	inline double lambda_beckmann_a(double a) {
+		return (std::exp(-a * a) / (a * std::sqrt(glm::pi<double>())) - std::erfc(a)) * 0.5;
 	}
 	inline double lambda_beckmann(double cosTheta, double alpha) {
 		double tanThetaO = std::sqrt(1.0 - cosTheta * cosTheta) / cosTheta;
 		double a = 1.0 / (alpha * tanThetaO);
-		return (std::erf(a) - 1.0) * 0.5 + std::exp(-a * a) / (2.0 * a * std::sqrt(glm::pi<double>()));
+		return lambda_beckmann_a(a);
 	}
 	inline double G2_height_correlated_beckmann(const glm::dvec3 &omega_i, const glm::dvec3 &omega_o, const glm::dvec3 &omega_h, const glm::dvec3 &n, double alpha) {
 		double numer = chi_plus(glm::dot(omega_o, omega_h)) * chi_plus(glm::dot(omega_i, omega_h));
@@ -70,7 +75,7 @@ namespace rt {
 	
 	struct BeckmannMicrosurfaceImportanceSampler {
 		static glm::dvec3 sample(PeseudoRandom *random, double alpha) {
-			double theta = std::atan(std::sqrt(-alpha * alpha * std::log(random->uniform())));
+			double theta = fmath::atan(std::sqrt(-alpha * alpha * fmath::log(random->uniform())));
 			double phi = random->uniform(0.0, glm::two_pi<double>());
 			return polar_to_cartesian(theta, phi);
 		}
@@ -133,6 +138,89 @@ namespace rt {
 		}
 	};
 
+	inline double D_GGX(const glm::dvec3 &n, const glm::dvec3 &h, double alpha) {
+		double cosTheta = glm::dot(n, h);
+
+		// chi+
+		if (cosTheta <= 0.0) {
+			return 0.0;
+		}
+
+		double cosTheta2 = cosTheta * cosTheta;
+		double alpha2 = alpha * alpha;
+		double denom = cosTheta2 * (alpha2 - 1.0) + 1.0;
+		return alpha2 / (glm::pi<double>() * denom * denom);
+	}
+	// tan を経由しない形。cosTheta = 0 では無限大になり G1, G2 が 0 になる
+	inline double lambda_ggx(double cosTheta, double alpha) {
+		double cosTheta2 = cosTheta * cosTheta;
+		double alpha2 = alpha * alpha;
+		return (std::sqrt(cosTheta2 + alpha2 * std::max(1.0 - cosTheta2, 0.0)) / std::abs(cosTheta) - 1.0) * 0.5;
+	}
+	inline double G1_ggx(double cosTheta, double alpha) {
+		return chi_plus(cosTheta) / (1.0 + lambda_ggx(cosTheta, alpha));
+	}
+	inline double G2_height_correlated_ggx(const glm::dvec3 &omega_i, const glm::dvec3 &omega_o, const glm::dvec3 &omega_h, const glm::dvec3 &n, double alpha) {
+		double numer = chi_plus(glm::dot(omega_o, omega_h)) * chi_plus(glm::dot(omega_i, omega_h));
+		double denom = (1.0 + lambda_ggx(glm::dot(omega_o, n), alpha) + lambda_ggx(glm::dot(omega_i, n), alpha));
+		return numer / denom;
+	}
+
+	/*
+	 GGX の可視法線の解析的なサンプリング
+	 Heitz 2018, "Sampling the GGX Distribution of Visible Normals"
+	 乱数 2 つと sqrt, cos, sin だけで済み、V-cavity のような鏡像の選択もいらない。
+	 重みは brdf * cos / pdf = F * G2 / G1(wo) になるので、分散も小さい
+	*/
+	struct GGXVisibleNormalSampler {
+		// wo_local は z 軸が法線の空間での向き。返すのも同じ空間の法線
+		static glm::dvec3 sampleVisibleNormal(double u1, double u2, double alpha, const glm::dvec3 &wo_local) {
+			// 半球の形に引き伸ばす
+			glm::dvec3 Vh = glm::normalize(glm::dvec3(alpha * wo_local.x, alpha * wo_local.y, wo_local.z));
+
+			double lensq = Vh.x * Vh.x + Vh.y * Vh.y;
+			glm::dvec3 T1 = 0.0 < lensq ? glm::dvec3(-Vh.y, Vh.x, 0.0) / std::sqrt(lensq) : glm::dvec3(1.0, 0.0, 0.0);
+			glm::dvec3 T2 = glm::cross(Vh, T1);
+
+			// 射影された円盤上の点
+			double r = std::sqrt(u1);
+			double phi = glm::two_pi<double>() * u2;
+			double t1 = r * std::cos(phi);
+			double t2 = r * std::sin(phi);
+			double s = 0.5 * (1.0 + Vh.z);
+			t2 = (1.0 - s) * std::sqrt(std::max(1.0 - t1 * t1, 0.0)) + s * t2;
+
+			// 半球へ戻して、元の形に縮める
+			glm::dvec3 Nh = t1 * T1 + t2 * T2 + std::sqrt(std::max(1.0 - t1 * t1 - t2 * t2, 0.0)) * Vh;
+			return glm::normalize(glm::dvec3(alpha * Nh.x, alpha * Nh.y, std::max(Nh.z, 0.0)));
+		}
+
+		// サンプリング範囲が半球ではないことに注意
+		static glm::dvec3 sample(PeseudoRandom *random, double alpha, glm::dvec3 wo, glm::dvec3 Ng) {
+			ArbitraryBRDFSpace basis(Ng);
+			glm::dvec3 wo_local = basis.globalToLocal(wo);
+
+			double u1 = random->uniform();
+			double u2 = random->uniform();
+			glm::dvec3 sample = sampleVisibleNormal(u1, u2, alpha, wo_local);
+
+			glm::dvec3 h = basis.localToGlobal(sample);
+			glm::dvec3 wi = glm::reflect(-wo, h);
+			return wi;
+		}
+
+		// 裏面はサポートしない
+		// dot(wo, wm) == dot(wi, wm) なので G1 * D / (4 cosThetaO) になる
+		static double pdf(glm::dvec3 sampled_wi, double alpha, glm::dvec3 wo, glm::dvec3 Ng) {
+			glm::dvec3 wm = glm::normalize(sampled_wi + wo);
+			double cosThetaO = glm::dot(wo, Ng);
+			if (glm::dot(wo, wm) <= 0.0) {
+				return 0.0;
+			}
+			return G1_ggx(cosThetaO, alpha) * D_GGX(Ng, wm, alpha) / (4.0 * cosThetaO);
+		}
+	};
+
 	inline double velvet_D(const glm::dvec3 &n, const glm::dvec3 &h, double r) {
 		double cosTheta = glm::dot(n, h);
 		if (cosTheta < 0.0) {
@@ -140,7 +228,7 @@ namespace rt {
 		}
 		// double sinTheta = std::sin(std::acos(cosTheta));
 		double sinTheta = std::sqrt(std::max(1.0 - cosTheta * cosTheta, 0.0));
-		return (2.0 + 1.0 / r) * std::pow(sinTheta, 1.0 / r) / (glm::pi<double>() * 2.0);
+		return (2.0 + 1.0 / r) * fmath::pow(sinTheta, 1.0 / r) / (glm::pi<double>() * 2.0);
 	}
 
 	// a, b, c, d, e
@@ -161,13 +249,13 @@ namespace rt {
 		double c = velvet_params_interpolate(2, power_of_one_minus_r);
 		double d = velvet_params_interpolate(3, power_of_one_minus_r);
 		double e = velvet_params_interpolate(4, power_of_one_minus_r);
-		return a / (1.0 + b * std::pow(x, c)) + d * x + e;
+		return a / (1.0 + b * fmath::pow(x, c)) + d * x + e;
 	}
 	inline double velvet_lambda(double cosTheta, double r) {
 		if (cosTheta < 0.5) {
-			return std::exp(velvet_L(cosTheta, r));
+			return fmath::exp(velvet_L(cosTheta, r));
 		}
-		return std::exp(2.0 * velvet_L(0.5, r) - velvet_L(1.0 - cosTheta, r));
+		return fmath::exp(2.0 * velvet_L(0.5, r) - velvet_L(1.0 - cosTheta, r));
 	}
 	//inline double velvet_lambda_dot(double cosTheta, double r) {
 	//	return std::pow(velvet_lambda(cosTheta, r), 1.0 + 2.0 * std::pow(1.0 - cosTheta, 8));
@@ -304,6 +392,14 @@ namespace rt {
 			const ValueProportionalSampler<double> &sampler = _discreteSamplers[alphaIndex];
 			return sampler.size();
 		}
+
+		// sampleTheta と一様な φ で選んだ向きの、立体角あたりの pdf
+		// sinθ は cosθ から直接求める。acos と sin を往復すると極の近くで桁が落ち、pdf が sample と合わなくなる
+		double pdf(double alpha, double cosTheta) const {
+			double theta = std::acos(glm::clamp(cosTheta, -1.0, 1.0));
+			double sinTheta = std::sqrt(std::max(1.0 - cosTheta * cosTheta, 0.0));
+			return thetaSize(alpha) / (glm::pi<double>() * glm::pi<double>() * sinTheta) * probability(alpha, theta);
+		}
 	private:
 		// 0     0.5     1
 		// |------|------|
@@ -409,5 +505,50 @@ namespace rt {
 			});
 		}
 	};
+
+	class CoupledBRDFConductorGGX {
+	public:
+		static SpecularAlbedo & specularAlbedo() {
+			static SpecularAlbedo s_specularAlbedo;
+			return s_specularAlbedo;
+		}
+		static SpecularAvgAlbedo& specularAvgAlbedo() {
+			static SpecularAvgAlbedo s_specularAvgAlbedo;
+			return s_specularAvgAlbedo;
+		}
+		static CoupledBRDFSampler &sampler() {
+			static CoupledBRDFSampler s_sampler;
+			return s_sampler;
+		}
+		static void load(const char *specularAlbedoBin, const char *specularAvgAlbedoBin) {
+			loadFromBinary(specularAlbedo(), specularAlbedoBin);
+			loadFromBinary(specularAvgAlbedo(), specularAvgAlbedoBin);
+			sampler().build([](double alpha, double cosTheta) {
+				return rt::CoupledBRDFConductorGGX::specularAlbedo().sample(alpha, cosTheta);
+			});
+		}
+	};
+	class CoupledBRDFDielectricsGGX {
+	public:
+		static SpecularAlbedo & specularAlbedo() {
+			static SpecularAlbedo s_specularAlbedo;
+			return s_specularAlbedo;
+		}
+		static SpecularAvgAlbedo& specularAvgAlbedo() {
+			static SpecularAvgAlbedo s_specularAvgAlbedo;
+			return s_specularAvgAlbedo;
+		}
+		static CoupledBRDFSampler &sampler() {
+			static CoupledBRDFSampler s_sampler;
+			return s_sampler;
+		}
+		static void load(const char *specularAlbedoBin, const char *specularAvgAlbedoBin) {
+			loadFromBinary(specularAlbedo(), specularAlbedoBin);
+			loadFromBinary(specularAvgAlbedo(), specularAvgAlbedoBin);
+			sampler().build([](double alpha, double cosTheta) {
+				return rt::CoupledBRDFDielectricsGGX::specularAlbedo().sample(alpha, cosTheta);
+			});
+		}
+	};
 }
 
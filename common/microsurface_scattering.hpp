@@ -0,0 +1,290 @@
+#pragma once
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+
+#include <glm/glm.hpp>
+#include <glm/ext.hpp>
+
+#include "peseudo_random.hpp"
+#include "microfacet.hpp"
+
+/*
+ Heitz et al. 2016, "Multiple-Scattering Microfacet BSDFs with the Smith Model" の導体のランダムウォーク。
+ 論文の補足のコード (MicrosurfaceScattering.cpp) の MicrosurfaceConductor (Beckmann) を元にしていて、違いは次の通り。
+ ・波長ごとに 3 回歩く代わりに 1 回だけ歩き、フレネルの重みを RGB で運ぶ。
+   経路の選び方はフレネルによらないので、チャンネルごとに歩いたときと同じ期待値になる
+ ・乱数は呼び出し側の PeseudoRandom から取る。同じ乱数列なら同じ結果になる
+ ・高さ分布は状態を持たず、傾き分布は alpha しか持たない。どちらも不変で、ヒープも使わない
+ ・高さ分布は一様分布にしている (元の material は Gaussian)。BSDF は高さ分布によらないので期待値は変わらず、
+   erf, erfinv を使わない分だけ安い
+*/
+namespace rt {
+	namespace microsurface {
+		inline double erfinv(double x) {
+			double w = -std::log((1.0 - x) * (1.0 + x));
+			double p;
+			if (w < 5.0) {
+				w = w - 2.5;
+				p = 2.81022636e-08;
+				p = 3.43273939e-07 + p * w;
+				p = -3.5233877e-06 + p * w;
+				p = -4.39150654e-06 + p * w;
+				p = 0.00021858087 + p * w;
+				p = -0.00125372503 + p * w;
+				p = -0.00417768164 + p * w;
+				p = 0.246640727 + p * w;
+				p = 1.50140941 + p * w;
+			}
+			else {
+				w = std::sqrt(w) - 3.0;
+				p = -0.000200214257;
+				p = 0.000100950558 + p * w;
+				p = 0.00134934322 + p * w;
+				p = -0.00367342844 + p * w;
+				p = 0.00573950773 + p * w;
+				p = -0.0076224613 + p * w;
+				p = 0.00943887047 + p * w;
+				p = 1.00167406 + p * w;
+				p = 2.83297682 + p * w;
+			}
+			return p * x;
+		}
+
+		// [-1, 1] の一様な高さ分布
+		struct HeightUniform {
+			static double C1(double h) {
+				return glm::clamp(0.5 * (h + 1.0), 0.0, 1.0);
+			}
+			static double invC1(double U) {
+				return glm::clamp(2.0 * U - 1.0, -1.0, 1.0);
+			}
+		};
+
+		// 等方な Beckmann の傾き分布
+		struct SlopeBeckmann {
+			SlopeBeckmann(double alpha) : alpha(alpha) {}
+
+			double Lambda(const glm::dvec3 &w) const {
+				if (0.9999 < w.z) {
+					return 0.0;
+				}
+				if (w.z < -0.9999) {
+					return -1.0;
+				}
+				// a = cotθ / alpha
+				double sinTheta = std::sqrt(std::max(1.0 - w.z * w.z, 0.0));
+				double a_ = w.z / (sinTheta * alpha);
+				return lambda_beckmann_a(a_);
+			}
+			double projectedArea(const glm::dvec3 &w) const {
+				if (0.9999 < w.z) {
+					return 1.0;
+				}
+				if (w.z < -0.9999) {
+					return 0.0;
+				}
+				double sinTheta = std::sqrt(std::max(1.0 - w.z * w.z, 0.0));
+				double a_ = w.z / (sinTheta * alpha);
+				return 0.5 * std::erfc(-a_) * w.z + alpha * sinTheta * std::exp(-a_ * a_) / (2.0 * std::sqrt(glm::pi<double>()));
+			}
+			double D(const glm::dvec3 &wm) const {
+				return D_Beckmann(glm::dvec3(0.0, 0.0, 1.0), wm, alpha);
+			}
+			double D_wi(const glm::dvec3 &wi, const glm::dvec3 &wm) const {
+				double area = projectedArea(wi);
+				if (area == 0.0) {
+					return 0.0;
+				}
+				return std::max(glm::dot(wi, wm), 0.0) * D(wm) / area;
+			}
+
+			// alpha = 1 の可視な傾きのサンプリング (Jakob の方法)
+			static glm::dvec2 sampleP22_11(double cosTheta, double sinTheta, double U1, double U2) {
+				if (sinTheta < 0.0001) {
+					double r = std::sqrt(-std::log(1.0 - U1));
+					double phi = glm::two_pi<double>() * U2;
+					return glm::dvec2(r * std::cos(phi), r * std::sin(phi));
+				}
+
+				double slope_i = cosTheta / sinTheta;
+				double area = 0.5 * std::erfc(-slope_i) * cosTheta + sinTheta * std::exp(-slope_i * slope_i) / (2.0 * std::sqrt(glm::pi<double>()));
+				if (area < 0.0001 || area != area) {
+					return glm::dvec2(0.0);
+				}
+				double c = 1.0 / area;
+
+				// CDF の逆を erf の空間でニュートン法と二分法で探す
+				double erf_min = -0.9999;
+				double erf_max = std::max(erf_min, fmath::erf(slope_i));
+				double erf_current = 0.5 * (erf_min + erf_max);
+				while (0.00001 < erf_max - erf_min) {
+					if (!(erf_min <= erf_current && erf_current <= erf_max)) {
+						erf_current = 0.5 * (erf_min + erf_max);
+					}
+					double slope = erfinv(erf_current);
+					double CDF = slope_i <= slope ? 1.0 : c * (sinTheta * fmath::exp(-slope * slope) / (2.0 * std::sqrt(glm::pi<double>())) + cosTheta * (0.5 + 0.5 * fmath::erf(slope)));
+					double diff = CDF - U1;
+					if (std::abs(diff) < 0.00001) {
+						break;
+					}
+					if (0.0 < diff) {
+						if (erf_max == erf_current) {
+							break;
+						}
+						erf_max = erf_current;
+					}
+					else {
+						if (erf_min == erf_current) {
+							break;
+						}
+						erf_min = erf_current;
+					}
+					double derivative = 0.5 * c * cosTheta - 0.5 * c * sinTheta * slope;
+					erf_current -= diff / derivative;
+				}
+				return glm::dvec2(
+					erfinv(glm::clamp(erf_current, erf_min, erf_max)),
+					erfinv(2.0 * U2 - 1.0)
+				);
+			}
+
+			// 可視法線のサンプリング。元の実装の acos, atan2 は cos, sin を直接求めて省く
+			glm::dvec3 sampleD_wi(const glm::dvec3 &wi, double U1, double U2) const {
+				glm::dvec3 wi_11 = glm::normalize(glm::dvec3(alpha * wi.x, alpha * wi.y, wi.z));
+				double sinTheta = std::sqrt(std::max(1.0 - wi_11.z * wi_11.z, 0.0));
+				glm::dvec2 slope_11 = sampleP22_11(wi_11.z, sinTheta, U1, U2);
+
+				double cosPhi = 1.0;
+				double sinPhi = 0.0;
+				double r = std::sqrt(wi_11.x * wi_11.x + wi_11.y * wi_11.y);
+				if (0.0 < r) {
+					cosPhi = wi_11.x / r;
+					sinPhi = wi_11.y / r;
+				}
+				glm::dvec2 slope(
+					(cosPhi * slope_11.x - sinPhi * slope_11.y) * alpha,
+					(sinPhi * slope_11.x + cosPhi * slope_11.y) * alpha
+				);
+
+				if (glm::isfinite(slope.x) == false) {
+					if (0.0 < wi.z) {
+						return glm::dvec3(0.0, 0.0, 1.0);
+					}
+					return glm::normalize(glm::dvec3(wi.x, wi.y, 0.0));
+				}
+				return glm::normalize(glm::dvec3(-slope.x, -slope.y, 1.0));
+			}
+
+			const double alpha;
+		};
+	}
+
+	/*
+	 z 軸が法線の空間で評価する。eval は f(wi, wo) * cosθo
+	*/
+	class MicrosurfaceConductorRGB {
+	public:
+		MicrosurfaceConductorRGB(double alpha, const glm::dvec3 &eta, const glm::dvec3 &k, bool useFresnel)
+			: _slope(alpha), _eta(eta), _k(k), _useFresnel(useFresnel) {
+		}
+
+		glm::dvec3 eval(const glm::dvec3 &wi, const glm::dvec3 &wo, PeseudoRandom *random) const {
+			if (wo.z < 0.0) {
+				return glm::dvec3(0.0);
+			}
+
+			glm::dvec3 wr = -wi;
+			double hr = 1.0 + microsurface::HeightUniform::invC1(0.999);
+
+			glm::dvec3 sum(0.0);
+			glm::dvec3 energy(1.0);
+			for (;;) {
+				hr = sampleHeight(wr, hr, random->uniform());
+
+				// 表面から出た
+				if (hr == DBL_MAX) {
+					break;
+				}
+
+				// next event estimation
+				glm::dvec3 I = energy * evalPhaseFunction(-wr, wo) * G_1(wo, hr);
+				if (glm::isfinite(I.x) && glm::isfinite(I.y) && glm::isfinite(I.z)) {
+					sum += I;
+				}
+
+				// 次の向き。位相関数は可視法線の分布そのものなので、重みはフレネルだけ
+				double U1 = random->uniform();
+				double U2 = random->uniform();
+				glm::dvec3 wm = _slope.sampleD_wi(-wr, U1, U2);
+				double cosThetaM = glm::dot(-wr, wm);
+				energy *= fresnel(cosThetaM);
+				wr = wr - 2.0 * wm * glm::dot(wr, wm);
+
+				if (hr != hr || wr.z != wr.z) {
+					return glm::dvec3(0.0);
+				}
+			}
+			return sum;
+		}
+	private:
+		glm::dvec3 fresnel(double cosTheta) const {
+			if (_useFresnel == false) {
+				return glm::dvec3(1.0);
+			}
+			return glm::dvec3(
+				fresnel_unpolarized(_eta.r, _k.r, cosTheta),
+				fresnel_unpolarized(_eta.g, _k.g, cosTheta),
+				fresnel_unpolarized(_eta.b, _k.b, cosTheta)
+			);
+		}
+		glm::dvec3 evalPhaseFunction(const glm::dvec3 &wi, const glm::dvec3 &wo) const {
+			glm::dvec3 wh = glm::normalize(wi + wo);
+			if (wh.z < 0.0) {
+				return glm::dvec3(0.0);
+			}
+			double cosThetaM = glm::dot(wi, wh);
+			return fresnel(cosThetaM) * (0.25 * _slope.D_wi(wi, wh) / cosThetaM);
+		}
+
+		// 高さ h0 での masking
+		double G_1(const glm::dvec3 &w, double h0) const {
+			if (0.9999 < w.z) {
+				return 1.0;
+			}
+			if (w.z <= 0.0) {
+				return 0.0;
+			}
+			return std::pow(microsurface::HeightUniform::C1(h0), _slope.Lambda(w));
+		}
+
+		// 次に当たる高さ。表面から出るときは DBL_MAX
+		double sampleHeight(const glm::dvec3 &wr, double hr, double U) const {
+			if (0.9999 < wr.z) {
+				return DBL_MAX;
+			}
+			if (wr.z < -0.9999) {
+				return microsurface::HeightUniform::invC1(U * microsurface::HeightUniform::C1(hr));
+			}
+			if (std::abs(wr.z) < 0.0001) {
+				return hr;
+			}
+
+			double lambda = _slope.Lambda(wr);
+			double C1_hr = microsurface::HeightUniform::C1(hr);
+
+			// 交差する確率
+			double G_1_ = 0.0 < wr.z ? std::pow(C1_hr, lambda) : 0.0;
+			if (1.0 - G_1_ < U) {
+				return DBL_MAX;
+			}
+			return microsurface::HeightUniform::invC1(C1_hr / std::pow(1.0 - U, 1.0 / lambda));
+		}
+
+		const microsurface::SlopeBeckmann _slope;
+		glm::dvec3 _eta;
+		glm::dvec3 _k;
+		bool _useFresnel;
+	};
+}
@@ -0,0 +1,129 @@
+#pragma once
+
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <vector>
+#include <tbb/tbb.h>
+
+#include "stopwatch.hpp"
+
+namespace rt {
+	/*
+	 NUMA ノードごとの TBB task arena
+	 画像を行のバンドに分けてノードに割り当て、各バンドはそのノードの arena の中だけで処理する。
+	 バンドはノード数の kBandsPerNode 倍に細かく分けて順にノードへ交互に配るので、
+	 空だけの行と物の多い行のように重さが偏っていてもノードの仕事量がおおよそ揃う。
+	 バンドの割り当ては常に同じなので、Image::place で最初に書き込んだノードと、
+	 レンダリングでアクセスするノードが一致する。
+
+	 ノードへのスレッドの固定には tbbbind が必要で、無い場合や NUMA の無いマシンでは 1 ノードとして動く
+	*/
+	class NumaArenas {
+	public:
+		// maxNodes: 使うノード数の上限 (0 = すべて)。ソケット間のスケーリングを測るため
+		// emulatedNodes: テスト用。NUMA の無いマシンでも、ノードに固定しない arena をこの数だけ作って複数ノードとして動かす
+		explicit NumaArenas(int maxNodes = 0, int emulatedNodes = 0) {
+			if (0 < emulatedNodes) {
+				for (int i = 0; i < emulatedNodes; ++i) {
+					_arenas.emplace_back(new tbb::task_arena());
+				}
+				return;
+			}
+#if TBB_INTERFACE_VERSION >= 12000
+			std::vector<tbb::numa_node_id> nodes = tbb::info::numa_nodes();
+#else
+			std::vector<int> nodes(1, -1);
+#endif
+			if (0 < maxNodes && maxNodes < (int)nodes.size()) {
+				nodes.resize(maxNodes);
+			}
+			for (auto node : nodes) {
+#if TBB_INTERFACE_VERSION >= 12000
+				_arenas.emplace_back(new tbb::task_arena(tbb::task_arena::constraints(node)));
+#else
+				_arenas.emplace_back(new tbb::task_arena());
+#endif
+			}
+		}
+		NumaArenas(const NumaArenas &) = delete;
+		void operator=(const NumaArenas &) = delete;
+
+		int nodeCount() const {
+			return (int)_arenas.size();
+		}
+		int concurrency() const {
+			int n = 0;
+			for (auto &arena : _arenas) {
+				n += arena->max_concurrency();
+			}
+			return n;
+		}
+
+		// 1 ノードあたりのバンドの数
+		static const int kBandsPerNode = 16;
+
+		// 高さ height の画像のバンドの数。1 行より細かくはしない
+		int bandCount(int height) const {
+			return std::max(std::min(height, nodeCount() * kBandsPerNode), 1);
+		}
+		// バンド index の行 [y0, y1)。バンド index はノード index % nodeCount() が担当する
+		void band(int index, int height, int *y0, int *y1) const {
+			int n = bandCount(height);
+			*y0 = (int)((int64_t)height * index / n);
+			*y1 = (int)((int64_t)height * (index + 1) / n);
+		}
+
+		// 直前の parallelRows で、各ノードが自分のバンドを終えるまでの秒数。ノード間の偏りを見るため
+		const std::vector<double> &nodeSeconds() const {
+			return _nodeSeconds;
+		}
+
+		// ノード node の arena の中で f を実行する
+		void execute(int node, const std::function<void()> &f) {
+			_arenas[node]->execute(f);
+		}
+
+		// f(node) を各ノードの arena の中で同時に実行し、すべて終わるまで待つ
+		void forEachNode(const std::function<void(int)> &f) {
+			int n = nodeCount();
+			std::vector<tbb::task_group> groups(n);
+			for (int i = 0; i < n; ++i) {
+				_arenas[i]->execute([&, i]() {
+					groups[i].run([&, i]() { f(i); });
+				});
+			}
+			for (int i = 0; i < n; ++i) {
+				_arenas[i]->execute([&, i]() {
+					groups[i].wait();
+				});
+			}
+		}
+
+		// 行 [0, height) をバンドに分け、各ノードの中で自分のバンドの行を parallel_for する
+		// f(node, range)
+		void parallelRows(int height, const std::function<void(int, const tbb::blocked_range<int> &)> &f) {
+			int n = nodeCount();
+			int count = bandCount(height);
+			_nodeSeconds.assign(n, 0.0);
+			Stopwatch sw;
+			forEachNode([&](int node) {
+				// node, node + n, node + 2n, ... 番めのバンド
+				int bands = node < count ? (count - node + n - 1) / n : 0;
+				tbb::parallel_for(tbb::blocked_range<int>(0, bands), [&](const tbb::blocked_range<int> &bandRange) {
+					for (int k = bandRange.begin(); k < bandRange.end(); ++k) {
+						int y0, y1;
+						band(node + k * n, height, &y0, &y1);
+						tbb::parallel_for(tbb::blocked_range<int>(y0, y1), [&](const tbb::blocked_range<int> &range) {
+							f(node, range);
+						});
+					}
+				});
+				_nodeSeconds[node] = sw.elapsed();
+			});
+		}
+	private:
+		std::vector<std::unique_ptr<tbb::task_arena>> _arenas;
+		std::vector<double> _nodeSeconds;
+	};
+}
@@ -46,7 +46,7 @@ namespace rt {
 
 		}
 		Xor64(uint64_t seed) {
-			_x = std::max(seed, 1ULL);
+			_x = std::max<uint64_t>(seed, 1);
 		}
 		uint64_t next() {
 			_x = _x ^ (_x << 13);
@@ -82,14 +82,14 @@ namespace rt {
 		XoroshiroPlus128() {
 			splitmix sp;
 			sp.x = 38927482;
-			s[0] = std::max(sp.next(), 1ULL);
-			s[1] = std::max(sp.next(), 1ULL);
+			s[0] = std::max<uint64_t>(sp.next(), 1);
+			s[1] = std::max<uint64_t>(sp.next(), 1);
 		}
 		XoroshiroPlus128(uint64_t seed) {
 			splitmix sp;
 			sp.x = seed;
-			s[0] = std::max(sp.next(), 1ULL);
-			s[1] = std::max(sp.next(), 1ULL);
+			s[0] = std::max<uint64_t>(sp.next(), 1);
+			s[1] = std::max<uint64_t>(sp.next(), 1);
 		}
 
 		double uniform64f() override {
@@ -125,6 +125,16 @@ namespace rt {
 			s[0] = s0;
 			s[1] = s1;
 		}
+
+		// チェックポイントなどで状態をそのまま保存, 復元するため
+		void state(uint64_t out[2]) const {
+			out[0] = s[0];
+			out[1] = s[1];
+		}
+		void setState(const uint64_t in[2]) {
+			s[0] = in[0];
+			s[1] = in[1];
+		}
 	private:
 		// http://xoshiro.di.unimi.it/splitmix64.c
 		// for generate seed
@@ -0,0 +1,137 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+#include <glm/glm.hpp>
+#include <glm/ext.hpp>
+
+#include "render_object.hpp"
+
+namespace rt {
+	/*
+	 光る三角形 2 枚でできた長方形。球面長方形サンプリング (SphericalRectangleSampler) に使う
+	 cross(ex, ey) は光る面の法線 (Ng) の向き
+	*/
+	struct RectangleEmitter {
+		int primitives[2];
+		glm::dvec3 s;
+		glm::dvec3 ex;
+		glm::dvec3 ey;
+	};
+
+	/*
+	 辺を共有し (頂点番号が同じ), Le と backEmission が同じ光る三角形の組のうち、長方形になるものを探す。
+	 共有する辺が対角線 (a + b = p + q) で、a から出る 2 辺が直交していれば長方形。
+	 直交しない平行四辺形は球面長方形ではサンプリングできないので三角形のまま。
+	 SamplingStrategy が NoSample (直接サンプリングしない) と SphericalRectangleSample (手で指定済み) のものは対象外
+	*/
+	inline std::vector<RectangleEmitter> findRectangleEmitters(const Geometry &geometry) {
+		std::vector<RectangleEmitter> rectangles;
+		if (geometry.quads.empty() == false) {
+			return rectangles;
+		}
+
+		auto emitter = [&](int primID) -> const LambertianMaterial * {
+			auto lambertian = dynamic_cast<const LambertianMaterial *>(geometry.material(primID).get());
+			if (lambertian == nullptr || lambertian->isEmission() == false) {
+				return nullptr;
+			}
+			if (lambertian->samplingStrategy.get<NoSample>() || lambertian->samplingStrategy.get<SphericalRectangleSample>()) {
+				return nullptr;
+			}
+			return lambertian;
+		};
+		auto edgeKey = [](uint32_t a, uint32_t b) {
+			return a < b ? ((uint64_t)a << 32) | b : ((uint64_t)b << 32) | a;
+		};
+		auto point = [&](uint32_t index) {
+			return glm::dvec3(geometry.points[index].P);
+		};
+
+		std::unordered_map<uint64_t, std::vector<int>> edges;
+		for (int j = 0; j < geometry.indices.size(); ++j) {
+			if (emitter(j) == nullptr) {
+				continue;
+			}
+			const glm::uvec3 &t = geometry.indices[j];
+			for (int e = 0; e < 3; ++e) {
+				edges[edgeKey(t[e], t[(e + 1) % 3])].push_back(j);
+			}
+		}
+		if (edges.empty()) {
+			return rectangles;
+		}
+
+		// 点は float なので、辺の長さに対する相対誤差で比べる
+		const double kEps = 1.0e-4;
+		std::vector<bool> paired(geometry.indices.size(), false);
+		auto tryPair = [&](int j, int k, int e) {
+			const LambertianMaterial *mj = emitter(j);
+			const LambertianMaterial *mk = emitter(k);
+			if (mj->Le != mk->Le || mj->backEmission != mk->backEmission) {
+				return false;
+			}
+			if (glm::dot(geometry.primitives[j].Ng, geometry.primitives[k].Ng) <= 0.0) {
+				return false;
+			}
+			const glm::uvec3 &tj = geometry.indices[j];
+			const glm::uvec3 &tk = geometry.indices[k];
+			uint32_t ip = tj[e];
+			uint32_t iq = tj[(e + 1) % 3];
+			uint32_t ia = tj[(e + 2) % 3];
+			uint32_t ib = tk[0] + tk[1] + tk[2] - ip - iq;
+
+			glm::dvec3 a = point(ia);
+			glm::dvec3 ex = point(ip) - a;
+			glm::dvec3 ey = point(iq) - a;
+			double exLength = glm::length(ex);
+			double eyLength = glm::length(ey);
+			if (exLength <= 0.0 || eyLength <= 0.0) {
+				return false;
+			}
+			double scale = std::max(exLength, eyLength);
+			if (kEps * scale < glm::length(a + ex + ey - point(ib))) {
+				return false;
+			}
+			if (kEps * exLength * eyLength < std::abs(glm::dot(ex, ey))) {
+				return false;
+			}
+
+			RectangleEmitter rectangle;
+			rectangle.primitives[0] = j;
+			rectangle.primitives[1] = k;
+			rectangle.s = a;
+			rectangle.ex = ex;
+			rectangle.ey = ey;
+			if (glm::dot(glm::cross(ex, ey), geometry.primitives[j].Ng) < 0.0) {
+				std::swap(rectangle.ex, rectangle.ey);
+			}
+			rectangles.push_back(rectangle);
+			return true;
+		};
+
+		for (int j = 0; j < geometry.indices.size(); ++j) {
+			if (paired[j] || emitter(j) == nullptr) {
+				continue;
+			}
+			const glm::uvec3 &t = geometry.indices[j];
+			for (int e = 0; e < 3 && paired[j] == false; ++e) {
+				for (int k : edges[edgeKey(t[e], t[(e + 1) % 3])]) {
+					if (k == j || paired[k]) {
+						continue;
+					}
+					if (tryPair(j, k, e)) {
+						paired[j] = true;
+						paired[k] = true;
+						break;
+					}
+				}
+			}
+		}
+		return rectangles;
+	}
+}
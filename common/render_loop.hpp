@@ -0,0 +1,33 @@
+#pragma once
+
+#include <functional>
+
+#include "stopwatch.hpp"
+#include "online.hpp"
+
+namespace rt {
+	// step(cur frame), save(spp)
+	// duration 秒以内に収まるように、最後の step の前に打ち切って保存する
+	inline void progressiveRender(const Stopwatch *main_sw, std::function<void(int)> step, std::function<void(int)> save, double duration, double save_interval) {
+		double safety_duration = 1.0;
+
+		Stopwatch save_interval_time;
+
+		OnlineMean<double> step_duration;
+		for (int i = 0; ; ++i) {
+			Stopwatch sw;
+			step(i);
+			step_duration.addSample(sw.elapsed());
+
+			if (duration - safety_duration < main_sw->elapsed() + step_duration.mean()) {
+				save(i + 1);
+				break;
+			}
+
+			if (save_interval < save_interval_time.elapsed()) {
+				save(i + 1);
+				save_interval_time = Stopwatch();
+			}
+		}
+	}
+}
@@ -1,5 +1,9 @@
 ﻿#pragma once
 
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
 #include <vector>
 
 #include <glm/glm.hpp>
@@ -13,16 +17,104 @@
 namespace rt {
 	class Geometry {
 	public:
+		/*
+		 points と indices (または quads) はそのまま Embree の頂点, インデックスバッファとして共有する (SceneInterface)。
+		 Embree は頂点を 16 バイト単位で読むので、Point は 16 バイトにしておく
+		*/
 		struct Point {
-			glm::dvec3 P;
+			glm::vec3 P;
+			float padding = 0.0f;
 		};
 		struct Primitive {
-			glm::ivec3 indices;
 			glm::dvec3 Ng;
-			Material material;
+			uint32_t material = 0; // materials の番号
 		};
 		std::vector<Point> points;
+		std::vector<glm::uvec3> indices; // プリミティブごとの頂点番号。primitives と同じ並び
+		std::vector<glm::uvec4> quads;   // 四角形メッシュのとき indices の代わりに使う。三角形は最後の頂点を繰り返す
 		std::vector<Primitive> primitives;
+
+		/*
+		 マテリアルの表。同じマテリアルのプリミティブは 1 つを共有する。
+		 ただし sampler を持つ光源のプリミティブは SceneInterface が自分だけの番号に付け替える
+		*/
+		std::vector<Material> materials;
+
+		const Material &material(int primID) const {
+			return materials[primitives[primID].material];
+		}
+		Material &material(int primID) {
+			return materials[primitives[primID].material];
+		}
+
+		/*
+		 points, indices (quads) の代わりに外のメモリ (シーンキャッシュの mmap) を Embree と共有するとき。
+		 positions は float3 x pointCount で後ろ 16 バイトまで読めること、indices はプリミティブごとに primitiveVertices 個。
+		 メモリは owner が保つ。CPU 側で位置が要るとき (光源の sampler) だけ materializeShape で points, indices にコピーする
+		*/
+		struct SharedShape {
+			const float *positions = nullptr;
+			size_t pointCount = 0;
+			const uint32_t *indices = nullptr;
+			int primitiveVertices = 3;
+			std::shared_ptr<const void> owner;
+		};
+		SharedShape shared;
+
+		bool hasSharedShape() const {
+			return shared.positions != nullptr;
+		}
+		size_t pointCount() const {
+			return hasSharedShape() ? shared.pointCount : points.size();
+		}
+
+		// 共有しているメモリから points, indices (quads) を作る。Embree は共有したメモリを使い続ける
+		void materializeShape() {
+			if (hasSharedShape() == false || points.size() == shared.pointCount) {
+				return;
+			}
+			points.resize(shared.pointCount);
+			for (size_t j = 0; j < shared.pointCount; ++j) {
+				points[j].P = glm::vec3(shared.positions[j * 3], shared.positions[j * 3 + 1], shared.positions[j * 3 + 2]);
+			}
+			if (shared.primitiveVertices == 4) {
+				quads.resize(primitives.size());
+				memcpy(quads.data(), shared.indices, sizeof(glm::uvec4) * quads.size());
+			}
+			else {
+				indices.resize(primitives.size());
+				memcpy(indices.data(), shared.indices, sizeof(glm::uvec3) * indices.size());
+			}
+		}
+
+		// 形 (points, indices, quads と共有しているメモリ) だけを入れ替える
+		void swapShape(Geometry &other) {
+			points.swap(other.points);
+			indices.swap(other.indices);
+			quads.swap(other.quads);
+			std::swap(shared, other.shared);
+		}
+
+		// リロード時の差分検出用
+		// name: alembic のオブジェクトのパス
+		// shapeHash: 点と頂点番号, materialHash: プリミティブのアトリビュート
+		std::string name;
+		uint64_t shapeHash = 0;
+		uint64_t materialHash = 0;
+
+		/*
+		 インスタンス: 0 <= prototype なら、形とマテリアルは Scene::geometries[prototype] のものを transform で置いて使う。
+		 自分の points, indices, quads, primitives は空。prototype はインスタンスではないジオメトリ
+		 transform: prototype の座標からこのジオメトリの座標へ
+		*/
+		int prototype = -1;
+		glm::dmat4 transform = glm::dmat4(1.0);
+
+		// 読み込み時の重複検出用 (instanceDuplicates)
+		// contentHash: ローカル座標での形とアトリビュートのハッシュ。0 なら調べない
+		// localToWorld: ローカル座標から points の座標へ
+		uint64_t contentHash = 0;
+		glm::dmat4 localToWorld = glm::dmat4(1.0);
 	};
 
 	class Scene {
@@ -30,4 +122,53 @@ namespace rt {
 		std::vector<Geometry> geometries;
 		rt::Camera camera;
 	};
+
+	/*
+	 四角形メッシュを三角形メッシュにする。Embree と同じく (0, 1, 3), (2, 3, 1) に分け、
+	 最後の頂点を繰り返した三角形はそのまま 1 枚にする。
+	 分けた 2 枚が矩形光源なら triangleIndex を 0, 1 の決まりに合わせる
+	*/
+	inline void triangulateQuads(Geometry &geometry) {
+		if (geometry.quads.empty()) {
+			return;
+		}
+		std::vector<glm::uvec3> indices;
+		std::vector<Geometry::Primitive> primitives;
+		indices.reserve(geometry.quads.size() * 2);
+		primitives.reserve(geometry.quads.size() * 2);
+
+		// 矩形光源のマテリアルは triangleIndex 0, 1 の 2 つに分ける。分けた先の番号
+		std::vector<glm::ivec2> splitted(geometry.materials.size(), glm::ivec2(-1));
+		auto split = [&](uint32_t index, int triangleIndex) -> uint32_t {
+			auto lambertian = dynamic_cast<LambertianMaterial *>(geometry.materials[index].get());
+			if (lambertian == nullptr || lambertian->samplingStrategy.get<SphericalRectangleSample>() == nullptr) {
+				return index;
+			}
+			if (splitted[index][triangleIndex] < 0) {
+				Material m = geometry.materials[index];
+				dynamic_cast<LambertianMaterial *>(m.get())->samplingStrategy.get<SphericalRectangleSample>()->triangleIndex = triangleIndex;
+				splitted[index][triangleIndex] = (int)geometry.materials.size();
+				geometry.materials.push_back(m);
+			}
+			return splitted[index][triangleIndex];
+		};
+
+		for (int j = 0; j < geometry.quads.size(); ++j) {
+			const glm::uvec4 &q = geometry.quads[j];
+			indices.emplace_back(q[0], q[1], q[3]);
+			primitives.push_back(geometry.primitives[j]);
+			if (q[2] == q[3]) {
+				continue;
+			}
+			indices.emplace_back(q[2], q[3], q[1]);
+			primitives.push_back(geometry.primitives[j]);
+
+			primitives[primitives.size() - 2].material = split(geometry.primitives[j].material, 0);
+			primitives.back().material = split(geometry.primitives[j].material, 1);
+		}
+		geometry.indices.swap(indices);
+		geometry.primitives.swap(primitives);
+		geometry.quads.clear();
+		geometry.quads.shrink_to_fit();
+	}
 }
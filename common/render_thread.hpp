@@ -0,0 +1,125 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <tbb/concurrent_queue.h>
+
+#include "integrator.hpp"
+#include "stopwatch.hpp"
+#include "tonemap.hpp"
+#include "triple_buffer.hpp"
+
+namespace rt {
+	/*
+	 PTRenderer を専用のスレッドで回し続ける。
+	 表示側はトーンマップ済みのフレームをトリプルバッファから受け取るだけで、レンダリングを待たない。
+	 カメラ, マテリアル, 設定などの変更はコマンドとして積み、パスの合間にレンダリングスレッドで適用する。
+	 コマンドは renderer そのものを差し替えてもよい
+	*/
+	class RenderThread {
+	public:
+		struct Frame {
+			int width = 0;
+			int height = 0;
+			int steps = 0;
+			int badSampleNanCount = 0;
+			int badSampleInfCount = 0;
+			int badSampleNegativeCount = 0;
+			int badSampleFireflyCount = 0;
+			std::vector<uint8_t> rgb;
+		};
+		using Command = std::function<void(std::shared_ptr<PTRenderer> &)>;
+
+		// onStep はパスが終わるたびにレンダリングスレッドで呼ばれる (保存など)
+		RenderThread(std::shared_ptr<PTRenderer> renderer, std::function<void(const PTRenderer &)> onStep = std::function<void(const PTRenderer &)>())
+			: _renderer(renderer)
+			, _onStep(onStep)
+			, _thread([this]() { run(); }) {
+		}
+		~RenderThread() {
+			_quit = true;
+			_thread.join();
+		}
+		RenderThread(const RenderThread &) = delete;
+		void operator=(const RenderThread &) = delete;
+
+		void post(Command command) {
+			_commands.push(std::move(command));
+		}
+		void setPaused(bool paused) {
+			_paused = paused;
+		}
+
+		// 表示側。新しいフレームが来ていれば true
+		bool pullFrame() {
+			return _frames.update();
+		}
+		const Frame &frame() const {
+			return _frames.readBuffer();
+		}
+
+		// トーンマップしたフレームを出す最短の間隔
+		void setFrameInterval(double seconds) {
+			_frameInterval = seconds;
+		}
+	private:
+		void run() {
+			Stopwatch frameTime;
+			while (_quit == false) {
+				bool applied = false;
+				Command command;
+				while (_commands.try_pop(command)) {
+					command(_renderer);
+					applied = true;
+				}
+
+				if (_paused) {
+					if (applied) {
+						publish();
+					}
+					std::this_thread::sleep_for(std::chrono::milliseconds(5));
+					continue;
+				}
+
+				// プレビューのパスはすぐに見せる
+				bool preview = 1 < _renderer->previewScale();
+				_renderer->step();
+				if (_onStep) {
+					_onStep(*_renderer);
+				}
+
+				if (_frameInterval < frameTime.elapsed() || applied || preview) {
+					publish();
+					frameTime = Stopwatch();
+				}
+			}
+		}
+		void publish() {
+			const Image &image = _renderer->_image;
+			Frame &frame = _frames.writeBuffer();
+			frame.width = image.width();
+			frame.height = image.height();
+			frame.steps = _renderer->stepCount();
+			frame.badSampleNanCount = _renderer->badSampleNanCount();
+			frame.badSampleInfCount = _renderer->badSampleInfCount();
+			frame.badSampleNegativeCount = _renderer->badSampleNegativeCount();
+			frame.badSampleFireflyCount = _renderer->badSampleFireflyCount();
+			frame.rgb.resize((size_t)frame.width * frame.height * 3);
+			toneMapGamma(_renderer->displayPixels(), frame.width, frame.height, frame.rgb.data());
+			_frames.publish();
+		}
+
+		std::shared_ptr<PTRenderer> _renderer;
+		std::function<void(const PTRenderer &)> _onStep;
+		tbb::concurrent_queue<Command> _commands;
+		TripleBuffer<Frame> _frames;
+		std::atomic<bool> _paused{ false };
+		std::atomic<bool> _quit{ false };
+		std::atomic<double> _frameInterval{ 1.0 / 60.0 };
+		std::thread _thread;
+	};
+}
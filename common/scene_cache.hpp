@@ -0,0 +1,632 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <tbb/tbb.h>
+
+#include "alembic_loader.hpp"
+#include "hash.hpp"
+#include "mapped_file.hpp"
+#include "scene_interface.hpp"
+
+namespace rt {
+	/*
+	 前処理済みのシーンのキャッシュ。
+	 alembic を読み、マテリアルを結びつけ、法線を計算した結果をそのまま置いておき、
+	 次からは mmap して位置と頂点番号を Embree に共有バッファで渡す (コピーも解析もしない)。
+
+	 キーは元ファイルの中身のハッシュ, kAlembicLoaderVersion, kSceneCacheVersion。
+	 どれかが違えば使わない。
+
+	 [Header]
+	 [GeometryRecord x geometryCount]
+	 [MaterialRecord x materialCount]  マテリアルの表 (同じものは 1 つにまとめる)
+	 ジオメトリごとに
+	   名前
+	   位置       float3 x pointCount      Embree の頂点バッファ。後ろに 16 バイトの余白
+	   頂点番号   uint32 x primitiveVertices x primitiveCount Embree のインデックスバッファ (3: 三角形, 4: 四角形)
+	   法線       double3 x primitiveCount
+	   マテリアル uint32 x primitiveCount  表の番号
+	 各区画は kSceneCacheAlignment に揃える
+	 インスタンスは GeometryRecord にプロトタイプの番号と変換だけを持ち、位置以降は空
+	*/
+	const uint32_t kSceneCacheVersion = 3;
+	const size_t kSceneCacheAlignment = 64;
+
+	class SceneCache {
+	public:
+		// 元ファイルの中身とローダーのバージョンから作るキー
+		static uint64_t sourceKey(const char *sourcePath) {
+			uint64_t key = fnv1a64(&kSceneCacheVersion, sizeof(kSceneCacheVersion));
+			key = fnv1a64(&kAlembicLoaderVersion, sizeof(kAlembicLoaderVersion), key);
+			MappedFile source;
+			if (source.open(sourcePath, MappedFile::ReadOnly)) {
+				key = fnv1a64(source.data(), source.size(), key);
+			}
+			return key;
+		}
+
+		// 書き終わってから名前を変えるので、途中で止まっても壊れたキャッシュは残らない
+		// 表せないマテリアルがあれば書かずに false
+		static bool write(const char *path, const Scene &scene, uint64_t key) {
+			std::vector<MaterialRecord> materials;
+			std::map<std::string, uint32_t> materialIndices;
+			std::vector<std::vector<uint32_t>> primitiveMaterials(scene.geometries.size());
+			for (int i = 0; i < scene.geometries.size(); ++i) {
+				const Geometry &geometry = scene.geometries[i];
+				// ジオメトリのマテリアルの表から、ファイル全体の表の番号へ
+				std::vector<uint32_t> globalIndices(geometry.materials.size());
+				for (int j = 0; j < geometry.materials.size(); ++j) {
+					MaterialRecord record;
+					if (toRecord(geometry.materials[j].get(), &record) == false) {
+						printf("scene cache: %s has a material that can't be cached\n", geometry.name.c_str());
+						return false;
+					}
+					std::string bytes((const char *)&record, sizeof(record));
+					auto it = materialIndices.find(bytes);
+					if (it == materialIndices.end()) {
+						it = materialIndices.insert(std::make_pair(bytes, (uint32_t)materials.size())).first;
+						materials.push_back(record);
+					}
+					globalIndices[j] = it->second;
+				}
+				primitiveMaterials[i].resize(geometry.primitives.size());
+				for (int j = 0; j < geometry.primitives.size(); ++j) {
+					primitiveMaterials[i][j] = globalIndices[geometry.primitives[j].material];
+				}
+			}
+
+			// 配置を決める
+			size_t offset = align(sizeof(Header));
+			size_t geometryTableOffset = offset;
+			offset = align(offset + sizeof(GeometryRecord) * scene.geometries.size());
+			size_t materialTableOffset = offset;
+			offset = align(offset + sizeof(MaterialRecord) * materials.size());
+			std::vector<GeometryRecord> records(scene.geometries.size());
+			for (int i = 0; i < scene.geometries.size(); ++i) {
+				const Geometry &geometry = scene.geometries[i];
+				GeometryRecord &record = records[i];
+				memset(&record, 0, sizeof(record));
+				record.pointCount = geometry.pointCount();
+				record.primitiveCount = geometry.primitives.size();
+				record.shapeHash = geometry.shapeHash;
+				record.materialHash = geometry.materialHash;
+				record.nameOffset = offset;
+				record.nameLength = (uint32_t)geometry.name.size();
+				record.primitiveVertices = geometry.hasSharedShape() ? geometry.shared.primitiveVertices : geometry.quads.empty() ? 3 : 4;
+				record.prototype = geometry.prototype;
+				memcpy(record.transform, glm::value_ptr(geometry.transform), sizeof(record.transform));
+				offset = align(offset + geometry.name.size());
+				record.positionsOffset = offset;
+				offset = align(offset + sizeof(float) * 3 * record.pointCount + 16);
+				record.indicesOffset = offset;
+				offset = align(offset + sizeof(uint32_t) * record.primitiveVertices * record.primitiveCount);
+				record.normalsOffset = offset;
+				offset = align(offset + sizeof(double) * 3 * record.primitiveCount);
+				record.materialsOffset = offset;
+				offset = align(offset + sizeof(uint32_t) * record.primitiveCount);
+			}
+			size_t fileSize = offset;
+
+			std::string temporary = std::string(path) + ".tmp";
+			MappedFile file;
+			if (file.open(temporary.c_str(), MappedFile::ReadWrite, fileSize) == false) {
+				printf("scene cache: can't create %s\n", temporary.c_str());
+				return false;
+			}
+			uint8_t *base = static_cast<uint8_t *>(file.data());
+			memset(base, 0, fileSize);
+
+			Header header;
+			memset(&header, 0, sizeof(header));
+			memcpy(header.magic, kMagic, sizeof(header.magic));
+			header.version = kSceneCacheVersion;
+			header.geometryCount = (uint32_t)scene.geometries.size();
+			header.materialCount = (uint32_t)materials.size();
+			header.key = key;
+			header.fileSize = fileSize;
+			header.geometryTableOffset = geometryTableOffset;
+			header.materialTableOffset = materialTableOffset;
+			header.camera = toRecord(scene.camera.setting());
+			memcpy(base, &header, sizeof(header));
+			if (records.empty() == false) {
+				memcpy(base + geometryTableOffset, records.data(), sizeof(GeometryRecord) * records.size());
+			}
+			if (materials.empty() == false) {
+				memcpy(base + materialTableOffset, materials.data(), sizeof(MaterialRecord) * materials.size());
+			}
+
+			tbb::parallel_for(tbb::blocked_range<int>(0, (int)scene.geometries.size(), 1), [&](const tbb::blocked_range<int> &range) {
+				for (int i = range.begin(); i < range.end(); ++i) {
+					const Geometry &geometry = scene.geometries[i];
+					const GeometryRecord &record = records[i];
+					memcpy(base + record.nameOffset, geometry.name.data(), geometry.name.size());
+
+					float *positions = reinterpret_cast<float *>(base + record.positionsOffset);
+					uint32_t *indices = reinterpret_cast<uint32_t *>(base + record.indicesOffset);
+					if (geometry.hasSharedShape()) {
+						// キャッシュから読んだシーンを書き直すとき
+						memcpy(positions, geometry.shared.positions, sizeof(float) * 3 * record.pointCount);
+						memcpy(indices, geometry.shared.indices, sizeof(uint32_t) * record.primitiveVertices * record.primitiveCount);
+					}
+					else {
+						for (size_t j = 0; j < record.pointCount; ++j) {
+							for (int k = 0; k < 3; ++k) {
+								positions[j * 3 + k] = geometry.points[j].P[k];
+							}
+						}
+						if (geometry.quads.empty() == false) {
+							memcpy(indices, geometry.quads.data(), sizeof(glm::uvec4) * geometry.quads.size());
+						}
+						else if (geometry.indices.empty() == false) {
+							memcpy(indices, geometry.indices.data(), sizeof(glm::uvec3) * geometry.indices.size());
+						}
+					}
+					double *normals = reinterpret_cast<double *>(base + record.normalsOffset);
+					for (size_t j = 0; j < record.primitiveCount; ++j) {
+						for (int k = 0; k < 3; ++k) {
+							normals[j * 3 + k] = geometry.primitives[j].Ng[k];
+						}
+					}
+					if (record.primitiveCount != 0) {
+						memcpy(base + record.materialsOffset, primitiveMaterials[i].data(), sizeof(uint32_t) * record.primitiveCount);
+					}
+				}
+			});
+
+			bool flushed = file.flush(0, fileSize);
+			file.close();
+			if (flushed == false || rename(temporary.c_str(), path) != 0) {
+				printf("scene cache: can't write %s\n", path);
+				remove(temporary.c_str());
+				return false;
+			}
+			return true;
+		}
+
+		/*
+		 キャッシュが key と一致すれば空の scene を埋め、位置と頂点番号を共有した SceneInterface を返す
+		 無い, 古い, 壊れているときは nullptr で、scene は空のまま
+		 build: Embree のシーンの作り方 (SceneInterface)
+		*/
+		static std::shared_ptr<SceneInterface> load(const char *path, uint64_t key, std::shared_ptr<Scene> scene, SceneBuildSettings build = SceneBuildSettings()) {
+			std::shared_ptr<MappedFile> file(new MappedFile());
+			if (file->open(path, MappedFile::ReadOnly) == false) {
+				return std::shared_ptr<SceneInterface>();
+			}
+			const uint8_t *base = static_cast<const uint8_t *>(file->data());
+			size_t size = file->size();
+			if (size < sizeof(Header)) {
+				return std::shared_ptr<SceneInterface>();
+			}
+			Header header;
+			memcpy(&header, base, sizeof(header));
+			if (memcmp(header.magic, kMagic, sizeof(header.magic)) != 0 || header.version != kSceneCacheVersion) {
+				return std::shared_ptr<SceneInterface>();
+			}
+			if (header.key != key || header.fileSize != size) {
+				return std::shared_ptr<SceneInterface>();
+			}
+			if (inside(header.geometryTableOffset, sizeof(GeometryRecord) * header.geometryCount, size) == false ||
+				inside(header.materialTableOffset, sizeof(MaterialRecord) * header.materialCount, size) == false) {
+				return std::shared_ptr<SceneInterface>();
+			}
+			const GeometryRecord *records = reinterpret_cast<const GeometryRecord *>(base + header.geometryTableOffset);
+			for (uint32_t i = 0; i < header.geometryCount; ++i) {
+				const GeometryRecord &record = records[i];
+				bool valid =
+					inside(record.nameOffset, record.nameLength, size) &&
+					inside(record.positionsOffset, sizeof(float) * 3 * record.pointCount + 16, size) &&
+					(record.primitiveVertices == 3 || record.primitiveVertices == 4) &&
+					(record.prototype < 0 || (record.prototype < (int32_t)header.geometryCount && records[record.prototype].prototype < 0)) &&
+					inside(record.indicesOffset, sizeof(uint32_t) * record.primitiveVertices * record.primitiveCount, size) &&
+					inside(record.normalsOffset, sizeof(double) * 3 * record.primitiveCount, size) &&
+					inside(record.materialsOffset, sizeof(uint32_t) * record.primitiveCount, size);
+				if (valid == false) {
+					return std::shared_ptr<SceneInterface>();
+				}
+			}
+
+			const MaterialRecord *materialRecords = reinterpret_cast<const MaterialRecord *>(base + header.materialTableOffset);
+			std::vector<Material> materials(header.materialCount);
+			for (uint32_t i = 0; i < header.materialCount; ++i) {
+				if (fromRecord(materialRecords[i], &materials[i]) == false) {
+					return std::shared_ptr<SceneInterface>();
+				}
+			}
+
+			/*
+			 位置と頂点番号はマップしたまま Geometry::shared から指し、ヒープにはコピーしない。
+			 光源の sampler を作るときに、光るジオメトリだけ CPU 側に取り出す (Geometry::materializeShape)
+			 交差判定で引く法線とマテリアルはプリミティブごとに持つ
+			 頂点番号は Embree に渡す前に範囲だけ確かめる
+			*/
+			Scene *loaded = scene.get();
+			loaded->camera = Camera(fromRecord(header.camera));
+			loaded->geometries.resize(header.geometryCount);
+
+			std::shared_ptr<const void> owner = file;
+			std::atomic<bool> valid(true);
+			tbb::parallel_for(tbb::blocked_range<int>(0, (int)header.geometryCount, 1), [&](const tbb::blocked_range<int> &range) {
+				for (int i = range.begin(); i < range.end(); ++i) {
+					const GeometryRecord &record = records[i];
+					Geometry &geometry = loaded->geometries[i];
+					geometry.name.assign((const char *)base + record.nameOffset, record.nameLength);
+					geometry.shapeHash = record.shapeHash;
+					geometry.materialHash = record.materialHash;
+					geometry.prototype = record.prototype;
+					memcpy(glm::value_ptr(geometry.transform), record.transform, sizeof(record.transform));
+					if (0 <= record.prototype || record.primitiveCount == 0) {
+						continue;
+					}
+
+					const uint32_t *indices = reinterpret_cast<const uint32_t *>(base + record.indicesOffset);
+					size_t indexCount = (size_t)record.primitiveVertices * record.primitiveCount;
+					uint32_t maxIndex = *std::max_element(indices, indices + indexCount);
+					if (record.pointCount <= maxIndex) {
+						valid = false;
+						continue;
+					}
+					geometry.shared.positions = reinterpret_cast<const float *>(base + record.positionsOffset);
+					geometry.shared.pointCount = record.pointCount;
+					geometry.shared.indices = indices;
+					geometry.shared.primitiveVertices = (int)record.primitiveVertices;
+					geometry.shared.owner = owner;
+
+					const double *normals = reinterpret_cast<const double *>(base + record.normalsOffset);
+					const uint32_t *materialIndices = reinterpret_cast<const uint32_t *>(base + record.materialsOffset);
+					// ファイル全体の表から、使っているものだけをジオメトリの表に入れる
+					std::unordered_map<uint32_t, uint32_t> localIndices;
+					geometry.primitives.resize(record.primitiveCount);
+					for (size_t j = 0; j < record.primitiveCount; ++j) {
+						Geometry::Primitive &primitive = geometry.primitives[j];
+						primitive.Ng = glm::dvec3(normals[j * 3], normals[j * 3 + 1], normals[j * 3 + 2]);
+						if (header.materialCount <= materialIndices[j]) {
+							valid = false;
+							break;
+						}
+						auto it = localIndices.find(materialIndices[j]);
+						if (it == localIndices.end()) {
+							it = localIndices.insert(std::make_pair(materialIndices[j], (uint32_t)geometry.materials.size())).first;
+							geometry.materials.push_back(materials[materialIndices[j]]);
+						}
+						primitive.material = it->second;
+					}
+				}
+			});
+			if (valid == false) {
+				loaded->geometries.clear();
+				return std::shared_ptr<SceneInterface>();
+			}
+			return std::make_shared<SceneInterface>(scene, false, build);
+		}
+	private:
+		static constexpr const char *kMagic = "MRSCENE";
+
+		struct CameraRecord {
+			double fovy;
+			double eye[3];
+			double lookat[3];
+			double up[3];
+			int32_t imageWidth;
+			int32_t imageHeight;
+			double lensRadius;
+			double focasDistance;
+		};
+		struct Header {
+			char magic[8];
+			uint32_t version;
+			uint32_t geometryCount;
+			uint64_t key;
+			uint64_t fileSize;
+			uint32_t materialCount;
+			uint32_t reserved;
+			uint64_t geometryTableOffset;
+			uint64_t materialTableOffset;
+			CameraRecord camera;
+		};
+		struct GeometryRecord {
+			uint64_t nameOffset;
+			uint32_t nameLength;
+			uint32_t primitiveVertices;
+			uint64_t pointCount;
+			uint64_t primitiveCount;
+			uint64_t positionsOffset;
+			uint64_t indicesOffset;
+			uint64_t normalsOffset;
+			uint64_t materialsOffset;
+			uint64_t shapeHash;
+			uint64_t materialHash;
+			int32_t prototype; // インスタンスでなければ -1
+			uint32_t reserved;
+			double transform[16];
+		};
+
+		enum MaterialType : uint32_t {
+			kLambertian,
+			kSpecular,
+			kDielectrics,
+			kMicrofacetConductor,
+			kMicrofacetCoupledConductor,
+			kMicrofacetCoupledDielectrics,
+			kMicrofacetVelvet,
+			kMicrofacetVelvetEnergyLoss,
+			kMicrofacetGGXConductor,
+			kMicrofacetGGXCoupledConductor,
+			kMicrofacetGGXCoupledDielectrics,
+			kHeitzConductor
+		};
+		enum MaterialFlag : uint32_t {
+			kBackEmission = 1,
+			kUseFresnel = 2
+		};
+		// 光源のサンプリング方法
+		enum Sampling : uint32_t {
+			kNoSample,
+			kAreaSample,
+			kSphericalTriangleSample,
+			kSphericalRectangleSample
+		};
+		// マテリアルの種類ごとに使うところだけを埋める。残りは 0
+		struct MaterialRecord {
+			uint32_t type;
+			uint32_t flags;
+			double alpha;
+			double colors[2][3];
+			uint32_t sampling;
+			int32_t triangleIndex;
+			double s[3];
+			double ex[3];
+			double ey[3];
+		};
+
+		static size_t align(size_t offset) {
+			return (offset + kSceneCacheAlignment - 1) / kSceneCacheAlignment * kSceneCacheAlignment;
+		}
+		static bool inside(uint64_t offset, uint64_t bytes, size_t size) {
+			return offset <= size && bytes <= size - offset;
+		}
+		static void storeVec(double *dst, const glm::dvec3 &v) {
+			for (int i = 0; i < 3; ++i) {
+				dst[i] = v[i];
+			}
+		}
+		static glm::dvec3 loadVec(const double *src) {
+			return glm::dvec3(src[0], src[1], src[2]);
+		}
+
+		static CameraRecord toRecord(const CameraSetting &setting) {
+			CameraRecord record;
+			memset(&record, 0, sizeof(record));
+			record.fovy = setting.fovy;
+			storeVec(record.eye, setting.eye);
+			storeVec(record.lookat, setting.lookat);
+			storeVec(record.up, setting.up);
+			record.imageWidth = setting.imageWidth;
+			record.imageHeight = setting.imageHeight;
+			record.lensRadius = setting.lensRadius;
+			record.focasDistance = setting.focasDistance;
+			return record;
+		}
+		static CameraSetting fromRecord(const CameraRecord &record) {
+			CameraSetting setting;
+			setting.fovy = record.fovy;
+			setting.eye = loadVec(record.eye);
+			setting.lookat = loadVec(record.lookat);
+			setting.up = loadVec(record.up);
+			setting.imageWidth = record.imageWidth;
+			setting.imageHeight = record.imageHeight;
+			setting.lensRadius = record.lensRadius;
+			setting.focasDistance = record.focasDistance;
+			return setting;
+		}
+
+		static bool toRecord(const IMaterial *m, MaterialRecord *record) {
+			memset(record, 0, sizeof(*record));
+			if (auto lambertian = dynamic_cast<const LambertianMaterial *>(m)) {
+				record->type = kLambertian;
+				record->flags = lambertian->backEmission ? kBackEmission : 0;
+				storeVec(record->colors[0], lambertian->Le);
+				storeVec(record->colors[1], lambertian->R);
+				if (lambertian->samplingStrategy.get<AreaSample>()) {
+					record->sampling = kAreaSample;
+				}
+				else if (lambertian->samplingStrategy.get<SphericalTriangleSample>()) {
+					record->sampling = kSphericalTriangleSample;
+				}
+				else if (auto sample = lambertian->samplingStrategy.get<SphericalRectangleSample>()) {
+					record->sampling = kSphericalRectangleSample;
+					record->triangleIndex = sample->triangleIndex;
+					storeVec(record->s, sample->s);
+					storeVec(record->ex, sample->ex);
+					storeVec(record->ey, sample->ey);
+				}
+			}
+			else if (dynamic_cast<const SpecularMaterial *>(m)) {
+				record->type = kSpecular;
+			}
+			else if (auto dielectrics = dynamic_cast<const DielectricsMaterial *>(m)) {
+				record->type = kDielectrics;
+				storeVec(record->colors[0], dielectrics->sigma);
+				storeVec(record->colors[1], dielectrics->eta_dielectrics);
+			}
+			else if (auto conductor = dynamic_cast<const MicrofacetConductorMaterial *>(m)) {
+				record->type = kMicrofacetConductor;
+				record->flags = conductor->useFresnel ? kUseFresnel : 0;
+				record->alpha = conductor->alpha;
+				storeVec(record->colors[0], conductor->eta);
+				storeVec(record->colors[1], conductor->k);
+			}
+			else if (auto conductor = dynamic_cast<const MicrofacetCoupledConductorMaterial *>(m)) {
+				record->type = kMicrofacetCoupledConductor;
+				record->flags = conductor->useFresnel ? kUseFresnel : 0;
+				record->alpha = conductor->alpha;
+				storeVec(record->colors[0], conductor->eta);
+				storeVec(record->colors[1], conductor->k);
+			}
+			else if (auto dielectrics = dynamic_cast<const MicrofacetCoupledDielectricsMaterial *>(m)) {
+				record->type = kMicrofacetCoupledDielectrics;
+				record->alpha = dielectrics->alpha;
+				storeVec(record->colors[0], dielectrics->Cd);
+			}
+			else if (auto conductor = dynamic_cast<const MicrofacetGGXConductorMaterial *>(m)) {
+				record->type = kMicrofacetGGXConductor;
+				record->flags = conductor->useFresnel ? kUseFresnel : 0;
+				record->alpha = conductor->alpha;
+				storeVec(record->colors[0], conductor->eta);
+				storeVec(record->colors[1], conductor->k);
+			}
+			else if (auto conductor = dynamic_cast<const MicrofacetGGXCoupledConductorMaterial *>(m)) {
+				record->type = kMicrofacetGGXCoupledConductor;
+				record->flags = conductor->useFresnel ? kUseFresnel : 0;
+				record->alpha = conductor->alpha;
+				storeVec(record->colors[0], conductor->eta);
+				storeVec(record->colors[1], conductor->k);
+			}
+			else if (auto dielectrics = dynamic_cast<const MicrofacetGGXCoupledDielectricsMaterial *>(m)) {
+				record->type = kMicrofacetGGXCoupledDielectrics;
+				record->alpha = dielectrics->alpha;
+				storeVec(record->colors[0], dielectrics->Cd);
+			}
+			else if (auto conductor = dynamic_cast<const HeitzConductorMaterial *>(m)) {
+				record->type = kHeitzConductor;
+				record->flags = conductor->useFresnel ? kUseFresnel : 0;
+				record->alpha = conductor->alpha;
+				storeVec(record->colors[0], conductor->eta);
+				storeVec(record->colors[1], conductor->k);
+			}
+			else if (auto velvet = dynamic_cast<const MicrofacetVelvetMaterial *>(m)) {
+				record->type = kMicrofacetVelvet;
+				record->alpha = velvet->alpha;
+				storeVec(record->colors[0], velvet->Cd);
+			}
+			else if (auto velvet = dynamic_cast<const MicrofacetVelvetEnergyLossMaterial *>(m)) {
+				record->type = kMicrofacetVelvetEnergyLoss;
+				record->alpha = velvet->alpha;
+			}
+			else {
+				return false;
+			}
+			return true;
+		}
+		static bool fromRecord(const MaterialRecord &record, Material *material) {
+			switch (record.type) {
+			case kLambertian: {
+				LambertianMaterial m;
+				m.backEmission = (record.flags & kBackEmission) != 0;
+				m.Le = loadVec(record.colors[0]);
+				m.R = loadVec(record.colors[1]);
+				if (record.sampling == kAreaSample) {
+					m.samplingStrategy = AreaSample();
+				}
+				else if (record.sampling == kSphericalTriangleSample) {
+					m.samplingStrategy = SphericalTriangleSample();
+				}
+				else if (record.sampling == kSphericalRectangleSample) {
+					SphericalRectangleSample sample;
+					sample.triangleIndex = record.triangleIndex;
+					sample.s = loadVec(record.s);
+					sample.ex = loadVec(record.ex);
+					sample.ey = loadVec(record.ey);
+					m.samplingStrategy = sample;
+				}
+				*material = m;
+				break;
+			}
+			case kSpecular:
+				*material = SpecularMaterial();
+				break;
+			case kDielectrics: {
+				DielectricsMaterial m;
+				m.sigma = loadVec(record.colors[0]);
+				m.eta_dielectrics = loadVec(record.colors[1]);
+				*material = m;
+				break;
+			}
+			case kMicrofacetConductor: {
+				MicrofacetConductorMaterial m;
+				m.useFresnel = (record.flags & kUseFresnel) != 0;
+				m.alpha = record.alpha;
+				m.eta = loadVec(record.colors[0]);
+				m.k = loadVec(record.colors[1]);
+				*material = m;
+				break;
+			}
+			case kMicrofacetCoupledConductor: {
+				MicrofacetCoupledConductorMaterial m;
+				m.useFresnel = (record.flags & kUseFresnel) != 0;
+				m.alpha = record.alpha;
+				m.eta = loadVec(record.colors[0]);
+				m.k = loadVec(record.colors[1]);
+				*material = m;
+				break;
+			}
+			case kMicrofacetCoupledDielectrics: {
+				MicrofacetCoupledDielectricsMaterial m;
+				m.alpha = record.alpha;
+				m.Cd = loadVec(record.colors[0]);
+				*material = m;
+				break;
+			}
+			case kMicrofacetGGXConductor: {
+				MicrofacetGGXConductorMaterial m;
+				m.useFresnel = (record.flags & kUseFresnel) != 0;
+				m.alpha = record.alpha;
+				m.eta = loadVec(record.colors[0]);
+				m.k = loadVec(record.colors[1]);
+				*material = m;
+				break;
+			}
+			case kMicrofacetGGXCoupledConductor: {
+				MicrofacetGGXCoupledConductorMaterial m;
+				m.useFresnel = (record.flags & kUseFresnel) != 0;
+				m.alpha = record.alpha;
+				m.eta = loadVec(record.colors[0]);
+				m.k = loadVec(record.colors[1]);
+				*material = m;
+				break;
+			}
+			case kMicrofacetGGXCoupledDielectrics: {
+				MicrofacetGGXCoupledDielectricsMaterial m;
+				m.alpha = record.alpha;
+				m.Cd = loadVec(record.colors[0]);
+				*material = m;
+				break;
+			}
+			case kHeitzConductor: {
+				HeitzConductorMaterial m;
+				m.useFresnel = (record.flags & kUseFresnel) != 0;
+				m.alpha = record.alpha;
+				m.eta = loadVec(record.colors[0]);
+				m.k = loadVec(record.colors[1]);
+				*material = m;
+				break;
+			}
+			case kMicrofacetVelvet: {
+				MicrofacetVelvetMaterial m;
+				m.alpha = record.alpha;
+				m.Cd = loadVec(record.colors[0]);
+				*material = m;
+				break;
+			}
+			case kMicrofacetVelvetEnergyLoss: {
+				MicrofacetVelvetEnergyLossMaterial m;
+				m.alpha = record.alpha;
+				*material = m;
+				break;
+			}
+			default:
+				return false;
+			}
+			return true;
+		}
+	};
+}
@@ -1,5 +1,11 @@
 ﻿#pragma once
 #include <embree3/rtcore.h>
+#include <cfloat>
+#include <cstdio>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <tbb/tbb.h>
 
 #include "render_object.hpp"
 #include "microfacet.hpp"
@@ -9,103 +15,303 @@
 #include "geometry.hpp"
 #include "stopwatch.hpp"
 #include "direct_sampler.hpp"
+#include "rectangle_emitter.hpp"
+
+// 1 なら AreaSample, SphericalTriangleSample の三角形光源は、どちらもシェーディング点ごとに面積と立体角のサンプリングを選ぶ (AdaptiveTriangleSampler)
+// 0 なら指定どおりに固定する
+#ifndef ENABLE_ADAPTIVE_TRIANGLE_SAMPLING
+#define ENABLE_ADAPTIVE_TRIANGLE_SAMPLING 1
+#endif
 
 namespace rt {
 	inline void EmbreeErorrHandler(void* userPtr, RTCError code, const char* str) {
 		printf("Embree Error [%d] %s\n", code, str);
 	}
+	/*
+	 Embree のシーンの作り方
+	 quality: シーンの BVH の品質。LOW は速く作れるがトレースが遅い
+	 asyncUpgrade: quality が HIGH でなければ、commit のあと裏で HIGH の BVH を作り始め、
+	   出来たら swapUpgradedScene (パスの合間) で差し替える。すぐに描き始めたいとき向け
+	*/
+	struct SceneBuildSettings {
+		RTCBuildQuality quality = RTC_BUILD_QUALITY_HIGH;
+		bool asyncUpgrade = false;
+	};
+
+	// シーンを作るのにかかった時間の内訳
+	struct SceneBuildStatistics {
+		double attachSeconds = 0.0;   // Embree のジオメトリ作成 (並列)。読み込みと並行して attach したときは 0
+		double instanceSeconds = 0.0; // プロトタイプの BVH とインスタンス
+		double bvhSeconds = 0.0;      // シーンの BVH (rtcCommitScene)
+		double samplerSeconds = 0.0;  // 光源の sampler (並列)
+		double upgradeSeconds = 0.0;  // asyncUpgrade で裏で作った HIGH の BVH。差し替えるまでは 0
+	};
+
 	class SceneInterface {
 	public:
-		SceneInterface(std::shared_ptr<rt::Scene> scene) :_scene(scene) {
-			_embreeDevice = rtcNewDevice("set_affinity=1");
-			rtcSetDeviceErrorFunction(_embreeDevice, EmbreeErorrHandler, nullptr);
-			_embreeScene = rtcNewScene(_embreeDevice);
-			rtcSetSceneBuildQuality(_embreeScene, RTC_BUILD_QUALITY_HIGH);
-			// RTC_BUILD_QUALITY_LOW, RTC_BUILD_QUALITY_MEDIUM, RTC_BUILD_QUALITY_HIGH
+		/*
+		 dynamic: リロードで差分更新するシーン向け。
+		 RTC_SCENE_FLAG_DYNAMIC でジオメトリごとに BVH を持つ 2 段の構成になり、
+		 変わったジオメトリの BVH だけを作り直せる。そのかわりトレースは少し遅くなる
+		*/
+		SceneInterface(std::shared_ptr<rt::Scene> scene, bool dynamic = false, SceneBuildSettings build = SceneBuildSettings()) {
+			createScene(dynamic, build);
+			attachAll(scene);
+		}
 
-			for (int i = 0; i < _scene->geometries.size(); ++i) {
-				RTCGeometry embreeGeometry = rtcNewGeometry(_embreeDevice, RTC_GEOMETRY_TYPE_TRIANGLE);
+		/*
+		 NUMA ノードごとのレプリカ。Embree のシーンは自分で作るが、光源の sampler は primary のものを使う。
+		 sampler はシーンのマテリアル (LambertianMaterial::sampler) に結びついていて、LightSelector::p はそのポインタで探すので、
+		 レプリカごとに作るとマテリアルは最後に作ったものを指し、ほかのノードでは MIS の重みが狂う。
+		 primary の sampler が変わったら (rebuildSamplers) shareSamplers で取り直すこと。primary はレプリカより長く生きること
+		 BVH の品質と asyncUpgrade は primary と同じにする。裏で作った HIGH の BVH はレプリカごとに swapUpgradedScene で差し替える
+		*/
+		SceneInterface(std::shared_ptr<rt::Scene> scene, const SceneInterface &primary) : _samplerSource(&primary) {
+			createScene(false, primary._build);
+			attachAll(scene);
+		}
 
-				// バッファーはGeometryに結びつき、所有される
-				float *pVertexBuffer = (float *)rtcSetNewGeometryBuffer(embreeGeometry, RTC_BUFFER_TYPE_VERTEX, 0, RTC_FORMAT_FLOAT3, sizeof(float) * 3, _scene->geometries[i].points.size());
-				for (int j = 0; j < _scene->geometries[i].points.size(); ++j) {
-					auto p = _scene->geometries[i].points[j].P;
+		/*
+		 読み込みと並行して作る場合 (loadFromABCPipelined)。
+		 geometryCount 個の枠だけ用意しておき、出来上がったジオメトリから attach する。
+		 attach は別々の geomID なら複数のスレッドから同時に呼んでよい。全部揃ったら commit する
+		*/
+		SceneInterface(int geometryCount, bool dynamic = false, SceneBuildSettings build = SceneBuildSettings()) {
+			createScene(dynamic, build);
+			_buffers.resize(geometryCount);
+		}
+		void attach(int geomID, const Geometry &geometry) {
+			attachGeometry(geometry, geomID);
+		}
 
-					for (int k = 0; k < 3; ++k) {
-						pVertexBuffer[j * 3 + k] = p[k];
-					}
-				}
-				uint32_t *pIndexBuffer = (uint32_t *)rtcSetNewGeometryBuffer(embreeGeometry, RTC_BUFFER_TYPE_INDEX, 0, RTC_FORMAT_UINT3, sizeof(uint32_t) * 3, _scene->geometries[i].primitives.size());
-				for (int j = 0; j < _scene->geometries[i].primitives.size(); ++j) {
-					auto indices = _scene->geometries[i].primitives[j].indices;
-					for (int k = 0; k < 3; ++k) {
-						pIndexBuffer[j * 3 + k] = indices[k];
-					}
-				}
-				rtcCommitGeometry(embreeGeometry);
-				rtcAttachGeometryByID(_embreeScene, embreeGeometry, i);
-				rtcReleaseGeometry(embreeGeometry);
+		/*
+		 Geometry の代わりに外のメモリ (シーンキャッシュの mmap など) を Embree に渡す。
+		 vertices は float3 で、最後の要素の後ろ 16 バイトまで読めること。
+		 indices はプリミティブごとに primitiveVertices 個 (3: 三角形, 4: 四角形)。
+		 メモリは owner が保ち、この SceneInterface が消えるまで手放さない。
+		 reload で形が変わったときは Geometry のほうを共有し直す
+		 Geometry::shared を持つジオメトリは attach でこれを使う
+		*/
+		void attachShared(int geomID, const float *vertices, size_t pointCount, const uint32_t *indices, size_t primitiveCount, int primitiveVertices, std::shared_ptr<const void> owner) {
+			GeometryBuffers &buffers = _buffers[geomID];
+			buffers = GeometryBuffers();
+			if (primitiveCount == 0) {
+				return;
 			}
+			bool quad = primitiveVertices == 4;
+			RTCGeometry embreeGeometry = rtcNewGeometry(_embreeDevice, quad ? RTC_GEOMETRY_TYPE_QUAD : RTC_GEOMETRY_TYPE_TRIANGLE);
+			rtcSetSharedGeometryBuffer(embreeGeometry, RTC_BUFFER_TYPE_VERTEX, 0, RTC_FORMAT_FLOAT3, vertices, 0, sizeof(float) * 3, pointCount);
+			rtcSetSharedGeometryBuffer(embreeGeometry, RTC_BUFFER_TYPE_INDEX, 0, quad ? RTC_FORMAT_UINT4 : RTC_FORMAT_UINT3, indices, 0, sizeof(uint32_t) * primitiveVertices, primitiveCount);
+			rtcCommitGeometry(embreeGeometry);
+			rtcAttachGeometryByID(_embreeScene, embreeGeometry, geomID);
+			rtcReleaseGeometry(embreeGeometry);
+
+			buffers.pointCount = pointCount;
+			buffers.primitiveCount = primitiveCount;
+			buffers.quad = quad;
+			buffers.external = true;
+
+			std::lock_guard<std::mutex> lock(_ownersMutex);
+			_owners.push_back(owner);
+		}
+		void commit(std::shared_ptr<rt::Scene> scene) {
+			_scene = scene;
+			Stopwatch sw;
+			attachInstances();
+			_buildStatistics.instanceSeconds = sw.elapsed();
 
+			sw = Stopwatch();
 			rtcCommitScene(_embreeScene);
+			_buildStatistics.bvhSeconds = sw.elapsed();
 
 			rtcInitIntersectContext(&_context);
 
+			// 各ジオメトリの sampler はそのジオメトリのマテリアルにだけ書き込むので、並列に作れる
+			sw = Stopwatch();
+			if (_samplerSource) {
+				shareSamplers();
+			}
+			else {
+				_geometrySamplers.resize(_scene->geometries.size());
+				tbb::parallel_for(tbb::blocked_range<int>(0, (int)_scene->geometries.size()), [&](const tbb::blocked_range<int> &range) {
+					for (int i = range.begin(); i < range.end(); ++i) {
+						buildSamplers(_scene->geometries[i], &_geometrySamplers[i]);
+					}
+				});
+				updateSamplerList();
+			}
+			_buildStatistics.samplerSeconds = sw.elapsed();
+
+			updateAdaptiveEps();
+
+			if (_build.asyncUpgrade && _build.quality != RTC_BUILD_QUALITY_HIGH) {
+				startUpgrade();
+			}
+		}
 
-			for (int i = 0; i < _scene->geometries.size(); ++i) {
-				Geometry& g = _scene->geometries[i];
-				SphericalRectangleSampler *previous_sr_sampler = nullptr;
+		const SceneBuildStatistics &buildStatistics() const {
+			return _buildStatistics;
+		}
+		const SceneBuildSettings &buildSettings() const {
+			return _build;
+		}
 
-				for (int j = 0; j < g.primitives.size(); ++j) {
-					Geometry::Primitive &p = g.primitives[j];
-					IMaterial *m = g.primitives[j].material.get();
-					LambertianMaterial *lambertian = dynamic_cast<LambertianMaterial *>(m);
-					if (lambertian && lambertian->isEmission()) {
-						if (auto sample = lambertian->samplingStrategy.get<AreaSample>()) {
-							auto a = g.points[p.indices[0]].P;
-							auto b = g.points[p.indices[1]].P;
-							auto c = g.points[p.indices[2]].P;
-							TriangleAreaSampler *sampler = new TriangleAreaSampler(a, b, c, lambertian->backEmission, lambertian->Le);
-							lambertian->sampler = sampler;
-							_directSamplers.emplace_back(sampler);
-						}
-						else if (auto sample = lambertian->samplingStrategy.get<SphericalTriangleSample>()) {
-							auto a = g.points[p.indices[0]].P;
-							auto b = g.points[p.indices[1]].P;
-							auto c = g.points[p.indices[2]].P;
-							SphericalTriangleDirectSampler *sampler = new SphericalTriangleDirectSampler(a, b, c, lambertian->backEmission, lambertian->Le);
-							lambertian->sampler = sampler;
-							_directSamplers.emplace_back(sampler);
+		/*
+		 asyncUpgrade の HIGH の BVH が出来ていれば、トレースに使うシーンを差し替えて true を返す。
+		 トレースしているスレッドが無いとき (パスの合間) に呼ぶこと
+		*/
+		bool swapUpgradedScene() {
+			if (_upgrade.valid() == false || _upgrade.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+				return false;
+			}
+			_buildStatistics.upgradeSeconds = _upgrade.get();
+			std::swap(_embreeScene, _upgradedScene);
+			rtcReleaseScene(_upgradedScene);
+			_upgradedScene = nullptr;
+			return true;
+		}
+		bool upgradePending() const {
+			return _upgrade.valid();
+		}
+
+		struct ReloadStatistics {
+			int shapeChanged = 0;
+			int refitted = 0;
+			int materialChanged = 0;
+			int unchanged = 0;
+			double seconds = 0.0;
+		};
+
+		/*
+		 読み直したシーンとの差分だけを更新する。ステップの合間に呼ぶこと。
+		 ジオメトリの数と名前の並びが同じときだけ使え、そうでなければ false を返すので作り直すこと。
+		   形の変わったジオメトリ: 点と頂点の数 (と三角形か四角形か) が同じなら新しい点と頂点番号を共有し直し、違えば detach して作り直す
+		   アトリビュートが変わったジオメトリ: Embree には触らず、光源の sampler だけ作り直す
+		   変わっていないジオメトリ: sampler を結びつけたマテリアルの表ごと古いシーンから引き継ぐ
+		 Embree は古いシーンの points, indices を指しているので、形の変わっていないジオメトリは
+		 中身の同じ配列を next と入れ替え、古いシーンを手放しても指す先が残るようにする
+		 refit: アニメーションの次のフレームなど、形が少しずつ変わる場合。
+		   バッファを書き換えたジオメトリの BVH を作り直さず、木の構造はそのままで箱だけを更新する
+		 インスタンスは同じプロトタイプのままなら変換だけを差し替える。
+		 インスタンスの組み合わせが変わった, プロトタイプの形が変わったときは false
+		*/
+		bool reload(std::shared_ptr<rt::Scene> next, ReloadStatistics *statistics = nullptr, bool refit = false) {
+			Stopwatch sw;
+			// 作りかけの HIGH の BVH は同じジオメトリを指しているので、書き換える前に済ませておく
+			finishUpgrade();
+			std::vector<Geometry> &olds = _scene->geometries;
+			std::vector<Geometry> &news = next->geometries;
+			if (olds.size() != news.size()) {
+				return false;
+			}
+			for (int i = 0; i < olds.size(); ++i) {
+				if (olds[i].name != news[i].name) {
+					return false;
+				}
+				if (olds[i].prototype != news[i].prototype) {
+					return false;
+				}
+				if (_buffers[i].instance && news[i].prototype < 0 && olds[i].shapeHash != news[i].shapeHash) {
+					return false;
+				}
+			}
+
+			ReloadStatistics stats;
+			bool shapeChanged = false;
+			for (int i = 0; i < news.size(); ++i) {
+				bool shape = olds[i].shapeHash != news[i].shapeHash;
+				bool material = olds[i].materialHash != news[i].materialHash;
+				if (shape && 0 <= news[i].prototype) {
+					RTCGeometry instance = rtcGetGeometry(_embreeScene, i);
+					setInstanceTransform(instance, news[i].transform);
+					rtcCommitGeometry(instance);
+					_instanceNormals[i] = normalTransform(news[i].transform);
+					shapeChanged = true;
+					stats.shapeChanged++;
+				}
+				else if (shape) {
+					GeometryBuffers &buffers = _buffers[i];
+					bool sameType = buffers.quad == (news[i].quads.empty() == false);
+					if (buffers.primitiveCount != 0 && sameType && buffers.pointCount == news[i].points.size() && buffers.primitiveCount == news[i].primitives.size()) {
+						RTCGeometry embreeGeometry = rtcGetGeometry(_embreeScene, i);
+						shareBuffers(embreeGeometry, news[i]);
+						buffers.external = false;
+						rtcSetGeometryBuildQuality(embreeGeometry, refit ? RTC_BUILD_QUALITY_REFIT : RTC_BUILD_QUALITY_MEDIUM);
+						if (refit) {
+							stats.refitted++;
 						}
-						else if (auto sample = lambertian->samplingStrategy.get<SphericalRectangleSample>())
-						{
-							// あまり綺麗ではないが、triangleIndex 0, 1, 0, 1...となる決まりにする。
-							if (sample->triangleIndex == 0) {
-								SphericalRectangleSampler *sampler = new SphericalRectangleSampler(sample->s, sample->ex, sample->ey, lambertian->backEmission, lambertian->Le);
-								previous_sr_sampler = sampler;
-								lambertian->sampler = sampler;
-								_directSamplers.emplace_back(sampler);
-							}
-							else {
-								lambertian->sampler = previous_sr_sampler;
-							}
+						rtcCommitGeometry(embreeGeometry);
+					}
+					else {
+						if (buffers.primitiveCount != 0) {
+							rtcDetachGeometry(_embreeScene, i);
 						}
+						attachGeometry(news[i], i);
 					}
+					shapeChanged = true;
+					stats.shapeChanged++;
+				}
+				else if (material) {
+					stats.materialChanged++;
+				}
+				else {
+					stats.unchanged++;
 				}
+				if (shape == false) {
+					news[i].swapShape(olds[i]);
+				}
+
+				if (shape || material) {
+					_geometrySamplers[i].clear();
+					buildSamplers(news[i], &_geometrySamplers[i]);
+				}
+				else {
+					// 同じなので、sampler を結びつけたマテリアルの表ごと引き継ぐ
+					news[i].primitives.swap(olds[i].primitives);
+					news[i].materials.swap(olds[i].materials);
+				}
+			}
+			if (shapeChanged) {
+				rtcCommitScene(_embreeScene);
 			}
 
-			RTCBounds bounds;
-			rtcGetSceneBounds(_embreeScene, &bounds);
+			_scene = next;
+			updateSamplerList();
+			if (shapeChanged) {
+				updateAdaptiveEps();
+			}
 
-			float maxWide = bounds.upper_x - bounds.lower_x;
-			maxWide = std::max(maxWide, bounds.upper_y - bounds.lower_y);
-			maxWide = std::max(maxWide, bounds.upper_z - bounds.lower_z);
+			stats.seconds = sw.elapsed();
+			if (statistics) {
+				*statistics = stats;
+			}
+			return true;
+		}
+		/*
+		 ジオメトリ geomID のマテリアルを書き換えたあとに、光源の sampler だけを作り直す。Embree のシーンには触らない
+		*/
+		void rebuildSamplers(int geomID) {
+			_geometrySamplers[geomID].clear();
+			buildSamplers(_scene->geometries[geomID], &_geometrySamplers[geomID]);
+			updateSamplerList();
+		}
 
-			_sceneAdaptiveEps = std::max(maxWide * 1.0e-5, 1.0e-5);
-			// printf("_sceneAdaptiveEps %.10f\n", _sceneAdaptiveEps);
+		// レプリカ: primary の sampler の一覧を取り直す
+		void shareSamplers() {
+			_directSamplers = _samplerSource->_directSamplers;
 		}
+
 		~SceneInterface() {
+			if (_upgrade.valid()) {
+				_upgrade.wait();
+				rtcReleaseScene(_upgradedScene);
+			}
 			rtcReleaseScene(_embreeScene);
+			for (RTCScene prototypeScene : _prototypeScenes) {
+				if (prototypeScene) {
+					rtcReleaseScene(prototypeScene);
+				}
+			}
 			rtcReleaseDevice(_embreeDevice);
 		}
 		SceneInterface(const SceneInterface &) = delete;
@@ -165,12 +371,17 @@ namespace rt {
 
 			*tmin = rayhit.ray.tfar;
 
-			int index = rayhit.hit.geomID;
-			const auto &geom = _scene->geometries[index];
+			// インスタンスなら instID[0] がこのシーンでの番号で、形とマテリアルはプロトタイプのもの
+			int index = rayhit.hit.instID[0] == RTC_INVALID_GEOMETRY_ID ? rayhit.hit.geomID : rayhit.hit.instID[0];
+			const auto &placed = _scene->geometries[index];
+			const auto &geom = placed.prototype < 0 ? placed : _scene->geometries[placed.prototype];
 			const auto &prim = geom.primitives[rayhit.hit.primID];
-			*material = prim.material;
+			*material = geom.materials[prim.material];
 
 			glm::dvec3 Ng = prim.Ng;
+			if (0 <= placed.prototype) {
+				Ng = glm::normalize(_instanceNormals[index] * Ng);
+			}
 
 			// 裏面
 			bool backfacing = false;
@@ -190,9 +401,9 @@ namespace rt {
 			*/
 			//double u = rayhit.hit.u;
 			//double v = rayhit.hit.v;
-			//auto v0 = geom.points[prim.indices[0]].P;
-			//auto v1 = geom.points[prim.indices[1]].P;
-			//auto v2 = geom.points[prim.indices[2]].P;
+			//auto v0 = geom.points[geom.indices[rayhit.hit.primID][0]].P;
+			//auto v1 = geom.points[geom.indices[rayhit.hit.primID][1]].P;
+			//auto v2 = geom.points[geom.indices[rayhit.hit.primID][2]].P;
 			//(*material)->p = (1.0 - u - v) * v0 + u * v1 + v * v2;
 
 			(*material)->p = ro + rd * double(*tmin);
@@ -213,12 +424,317 @@ namespace rt {
 			return _directSamplers.size();
 		}
 
+	private:
+		void attachAll(std::shared_ptr<rt::Scene> scene) {
+			Stopwatch sw;
+			_buffers.resize(scene->geometries.size());
+			tbb::parallel_for(tbb::blocked_range<int>(0, (int)scene->geometries.size()), [&](const tbb::blocked_range<int> &range) {
+				for (int i = range.begin(); i < range.end(); ++i) {
+					attachGeometry(scene->geometries[i], i);
+				}
+			});
+			_buildStatistics.attachSeconds = sw.elapsed();
+			commit(scene);
+		}
+
+		// external: attachShared で渡された Geometry の外のメモリ
+		// instance: このシーンには Embree のインスタンスとして置いている (インスタンスと、インスタンスを持つプロトタイプ)
+		struct GeometryBuffers {
+			size_t pointCount = 0;
+			size_t primitiveCount = 0;
+			bool quad = false;
+			bool external = false;
+			bool instance = false;
+		};
+
+		// コピーはしない。geometry の points, indices (quads) は Embree が使う間は動かさないこと
+		static void shareBuffers(RTCGeometry embreeGeometry, const Geometry &geometry) {
+			rtcSetSharedGeometryBuffer(embreeGeometry, RTC_BUFFER_TYPE_VERTEX, 0, RTC_FORMAT_FLOAT3, geometry.points.data(), 0, sizeof(Geometry::Point), geometry.points.size());
+			if (geometry.quads.empty()) {
+				rtcSetSharedGeometryBuffer(embreeGeometry, RTC_BUFFER_TYPE_INDEX, 0, RTC_FORMAT_UINT3, geometry.indices.data(), 0, sizeof(glm::uvec3), geometry.indices.size());
+			}
+			else {
+				rtcSetSharedGeometryBuffer(embreeGeometry, RTC_BUFFER_TYPE_INDEX, 0, RTC_FORMAT_UINT4, geometry.quads.data(), 0, sizeof(glm::uvec4), geometry.quads.size());
+			}
+		}
+
+		void createScene(bool dynamic, SceneBuildSettings build) {
+			_embreeDevice = rtcNewDevice("set_affinity=1");
+			rtcSetDeviceErrorFunction(_embreeDevice, EmbreeErorrHandler, nullptr);
+			_dynamic = dynamic;
+			_build = build;
+			_embreeScene = newScene(build.quality);
+		}
+		RTCScene newScene(RTCBuildQuality quality) const {
+			RTCScene scene = rtcNewScene(_embreeDevice);
+			if (_dynamic) {
+				rtcSetSceneFlags(scene, RTC_SCENE_FLAG_DYNAMIC);
+			}
+			// RTC_BUILD_QUALITY_LOW, RTC_BUILD_QUALITY_MEDIUM, RTC_BUILD_QUALITY_HIGH
+			rtcSetSceneBuildQuality(scene, quality);
+			return scene;
+		}
+
+		/*
+		 いまのシーンと同じジオメトリ (共有バッファ, インスタンス) を並べた HIGH のシーンを作り、BVH は裏のスレッドで作る。
+		 Embree のジオメトリは複数のシーンに attach できるので、バッファはコピーしない
+		*/
+		void startUpgrade() {
+			_upgradedScene = newScene(RTC_BUILD_QUALITY_HIGH);
+			for (int i = 0; i < _buffers.size(); ++i) {
+				if (_buffers[i].primitiveCount != 0 || _buffers[i].instance) {
+					rtcAttachGeometryByID(_upgradedScene, rtcGetGeometry(_embreeScene, i), i);
+				}
+			}
+			RTCScene upgradedScene = _upgradedScene;
+			_upgrade = std::async(std::launch::async, [upgradedScene]() {
+				Stopwatch sw;
+				rtcCommitScene(upgradedScene);
+				return sw.elapsed();
+			});
+		}
+		void finishUpgrade() {
+			if (_upgrade.valid()) {
+				_upgrade.wait();
+				swapUpgradedScene();
+			}
+		}
+
+		static void setInstanceTransform(RTCGeometry instance, const glm::dmat4 &transform) {
+			glm::mat4 m(transform);
+			rtcSetGeometryTransform(instance, 0, RTC_FORMAT_FLOAT4X4_COLUMN_MAJOR, glm::value_ptr(m));
+		}
+		// 法線の変換 (余因子行列)。鏡映では三角形の向きと一緒に法線も裏返る
+		static glm::dmat3 normalTransform(const glm::dmat4 &transform) {
+			glm::dmat3 linear(transform);
+			return glm::determinant(linear) * glm::inverseTranspose(linear);
+		}
+		void attachInstance(int geomID, RTCScene prototypeScene, const glm::dmat4 &transform) {
+			RTCGeometry instance = rtcNewGeometry(_embreeDevice, RTC_GEOMETRY_TYPE_INSTANCE);
+			rtcSetGeometryInstancedScene(instance, prototypeScene);
+			setInstanceTransform(instance, transform);
+			rtcCommitGeometry(instance);
+			rtcAttachGeometryByID(_embreeScene, instance, geomID);
+			rtcReleaseGeometry(instance);
+			_buffers[geomID].instance = true;
+		}
+
+		/*
+		 インスタンスとそのプロトタイプを Embree のインスタンスとして置く。
+		 プロトタイプのジオメトリは専用の RTCScene に移して BVH を 1 度だけ作り、自分自身も単位行列のインスタンスとして置く。
+		 読み込みと並行して attach したあとでインスタンスになったジオメトリ (loadFromABCPipelined) は、ここで外す
+		*/
+		void attachInstances() {
+			const std::vector<Geometry> &geometries = _scene->geometries;
+			_prototypeScenes.resize(geometries.size(), nullptr);
+			_instanceNormals.resize(geometries.size(), glm::dmat3(1.0));
+
+			std::vector<int> prototypes;
+			for (int i = 0; i < geometries.size(); ++i) {
+				int p = geometries[i].prototype;
+				if (p < 0 || _prototypeScenes[p] || _buffers[p].primitiveCount == 0) {
+					continue;
+				}
+				RTCScene prototypeScene = rtcNewScene(_embreeDevice);
+				rtcSetSceneBuildQuality(prototypeScene, RTC_BUILD_QUALITY_HIGH);
+				RTCGeometry embreeGeometry = rtcGetGeometry(_embreeScene, p);
+				rtcRetainGeometry(embreeGeometry);
+				rtcDetachGeometry(_embreeScene, p);
+				rtcAttachGeometryByID(prototypeScene, embreeGeometry, 0);
+				rtcReleaseGeometry(embreeGeometry);
+				_prototypeScenes[p] = prototypeScene;
+				prototypes.push_back(p);
+			}
+
+			// プロトタイプの BVH は別々のシーンなので並列に作れる
+			tbb::parallel_for(tbb::blocked_range<int>(0, (int)prototypes.size(), 1), [&](const tbb::blocked_range<int> &range) {
+				for (int i = range.begin(); i < range.end(); ++i) {
+					rtcCommitScene(_prototypeScenes[prototypes[i]]);
+				}
+			});
+			for (int p : prototypes) {
+				attachInstance(p, _prototypeScenes[p], glm::dmat4(1.0));
+			}
+
+			for (int i = 0; i < geometries.size(); ++i) {
+				const Geometry &geometry = geometries[i];
+				if (geometry.prototype < 0 || _prototypeScenes[geometry.prototype] == nullptr) {
+					continue;
+				}
+				if (_buffers[i].primitiveCount != 0) {
+					rtcDetachGeometry(_embreeScene, i);
+				}
+				_buffers[i] = GeometryBuffers();
+				attachInstance(i, _prototypeScenes[geometry.prototype], geometry.transform);
+				_instanceNormals[i] = normalTransform(geometry.transform);
+			}
+		}
+
+		// 三角形の無いジオメトリ (読めなかったメッシュ) とインスタンスは Embree に渡さない。インスタンスは commit で置く
+		void attachGeometry(const Geometry &geometry, int geomID) {
+			if (geometry.hasSharedShape()) {
+				const Geometry::SharedShape &shared = geometry.shared;
+				attachShared(geomID, shared.positions, shared.pointCount, shared.indices, geometry.primitives.size(), shared.primitiveVertices, shared.owner);
+				return;
+			}
+			GeometryBuffers &buffers = _buffers[geomID];
+			buffers = GeometryBuffers();
+			if (geometry.primitives.empty()) {
+				return;
+			}
+
+			buffers.quad = geometry.quads.empty() == false;
+			RTCGeometry embreeGeometry = rtcNewGeometry(_embreeDevice, buffers.quad ? RTC_GEOMETRY_TYPE_QUAD : RTC_GEOMETRY_TYPE_TRIANGLE);
+
+			// バッファーは Geometry が所有し、Embree は共有するだけ
+			buffers.pointCount = geometry.points.size();
+			buffers.primitiveCount = geometry.primitives.size();
+			shareBuffers(embreeGeometry, geometry);
+
+			rtcCommitGeometry(embreeGeometry);
+			rtcAttachGeometryByID(_embreeScene, embreeGeometry, geomID);
+			rtcReleaseGeometry(embreeGeometry);
+		}
+
+		/*
+		 光源の sampler を作ってマテリアルに結びつける。sampler は samplers が所有する
+		 長方形になっている光る三角形の組は 1 つの SphericalRectangleSampler を共有し、それ以外は SamplingStrategy に従う
+		 光る四角形メッシュは読み込みで三角形に戻してある。あとから編集で光らせた四角形は sampler を持たず、
+		 BSDF のサンプリングで当たったときだけ寄与する
+		*/
+		static void buildSamplers(Geometry &g, std::vector<std::unique_ptr<IDirectSampler>> *samplers) {
+			// キャッシュから読んだジオメトリは、光るときだけ位置を CPU 側にも持つ
+			if (g.hasSharedShape()) {
+				for (const Material &material : g.materials) {
+					auto lambertian = dynamic_cast<const LambertianMaterial *>(material.get());
+					if (lambertian && lambertian->isEmission()) {
+						g.materializeShape();
+						break;
+					}
+				}
+			}
+
+			SphericalRectangleSampler *previous_sr_sampler = nullptr;
+
+			std::vector<IDirectSampler *> rectangleSamplers;
+			for (const RectangleEmitter &rectangle : findRectangleEmitters(g)) {
+				if (rectangleSamplers.empty()) {
+					rectangleSamplers.resize(g.primitives.size(), nullptr);
+				}
+				auto lambertian = dynamic_cast<const LambertianMaterial *>(g.material(rectangle.primitives[0]).get());
+				SphericalRectangleSampler *sampler = new SphericalRectangleSampler(rectangle.s, rectangle.ex, rectangle.ey, lambertian->backEmission, lambertian->Le);
+				samplers->emplace_back(sampler);
+				rectangleSamplers[rectangle.primitives[0]] = sampler;
+				rectangleSamplers[rectangle.primitives[1]] = sampler;
+			}
+
+			// sampler はプリミティブごとなので、sampler を持つプリミティブのマテリアルは自分だけのものにする。
+			// ほかのプリミティブと共有していれば表に複製を足して付け替える
+			std::vector<int> users(g.materials.size(), 0);
+			for (const Geometry::Primitive &primitive : g.primitives) {
+				users[primitive.material]++;
+			}
+			for (Material &material : g.materials) {
+				if (auto lambertian = dynamic_cast<LambertianMaterial *>(material.get())) {
+					lambertian->sampler = nullptr;
+				}
+			}
+			auto own = [&](int j) {
+				uint32_t index = g.primitives[j].material;
+				if (1 < users[index]) {
+					users[index]--;
+					Material copied = g.materials[index];
+					index = (uint32_t)g.materials.size();
+					g.materials.push_back(copied);
+					users.push_back(1);
+					g.primitives[j].material = index;
+				}
+				return dynamic_cast<LambertianMaterial *>(g.materials[index].get());
+			};
+
+			for (int j = 0; j < g.primitives.size(); ++j) {
+				auto lambertian = dynamic_cast<const LambertianMaterial *>(g.material(j).get());
+				if (lambertian == nullptr) {
+					continue;
+				}
+				IDirectSampler *sampler = nullptr;
+				if (rectangleSamplers.empty() == false && rectangleSamplers[j]) {
+					sampler = rectangleSamplers[j];
+				}
+				else if (lambertian->isEmission() && g.quads.empty()) {
+					bool area = lambertian->samplingStrategy.get<AreaSample>() != nullptr;
+					bool sphericalTriangle = lambertian->samplingStrategy.get<SphericalTriangleSample>() != nullptr;
+					if (area || sphericalTriangle) {
+						glm::dvec3 a = g.points[g.indices[j][0]].P;
+						glm::dvec3 b = g.points[g.indices[j][1]].P;
+						glm::dvec3 c = g.points[g.indices[j][2]].P;
+#if ENABLE_ADAPTIVE_TRIANGLE_SAMPLING
+						sampler = new AdaptiveTriangleSampler(a, b, c, lambertian->backEmission, lambertian->Le);
+#else
+						if (area) {
+							sampler = new TriangleAreaSampler(a, b, c, lambertian->backEmission, lambertian->Le);
+						}
+						else {
+							sampler = new SphericalTriangleDirectSampler(a, b, c, lambertian->backEmission, lambertian->Le);
+						}
+#endif
+						samplers->emplace_back(sampler);
+					}
+					else if (auto sample = lambertian->samplingStrategy.get<SphericalRectangleSample>())
+					{
+						// あまり綺麗ではないが、triangleIndex 0, 1, 0, 1...となる決まりにする。
+						if (sample->triangleIndex == 0) {
+							previous_sr_sampler = new SphericalRectangleSampler(sample->s, sample->ex, sample->ey, lambertian->backEmission, lambertian->Le);
+							samplers->emplace_back(previous_sr_sampler);
+						}
+						sampler = previous_sr_sampler;
+					}
+				}
+				if (sampler) {
+					own(j)->sampler = sampler;
+				}
+			}
+		}
+		void updateSamplerList() {
+			_directSamplers.clear();
+			for (auto &samplers : _geometrySamplers) {
+				for (auto &sampler : samplers) {
+					_directSamplers.push_back(sampler.get());
+				}
+			}
+		}
+
+		void updateAdaptiveEps() {
+			RTCBounds bounds;
+			rtcGetSceneBounds(_embreeScene, &bounds);
+
+			float maxWide = bounds.upper_x - bounds.lower_x;
+			maxWide = std::max(maxWide, bounds.upper_y - bounds.lower_y);
+			maxWide = std::max(maxWide, bounds.upper_z - bounds.lower_z);
+
+			_sceneAdaptiveEps = std::max(maxWide * 1.0e-5, 1.0e-5);
+			// printf("_sceneAdaptiveEps %.10f\n", _sceneAdaptiveEps);
+		}
+	public:
 		std::shared_ptr<rt::Scene> _scene;
 		RTCDevice _embreeDevice = nullptr;
 		RTCScene _embreeScene = nullptr;
 		mutable RTCIntersectContext _context;
 
 		std::vector<IDirectSampler *> _directSamplers;
+		std::vector<std::vector<std::unique_ptr<IDirectSampler>>> _geometrySamplers;
+		std::vector<GeometryBuffers> _buffers;
+		const SceneInterface *_samplerSource = nullptr; // レプリカなら primary
+		bool _dynamic = false;
+		SceneBuildSettings _build;
+		SceneBuildStatistics _buildStatistics;
+		RTCScene _upgradedScene = nullptr;
+		std::future<double> _upgrade;
+
+		std::vector<RTCScene> _prototypeScenes;   // ジオメトリの番号ごと。インスタンスを持つプロトタイプだけ
+		std::vector<glm::dmat3> _instanceNormals; // インスタンスの法線の変換
+		std::mutex _ownersMutex;
+		std::vector<std::shared_ptr<const void>> _owners;
 
 		double _sceneAdaptiveEps = 0.0f;
 	};
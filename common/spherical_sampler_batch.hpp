@@ -0,0 +1,241 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+
+#include <glm/glm.hpp>
+#include <glm/ext.hpp>
+
+#include "spherical_rectangle_sampler.hpp"
+#include "spherical_triangle_sampler.hpp"
+
+namespace rt {
+	/*
+	 球面長方形・球面三角形サンプリングの W 本 (4 か 8) ぶんをまとめて float で計算する。
+	 レーン k には (光源, 原点) の組をひとつ入れる。同じ光源で原点が違っても、同じ原点で光源が違ってもよい。
+	 値はレーンごとの配列 (SoA) に持ち、ループはすべて固定長 W なので、コンパイラがベクトル化できる。
+	 使わないレーンにも何か set しておくこと。
+	 原点ごとの準備がすでに double 版 (SphericalRectangleSamplerCoordinate, SphericalTriangleSampler) にあれば、
+	 それを set で写せば prepare は要らない (同じ光源から同じ原点に向けて何本も引く NEE の場合)。
+	 float なので、角の和から pi (2 pi) を引く立体角は、小さく見える光源ほど桁落ちする。
+	 立体角が 1e-2 以上 (AdaptiveTriangleSampler が立体角サンプリングを選ぶ範囲) なら、double 版との差は立体角で相対 1e-3 以下
+	*/
+	template <int W>
+	struct SphericalRectangleBatch {
+		static_assert(W == 4 || W == 8, "W must be 4 or 8");
+
+		void set(int k, const Rectangle &rectangle, const glm::dvec3 &o) {
+			glm::dvec3 d = rectangle.s() - o;
+			double z0 = glm::dot(d, rectangle.z());
+			double zsign = z0 > 0.0 ? -1.0 : 1.0;
+			for (int i = 0; i < 3; ++i) {
+				ox[i][k] = (float)o[i];
+				x[i][k] = (float)rectangle.x()[i];
+				y[i][k] = (float)rectangle.y()[i];
+				z[i][k] = (float)(rectangle.z()[i] * zsign);
+			}
+			x0[k] = (float)glm::dot(d, rectangle.x());
+			y0[k] = (float)glm::dot(d, rectangle.y());
+			this->z0[k] = (float)(z0 * zsign);
+			x1[k] = x0[k] + (float)rectangle.exLength();
+			y1[k] = y0[k] + (float)rectangle.eyLength();
+		}
+
+		// double 版の準備を写す。このレーンは prepare しなくてよい
+		void set(int k, const SphericalRectangleSamplerCoordinate &coordinate) {
+			for (int i = 0; i < 3; ++i) {
+				ox[i][k] = (float)coordinate._o[i];
+				x[i][k] = (float)coordinate._rectangle.x()[i];
+				y[i][k] = (float)coordinate._rectangle.y()[i];
+				z[i][k] = (float)coordinate._rectangle.z()[i];
+			}
+			x0[k] = (float)coordinate._x0;
+			x1[k] = (float)coordinate._x1;
+			y0[k] = (float)coordinate._y0;
+			y1[k] = (float)coordinate._y1;
+			z0[k] = (float)coordinate._z0;
+			b0[k] = (float)coordinate._n[0].z;
+			b1[k] = (float)coordinate._n[2].z;
+			k0[k] = (float)(glm::two_pi<double>() - coordinate._g[2] - coordinate._g[3]);
+			sr[k] = (float)coordinate._sr;
+		}
+
+		// set したあとに 1 度呼ぶ
+		void prepare() {
+			for (int k = 0; k < W; ++k) {
+				float z0z0 = z0[k] * z0[k];
+				float n0 = -y0[k] / std::sqrt(z0z0 + y0[k] * y0[k]);
+				float n1 = x1[k] / std::sqrt(z0z0 + x1[k] * x1[k]);
+				float n2 = y1[k] / std::sqrt(z0z0 + y1[k] * y1[k]);
+				float n3 = -x0[k] / std::sqrt(z0z0 + x0[k] * x0[k]);
+				float g0 = std::acos(-n0 * n1);
+				float g1 = std::acos(-n1 * n2);
+				float g2 = std::acos(-n2 * n3);
+				float g3 = std::acos(-n3 * n0);
+				b0[k] = n0;
+				b1[k] = n2;
+				k0[k] = glm::two_pi<float>() - g2 - g3;
+				sr[k] = g0 + g1 + g2 + g3 - glm::two_pi<float>();
+			}
+		}
+
+		// レーンごとの一様乱数 (u, v) から光源上の点 (px, py, pz) を作る
+		void sample(const float *u, const float *v, float *px, float *py, float *pz) const {
+			for (int k = 0; k < W; ++k) {
+				float phi_u = u[k] * sr[k] + k0[k];
+				float fu = (std::cos(phi_u) * b0[k] - b1[k]) / std::sin(phi_u);
+				float cu = std::copysign(1.0f, fu) / std::sqrt(fu * fu + b0[k] * b0[k]);
+				float xu = -cu * z0[k] / std::sqrt(std::max(1.0f - cu * cu, 0.0f));
+
+				float d2 = xu * xu + z0[k] * z0[k];
+				float d = std::sqrt(d2);
+				float h0 = y0[k] / std::sqrt(d2 + y0[k] * y0[k]);
+				float h1 = y1[k] / std::sqrt(d2 + y1[k] * y1[k]);
+				float hv = h0 + (h1 - h0) * v[k];
+				float yv = hv * d / std::sqrt(std::max(1.0f - hv * hv, 0.0f));
+
+				px[k] = ox[0][k] + xu * x[0][k] + yv * y[0][k] + z0[k] * z[0][k];
+				py[k] = ox[1][k] + xu * x[1][k] + yv * y[1][k] + z0[k] * z[1][k];
+				pz[k] = ox[2][k] + xu * x[2][k] + yv * y[2][k] + z0[k] * z[2][k];
+			}
+		}
+
+		float ox[3][W];
+		float x[3][W];
+		float y[3][W];
+		float z[3][W];
+		float x0[W];
+		float x1[W];
+		float y0[W];
+		float y1[W];
+		float z0[W];
+
+		float b0[W];
+		float b1[W];
+		float k0[W];
+		float sr[W]; // 立体角
+	};
+
+	template <int W>
+	struct SphericalTriangleBatch {
+		static_assert(W == 4 || W == 8, "W must be 4 or 8");
+
+		// a, b, c はポリゴンの頂点, n はポリゴンの法線
+		void set(int k, const glm::dvec3 &a, const glm::dvec3 &b, const glm::dvec3 &c, const glm::dvec3 &n, const glm::dvec3 &o) {
+			glm::dvec3 A = glm::normalize(a - o);
+			glm::dvec3 B = glm::normalize(b - o);
+			glm::dvec3 C = glm::normalize(c - o);
+			for (int i = 0; i < 3; ++i) {
+				ox[i][k] = (float)o[i];
+				this->A[i][k] = (float)A[i];
+				this->B[i][k] = (float)B[i];
+				this->C[i][k] = (float)C[i];
+				this->n[i][k] = (float)n[i];
+			}
+			planeDistance[k] = (float)glm::dot(a - o, n);
+		}
+
+		// double 版の準備を写す。このレーンは prepare しなくてよい
+		void set(int k, const SphericalTriangleSampler &triangle) {
+			for (int i = 0; i < 3; ++i) {
+				ox[i][k] = (float)triangle._o[i];
+				A[i][k] = (float)triangle._A[i];
+				B[i][k] = (float)triangle._B[i];
+				C[i][k] = (float)triangle._C[i];
+				n[i][k] = (float)triangle._n[i];
+				CorthoA[i][k] = (float)triangle._CorthoA[i];
+			}
+			planeDistance[k] = (float)triangle._planeDistance;
+			alpha[k] = (float)triangle._alpha;
+			sinAlpha[k] = (float)triangle._sinAlpha;
+			cosAlpha[k] = (float)triangle._cosAlpha;
+			cos_c[k] = (float)triangle._cos_c;
+			sr[k] = (float)triangle._sr;
+		}
+
+		// set したあとに 1 度呼ぶ
+		void prepare() {
+			auto normalize = [](float *x, float *y, float *z) {
+				float s = 1.0f / std::sqrt(*x * *x + *y * *y + *z * *z);
+				*x *= s;
+				*y *= s;
+				*z *= s;
+			};
+			for (int k = 0; k < W; ++k) {
+				float ax = A[0][k], ay = A[1][k], az = A[2][k];
+				float bx = B[0][k], by = B[1][k], bz = B[2][k];
+				float cx = C[0][k], cy = C[1][k], cz = C[2][k];
+
+				float abx = ay * bz - az * by, aby = az * bx - ax * bz, abz = ax * by - ay * bx;
+				float bcx = by * cz - bz * cy, bcy = bz * cx - bx * cz, bcz = bx * cy - by * cx;
+				float cax = cy * az - cz * ay, cay = cz * ax - cx * az, caz = cx * ay - cy * ax;
+				normalize(&abx, &aby, &abz);
+				normalize(&bcx, &bcy, &bcz);
+				normalize(&cax, &cay, &caz);
+
+				float alpha = std::acos(std::min(std::max(-(abx * cax + aby * cay + abz * caz), -1.0f), 1.0f));
+				float beta = std::acos(std::min(std::max(-(bcx * abx + bcy * aby + bcz * abz), -1.0f), 1.0f));
+				float gamma = std::acos(std::min(std::max(-(cax * bcx + cay * bcy + caz * bcz), -1.0f), 1.0f));
+				this->alpha[k] = alpha;
+				sr[k] = alpha + beta + gamma - glm::pi<float>();
+				cos_c[k] = ax * bx + ay * by + az * bz;
+				sinAlpha[k] = std::sin(alpha);
+				cosAlpha[k] = std::cos(alpha);
+
+				float ca = cx * ax + cy * ay + cz * az;
+				float ex = cx - ca * ax, ey = cy - ca * ay, ez = cz - ca * az;
+				normalize(&ex, &ey, &ez);
+				CorthoA[0][k] = ex;
+				CorthoA[1][k] = ey;
+				CorthoA[2][k] = ez;
+			}
+		}
+
+		// レーンごとの一様乱数 (u, v) から光源上の点 (px, py, pz) を作る
+		void sample(const float *u, const float *v, float *px, float *py, float *pz) const {
+			for (int k = 0; k < W; ++k) {
+				float phi = sr[k] * u[k] - alpha[k];
+				float sinPhi = std::sin(phi);
+				float cosPhi = std::cos(phi);
+				float uu = cosPhi - cosAlpha[k];
+				float vv = sinPhi + sinAlpha[k] * cos_c[k];
+				float cos_b_hat = ((vv * cosPhi - uu * sinPhi) * cosAlpha[k] - vv) / ((vv * sinPhi + uu * cosPhi) * sinAlpha[k]);
+				float sin_b_hat = std::sqrt(std::max(1.0f - cos_b_hat * cos_b_hat, 0.0f));
+
+				float chx = A[0][k] * cos_b_hat + sin_b_hat * CorthoA[0][k];
+				float chy = A[1][k] * cos_b_hat + sin_b_hat * CorthoA[1][k];
+				float chz = A[2][k] * cos_b_hat + sin_b_hat * CorthoA[2][k];
+
+				float bx = B[0][k], by = B[1][k], bz = B[2][k];
+				float chb = chx * bx + chy * by + chz * bz;
+				float cosTheta = 1.0f - v[k] * (1.0f - chb);
+				float sinTheta = std::sqrt(std::max(1.0f - cosTheta * cosTheta, 0.0f));
+
+				float ox_ = chx - chb * bx, oy_ = chy - chb * by, oz_ = chz - chb * bz;
+				float s = 1.0f / std::sqrt(std::max(ox_ * ox_ + oy_ * oy_ + oz_ * oz_, 1.0e-30f));
+				float dx = cosTheta * bx + sinTheta * ox_ * s;
+				float dy = cosTheta * by + sinTheta * oy_ * s;
+				float dz = cosTheta * bz + sinTheta * oz_ * s;
+
+				float t = planeDistance[k] / (n[0][k] * dx + n[1][k] * dy + n[2][k] * dz);
+				px[k] = ox[0][k] + dx * t;
+				py[k] = ox[1][k] + dy * t;
+				pz[k] = ox[2][k] + dz * t;
+			}
+		}
+
+		float ox[3][W];
+		float A[3][W];
+		float B[3][W];
+		float C[3][W];
+		float n[3][W];
+		float planeDistance[W];
+
+		float alpha[W];
+		float sinAlpha[W];
+		float cosAlpha[W];
+		float cos_c[W];
+		float CorthoA[3][W];
+		float sr[W]; // 立体角
+	};
+}
@@ -1,11 +1,18 @@
 ﻿#pragma once
 #include <algorithm>
+#include <cmath>
 #include <glm/glm.hpp>
 #include <glm/ext.hpp>
 
 namespace rt {
+	/*
+	 原点 o から見た三角形の球面三角形。o ごとに 1 度作り、sample と solidAngle で使い回す
+	 sample ごとに変わらない値 (cos_c, sinAlpha, cosAlpha, C の A に直交する成分, 平面の式) は作るときに計算しておく
+	*/
 	class SphericalTriangleSampler {
 	public:
+		SphericalTriangleSampler() {}
+
 		/*
 		 a, b, c はポリゴンの頂点
 		 n はポリゴンの法線
@@ -23,7 +30,19 @@ namespace rt {
 			_alpha = std::acos(glm::dot(-nAB, nCA));
 			_beta = std::acos(glm::dot(-nBC, nAB));
 			_gamma = std::acos(glm::dot(-nCA, nBC));
-			_sr = _alpha + _beta + _gamma - glm::pi<float>();
+			_sr = _alpha + _beta + _gamma - glm::pi<double>();
+
+			_cos_c = glm::dot(_A, _B);
+			_sinAlpha = std::sin(_alpha);
+			_cosAlpha = std::cos(_alpha);
+			_CorthoA = glm::normalize(_C - glm::dot(_C, _A) * _A);
+
+			// 平面の方程式 
+			// ax + by + cz + d = 0
+			// n = {a, b, c}
+			// n.(o + P * t) + d = 0
+			// t = - (n.o + d) / (n.P)
+			_planeDistance = -(glm::dot(_n, _o) - glm::dot(_a, _n));
 		}
 
 		double solidAngle() const {
@@ -36,38 +55,26 @@ namespace rt {
 			double phi = _area - _alpha;
 			double sinPhi = sin(phi);
 			double cosPhi = cos(phi);
-			
-			double cos_c = glm::dot(_A, _B);
 
-			double sinAlpha = sin(_alpha);
-			double cosAlpha = cos(_alpha);
-
-			double u = cosPhi - cosAlpha;
-			double v = sinPhi + sinAlpha * cos_c;
+			double u = cosPhi - _cosAlpha;
+			double v = sinPhi + _sinAlpha * _cos_c;
 
 			double cos_b_hat =
-				((v * cosPhi - u * sinPhi) * cosAlpha - v)
+				((v * cosPhi - u * sinPhi) * _cosAlpha - v)
 				/
-				((v * sinPhi + u * cosPhi) * sinAlpha);
+				((v * sinPhi + u * cosPhi) * _sinAlpha);
 
 			auto ortho_vector = [](glm::dvec3 x, glm::dvec3 y) {
 				return glm::normalize(x - glm::dot(x, y) * y);
 			};
 
-			glm::dvec3 C_hat = _A * cos_b_hat + sqrt(1.0 - cos_b_hat * cos_b_hat) * ortho_vector(_C, _A);
+			glm::dvec3 C_hat = _A * cos_b_hat + sqrt(std::max(1.0 - cos_b_hat * cos_b_hat, 0.0)) * _CorthoA;
 			double cosTheta = 1.0 - xi_v * (1.0 - glm::dot(C_hat, _B));
-			glm::dvec3 P = cosTheta * _B + sqrt(std::max(1.0f - cosTheta * cosTheta, 0.0)) * ortho_vector(C_hat, _B);
+			glm::dvec3 P = cosTheta * _B + sqrt(std::max(1.0 - cosTheta * cosTheta, 0.0)) * ortho_vector(C_hat, _B);
 
 			*direction = P;
 
-			// 平面の方程式 
-			// ax + by + cz + d = 0
-			// n = {a, b, c}
-			double d = -glm::dot(_a, _n);
-
-			// n.(o + P * t) + d = 0
-			// t = - (n.o + d) / (n.P)
-			double t = -(glm::dot(_n, _o) + d) / glm::dot(_n, P);
+			double t = _planeDistance / glm::dot(_n, P);
 			return _o + P * t;
 		}
 
@@ -85,5 +92,11 @@ namespace rt {
 		double _beta = 0.0;
 		double _gamma = 0.0;
 		double _sr = 0.0;
+
+		double _cos_c = 0.0;
+		double _sinAlpha = 0.0;
+		double _cosAlpha = 0.0;
+		glm::dvec3 _CorthoA;
+		double _planeDistance = 0.0;
 	};
 }
\ No newline at end of file
@@ -0,0 +1,136 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include <emmintrin.h>
+#include <tbb/tbb.h>
+
+#include "image.hpp"
+
+namespace rt {
+	namespace tonemap_details {
+		// x > 0
+		// x = m * 2^e, m in [sqrt(1/2), sqrt(2))
+		// ln(m) = 2 * atanh(t), t = (m - 1) / (m + 1), |t| < 0.172
+		// t^9 の項まで打ち切ったときの誤差は 1e-8 程度
+		inline __m128 log2_ps(__m128 x) {
+			const __m128i kMantissaMask = _mm_set1_epi32(0x007FFFFF);
+			const __m128i kOneBits = _mm_set1_epi32(0x3F800000);
+			const __m128 kOne = _mm_set1_ps(1.0f);
+			const __m128 kSqrt2 = _mm_set1_ps(1.41421356f);
+
+			__m128i bits = _mm_castps_si128(x);
+			__m128i e = _mm_sub_epi32(_mm_srli_epi32(bits, 23), _mm_set1_epi32(127));
+			__m128 m = _mm_castsi128_ps(_mm_or_si128(_mm_and_si128(bits, kMantissaMask), kOneBits));
+
+			__m128 large = _mm_cmpge_ps(m, kSqrt2);
+			m = _mm_sub_ps(m, _mm_and_ps(large, _mm_mul_ps(m, _mm_set1_ps(0.5f))));
+			__m128 ef = _mm_add_ps(_mm_cvtepi32_ps(e), _mm_and_ps(large, kOne));
+
+			__m128 t = _mm_div_ps(_mm_sub_ps(m, kOne), _mm_add_ps(m, kOne));
+			__m128 t2 = _mm_mul_ps(t, t);
+			__m128 p = _mm_set1_ps(1.0f / 9.0f);
+			p = _mm_add_ps(_mm_mul_ps(p, t2), _mm_set1_ps(1.0f / 7.0f));
+			p = _mm_add_ps(_mm_mul_ps(p, t2), _mm_set1_ps(1.0f / 5.0f));
+			p = _mm_add_ps(_mm_mul_ps(p, t2), _mm_set1_ps(1.0f / 3.0f));
+			p = _mm_add_ps(_mm_mul_ps(p, t2), kOne);
+			p = _mm_mul_ps(p, t);
+
+			// 2 / ln(2)
+			return _mm_add_ps(ef, _mm_mul_ps(p, _mm_set1_ps(2.88539008f)));
+		}
+
+		// -126 <= x <= 0 を想定
+		// 2^x = 2^i * e^(f ln2), i = round(x), |f| <= 0.5
+		inline __m128 exp2_ps(__m128 x) {
+			x = _mm_max_ps(x, _mm_set1_ps(-126.0f));
+			__m128i i = _mm_cvtps_epi32(x);
+			__m128 y = _mm_mul_ps(_mm_sub_ps(x, _mm_cvtepi32_ps(i)), _mm_set1_ps(0.693147181f));
+
+			__m128 p = _mm_set1_ps(1.0f / 720.0f);
+			p = _mm_add_ps(_mm_mul_ps(p, y), _mm_set1_ps(1.0f / 120.0f));
+			p = _mm_add_ps(_mm_mul_ps(p, y), _mm_set1_ps(1.0f / 24.0f));
+			p = _mm_add_ps(_mm_mul_ps(p, y), _mm_set1_ps(1.0f / 6.0f));
+			p = _mm_add_ps(_mm_mul_ps(p, y), _mm_set1_ps(0.5f));
+			p = _mm_add_ps(_mm_mul_ps(p, y), _mm_set1_ps(1.0f));
+			p = _mm_add_ps(_mm_mul_ps(p, y), _mm_set1_ps(1.0f));
+
+			__m128 scale = _mm_castsi128_ps(_mm_slli_epi32(_mm_add_epi32(i, _mm_set1_epi32(127)), 23));
+			return _mm_mul_ps(p, scale);
+		}
+
+		// 4 つの線形値を [0, 255] に量子化する
+		inline __m128i gamma_quantize_ps(__m128 L, __m128 scale, __m128 inv_gamma) {
+			const __m128 kTiny = _mm_set1_ps(1.0e-30f);
+			__m128 x = _mm_min_ps(_mm_max_ps(_mm_mul_ps(L, scale), kTiny), _mm_set1_ps(1.0f));
+			__m128 v = exp2_ps(_mm_mul_ps(log2_ps(x), inv_gamma));
+			v = _mm_mul_ps(v, _mm_set1_ps(255.0f));
+			v = _mm_min_ps(v, _mm_set1_ps(255.99f));
+			return _mm_cvttps_epi32(v);
+		}
+	}
+
+	// 平均値を float の RGB にする (width * height * 3)
+	inline void toLinearRGB(const Image::Snapshot &image, float *dst) {
+		tbb::parallel_for(tbb::blocked_range<int>(0, image.height), [&](const tbb::blocked_range<int> &range) {
+			for (int y = range.begin(); y < range.end(); ++y) {
+				for (int x = 0; x < image.width; ++x) {
+					int index = y * image.width + x;
+					const Image::Pixel &px = *image.pixel(x, y);
+					double inv = px.sample == 0 ? 0.0 : 1.0 / px.sample;
+					dst[index * 3 + 0] = (float)(px.color.x * inv);
+					dst[index * 3 + 1] = (float)(px.color.y * inv);
+					dst[index * 3 + 2] = (float)(px.color.z * inv);
+				}
+			}
+		});
+	}
+
+	// pow(L * scale, 1 / gamma) を 8bit RGB にする (width * height * 3)
+	// 行ごとに並列、行の中は4チャンネルずつ SSE で処理
+	// pixels は width * height の累積バッファ
+	inline void toneMapGamma(const Image::Pixel *pixels, int width, int height, uint8_t *dst, double scale = 1.0, double gamma = 2.2) {
+		using namespace tonemap_details;
+
+		tbb::parallel_for(tbb::blocked_range<int>(0, height), [&](const tbb::blocked_range<int> &range) {
+			int n = width * 3;
+			std::vector<float> linear(n + 4);
+			const __m128 scale4 = _mm_set1_ps((float)scale);
+			const __m128 inv_gamma4 = _mm_set1_ps((float)(1.0 / gamma));
+
+			for (int y = range.begin(); y < range.end(); ++y) {
+				for (int x = 0; x < width; ++x) {
+					const Image::Pixel &px = pixels[(size_t)y * width + x];
+					double inv = px.sample == 0 ? 0.0 : 1.0 / px.sample;
+					linear[x * 3 + 0] = (float)(px.color.x * inv);
+					linear[x * 3 + 1] = (float)(px.color.y * inv);
+					linear[x * 3 + 2] = (float)(px.color.z * inv);
+				}
+
+				uint8_t *row = dst + (size_t)y * n;
+				int i = 0;
+				for (; i + 16 <= n; i += 16) {
+					__m128i a = gamma_quantize_ps(_mm_loadu_ps(linear.data() + i), scale4, inv_gamma4);
+					__m128i b = gamma_quantize_ps(_mm_loadu_ps(linear.data() + i + 4), scale4, inv_gamma4);
+					__m128i c = gamma_quantize_ps(_mm_loadu_ps(linear.data() + i + 8), scale4, inv_gamma4);
+					__m128i d = gamma_quantize_ps(_mm_loadu_ps(linear.data() + i + 12), scale4, inv_gamma4);
+					__m128i ab = _mm_packs_epi32(a, b);
+					__m128i cd = _mm_packs_epi32(c, d);
+					_mm_storeu_si128((__m128i *)(row + i), _mm_packus_epi16(ab, cd));
+				}
+				for (; i < n; i += 4) {
+					__m128i a = gamma_quantize_ps(_mm_loadu_ps(linear.data() + i), scale4, inv_gamma4);
+					alignas(16) int32_t values[4];
+					_mm_store_si128((__m128i *)values, a);
+					for (int j = 0; j < 4 && i + j < n; ++j) {
+						row[i + j] = (uint8_t)values[j];
+					}
+				}
+			}
+		});
+	}
+
+	inline void toneMapGamma(const Image::Snapshot &image, uint8_t *dst, double scale = 1.0, double gamma = 2.2) {
+		toneMapGamma(image.pixels.data(), image.width, image.height, dst, scale, gamma);
+	}
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+namespace rt {
+	/*
+	 書き込み側 1 スレッド, 読み込み側 1 スレッドのトリプルバッファ
+	 どちらも相手を待たない。書き込み側は writeBuffer() に書いて publish()、
+	 読み込み側は update() が true を返したときに readBuffer() が新しくなっている。
+	 間に合わなかったフレームは上書きされて捨てられる
+	*/
+	template <class T>
+	class TripleBuffer {
+	public:
+		TripleBuffer() {}
+		TripleBuffer(const TripleBuffer &) = delete;
+		void operator=(const TripleBuffer &) = delete;
+
+		// 書き込み側
+		T &writeBuffer() {
+			return _buffers[_write];
+		}
+		void publish() {
+			uint8_t previous = _middle.exchange((uint8_t)(_write | kFresh), std::memory_order_acq_rel);
+			_write = previous & kIndexMask;
+		}
+
+		// 読み込み側
+		bool update() {
+			if ((_middle.load(std::memory_order_relaxed) & kFresh) == 0) {
+				return false;
+			}
+			uint8_t previous = _middle.exchange((uint8_t)_read, std::memory_order_acq_rel);
+			_read = previous & kIndexMask;
+			return true;
+		}
+		const T &readBuffer() const {
+			return _buffers[_read];
+		}
+	private:
+		enum : uint8_t {
+			kIndexMask = 0x3,
+			kFresh = 0x4
+		};
+		T _buffers[3];
+
+		// 受け渡し中のバッファの番号と、まだ読まれていないかどうか
+		std::atomic<uint8_t> _middle{ 1 };
+		int _write = 0;
+		int _read = 2;
+	};
+}